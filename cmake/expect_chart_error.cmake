@@ -0,0 +1,21 @@
+# Runs state_chart_gen on a chart it must reject, and fails unless it exits
+# with an error that matches ERROR and writes no header:
+#
+#   cmake -DGENERATOR=<state_chart_gen> -DCHART=<chart> -DHEADER=<header>
+#         -DERROR=<regex> -P expect_chart_error.cmake
+
+file(REMOVE ${HEADER})
+execute_process(
+  COMMAND ${GENERATOR} ${CHART} ${HEADER}
+  RESULT_VARIABLE result
+  ERROR_VARIABLE error)
+
+if(result EQUAL 0)
+  message(FATAL_ERROR "${CHART} was accepted")
+endif()
+if(NOT error MATCHES "${ERROR}")
+  message(FATAL_ERROR "${CHART} failed with \"${error}\", expected \"${ERROR}\"")
+endif()
+if(EXISTS ${HEADER})
+  message(FATAL_ERROR "${CHART} was rejected but ${HEADER} was written")
+endif()
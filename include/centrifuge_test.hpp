@@ -4,7 +4,16 @@
 
 class CentrifugeTest : public SelfTest
 {
+  DIRECT_STATE_ENGINE(CentrifugeTest)
+
 public:
+  enum events
+  {
+    EV_START = SelfTest::EV_MAX_EVENTS,
+    EV_POLL,
+    EV_MAX_EVENTS
+  };
+
   CentrifugeTest();
 
   virtual void start();
@@ -19,6 +28,8 @@ private:
   void startPoll() { this->poll_active_ = true; }
   void stopPoll() { this->poll_active_ = false; }
 
+  virtual void snapshotFields(SnapshotFields &fields);
+
   enum states
   {
     ST_START_TEST = SelfTest::ST_MAX_STATES,
@@ -58,4 +69,34 @@ private:
         "Invalid size of STATE_MAP");
     return &STATE_MAP[0];
   }
+
+  BEGIN_EVENT_MAP()
+    EVENT_MAP_ENTRY(EV_CANCEL,
+                    EVENT_IGNORED, // ST_IDLE
+                    CANNOT_HAPPEN, // ST_COMPLETED
+                    CANNOT_HAPPEN, // ST_FAILED
+                    ST_FAILED,     // ST_START_TEST
+                    ST_FAILED,     // ST_ACCELERATION
+                    ST_FAILED,     // ST_WAIT_FOR_ACCELERATION
+                    ST_FAILED,     // ST_DECELERATION
+                    ST_FAILED)     // ST_WAIT_FOR_DECELERATION
+    EVENT_MAP_ENTRY(EV_START,
+                    ST_START_TEST, // ST_IDLE
+                    CANNOT_HAPPEN, // ST_COMPLETED
+                    CANNOT_HAPPEN, // ST_FAILED
+                    EVENT_IGNORED, // ST_START_TEST
+                    EVENT_IGNORED, // ST_ACCELERATION
+                    EVENT_IGNORED, // ST_WAIT_FOR_ACCELERATION
+                    EVENT_IGNORED, // ST_DECELERATION
+                    EVENT_IGNORED) // ST_WAIT_FOR_DECELERATION
+    EVENT_MAP_ENTRY(EV_POLL,
+                    EVENT_IGNORED,            // ST_IDLE
+                    EVENT_IGNORED,            // ST_COMPLETED
+                    EVENT_IGNORED,            // ST_FAILED
+                    EVENT_IGNORED,            // ST_START_TEST
+                    ST_WAIT_FOR_ACCELERATION, // ST_ACCELERATION
+                    ST_WAIT_FOR_ACCELERATION, // ST_WAIT_FOR_ACCELERATION
+                    ST_WAIT_FOR_DECELERATION, // ST_DECELERATION
+                    ST_WAIT_FOR_DECELERATION) // ST_WAIT_FOR_DECELERATION
+  END_EVENT_MAP()
 };
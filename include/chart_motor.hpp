@@ -0,0 +1,21 @@
+#pragma once
+
+#include "motor.hpp"
+#include "chart_motor_chart.hpp"
+
+// Motor with its enums, state map and event map generated from
+// src/chart_motor.chart by state_chart_gen
+class ChartMotor : public StateMachine, public ChartMotorChart
+{
+public:
+  ChartMotor();
+
+  // External events, also raised by id through dispatch()
+  void setSpeed(const MotorData &data);
+  void halt();
+
+private:
+  int current_speed_;
+
+  CHART_MOTOR_CHART()
+};
@@ -0,0 +1,378 @@
+#pragma once
+
+#include "state_machine.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Fixed-size blocks for objects of type T, recycled through free lists.
+// Each thread allocates from and frees to a cache of its own without
+// locking. A cache that runs dry takes a batch of blocks from the shared
+// list, and one holding two batches gives one back, so blocks freed by the
+// thread running a machine flow back to the threads posting its events.
+// Blocks are carved from slabs that are kept for the life of the process.
+template <class T>
+class BlockPool
+{
+public:
+  static const size_t BATCH = 32;
+  static const size_t SLAB_BLOCKS = 256;
+
+  static void *allocate()
+  {
+    Cache &cache = localCache();
+    if (cache.head == nullptr)
+    {
+      cache.head = shared().take(BATCH);
+      cache.count = BATCH;
+    }
+    Block *block = cache.head;
+    cache.head = block->next;
+    --cache.count;
+    return block;
+  }
+
+  static void deallocate(void *ptr)
+  {
+    Cache &cache = localCache();
+    Block *block = static_cast<Block *>(ptr);
+    block->next = cache.head;
+    cache.head = block;
+    if (++cache.count == 2 * BATCH)
+    {
+      cache.give(BATCH);
+    }
+  }
+
+  // Carve blocks up front so that the first count allocations do not
+  // allocate memory
+  static void reserve(size_t count)
+  {
+    Shared &pool = shared();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    while (pool.count < count)
+    {
+      pool.carveSlab();
+    }
+  }
+
+private:
+  union Block
+  {
+    Block *next;
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+
+  struct Shared
+  {
+    std::mutex mutex;
+    Block *head = nullptr;
+    size_t count = 0;
+
+    // Chain of count free blocks
+    Block *take(size_t count)
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      while (this->count < count)
+      {
+        this->carveSlab();
+      }
+      Block *first = this->head;
+      Block *last = first;
+      for (size_t i = 1; i < count; ++i)
+      {
+        last = last->next;
+      }
+      this->head = last->next;
+      this->count -= count;
+      last->next = nullptr;
+      return first;
+    }
+
+    void give(Block *first, Block *last, size_t count)
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      last->next = this->head;
+      this->head = first;
+      this->count += count;
+    }
+
+    void carveSlab()
+    {
+      Block *slab = static_cast<Block *>(
+          ::operator new(SLAB_BLOCKS * sizeof(Block)));
+      for (size_t i = 0; i + 1 < SLAB_BLOCKS; ++i)
+      {
+        slab[i].next = &slab[i + 1];
+      }
+      slab[SLAB_BLOCKS - 1].next = this->head;
+      this->head = slab;
+      this->count += SLAB_BLOCKS;
+    }
+  };
+
+  struct Cache
+  {
+    Block *head = nullptr;
+    size_t count = 0;
+
+    // Blocks still cached when the thread exits go back to the shared list
+    ~Cache()
+    {
+      if (this->count > 0)
+      {
+        this->give(this->count);
+      }
+    }
+
+    void give(size_t count)
+    {
+      Block *first = this->head;
+      Block *last = first;
+      for (size_t i = 1; i < count; ++i)
+      {
+        last = last->next;
+      }
+      this->head = last->next;
+      this->count -= count;
+      shared().give(first, last, count);
+    }
+  };
+
+  static Shared &shared()
+  {
+    // Never destroyed, blocks may be freed late in process exit
+    static Shared *const shared = new Shared;
+    return *shared;
+  }
+
+  static Cache &localCache()
+  {
+    static thread_local Cache cache;
+    return cache;
+  }
+};
+
+// Allocator handing out BlockPool blocks one object at a time, as
+// std::allocate_shared does for an object and its control block
+template <class T>
+struct PoolAllocator
+{
+  using value_type = T;
+
+  PoolAllocator() = default;
+  template <class U>
+  PoolAllocator(const PoolAllocator<U> &) {}
+
+  T *allocate(size_t n)
+  {
+    if (n != 1)
+    {
+      return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+    return static_cast<T *>(BlockPool<T>::allocate());
+  }
+
+  void deallocate(T *ptr, size_t n)
+  {
+    if (n != 1)
+    {
+      ::operator delete(ptr);
+      return;
+    }
+    BlockPool<T>::deallocate(ptr);
+  }
+
+  template <class U>
+  bool operator==(const PoolAllocator<U> &) const { return true; }
+  template <class U>
+  bool operator!=(const PoolAllocator<U> &) const { return false; }
+};
+
+// Pooled payloads of type Data. make() returns a shared_ptr holding the
+// payload and its control block in one pooled block, passed to event
+// functions like any other shared payload. The engine drops it once the
+// state has run and the block goes back to the pool, ready for the next
+// event, without calling malloc:
+//
+//   motor->setSpeed(EventPool<MotorData>::make());
+//
+// Each Data type has a pool of its own, shared by all threads.
+template <class Data>
+class EventPool
+{
+public:
+  static_assert(std::is_base_of<EventData, Data>::value,
+                "Pooled payloads must derive from EventData");
+
+  template <class... Args>
+  static std::shared_ptr<Data> make(Args &&... args)
+  {
+    return std::allocate_shared<Data>(PoolAllocator<Data>(),
+                                      std::forward<Args>(args)...);
+  }
+
+  // Make room for count payloads alive at once, so that making them does
+  // not allocate. Data must be default constructible.
+  static void reserve(size_t count)
+  {
+    std::vector<std::shared_ptr<Data>> payloads;
+    payloads.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+      payloads.push_back(make());
+    }
+  }
+};
+
+// Bump allocator for the payloads of one batch of events. make() carves
+// each payload and its control block out of the current chunk, and
+// reset() takes the whole arena back in one step once every payload of
+// the batch has been dropped, keeping the chunks for the next batch. It
+// refuses while a payload is still held, so none is ever overwritten:
+//
+//   EventArena arena;
+//   for (...)
+//   {
+//     for (const Command &command : batch)
+//     {
+//       auto data = arena.make<MotorData>();
+//       data->speed = command.speed;
+//       motor->setSpeed(data);
+//     }
+//     arena.reset();
+//   }
+//
+// An arena is filled and reset by one thread; its payloads may be dropped
+// by any thread.
+class EventArena
+{
+public:
+  static const size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+  explicit EventArena(size_t chunk_size = DEFAULT_CHUNK_SIZE)
+      : chunk_size_(chunk_size), chunk_(0), offset_(0), live_(0)
+  {
+  }
+
+  ~EventArena()
+  {
+    assert(this->live_.load(std::memory_order_acquire) == 0);
+    for (const Chunk &chunk : this->chunks_)
+    {
+      ::operator delete(chunk.data);
+    }
+  }
+
+  EventArena(const EventArena &) = delete;
+  EventArena &operator=(const EventArena &) = delete;
+
+  template <class Data, class... Args>
+  std::shared_ptr<Data> make(Args &&... args)
+  {
+    static_assert(std::is_base_of<EventData, Data>::value,
+                  "Arena payloads must derive from EventData");
+    return std::allocate_shared<Data>(Allocator<Data>(this),
+                                      std::forward<Args>(args)...);
+  }
+
+  // Payloads made since the last reset and not dropped yet
+  size_t live() const { return this->live_.load(std::memory_order_acquire); }
+
+  // Reuse the arena from its first chunk once every payload has been
+  // dropped: the engine drops a payload once its state has run, or when a
+  // queued event is discarded. Returns false, and the arena carries on
+  // filling where it was, while any payload is still alive.
+  bool reset()
+  {
+    if (this->live() != 0)
+    {
+      return false;
+    }
+    this->chunk_ = 0;
+    this->offset_ = 0;
+    return true;
+  }
+
+private:
+  template <class T>
+  struct Allocator
+  {
+    using value_type = T;
+
+    EventArena *arena;
+
+    explicit Allocator(EventArena *arena) : arena(arena) {}
+    template <class U>
+    Allocator(const Allocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t n)
+    {
+      return static_cast<T *>(this->arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *ptr, size_t n)
+    {
+      (void)ptr;
+      (void)n;
+      this->arena->live_.fetch_sub(1, std::memory_order_release);
+    }
+
+    template <class U>
+    bool operator==(const Allocator<U> &other) const
+    {
+      return this->arena == other.arena;
+    }
+    template <class U>
+    bool operator!=(const Allocator<U> &other) const
+    {
+      return this->arena != other.arena;
+    }
+  };
+
+  struct Chunk
+  {
+    unsigned char *data;
+    size_t size;
+  };
+
+  const size_t chunk_size_;
+  std::vector<Chunk> chunks_;
+  size_t chunk_;  // chunk being filled
+  size_t offset_; // into it
+  std::atomic<size_t> live_;
+
+  void *allocate(size_t size, size_t align)
+  {
+    assert(align <= alignof(std::max_align_t));
+    this->live_.fetch_add(1, std::memory_order_relaxed);
+    while (true)
+    {
+      if (this->chunk_ < this->chunks_.size())
+      {
+        const Chunk &chunk = this->chunks_[this->chunk_];
+        size_t offset = (this->offset_ + align - 1) & ~(align - 1);
+        if (offset + size <= chunk.size)
+        {
+          this->offset_ = offset + size;
+          return chunk.data + offset;
+        }
+        ++this->chunk_;
+        this->offset_ = 0;
+        continue;
+      }
+
+      // Chunks come from operator new, aligned for any payload
+      size_t chunk_size = size > this->chunk_size_ ? size : this->chunk_size_;
+      this->chunks_.push_back(Chunk{
+          static_cast<unsigned char *>(::operator new(chunk_size)), chunk_size});
+    }
+  }
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "state_machine.hpp"
+#include "mpsc_queue.hpp"
+#include "work_stealing_deque.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Active-object executor: a fixed pool of worker threads running attached
+// machines. Each attached machine's event queue is its mailbox; when a
+// mailbox goes from empty to non-empty the machine is scheduled onto a
+// worker, which runs a batch of its events and reschedules it if more are
+// pending. Idle workers steal machines from busy ones. A machine is only
+// ever owned by one worker at a time, so its state actions never run
+// concurrently.
+class Executor : public EventScheduler
+{
+public:
+  // Events run per machine before it yields its worker to others
+  static const size_t DEFAULT_BATCH_SIZE = 64;
+
+  explicit Executor(
+      size_t thread_count = std::thread::hardware_concurrency(),
+      size_t batch_size = DEFAULT_BATCH_SIZE);
+  virtual ~Executor();
+
+  Executor(const Executor &) = delete;
+  Executor &operator=(const Executor &) = delete;
+
+  // Route the machine's events through this executor. Must be done before
+  // events are posted to it, and the machine must be idle when either of
+  // them is destroyed.
+  void attach(StateMachine &sm);
+
+  // Block until no attached machine has pending events
+  void waitIdle();
+
+  size_t getThreadCount() const { return this->workers_.size(); }
+
+  // Machines taken from other workers' deques, since construction
+  uint64_t getStealCount() const;
+
+  virtual void schedule(StateMachine *sm);
+
+private:
+  struct Worker
+  {
+    explicit Worker(size_t index_) : index(index_), steals(0) {}
+
+    const size_t index;
+    WorkStealingDeque<StateMachine> deque;
+    MpscQueue inbox;
+    std::thread thread;
+
+    // Written by this worker only
+    std::atomic<uint64_t> steals;
+  };
+
+  const size_t batch_size_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  std::atomic<size_t> next_worker_;
+  std::atomic<size_t> active_machines_;
+
+  // Parking of idle workers
+  std::mutex park_mutex_;
+  std::condition_variable park_cv_;
+  std::atomic<uint64_t> epoch_;
+  std::atomic<size_t> sleepers_;
+  std::atomic<bool> stopping_;
+
+  void run(Worker &self);
+  StateMachine *findWork(Worker &self);
+  void wakeWorker();
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <cinttypes>
+#include <cstddef>
+
+#include "state_index.hpp"
+#include "state_machine_metrics.hpp"
+
+// Number of records kept per thread, a power of two
+#ifndef STATE_MACHINE_FLIGHT_RECORDER_SIZE
+#define STATE_MACHINE_FLIGHT_RECORDER_SIZE 4096
+#endif
+
+// One engine step: a state action about to run, or an external event
+// dropped before reaching the engine
+struct FlightRecord
+{
+  // Bits of event besides the event id
+  static const uint16_t GUARD_FAILED = 0x8000;
+  static const uint16_t EVENT_MASK = 0x7FFF;
+
+  // Event id for internal events and events without a transition map
+  static const uint16_t NO_EVENT = 0;
+
+  uint64_t timestamp; // MetricsClock ticks
+  uint32_t machine;   // StateMachine::getRecorderId()
+  uint16_t event;     // FlightRecorder::eventId() plus flags
+  StateIndex from;
+  StateIndex to; // new state, or EVENT_IGNORED / CANNOT_HAPPEN
+};
+
+static_assert(sizeof(StateIndex) != 1 || sizeof(FlightRecord) == 16,
+              "FlightRecord must stay packed");
+
+// Layout of a dump, all integers in host byte order:
+//   FlightDumpHeader
+//   event_count x { uint32_t length; char name[length]; }
+//   thread_count x { FlightDumpThread; records[min(head, capacity)] }
+// Records of a thread are stored oldest first.
+struct FlightDumpHeader
+{
+  static const uint32_t MAGIC = 0x52464D53; // "SMFR"
+  static const uint32_t VERSION = 2;
+
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t state_size; // sizeof(StateIndex) of the recording build
+  uint32_t capacity;
+  double ns_per_tick; // 0 if the clock was never calibrated
+  uint32_t event_count;
+  uint32_t thread_count;
+};
+
+struct FlightDumpThread
+{
+  uint32_t thread;
+  uint32_t record_count;
+  uint64_t head; // records ever written by the thread
+};
+
+// Per-thread binary ring buffers of engine steps, kept so the history of a
+// crashed process can be dumped and decoded offline with
+// flight_recorder_decode. Appending is a plain store into the calling
+// thread's buffer followed by a release of its head, with no locks and no
+// shared cache lines. Buffers are never freed, so the history of threads
+// that have exited stays in the dump.
+class FlightRecorder
+{
+public:
+  static const size_t CAPACITY = STATE_MACHINE_FLIGHT_RECORDER_SIZE;
+  static_assert((CAPACITY & (CAPACITY - 1)) == 0,
+                "Flight recorder size must be a power of two");
+
+  static void record(
+      uint32_t machine, uint16_t event, StateIndex from, StateIndex to)
+  {
+    Buffer *buffer = localBuffer();
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    FlightRecord &record = buffer->records[head & (CAPACITY - 1)];
+    record.timestamp = MetricsClock::now();
+    record.machine = machine;
+    record.event = event;
+    record.from = from;
+    record.to = to;
+    buffer->head.store(head + 1, std::memory_order_release);
+  }
+
+  // Id of an event name, registered once per call site. name must have
+  // static storage duration, e.g. __func__.
+  static uint16_t eventId(const char *name);
+
+  // Unique id for a new machine
+  static uint32_t nextMachineId();
+
+  // Write every buffer to fd. Async-signal-safe once the clock has been
+  // calibrated by installCrashHandler() or an earlier dump.
+  static bool dump(int fd);
+  static bool dumpToFile(const char *path);
+
+  // Dump to path when the process dies of SIGSEGV, SIGABRT (failed
+  // asserts), SIGBUS, SIGILL or SIGFPE, then let the signal proceed
+  static void installCrashHandler(const char *path);
+
+private:
+  struct Buffer
+  {
+    Buffer *next;
+    uint32_t thread;
+    std::atomic<uint64_t> head;
+    FlightRecord records[CAPACITY];
+  };
+
+  // Every thread's buffer, newest first
+  static std::atomic<Buffer *> buffers_;
+
+  static Buffer *localBuffer()
+  {
+    static thread_local Buffer *buffer = nullptr;
+    if (buffer == nullptr)
+    {
+      buffer = createBuffer();
+    }
+    return buffer;
+  }
+
+  static Buffer *createBuffer();
+};
@@ -10,16 +10,24 @@ public:
 
 class Motor : public StateMachine
 {
+  DIRECT_STATE_ENGINE(Motor)
+
 public:
   Motor();
 
-  // External event
+  // External events, also raised by id through dispatch()
+  enum Events
+  {
+    EV_SET_SPEED,
+    EV_HALT,
+    EV_MAX_EVENTS
+  };
+
   void setSpeed(std::shared_ptr<MotorData> data);
+  void setSpeed(const MotorData &data);
   void halt();
 
-private:
-  int current_speed_;
-
+  // States, as getCurrentState() and published states report them
   enum States
   {
     ST_IDLE,
@@ -29,6 +37,9 @@ private:
     ST_MAX_STATES
   };
 
+private:
+  int current_speed_;
+
   // States
   STATE_DECLARE(Motor, Idle, NoEventData)
   STATE_DECLARE(Motor, Stop, NoEventData)
@@ -36,6 +47,8 @@ private:
   STATE_DECLARE(Motor, ChangeSpeed, MotorData)
 
 private:
+  virtual void snapshotFields(SnapshotFields &fields);
+
   // State map
   virtual const StateMapRowEx *getStateMapEx() { return nullptr; }
   virtual const StateMapRow *getStateMap()
@@ -51,4 +64,18 @@ private:
         "Invalid size of STATE_MAP");
     return &STATE_MAP[0];
   }
+
+  // Event map
+  BEGIN_EVENT_MAP()
+    EVENT_MAP_ENTRY(EV_SET_SPEED,
+                    ST_START,        // ST_IDLE
+                    CANNOT_HAPPEN,   // ST_STOP
+                    ST_CHANGE_SPEED, // ST_START
+                    ST_CHANGE_SPEED) // ST_CHANGE_SPEED
+    EVENT_MAP_ENTRY(EV_HALT,
+                    EVENT_IGNORED, // ST_IDLE
+                    CANNOT_HAPPEN, // ST_STOP
+                    ST_STOP,       // ST_START
+                    ST_STOP)       // ST_CHANGE_SPEED
+  END_EVENT_MAP()
 };
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+
+// Intrusive multi-producer single-consumer queue (Vyukov). push() is a
+// single atomic exchange and never blocks; pop() must only be called by one
+// consumer at a time.
+struct MpscNode
+{
+  std::atomic<MpscNode *> next;
+};
+
+class MpscQueue
+{
+public:
+  MpscQueue() : head_(&stub_), tail_(&stub_)
+  {
+    this->stub_.next.store(nullptr, std::memory_order_relaxed);
+  }
+  MpscQueue(const MpscQueue &) = delete;
+  MpscQueue &operator=(const MpscQueue &) = delete;
+
+  void push(MpscNode *node)
+  {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    MpscNode *prev = this->head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // Returns nullptr when the queue is empty, or when a producer has
+  // claimed its slot but not yet linked it in. Callers that know an item
+  // was pushed should simply retry.
+  MpscNode *pop()
+  {
+    MpscNode *tail = this->tail_;
+    MpscNode *next = tail->next.load(std::memory_order_acquire);
+    if (tail == &this->stub_)
+    {
+      if (next == nullptr)
+      {
+        return nullptr;
+      }
+      this->tail_ = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next != nullptr)
+    {
+      this->tail_ = next;
+      return tail;
+    }
+
+    if (tail != this->head_.load(std::memory_order_acquire))
+    {
+      return nullptr;
+    }
+
+    this->push(&this->stub_);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != nullptr)
+    {
+      this->tail_ = next;
+      return tail;
+    }
+    return nullptr;
+  }
+
+private:
+  std::atomic<MpscNode *> head_;
+  MpscNode *tail_;
+  MpscNode stub_;
+};
@@ -5,10 +5,23 @@
 class SelfTest : public StateMachine
 {
 public:
-  SelfTest(uint8_t max_state_);
+  // External events. Derived tests number theirs from EV_MAX_EVENTS and
+  // list EV_CANCEL first in their event map.
+  enum events
+  {
+    EV_CANCEL,
+    EV_MAX_EVENTS
+  };
+
+  SelfTest(size_t max_state_);
   virtual void start() = 0;
   void cancel();
 
+#ifdef STATE_MACHINE_ENABLE_COROUTINES
+  // co_await test.completed() resumes once the test has passed
+  StateAwaiter completed() { return this->enteredState(ST_COMPLETED); }
+#endif
+
 protected:
   enum states
   {
@@ -22,4 +35,15 @@ protected:
   ENTRY_DECLARE(SelfTest, EntryIdle, NoEventData)
   STATE_DECLARE(SelfTest, Completed, NoEventData)
   STATE_DECLARE(SelfTest, Failed, NoEventData)
-};
\ No newline at end of file
+};
+
+// cancel() dispatches EV_CANCEL by id through the derived test's event
+// map, so that map must list it first, under its own name
+template <size_t Events, size_t States>
+constexpr bool eventMapFitsBase(
+    const SelfTest *,
+    const EventMapRow<States> (&rows)[Events])
+{
+  return Events >= SelfTest::EV_MAX_EVENTS &&
+         isEventName(rows[SelfTest::EV_CANCEL].name, "EV_CANCEL");
+}
\ No newline at end of file
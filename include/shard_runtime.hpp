@@ -0,0 +1,237 @@
+#pragma once
+
+#include "state_machine.hpp"
+#include "spsc_ring.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <cinttypes>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Machine owned by a shard of a ShardRuntime, as returned by adopt()
+struct ShardAddress
+{
+  StateMachine *sm;
+  size_t shard;
+};
+
+// Event in flight to a machine of another shard, raised there with
+// StateMachine::dispatch()
+struct ShardMessage
+{
+  StateMachine *sm;
+  size_t event;
+  EventPayload payload;
+};
+
+// Thread-per-core runtime: machines are partitioned into shards, each run
+// by one thread pinned to its own core. A shard owns its machines
+// outright and runs them in the plain single-threaded mode, so their
+// engines take no locks and touch no atomics. Events for a machine are
+// sent to its shard as messages over a single-producer single-consumer
+// ring per pair of shards, which the owning shard drains in batches.
+//
+// Messages a shard sends while a ring is full wait in a backlog of the
+// sending shard, in order, instead of blocking it, so two shards flooding
+// each other cannot deadlock. Threads outside the runtime send over one
+// more ring per shard, taking turns on a lock.
+//
+// Each shard allocates the rings it reads from its own thread once
+// pinned, so on NUMA machines they are placed on its node by first touch.
+// Machines created on their shard through execute() get the same
+// treatment:
+//
+//   ShardRuntime runtime;
+//   std::vector<std::unique_ptr<Motor>> motors(runtime.getShardCount());
+//   for (size_t shard = 0; shard < motors.size(); ++shard)
+//   {
+//     runtime.execute(shard, [&motors, shard]() {
+//       motors[shard].reset(new Motor());
+//     });
+//   }
+//   runtime.waitIdle();
+//   ShardAddress motor = runtime.adopt(*motors[0], 0);
+//   runtime.send(motor, Motor::EV_SET_SPEED, data);
+//
+// Machines must have an event map (see BEGIN_EVENT_MAP) and no event
+// queue, and may only be used from their shard once adopted. Shards poll
+// their rings and yield when idle, they are meant to have their cores to
+// themselves.
+class ShardRuntime
+{
+public:
+  static const size_t DEFAULT_RING_CAPACITY = 256;
+
+  // Messages run per ring before the shard moves on to the next one
+  static const size_t DEFAULT_BATCH_SIZE = 64;
+
+  static const size_t NO_SHARD = SIZE_MAX;
+
+  explicit ShardRuntime(
+      size_t shard_count = std::thread::hardware_concurrency(),
+      bool pin_threads = true,
+      size_t ring_capacity = DEFAULT_RING_CAPACITY,
+      size_t batch_size = DEFAULT_BATCH_SIZE);
+
+  // Stops the shards; messages not run yet are dropped, see waitIdle()
+  ~ShardRuntime();
+
+  ShardRuntime(const ShardRuntime &) = delete;
+  ShardRuntime &operator=(const ShardRuntime &) = delete;
+
+  size_t getShardCount() const { return this->shards_.size(); }
+
+  // Shard of the calling thread, NO_SHARD outside this runtime
+  size_t currentShard() const
+  {
+    return current_shard_ != nullptr && current_shard_->runtime == this
+               ? current_shard_->index
+               : NO_SHARD;
+  }
+
+  ShardAddress adopt(StateMachine &sm, size_t shard)
+  {
+    assert(shard < this->shards_.size() && !sm.isEventQueueEnabled());
+    return ShardAddress{&sm, shard};
+  }
+
+  // Raise event event_id of the machine at to on its shard. data is
+  // forwarded as by StateMachine::dispatch(), except that payloads given
+  // by reference are copied.
+  template <class DataArg>
+  void send(const ShardAddress &to, size_t event_id, DataArg &&data)
+  {
+    ShardMessage *message;
+    Shard *from = current_shard_;
+    if (from != nullptr && from->runtime == this)
+    {
+      message = this->claim(*from, to.shard);
+    }
+    else
+    {
+      message = this->claimExternal(to.shard);
+    }
+    message->sm = to.sm;
+    message->event = event_id;
+    message->payload.set(std::forward<DataArg>(data));
+    this->publish(from, to.shard);
+  }
+  void send(const ShardAddress &to, size_t event_id)
+  {
+    this->send(to, event_id, nullptr);
+  }
+
+  // Run task on shard, after the messages already sent to it from the
+  // calling thread. Meant for setting up machines, not for events.
+  void execute(size_t shard, std::function<void()> task);
+
+  // Block until no message or task is pending or running on any shard.
+  // Machines that keep sending to each other never get there.
+  void waitIdle() const;
+
+  // Messages that found their ring full and waited in a backlog, since
+  // construction
+  uint64_t getBackloggedCount() const;
+
+private:
+  using Ring = SpscRing<ShardMessage>;
+
+  struct Shard
+  {
+    Shard(ShardRuntime *runtime_, size_t index_, size_t shard_count)
+        : runtime(runtime_), index(index_), backlog(shard_count),
+          backlog_count(0), sent(0), received(0), backlogged(0),
+          has_tasks(false)
+    {
+    }
+
+    ShardRuntime *const runtime;
+    const size_t index;
+    std::thread thread;
+
+    // Rings this shard reads, by sending shard, then one for other threads
+    std::vector<std::unique_ptr<Ring>> inbound;
+    std::mutex external_mutex;
+
+    // Messages waiting for room in a full ring, by receiving shard
+    std::vector<std::deque<ShardMessage>> backlog;
+    size_t backlog_count;
+
+    // Written by this shard only
+    std::atomic<uint64_t> sent;
+    std::atomic<uint64_t> received;
+    std::atomic<uint64_t> backlogged;
+
+    std::mutex task_mutex;
+    std::vector<std::function<void()>> tasks;
+    std::atomic<bool> has_tasks;
+  };
+
+  static thread_local Shard *current_shard_;
+
+  const bool pin_threads_;
+  const size_t ring_capacity_;
+  const size_t batch_size_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  // Messages and tasks from threads outside the runtime
+  std::atomic<uint64_t> external_sent_;
+
+  std::atomic<size_t> ready_;
+  std::atomic<bool> stopping_;
+
+  // Slot for a message to shard to, in the ring or at the end of the
+  // backlog if the ring is full or the backlog already holds messages
+  ShardMessage *claim(Shard &from, size_t to)
+  {
+    std::deque<ShardMessage> &backlog = from.backlog[to];
+    if (backlog.empty())
+    {
+      ShardMessage *message = this->shards_[to]->inbound[from.index]->claim();
+      if (message != nullptr)
+      {
+        return message;
+      }
+    }
+    backlog.emplace_back();
+    ++from.backlog_count;
+    from.backlogged.store(from.backlogged.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+    return &backlog.back();
+  }
+
+  void publish(Shard *from, size_t to)
+  {
+    if (from != nullptr && from->runtime == this)
+    {
+      from->sent.store(from->sent.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_release);
+      if (from->backlog[to].empty())
+      {
+        this->shards_[to]->inbound[from->index]->publish();
+      }
+    }
+    else
+    {
+      this->external_sent_.fetch_add(1, std::memory_order_release);
+      Shard &shard = *this->shards_[to];
+      shard.inbound.back()->publish();
+      shard.external_mutex.unlock();
+    }
+  }
+
+  // Locks the shard's external ring until publish(), waiting unlocked
+  // while it is full
+  ShardMessage *claimExternal(size_t to);
+
+  void run(Shard &self);
+  size_t drain(Shard &self, Ring &ring);
+  void flushBacklog(Shard &self);
+  void runTasks(Shard &self);
+  void pin(size_t index);
+};
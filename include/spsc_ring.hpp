@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+// Bounded single-producer single-consumer ring of preallocated slots. The
+// producer fills the slot returned by claim() and hands it over with
+// publish(); the consumer reads front() and frees it with pop(). Each side
+// keeps a cached copy of the other's index, so the shared indexes are only
+// read when the ring looks full or empty, and they are padded apart so
+// that each side writes its own cache line.
+template <class T>
+class SpscRing
+{
+public:
+  static const size_t CACHE_LINE = 64;
+
+  // capacity is rounded up to a power of two
+  explicit SpscRing(size_t capacity)
+      : mask_(roundUp(capacity) - 1),
+        slots_(new T[mask_ + 1]),
+        head_(0),
+        cached_tail_(0),
+        tail_(0),
+        cached_head_(0)
+  {
+  }
+
+  SpscRing(const SpscRing &) = delete;
+  SpscRing &operator=(const SpscRing &) = delete;
+
+  size_t capacity() const { return this->mask_ + 1; }
+
+  // Producer: free slot to fill, or nullptr if the ring is full
+  T *claim()
+  {
+    size_t tail = this->tail_.load(std::memory_order_relaxed);
+    if (tail - this->cached_head_ > this->mask_)
+    {
+      this->cached_head_ = this->head_.load(std::memory_order_acquire);
+      if (tail - this->cached_head_ > this->mask_)
+      {
+        return nullptr;
+      }
+    }
+    return &this->slots_[tail & this->mask_];
+  }
+
+  // Producer: make the claimed slot visible to the consumer
+  void publish()
+  {
+    this->tail_.store(this->tail_.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
+  }
+
+  // Consumer: oldest published slot, or nullptr if the ring is empty
+  T *front()
+  {
+    size_t head = this->head_.load(std::memory_order_relaxed);
+    if (head == this->cached_tail_)
+    {
+      this->cached_tail_ = this->tail_.load(std::memory_order_acquire);
+      if (head == this->cached_tail_)
+      {
+        return nullptr;
+      }
+    }
+    return &this->slots_[head & this->mask_];
+  }
+
+  // Consumer: give the slot returned by front() back to the producer
+  void pop()
+  {
+    this->head_.store(this->head_.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
+  }
+
+private:
+  static size_t roundUp(size_t capacity)
+  {
+    size_t size = 1;
+    while (size < capacity)
+    {
+      size <<= 1;
+    }
+    return size;
+  }
+
+  const size_t mask_;
+  const std::unique_ptr<T[]> slots_;
+  char pad0_[CACHE_LINE];
+
+  // Consumer side
+  std::atomic<size_t> head_;
+  size_t cached_tail_;
+  char pad1_[CACHE_LINE];
+
+  // Producer side
+  std::atomic<size_t> tail_;
+  size_t cached_head_;
+  char pad2_[CACHE_LINE];
+};
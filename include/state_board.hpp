@@ -0,0 +1,154 @@
+#pragma once
+
+#include <atomic>
+#include <cinttypes>
+#include <cstddef>
+
+// Latest state of one machine as read from a StateBoard
+struct PublishedState
+{
+  uint32_t state;
+  uint64_t transitions; // engine steps since the slot was attached
+  uint64_t timestamp;   // MetricsClock ticks of the last one
+};
+
+// One machine's entry on a StateBoard, written by the thread running the
+// machine's engine only and read by any process. Updates are a seqlock:
+// the sequence is odd while the fields change, and a reader retries when
+// it saw an odd sequence or the sequence moved under it. Writing never
+// waits on readers and, on x86, costs a few plain stores.
+struct StateBoardSlot
+{
+  std::atomic<uint32_t> sequence;
+  std::atomic<uint32_t> state;
+  std::atomic<uint64_t> transitions;
+  std::atomic<uint64_t> timestamp;
+
+  // Writer: publish new_state, adding steps to the count of engine steps
+  void write(uint32_t new_state, uint64_t steps, uint64_t now)
+  {
+    uint32_t seq = this->sequence.load(std::memory_order_relaxed);
+    this->sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    this->state.store(new_state, std::memory_order_relaxed);
+    this->transitions.store(
+        this->transitions.load(std::memory_order_relaxed) + steps,
+        std::memory_order_relaxed);
+    this->timestamp.store(now, std::memory_order_relaxed);
+    this->sequence.store(seq + 2, std::memory_order_release);
+  }
+
+  // Reader: a consistent copy, or false if a write was in progress
+  bool read(PublishedState &out) const
+  {
+    uint32_t seq = this->sequence.load(std::memory_order_acquire);
+    if ((seq & 1) != 0)
+    {
+      return false;
+    }
+    out.state = this->state.load(std::memory_order_relaxed);
+    out.transitions = this->transitions.load(std::memory_order_relaxed);
+    out.timestamp = this->timestamp.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return this->sequence.load(std::memory_order_relaxed) == seq;
+  }
+};
+
+static_assert(sizeof(StateBoardSlot) == 24, "StateBoardSlot must stay packed");
+
+// Layout of a board segment, all integers in host byte order:
+//   StateBoardHeader
+//   capacity x StateBoardSlot, at slots_offset
+// Slots are handed out in order, count of them are in use.
+struct StateBoardHeader
+{
+  static const uint32_t MAGIC = 0x42534D53; // "SMSB"
+  static const uint32_t VERSION = 1;
+  static const uint64_t ALIGNMENT = 64;
+
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slot_size;
+  uint32_t reserved;
+  double ns_per_tick; // of the publishing process's MetricsClock
+  uint64_t capacity;
+  uint64_t slots_offset;
+  std::atomic<uint64_t> count;
+};
+
+// Segment through which machines publish their current state to external
+// monitors, see StateMachine::publishState(). The publishing process
+// creates it and attaches one slot per machine; monitors open it
+// read-only and read any slot at any time, without locks and without
+// slowing the engines down:
+//
+//   StateBoard board;
+//   board.create("/motors", 1000000);
+//   motor.publishState(board.attach());
+//
+// A name with no '/' past its first character is a POSIX shared memory
+// object, anything else a file path. Slots are never reused, the
+// segment is removed by unlink(). The mapping is released by close() or
+// the destructor.
+class StateBoard
+{
+public:
+  StateBoard() : data_(nullptr), size_(0), writable_(false) {}
+  ~StateBoard() { this->close(); }
+
+  StateBoard(const StateBoard &) = delete;
+  StateBoard &operator=(const StateBoard &) = delete;
+
+  // Replace name with a board of capacity empty slots mapped for writing
+  bool create(const char *name, size_t capacity);
+
+  // Map an existing board for reading, returns false if name is not a
+  // board of this build
+  bool open(const char *name);
+  void close();
+
+  static bool unlink(const char *name);
+
+  bool isOpen() const { return this->data_ != nullptr; }
+  const StateBoardHeader *header() const
+  {
+    return reinterpret_cast<const StateBoardHeader *>(this->data_);
+  }
+
+  // Slots handed out so far
+  size_t size() const
+  {
+    uint64_t count = this->header()->count.load(std::memory_order_acquire);
+    return static_cast<size_t>(
+        count < this->header()->capacity ? count : this->header()->capacity);
+  }
+  size_t capacity() const
+  {
+    return static_cast<size_t>(this->header()->capacity);
+  }
+
+  // Next free slot of a created board, or nullptr if it is full. Safe to
+  // call from several threads.
+  StateBoardSlot *attach();
+
+  size_t indexOf(const StateBoardSlot *slot) const
+  {
+    return static_cast<size_t>(slot - this->slots());
+  }
+
+  // Consistent copy of slot index, retrying while it is being written.
+  // Returns false if index is not in use, or if it stays mid-write
+  // because its writer died.
+  bool read(size_t index, PublishedState &out) const;
+
+private:
+  unsigned char *data_;
+  size_t size_;
+  bool writable_;
+
+  StateBoardSlot *slots() const
+  {
+    return reinterpret_cast<StateBoardSlot *>(this->data_ +
+                                              this->header()->slots_offset);
+  }
+};
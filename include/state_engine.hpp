@@ -0,0 +1,439 @@
+#pragma once
+
+#include "state_machine.hpp"
+
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+// Engine loops of StateMachine, shared by the map engine and DirectEngine.
+// The loops reach the actions of a state through an Actions policy:
+//
+//   actions.state(sm, state, data)       state action, always present
+//   actions.hasGuard(state)              guard(sm, state, data)
+//   actions.hasEntry(state)              entry(sm, state, data)
+//   actions.hasExit(state)               exit(sm, state)
+//
+// The guard, entry and exit calls are only made when the matching has*()
+// is true; flat maps only need state().
+
+struct StateMachine::EngineEvents
+{
+  EngineEvents(EventRing *deferred_, StateTimers *timers_,
+               EngineBudget *budget_)
+      : deferred(deferred_), timers(timers_), defer(false), budget(budget_),
+        steps(0), deadline(0)
+  {
+  }
+
+  // Internal events run before the machine's own external events
+  FixedEventRing<STATE_MACHINE_ENGINE_QUEUE_SIZE> internal;
+  FixedEventRing<STATE_MACHINE_ENGINE_QUEUE_SIZE> external;
+
+  // Hooks of the machine, looked up once per run
+  EventRing *const deferred;
+  StateTimers *const timers;
+
+  // Event of the running step, for deferEvent()
+  const StateIndex *transitions;
+  size_t size;
+  StateIndex state;
+  uint16_t event_id;
+  bool defer;
+
+  // Limit on this run, nullptr without one. deadline is 0 without a time
+  // limit, so the clock is only read when there is one.
+  EngineBudget *const budget;
+  size_t steps;
+  uint64_t deadline;
+};
+
+// Actions of a flat state map, called through its pointers
+class MapActions
+{
+public:
+  explicit MapActions(const StateMapRow *map) : map_(map) {}
+
+  void state(StateMachine *sm, StateIndex state, const EventPayload &data) const
+  {
+    StateFunc func = this->map_[state].state;
+    assert(func != nullptr);
+    func(sm, data);
+  }
+
+private:
+  const StateMapRow *const map_;
+};
+
+// Actions of an extended state map, called through its pointers
+class MapActionsEx
+{
+public:
+  explicit MapActionsEx(const StateMapRowEx *map) : map_(map) {}
+
+  void state(StateMachine *sm, StateIndex state, const EventPayload &data) const
+  {
+    StateFunc func = this->map_[state].state;
+    assert(func != nullptr);
+    func(sm, data);
+  }
+
+  bool hasGuard(StateIndex state) const
+  {
+    return this->map_[state].guard != nullptr;
+  }
+  bool guard(StateMachine *sm, StateIndex state, const EventPayload &data) const
+  {
+    return this->map_[state].guard(sm, data);
+  }
+
+  bool hasEntry(StateIndex state) const
+  {
+    return this->map_[state].entry != nullptr;
+  }
+  void entry(StateMachine *sm, StateIndex state, const EventPayload &data) const
+  {
+    this->map_[state].entry(sm, data);
+  }
+
+  bool hasExit(StateIndex state) const
+  {
+    return this->map_[state].exit != nullptr;
+  }
+  void exit(StateMachine *sm, StateIndex state) const
+  {
+    this->map_[state].exit(sm);
+  }
+
+private:
+  const StateMapRowEx *const map_;
+};
+
+// Engine compiled for the machine SM, run by the events of its transition
+// maps once the machine has DIRECT_STATE_ENGINE(SM). getStateMap() and
+// getStateMapEx() are called without going through the vtable, so the
+// compiler sees which of the two the machine has and drops the other
+// engine. The actions are reached through a table with one small function
+// per state, which reads its row of the map as a constant and calls the
+// actions directly, inlining them where it can. The deferred events,
+// timers and budget of the machine are looked up the same way.
+//
+// Events posted to an event queue, sent while the engine is busy or
+// suspended, raised by dispatch() or by the event functions of a base
+// class run on the map engine, with the same results. SM must be the most
+// derived machine, a machine derived from it would otherwise run SM's
+// states.
+template <class SM>
+class DirectEngine
+{
+private:
+  friend class StateMachine;
+
+  template <size_t I>
+  using Index = std::integral_constant<size_t, I>;
+  using States = std::make_index_sequence<SM::ST_MAX_STATES>;
+
+  static SM *derived(StateMachine *sm) { return static_cast<SM *>(sm); }
+
+  static const StateMapRow *rows(SM *sm, const StateMapRow *)
+  {
+    return sm->SM::getStateMap();
+  }
+  static const StateMapRowEx *rows(SM *sm, const StateMapRowEx *)
+  {
+    return sm->SM::getStateMapEx();
+  }
+
+  template <class Func, size_t I>
+  static void call(const Func &func)
+  {
+    func(Index<I>());
+  }
+
+  // Call func with the index of state as an Index<I>, through a table of
+  // one call<Func, I> per state. The table is expanded from an index
+  // sequence, so machines of any size compile without nesting templates
+  // one level per state.
+  template <class Func, size_t... I>
+  static void visit(StateIndex state, const Func &func, std::index_sequence<I...>)
+  {
+    using Call = void (*)(const Func &);
+    static const Call CALLS[] = {&DirectEngine::call<Func, I>...};
+    assert(static_cast<size_t>(state) < sizeof...(I));
+    CALLS[state](func);
+  }
+
+  // Actions of the rows of type Row of the machine's map. The map is
+  // looked up again for every call rather than kept, so that it stays a
+  // constant the compiler can read the rows from.
+  template <class Row>
+  class Actions
+  {
+  public:
+    explicit Actions(SM *sm) : sm_(sm) {}
+
+    void state(StateMachine *sm, StateIndex state, const EventPayload &data) const
+    {
+      const Row *map = this->map();
+      visit(state, [map, sm, &data](auto index) {
+        StateFunc func = map[index.value].state;
+        assert(func != nullptr);
+        func(sm, data);
+      }, States());
+    }
+
+    // The has*() only read a row, which is no dearer than a call through
+    // the table
+    bool hasGuard(StateIndex state) const
+    {
+      return this->map()[state].guard != nullptr;
+    }
+    bool guard(StateMachine *sm, StateIndex state, const EventPayload &data) const
+    {
+      const Row *map = this->map();
+      bool result = true;
+      visit(state, [map, sm, &data, &result](auto index) {
+        GuardFunc func = map[index.value].guard;
+        result = func == nullptr || func(sm, data);
+      }, States());
+      return result;
+    }
+
+    bool hasEntry(StateIndex state) const
+    {
+      return this->map()[state].entry != nullptr;
+    }
+    void entry(StateMachine *sm, StateIndex state, const EventPayload &data) const
+    {
+      const Row *map = this->map();
+      visit(state, [map, sm, &data](auto index) {
+        EntryFunc func = map[index.value].entry;
+        if (func != nullptr)
+        {
+          func(sm, data);
+        }
+      }, States());
+    }
+
+    bool hasExit(StateIndex state) const
+    {
+      return this->map()[state].exit != nullptr;
+    }
+    void exit(StateMachine *sm, StateIndex state) const
+    {
+      const Row *map = this->map();
+      visit(state, [map, sm](auto index) {
+        ExitFunc func = map[index.value].exit;
+        if (func != nullptr)
+        {
+          func(sm);
+        }
+      }, States());
+    }
+
+  private:
+    SM *const sm_;
+
+    const Row *map() const
+    {
+      return DirectEngine::rows(this->sm_, static_cast<const Row *>(nullptr));
+    }
+  };
+
+  static EngineBudget *engineBudget(StateMachine *sm)
+  {
+    return derived(sm)->SM::getEngineBudget();
+  }
+  static EventRing *deferredEvents(StateMachine *sm)
+  {
+    return derived(sm)->SM::getDeferredEvents();
+  }
+  static StateTimers *stateTimers(StateMachine *sm)
+  {
+    return derived(sm)->SM::getStateTimers();
+  }
+
+  static void run(StateMachine *sm, EventPayload &data)
+  {
+    SM *machine = derived(sm);
+
+    // A machine derived from SM has maps of its own
+    assert(sm->getStateMap() == machine->SM::getStateMap() &&
+           sm->getStateMapEx() == machine->SM::getStateMapEx());
+
+    if (machine->SM::getStateMap() != nullptr)
+    {
+      sm->stateEngine(Actions<StateMapRow>(machine), data);
+    }
+    else
+    {
+      assert(machine->SM::getStateMapEx() != nullptr);
+      sm->stateEngine(Actions<StateMapRowEx>(machine),
+                      machine->SM::getStateHierarchy(), data);
+    }
+  }
+};
+
+template <class SM>
+void StateMachine::stateEngine(
+    const StateIndex *transitions,
+    size_t size,
+    StateIndex state,
+    uint16_t event_id,
+    EventPayload &data,
+    DirectEngine<SM> engine)
+{
+  assert(this->engine_events_ == nullptr);
+  EngineEvents events(engine.deferredEvents(this), engine.stateTimers(this),
+                      engine.engineBudget(this));
+  this->startEngine(events, transitions, size, state, event_id);
+  this->engine_events_ = &events;
+  engine.run(this, data);
+  this->stopEngine(events);
+}
+
+template <class Actions>
+void StateMachine::stateEngine(const Actions &actions, EventPayload &data)
+{
+  while (this->event_generated_)
+  {
+    this->recordStep(true);
+    assert(this->new_state_ < this->max_states_);
+    StateIndex new_state = this->new_state_;
+    this->event_generated_ = false;
+    StateIndex previous_state = this->current_state_;
+    if (new_state != previous_state)
+    {
+      this->exitStateTimers(previous_state);
+    }
+    this->setCurrentState(new_state);
+    this->publishStep(1);
+
+    uint64_t start = this->metricsNow();
+    actions.state(this, new_state, data);
+    this->recordActionMetrics(previous_state, this->current_state_, start);
+    this->notifyWaiters(previous_state);
+
+    // Delete the used event data, taking over the next event's if any
+    this->nextEvent(previous_state, data);
+  }
+}
+
+template <class Actions>
+void StateMachine::stateEngine(
+    const Actions &actions,
+    const StateHierarchy *hierarchy,
+    EventPayload &data)
+{
+  assert(hierarchy == nullptr || hierarchy->size() == this->max_states_);
+
+  // While events are being generated keep executing states
+  while (this->event_generated_)
+  {
+    // Error check that the new state is valid before proceeding, keeping
+    // a record of the step that failed it
+    if (this->new_state_ >= this->max_states_)
+    {
+      this->recordStep(true);
+    }
+    assert(this->new_state_ < this->max_states_);
+
+    // Event used up, reset the flag
+    this->event_generated_ = false;
+
+    // Execute the guard condition
+    bool guard_result = true;
+    if (actions.hasGuard(this->new_state_))
+    {
+      guard_result = actions.guard(this, this->new_state_, data);
+      this->recordGuardMetrics(this->new_state_, guard_result);
+    }
+    this->recordStep(guard_result);
+
+    // If the guard condition succeeds
+    StateIndex previous_state = this->current_state_;
+    if (guard_result == true)
+    {
+
+      // Transitioning to a new state?
+      if (this->new_state_ != this->current_state_)
+      {
+        if (hierarchy != nullptr)
+        {
+          this->runTransitionActions(actions, *hierarchy, data);
+        }
+        else
+        {
+          // Execute the state exit action on current state before switching to new state
+          this->exitStateTimers(this->current_state_);
+          if (actions.hasExit(this->current_state_))
+          {
+            uint64_t start = this->metricsNow();
+            actions.exit(this, this->current_state_);
+            this->recordExitMetrics(this->current_state_, start);
+          }
+
+          // Execute the state entry action on the new state
+          if (actions.hasEntry(this->new_state_))
+          {
+            uint64_t start = this->metricsNow();
+            actions.entry(this, this->new_state_, data);
+            this->recordEntryMetrics(this->new_state_, start);
+          }
+        }
+      }
+
+      // Switch to the new current state
+      this->setCurrentState(this->new_state_);
+      this->publishStep(1);
+
+      // Execute the state action passing in event data
+      uint64_t start = this->metricsNow();
+      actions.state(this, this->new_state_, data);
+      this->recordActionMetrics(previous_state, this->current_state_, start);
+      this->notifyWaiters(previous_state);
+    }
+
+    // Delete the used event data, taking over the next event's if any
+    this->nextEvent(previous_state, data);
+  }
+}
+
+template <class Actions>
+void StateMachine::runTransitionActions(
+    const Actions &actions,
+    const StateHierarchy &hierarchy,
+    const EventPayload &data)
+{
+  size_t common = hierarchy.common(this->current_state_, this->new_state_);
+
+  // Exit from the current state up to the least common ancestor
+  const StateIndex *exit_path = hierarchy.path(this->current_state_);
+  for (size_t depth = hierarchy.depth(this->current_state_) + 1;
+       depth-- > common;)
+  {
+    StateIndex state = exit_path[depth];
+    this->exitStateTimers(state);
+    if (actions.hasExit(state))
+    {
+      uint64_t start = this->metricsNow();
+      actions.exit(this, state);
+      this->recordExitMetrics(state, start);
+    }
+  }
+
+  // Enter from below the least common ancestor down to the new state
+  const StateIndex *entry_path = hierarchy.path(this->new_state_);
+  for (size_t depth = common; depth <= hierarchy.depth(this->new_state_);
+       ++depth)
+  {
+    StateIndex state = entry_path[depth];
+    if (actions.hasEntry(state))
+    {
+      uint64_t start = this->metricsNow();
+      actions.entry(this, state, data);
+      this->recordEntryMetrics(state, start);
+    }
+  }
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "state_index.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cinttypes>
+#include <cstddef>
+#include <memory>
+
+// Parents of the states of a hierarchical StateMachine. A transition runs
+// the exit actions from the current state up to, but not including, the
+// least common ancestor of both states, then the entry actions from below
+// that ancestor down to the new state. Ancestors receive the payload of
+// the event, so declare their entry actions with NoEventData or the
+// payload type shared by every transition into them.
+//
+// The ancestor path of every state is resolved when the hierarchy is
+// built, so the engine only indexes tables and a deep hierarchy costs no
+// more per event than a flat map running the same actions. The common
+// ancestor of two states is found by a binary search over their paths.
+// Paths take one state id per ancestor of each state; no table grows
+// with the square of the state count. A parent outside the machine or a
+// cycle of parents is reported and aborts, in release builds too.
+//
+// Built once per machine type, as a function-local static returned by
+// getStateHierarchy():
+//
+//   static const StateIndex PARENTS[] = {
+//       StateHierarchy::NO_PARENT, // ST_IDLE
+//       ST_IDLE,                   // ST_CHILD
+//   };
+//   static const StateHierarchy HIERARCHY(PARENTS);
+class StateHierarchy
+{
+public:
+  static const StateIndex NO_PARENT = STATE_INDEX_CANNOT_HAPPEN;
+
+  // parents[s] is the parent of state s, or NO_PARENT for a top level state
+  template <size_t N>
+  explicit StateHierarchy(const StateIndex (&parents)[N])
+      : StateHierarchy(parents, N)
+  {
+  }
+  StateHierarchy(const StateIndex *parents, size_t size);
+
+  StateHierarchy(const StateHierarchy &) = delete;
+  StateHierarchy &operator=(const StateHierarchy &) = delete;
+
+  size_t size() const { return this->size_; }
+
+  // Number of ancestors of state, 0 at the top level
+  size_t depth(StateIndex state) const
+  {
+    assert(state < this->size_);
+    return this->depths_[state];
+  }
+
+  // Ancestors of state from the top level down, followed by state itself:
+  // depth(state) + 1 entries
+  const StateIndex *path(StateIndex state) const
+  {
+    assert(state < this->size_);
+    return &this->paths_[this->offsets_[state]];
+  }
+
+  // Length of the leading part path(from) and path(to) have in common.
+  // States of path(from) past it are exited, states of path(to) past it
+  // are entered. Two paths that agree at some depth agree above it too,
+  // so the first difference is found by bisection.
+  size_t common(StateIndex from, StateIndex to) const
+  {
+    const StateIndex *from_path = this->path(from);
+    const StateIndex *to_path = this->path(to);
+    size_t low = 0;
+    size_t high = std::min(this->depth(from), this->depth(to)) + 1;
+    while (low < high)
+    {
+      size_t middle = low + (high - low) / 2;
+      if (from_path[middle] == to_path[middle])
+      {
+        low = middle + 1;
+      }
+      else
+      {
+        high = middle;
+      }
+    }
+    return low;
+  }
+
+private:
+  const size_t size_;
+  std::unique_ptr<StateIndex[]> depths_;
+  std::unique_ptr<size_t[]> offsets_; // of each path in paths_
+  std::unique_ptr<StateIndex[]> paths_;
+};
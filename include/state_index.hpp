@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+
+// Integer type of state ids, shared by both engines, their transition maps
+// and the flight recorder. Transition maps hold one id per state, so keep
+// it as narrow as the largest machine of the build allows: uint8_t (the
+// default) for up to 253 states, uint16_t for up to 65533, uint32_t beyond.
+#ifndef STATE_MACHINE_STATE_INDEX_TYPE
+#define STATE_MACHINE_STATE_INDEX_TYPE uint8_t
+#endif
+
+using StateIndex = STATE_MACHINE_STATE_INDEX_TYPE;
+
+static_assert(std::is_same<StateIndex, uint8_t>::value ||
+                  std::is_same<StateIndex, uint16_t>::value ||
+                  std::is_same<StateIndex, uint32_t>::value,
+              "State index type must be uint8_t, uint16_t or uint32_t");
+
+// The two largest ids are the EVENT_IGNORED and CANNOT_HAPPEN sentinels,
+// a machine has fewer states than the first of them
+const StateIndex STATE_INDEX_EVENT_IGNORED =
+    std::numeric_limits<StateIndex>::max() - 1;
+const StateIndex STATE_INDEX_CANNOT_HAPPEN =
+    std::numeric_limits<StateIndex>::max();
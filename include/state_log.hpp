@@ -0,0 +1,297 @@
+#pragma once
+
+#include <atomic>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdio>
+#include <initializer_list>
+#include <type_traits>
+
+#include "spsc_ring.hpp"
+#include "state_machine_metrics.hpp"
+
+#define STATE_LOG_LEVEL_DEBUG 0
+#define STATE_LOG_LEVEL_INFO 1
+#define STATE_LOG_LEVEL_WARN 2
+#define STATE_LOG_LEVEL_ERROR 3
+#define STATE_LOG_LEVEL_OFF 4
+
+// Lowest level built in. Log calls below it expand to nothing, their
+// arguments are not even compiled.
+#ifndef STATE_MACHINE_LOG_LEVEL
+#define STATE_MACHINE_LOG_LEVEL STATE_LOG_LEVEL_INFO
+#endif
+
+// Records buffered per thread, rounded up to a power of two
+#ifndef STATE_MACHINE_LOG_BUFFER_SIZE
+#define STATE_MACHINE_LOG_BUFFER_SIZE 1024
+#endif
+
+// One log call: the format and up to MAX_ARGS arguments, kept in binary
+// and formatted later by the logging thread. String arguments are copied
+// into text, one after the other, and cut when it runs out.
+struct LogRecord
+{
+  static const size_t MAX_ARGS = 6;
+  static const size_t TEXT_SIZE = 48;
+
+  enum ArgType : uint8_t
+  {
+    INT,
+    UINT,
+    DOUBLE,
+    STRING,
+    POINTER
+  };
+
+  union Arg
+  {
+    int64_t i;
+    uint64_t u; // also the offset in text of a STRING
+    double d;
+    const void *p;
+  };
+
+  uint64_t timestamp; // MetricsClock ticks
+  const char *format;
+  uint8_t level;
+  uint8_t count;
+  uint8_t text_size;
+  uint8_t types[MAX_ARGS];
+  Arg args[MAX_ARGS];
+  char text[TEXT_SIZE];
+};
+
+static_assert(sizeof(LogRecord) <= 128, "LogRecord should stay two cache lines");
+
+// Asynchronous logger for state actions and the engine. A log call copies
+// its format pointer and arguments into a fixed-size record in the calling
+// thread's buffer, a single-producer single-consumer ring, without locks,
+// allocation or formatting. A background thread started by start() drains
+// every thread's buffer, formats the records printf-style and writes them
+// out in batches:
+//
+//   StateLog::start(stderr);
+//   STATE_LOG_INFO("Motor::ST_Start : Speed is %d", data->speed);
+//   ...
+//   StateLog::stop();
+//
+// Since formatting happens later, the format must be a string literal.
+// String arguments are copied into the record, up to
+// LogRecord::TEXT_SIZE bytes for all of a call's strings together, and
+// longer ones are cut; there is no overload for std::string. Integer
+// arguments are formatted with any length modifier of the format, so %d
+// and %u print any integer type, and a * width or precision takes an
+// integer argument as printf does. Records logged while the logger is stopped are discarded, and so
+// are records logged while the thread's buffer is full; the logging thread
+// reports how many were lost. Records of one thread are written in order,
+// those of different threads interleave in batches, each line starting
+// with its time since start().
+class StateLog
+{
+public:
+  enum Level : uint8_t
+  {
+    LEVEL_DEBUG = STATE_LOG_LEVEL_DEBUG,
+    LEVEL_INFO = STATE_LOG_LEVEL_INFO,
+    LEVEL_WARN = STATE_LOG_LEVEL_WARN,
+    LEVEL_ERROR = STATE_LOG_LEVEL_ERROR
+  };
+
+  static const size_t BUFFER_SIZE = STATE_MACHINE_LOG_BUFFER_SIZE;
+
+  // Start the logging thread, writing to out. Not thread-safe with stop().
+  static void start(FILE *out = stdout);
+
+  // Write every record logged so far, then stop the logging thread
+  static void stop();
+
+  // Block until every record logged before the call is written
+  static void flush();
+
+  static bool running() { return running_.load(std::memory_order_relaxed); }
+
+  template <size_t N, class... Args>
+  static void write(Level level, const char (&format)[N], Args... args)
+  {
+    static_assert(sizeof...(Args) <= LogRecord::MAX_ARGS,
+                  "Too many log arguments");
+    if (!running())
+    {
+      return;
+    }
+    Buffer *buffer = localBuffer();
+    LogRecord *record = buffer->ring.claim();
+    if (record == nullptr)
+    {
+      buffer->dropped.store(
+          buffer->dropped.load(std::memory_order_relaxed) + 1,
+          std::memory_order_relaxed);
+      return;
+    }
+    record->timestamp = MetricsClock::now();
+    record->format = format;
+    record->level = level;
+    record->count = static_cast<uint8_t>(sizeof...(Args));
+    record->text_size = 0;
+    size_t index = 0;
+    (void)std::initializer_list<int>{
+        (setArg(*record, index++, args), 0)...};
+    buffer->ring.publish();
+  }
+
+private:
+  struct Buffer
+  {
+    Buffer() : next(nullptr), in_use(true), dropped(0), ring(BUFFER_SIZE) {}
+
+    Buffer *next;
+
+    // Cleared when the owning thread exits, so a new thread can take the
+    // buffer over
+    std::atomic<bool> in_use;
+
+    // Written by the owning thread only
+    std::atomic<uint64_t> dropped;
+
+    SpscRing<LogRecord> ring;
+  };
+
+  // Every buffer ever made, newest first
+  static std::atomic<Buffer *> buffers_;
+  static std::atomic<bool> running_;
+
+  static Buffer *localBuffer()
+  {
+    static thread_local Owner owner;
+    if (owner.buffer == nullptr)
+    {
+      owner.buffer = acquireBuffer();
+    }
+    return owner.buffer;
+  }
+
+  // Gives the buffer back when its thread exits
+  struct Owner
+  {
+    Buffer *buffer = nullptr;
+
+    ~Owner()
+    {
+      if (this->buffer != nullptr)
+      {
+        this->buffer->in_use.store(false, std::memory_order_release);
+      }
+    }
+  };
+
+  static Buffer *acquireBuffer();
+
+  template <class T>
+  static void setArg(LogRecord &record, size_t index, const T &arg)
+  {
+    setArg(record, index, arg, std::is_enum<T>());
+  }
+
+  template <class T>
+  static void setArg(LogRecord &record, size_t index, const T &arg,
+                     std::true_type)
+  {
+    setArg(record, index,
+           static_cast<typename std::underlying_type<T>::type>(arg));
+  }
+
+  template <class T>
+  static void setArg(LogRecord &record, size_t index, const T &arg,
+                     std::false_type)
+  {
+    static_assert(std::is_arithmetic<T>::value || std::is_pointer<T>::value,
+                  "Log arguments must be numbers, enums or pointers");
+    setValue(record, index, arg);
+  }
+
+  template <class T>
+  static typename std::enable_if<std::is_integral<T>::value &&
+                                 std::is_signed<T>::value>::type
+  setValue(LogRecord &record, size_t index, T value)
+  {
+    record.types[index] = LogRecord::INT;
+    record.args[index].i = value;
+  }
+
+  template <class T>
+  static typename std::enable_if<std::is_integral<T>::value &&
+                                 !std::is_signed<T>::value>::type
+  setValue(LogRecord &record, size_t index, T value)
+  {
+    record.types[index] = LogRecord::UINT;
+    record.args[index].u = value;
+  }
+
+  template <class T>
+  static typename std::enable_if<std::is_floating_point<T>::value>::type
+  setValue(LogRecord &record, size_t index, T value)
+  {
+    record.types[index] = LogRecord::DOUBLE;
+    record.args[index].d = value;
+  }
+
+  template <class T>
+  static void setValue(LogRecord &record, size_t index, const T *value)
+  {
+    record.types[index] = LogRecord::POINTER;
+    record.args[index].p = value;
+  }
+
+  // Copied after the record's earlier strings, as much as fits
+  static void setValue(LogRecord &record, size_t index, const char *value)
+  {
+    record.types[index] = LogRecord::STRING;
+    size_t offset = record.text_size;
+    if (offset == LogRecord::TEXT_SIZE)
+    {
+      // Full: the terminator of the last string reads as an empty one
+      record.args[index].u = LogRecord::TEXT_SIZE - 1;
+      return;
+    }
+    if (value == nullptr)
+    {
+      value = "(null)";
+    }
+    size_t length = 0;
+    while (offset + length + 1 < LogRecord::TEXT_SIZE && value[length] != '\0')
+    {
+      record.text[offset + length] = value[length];
+      ++length;
+    }
+    record.text[offset + length] = '\0';
+    record.args[index].u = offset;
+    record.text_size = static_cast<uint8_t>(offset + length + 1);
+  }
+
+  static void run();
+};
+
+#if STATE_MACHINE_LOG_LEVEL <= STATE_LOG_LEVEL_DEBUG
+#define STATE_LOG_DEBUG(...) StateLog::write(StateLog::LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define STATE_LOG_DEBUG(...) ((void)0)
+#endif
+
+#if STATE_MACHINE_LOG_LEVEL <= STATE_LOG_LEVEL_INFO
+#define STATE_LOG_INFO(...) StateLog::write(StateLog::LEVEL_INFO, __VA_ARGS__)
+#else
+#define STATE_LOG_INFO(...) ((void)0)
+#endif
+
+#if STATE_MACHINE_LOG_LEVEL <= STATE_LOG_LEVEL_WARN
+#define STATE_LOG_WARN(...) StateLog::write(StateLog::LEVEL_WARN, __VA_ARGS__)
+#else
+#define STATE_LOG_WARN(...) ((void)0)
+#endif
+
+#if STATE_MACHINE_LOG_LEVEL <= STATE_LOG_LEVEL_ERROR
+#define STATE_LOG_ERROR(...) StateLog::write(StateLog::LEVEL_ERROR, __VA_ARGS__)
+#else
+#define STATE_LOG_ERROR(...) ((void)0)
+#endif
@@ -1,11 +1,51 @@
 #pragma once
 
 #include <memory>
+#include <new>
 #include <stdio.h>
-#include <typeinfo>
+#include <type_traits>
 #include <cinttypes>
 #include <cassert>
+#include <cstddef>
+#include <atomic>
 #include <vector>
+#include "mpsc_queue.hpp"
+#include "state_hierarchy.hpp"
+#include "state_index.hpp"
+
+#ifdef STATE_MACHINE_ENABLE_METRICS
+#include "state_machine_metrics.hpp"
+#endif
+
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+#include "flight_recorder.hpp"
+#endif
+
+#ifdef STATE_MACHINE_ENABLE_COROUTINES
+#include "state_machine_coro.hpp"
+#endif
+
+#ifdef STATE_MACHINE_ENABLE_TRANSITION_LOG
+#include "state_log.hpp"
+#endif
+
+#ifdef STATE_MACHINE_ENABLE_STATE_BOARD
+#include "state_board.hpp"
+#include "state_machine_metrics.hpp"
+#endif
+
+// Capacity of the fixed queues a running engine keeps for the internal
+// events its actions generate and for external events the machine sends
+// itself. Both live on the engine's stack.
+#ifndef STATE_MACHINE_ENGINE_QUEUE_SIZE
+#define STATE_MACHINE_ENGINE_QUEUE_SIZE 8
+#endif
+
+// Size of the inline buffer used for payloads passed by reference.
+// Payloads that do not fit are copied to the heap instead.
+#ifndef STATE_MACHINE_INLINE_DATA_SIZE
+#define STATE_MACHINE_INLINE_DATA_SIZE 32
+#endif
 
 class EventData
 {
@@ -15,179 +55,1468 @@ public:
 
 using NoEventData = EventData;
 
-class StateMachine;
-class StateBase
+// Shared pointer to a static NoEventData instance. It owns no control
+// block, so copying it neither allocates nor touches a reference count.
+inline const std::shared_ptr<const EventData> &noEventData()
+{
+  static const NoEventData no_event_data;
+  static const std::shared_ptr<const EventData> no_event_data_ptr(
+      std::shared_ptr<const EventData>(), &no_event_data);
+  return no_event_data_ptr;
+}
+
+// Cheap RTTI-free type tag: the address of a per-type static object
+using EventTypeId = const void *;
+
+template <class Data>
+struct EventTypeTag
+{
+  static const char id;
+};
+
+template <class Data>
+const char EventTypeTag<Data>::id = 0;
+
+template <class Data>
+EventTypeId eventTypeId()
+{
+  return &EventTypeTag<typename std::remove_cv<Data>::type>::id;
+}
+
+class EventPayload
 {
 public:
-  virtual void invokeStateAction(
-      StateMachine *sm,
-      std::shared_ptr<const EventData> data) const = 0;
+  static const size_t INLINE_SIZE = STATE_MACHINE_INLINE_DATA_SIZE;
+
+  template <class Data>
+  struct FitsInline
+      : std::integral_constant<
+            bool,
+            sizeof(Data) <= INLINE_SIZE &&
+                alignof(Data) <= alignof(std::max_align_t) &&
+                std::is_nothrow_copy_constructible<Data>::value>
+  {
+  };
+
+  EventPayload()
+      : relocate_(nullptr)
+#ifndef NDEBUG
+        ,
+        type_(nullptr)
+#endif
+  {
+  }
+  ~EventPayload() { this->reset(); }
+  EventPayload(const EventPayload &) = delete;
+  EventPayload &operator=(const EventPayload &) = delete;
+
+  // Payload to hand to the state, or noEventData() if there is none
+  const std::shared_ptr<const EventData> &get() const
+  {
+    return this->data_ptr_ ? this->data_ptr_ : noEventData();
+  }
+
+  // Payload of unknown dynamic type
+  void assign(std::shared_ptr<const EventData> data_ptr)
+  {
+    this->reset();
+    this->data_ptr_ = std::move(data_ptr);
+  }
+
+  template <class Data>
+  void assign(std::shared_ptr<const Data> data_ptr)
+  {
+    this->reset();
+    this->data_ptr_ = std::move(data_ptr);
+    this->setType<Data>();
+  }
+
+  // Refer to a payload the caller keeps alive for as long as it is used
+  template <class Data>
+  void borrow(const Data &data)
+  {
+    this->reset();
+    this->data_ptr_ = std::shared_ptr<const EventData>(
+        std::shared_ptr<const EventData>(), &data);
+    this->setType<Data>();
+  }
+
+  // Copy the payload, into inline storage if it fits
+  template <class Data>
+  void store(const Data &data)
+  {
+    this->reset();
+    this->store(data, FitsInline<Data>());
+    this->setType<Data>();
+  }
+
+  // Overloads used to forward whatever an event function was given
+  void set(std::nullptr_t) { this->reset(); }
+  void set(std::shared_ptr<const EventData> data_ptr)
+  {
+    this->assign(std::move(data_ptr));
+  }
+  template <class Data>
+  void set(std::shared_ptr<Data> data_ptr)
+  {
+    if (data_ptr == nullptr)
+    {
+      this->reset();
+    }
+    else
+    {
+      this->assign(std::shared_ptr<const Data>(std::move(data_ptr)));
+    }
+  }
+  template <class Data, class = typename std::enable_if<
+                            std::is_base_of<EventData, Data>::value>::type>
+  void set(const Data &data)
+  {
+    this->store(data);
+  }
+  // Payload carried by a message, taken over on delivery
+  void set(EventPayload &other) { this->moveFrom(other); }
+
+  // Take over the payload of other, leaving it empty
+  void moveFrom(EventPayload &other)
+  {
+    this->reset();
+    if (other.relocate_ != nullptr)
+    {
+      this->setInline(
+          other.relocate_(this->storage_, other.data_ptr_.get()),
+          other.relocate_);
+      other.reset();
+    }
+    else
+    {
+      this->data_ptr_ = std::move(other.data_ptr_);
+    }
+#ifndef NDEBUG
+    this->type_ = other.type_;
+    other.type_ = nullptr;
+#endif
+  }
+
+  void reset()
+  {
+    if (this->relocate_ != nullptr)
+    {
+      const EventData *data = this->data_ptr_.get();
+      this->relocate_ = nullptr;
+      this->data_ptr_.reset();
+      data->~EventData();
+    }
+    else
+    {
+      this->data_ptr_.reset();
+    }
+#ifndef NDEBUG
+    this->type_ = nullptr;
+#endif
+  }
+
+  // Payload downcast for an action whose payload type is known at compile
+  // time. Release builds use a static cast; debug builds check the type tag
+  // recorded when the event was generated, falling back to dynamic_cast when
+  // RTTI is available.
+  template <class Data>
+  std::shared_ptr<const Data> as() const
+  {
+    assert(this->isA<Data>());
+    return std::static_pointer_cast<const Data>(this->get());
+  }
+
+  // Same check, without touching the shared_ptr
+  template <class Data>
+  const Data &ref() const
+  {
+    assert(this->isA<Data>());
+    return static_cast<const Data &>(*this->get());
+  }
+
+private:
+  using Relocate = const EventData *(*)(void *, const EventData *);
+
+  std::shared_ptr<const EventData> data_ptr_;
+  Relocate relocate_;
+  alignas(std::max_align_t) unsigned char storage_[INLINE_SIZE];
+#ifndef NDEBUG
+  EventTypeId type_;
+#endif
+
+  template <class Data>
+  void setType()
+  {
+#ifndef NDEBUG
+    // A plain EventData pointer says nothing about the dynamic type
+    this->type_ = std::is_same<typename std::remove_cv<Data>::type,
+                               EventData>::value
+                      ? nullptr
+                      : eventTypeId<Data>();
+#endif
+  }
+
+#ifndef NDEBUG
+  template <class Data>
+  bool isA() const
+  {
+    if (std::is_same<Data, EventData>::value ||
+        this->type_ == eventTypeId<Data>())
+    {
+      return true;
+    }
+#if defined(__cpp_rtti) || defined(__GXX_RTTI) || defined(_CPPRTTI)
+    return dynamic_cast<const Data *>(this->get().get()) != nullptr;
+#else
+    // Without RTTI only a recorded tag can be checked
+    return this->type_ == nullptr;
+#endif
+  }
+#endif
+
+  template <class Data>
+  static const EventData *copyInline(void *dst, const EventData *src)
+  {
+    return ::new (dst) Data(*static_cast<const Data *>(src));
+  }
+
+  template <class Data>
+  void store(const Data &data, std::true_type)
+  {
+    this->setInline(copyInline<Data>(this->storage_, &data), &copyInline<Data>);
+  }
+
+  template <class Data>
+  void store(const Data &data, std::false_type)
+  {
+    this->data_ptr_ = std::make_shared<const Data>(data);
+  }
+
+  void setInline(const EventData *data, Relocate relocate)
+  {
+    // Non-owning alias: the object lives in storage_ and is destroyed by reset()
+    this->data_ptr_ = std::shared_ptr<const EventData>(
+        std::shared_ptr<const EventData>(), data);
+    this->relocate_ = relocate;
+  }
 };
 
+class StateMachine;
+
+// State map entries are plain function pointers to static members generated
+// by the *_DECLARE macros. They are per-type data and add nothing to the
+// size of a machine instance.
+using StateFunc = void (*)(StateMachine *sm, const EventPayload &data);
+using GuardFunc = bool (*)(StateMachine *sm, const EventPayload &data);
+using EntryFunc = void (*)(StateMachine *sm, const EventPayload &data);
+using ExitFunc = void (*)(StateMachine *sm);
+
 template <class SM, class Data, void (SM::*Func)(std::shared_ptr<const Data>)>
-class StateAction : public StateBase
+struct StateAction
 {
-public:
-  virtual void invokeStateAction(
-      StateMachine *sm,
-      std::shared_ptr<const EventData> data) const
+  static void invoke(StateMachine *sm, const EventPayload &data)
   {
     auto derived_sm = static_cast<SM *>(sm);
-    auto derived_data = std::dynamic_pointer_cast<const Data>(data);
+    (derived_sm->*Func)(data.template as<Data>());
+  }
+};
 
-    assert(derived_data.get() != nullptr);
-    (derived_sm->*Func)(derived_data);
+template <class SM, class Data, bool (SM::*Func)(std::shared_ptr<const Data>)>
+struct GuardCondition
+{
+  static bool invoke(StateMachine *sm, const EventPayload &data)
+  {
+    auto derived_sm = static_cast<SM *>(sm);
+    return (derived_sm->*Func)(data.template as<Data>());
   }
 };
 
-class GuardBase
+template <class SM, class Data, void (SM::*Func)(std::shared_ptr<const Data>)>
+struct EntryAction
 {
-public:
-  virtual bool invokeGuardCondition(
-      StateMachine *sm,
-      std::shared_ptr<const EventData> data) const = 0;
+  static void invoke(StateMachine *sm, const EventPayload &data)
+  {
+    auto derived_sm = static_cast<SM *>(sm);
+    (derived_sm->*Func)(data.template as<Data>());
+  }
 };
 
-template <class SM, class Data, bool (SM::*Func)(std::shared_ptr<const Data>)>
-class GuardCondition : public GuardBase
+template <class SM, void (SM::*Func)(void)>
+struct ExitAction
 {
-public:
-  virtual bool invokeGuardCondition(
-      StateMachine *sm,
-      std::shared_ptr<const EventData> data) const
+  static void invoke(StateMachine *sm)
   {
     auto derived_sm = static_cast<SM *>(sm);
-    auto derived_data = std::dynamic_pointer_cast<const Data>(data);
-    assert(derived_data.get() != nullptr);
 
-    return (derived_sm->*Func)(derived_data);
+    (derived_sm->*Func)();
+  }
+};
+
+struct StateMapRow
+{
+  const StateFunc state;
+};
+
+struct StateMapRowEx
+{
+  const StateFunc state;
+  const GuardFunc guard;
+  const EntryFunc entry;
+  const ExitFunc exit;
+};
+
+// Transitions of one event for every state, with the event id and name
+// given to EVENT_MAP_ENTRY
+template <size_t States>
+struct EventMapRow
+{
+  StateIndex event;
+  const char *name;
+  StateIndex transitions[States];
+};
+
+template <size_t States, class... NewStates>
+constexpr EventMapRow<States> makeEventMapRow(
+    StateIndex event,
+    const char *name,
+    NewStates... new_states)
+{
+  static_assert(sizeof...(NewStates) == States,
+                "Event map entry must list every state");
+  return EventMapRow<States>{event, name, {static_cast<StateIndex>(new_states)...}};
+}
+
+// True if name, an event's enum name as given to EVENT_MAP_ENTRY, is
+// event, qualified or not
+constexpr bool isEventName(const char *name, const char *event)
+{
+  size_t name_length = 0;
+  while (name[name_length] != '\0')
+  {
+    ++name_length;
+  }
+  size_t event_length = 0;
+  while (event[event_length] != '\0')
+  {
+    ++event_length;
+  }
+  if (name_length < event_length)
+  {
+    return false;
+  }
+  size_t start = name_length - event_length;
+  for (size_t i = 0; i < event_length; ++i)
+  {
+    if (name[start + i] != event[i])
+    {
+      return false;
+    }
+  }
+  return start == 0 || name[start - 1] == ':';
+}
+
+// Checked by END_EVENT_MAP against the machine's base. Bases that raise
+// their own events by id from the derived map overload it for themselves,
+// see SelfTest.
+template <size_t Events, size_t States>
+constexpr bool eventMapFitsBase(
+    const StateMachine *,
+    const EventMapRow<States> (&)[Events])
+{
+  return true;
+}
+
+// Rows of an event map copied into one contiguous [event][state] array
+template <size_t Events, size_t States>
+struct DenseEventMap
+{
+  StateIndex transitions[Events][States];
+  const char *names[Events];
+  bool ordered; // rows were listed in event id order
+};
+
+template <size_t Events, size_t States>
+constexpr DenseEventMap<Events, States> makeDenseEventMap(
+    const EventMapRow<States> (&rows)[Events])
+{
+  DenseEventMap<Events, States> map{};
+  map.ordered = true;
+  for (size_t event = 0; event < Events; ++event)
+  {
+    map.ordered = map.ordered && rows[event].event == event;
+    map.names[event] = rows[event].name;
+    for (size_t state = 0; state < States; ++state)
+    {
+      map.transitions[event][state] = rows[event].transitions[state];
+    }
   }
+  return map;
+}
+
+// Event map whose events share rows: row_of[event] is the row of transitions
+// of each event. Written by state_chart_gen for maps with many identical
+// rows, such as events handled the same way in every state.
+template <size_t Rows, size_t Events, size_t States>
+struct CompressedEventMap
+{
+  StateIndex transitions[Rows][States];
+  uint16_t row_of[Events];
+  const char *names[Events];
 };
 
-class EntryBase
+// Compressed map from its distinct rows, the row of each event and the
+// event names, as state_chart_gen writes it. The rows come from
+// makeEventMapRow, so each must list every state.
+template <size_t Rows, size_t Events, size_t States>
+constexpr CompressedEventMap<Rows, Events, States> makeCompressedEventMap(
+    const EventMapRow<States> (&rows)[Rows],
+    const uint16_t (&row_of)[Events],
+    const char *const (&names)[Events])
+{
+  CompressedEventMap<Rows, Events, States> map{};
+  for (size_t row = 0; row < Rows; ++row)
+  {
+    for (size_t state = 0; state < States; ++state)
+    {
+      map.transitions[row][state] = rows[row].transitions[state];
+    }
+  }
+  for (size_t event = 0; event < Events; ++event)
+  {
+    map.row_of[event] = row_of[event];
+    map.names[event] = names[event];
+  }
+  return map;
+}
+
+// Event map of a machine, generated by BEGIN_EVENT_MAP. The new state of
+// an event is one load at transitions[event * states + current state], or
+// at transitions[row_of[event] * states + current state] for a compressed
+// map.
+class EventTable
 {
 public:
-  virtual void invokeEntryAction(
-      StateMachine *sm,
-      std::shared_ptr<const EventData> data) const = 0;
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+  template <size_t Events, size_t States>
+  explicit EventTable(const DenseEventMap<Events, States> &map)
+      : transitions_(&map.transitions[0][0]),
+        row_of_(nullptr),
+        names_(map.names),
+        events_(Events),
+        states_(States),
+        recorder_events_(new uint16_t[Events])
+  {
+    this->registerNames();
+  }
+
+  template <size_t Rows, size_t Events, size_t States>
+  explicit EventTable(const CompressedEventMap<Rows, Events, States> &map)
+      : transitions_(&map.transitions[0][0]),
+        row_of_(map.row_of),
+        names_(map.names),
+        events_(Events),
+        states_(States),
+        recorder_events_(new uint16_t[Events])
+  {
+    this->registerNames();
+  }
+#else
+  // Constant initialized, so looking the table up costs no guard check
+  template <size_t Events, size_t States>
+  constexpr explicit EventTable(const DenseEventMap<Events, States> &map)
+      : transitions_(&map.transitions[0][0]),
+        row_of_(nullptr),
+        names_(map.names),
+        events_(Events),
+        states_(States)
+  {
+  }
+
+  template <size_t Rows, size_t Events, size_t States>
+  constexpr explicit EventTable(const CompressedEventMap<Rows, Events, States> &map)
+      : transitions_(&map.transitions[0][0]),
+        row_of_(map.row_of),
+        names_(map.names),
+        events_(Events),
+        states_(States)
+  {
+  }
+#endif
+
+  EventTable(const EventTable &) = delete;
+  EventTable &operator=(const EventTable &) = delete;
+
+  size_t events() const { return this->events_; }
+  size_t states() const { return this->states_; }
+
+  // New state of every state for event
+  const StateIndex *row(size_t event) const
+  {
+    assert(event < this->events_);
+    size_t row = this->row_of_ != nullptr ? this->row_of_[event] : event;
+    return this->transitions_ + row * this->states_;
+  }
+
+  const char *name(size_t event) const
+  {
+    assert(event < this->events_);
+    return this->names_[event];
+  }
+
+  // FlightRecorder::eventId() of event, 0 without the flight recorder
+  uint16_t recorderEvent(size_t event) const
+  {
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+    return this->recorder_events_[event];
+#else
+    (void)event;
+    return 0;
+#endif
+  }
+
+private:
+  const StateIndex *const transitions_;
+  const uint16_t *const row_of_; // nullptr for a dense map
+  const char *const *const names_;
+  const size_t events_;
+  const size_t states_;
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+  std::unique_ptr<uint16_t[]> recorder_events_;
+
+  void registerNames()
+  {
+    for (size_t event = 0; event < this->events_; ++event)
+    {
+      this->recorder_events_[event] = FlightRecorder::eventId(this->names_[event]);
+    }
+  }
+#endif
 };
 
-template <class SM, class Data, void (SM::*Func)(std::shared_ptr<const Data>)>
-class EntryAction : public EntryBase
+// Event posted to a machine in thread-safe mode. The transition map is
+// resolved against the current state by the thread draining the queue.
+// Posted events are recycled through a BlockPool, so posting only
+// allocates while the pool grows.
+struct QueuedEvent : MpscNode
+{
+  QueuedEvent(const StateIndex *transitions_, size_t size_, StateIndex state_)
+      : transitions(transitions_), size(size_), state(state_)
+  {
+  }
+
+  static void *operator new(size_t size);
+  static void operator delete(void *ptr);
+
+  const StateIndex *transitions; // nullptr if state is already resolved
+  size_t size;
+  StateIndex state; // new state, or parent state when transitions is set
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+  uint16_t event; // FlightRecorder::eventId() of the event function
+#endif
+  EventPayload data;
+};
+
+// Fixed-capacity FIFO of events, with storage provided by FixedEventRing.
+// Queueing never allocates; payloads are kept in EventPayload's inline
+// buffer when they fit.
+class EventRing
 {
 public:
-  virtual void invokeEntryAction(
-      StateMachine *sm,
-      std::shared_ptr<const EventData> data) const
+  EventRing(const EventRing &) = delete;
+  EventRing &operator=(const EventRing &) = delete;
+
+  bool empty() const { return this->count_ == 0; }
+  bool full() const { return this->count_ == this->capacity_; }
+  size_t size() const { return this->count_; }
+  size_t capacity() const { return this->capacity_; }
+
+  // New event at the back, or nullptr when the ring is full
+  QueuedEvent *push(const StateIndex *transitions, size_t size, StateIndex state)
   {
-    auto derived_sm = static_cast<SM *>(sm);
-    auto derived_data = std::dynamic_pointer_cast<const Data>(data);
+    if (this->full())
+    {
+      return nullptr;
+    }
+    void *slot = &this->slots_[(this->head_ + this->count_) % this->capacity_];
+    ++this->count_;
+    return ::new (slot) QueuedEvent(transitions, size, state);
+  }
 
-    assert(derived_data.get() != nullptr);
-    (derived_sm->*Func)(derived_data);
+  // New event at the front, or nullptr when the ring is full
+  QueuedEvent *pushFront(const StateIndex *transitions, size_t size,
+                         StateIndex state)
+  {
+    if (this->full())
+    {
+      return nullptr;
+    }
+    this->head_ = (this->head_ + this->capacity_ - 1) % this->capacity_;
+    ++this->count_;
+    return ::new (&this->slots_[this->head_])
+        QueuedEvent(transitions, size, state);
   }
+
+  QueuedEvent &front() { return (*this)[0]; }
+
+  // Event index places behind the front
+  QueuedEvent &operator[](size_t index)
+  {
+    assert(index < this->count_);
+    return *reinterpret_cast<QueuedEvent *>(
+        &this->slots_[(this->head_ + index) % this->capacity_]);
+  }
+
+  void pop()
+  {
+    this->front().~QueuedEvent();
+    this->head_ = (this->head_ + 1) % this->capacity_;
+    --this->count_;
+  }
+
+  void popBack()
+  {
+    (*this)[this->count_ - 1].~QueuedEvent();
+    --this->count_;
+  }
+
+  void clear()
+  {
+    while (!this->empty())
+    {
+      this->pop();
+    }
+  }
+
+protected:
+  using Slot = typename std::aligned_storage<sizeof(QueuedEvent),
+                                             alignof(QueuedEvent)>::type;
+
+  EventRing(Slot *slots, size_t capacity)
+      : slots_(slots), capacity_(capacity), head_(0), count_(0)
+  {
+  }
+  ~EventRing() {}
+
+private:
+  Slot *const slots_;
+  const size_t capacity_;
+  size_t head_;
+  size_t count_;
 };
 
-class ExitBase
+template <size_t Capacity>
+class FixedEventRing : public EventRing
 {
 public:
-  virtual void invokeExitAction(
-      StateMachine *sm) const = 0;
+  FixedEventRing() : EventRing(this->storage_, Capacity) {}
+  ~FixedEventRing() { this->clear(); }
+
+private:
+  Slot storage_[Capacity];
 };
 
-template <class SM, void (SM::*Func)(void)>
-class ExitAction : public ExitBase
+// Storage for StateMachine::deferEvent(), a member of machines that defer
+template <size_t Capacity>
+using DeferredEvents = FixedEventRing<Capacity>;
+
+// Bound on the work one call into the engine may do, a member of machines
+// whose event chains must not hold their thread for long:
+//
+//   EngineBudget budget_{16};
+//   virtual EngineBudget *getEngineBudget() { return &this->budget_; }
+//
+// Once max_steps state actions have run, or max_nanoseconds have passed
+// since the engine started, the engine stops before its next event and
+// the events still queued wait here. The machine then reports
+// isEnginePending(), and resumeEngine() carries on exactly where it
+// stopped, with a fresh budget. Events sent to a machine while it is
+// suspended run after the pending ones. 0 means no limit.
+//
+// The budget holds at most CAPACITY events. An event sent while it is
+// full is dropped, and the send returns false. When an engine stops with
+// more events than fit, its internal events are kept and the newest
+// external ones dropped. Every event lost either way is counted by
+// dropped().
+class EngineBudget
 {
 public:
-  virtual void invokeExitAction(
-      StateMachine *sm) const
+  // Internal and external events of one engine, and events sent while it
+  // is suspended
+  static const size_t CAPACITY = 3 * STATE_MACHINE_ENGINE_QUEUE_SIZE;
+
+  explicit EngineBudget(size_t max_steps, uint64_t max_nanoseconds = 0)
+      : max_steps_(max_steps), max_nanoseconds_(max_nanoseconds),
+        internal_count_(0), dropped_(0)
   {
-    auto derived_sm = static_cast<SM *>(sm);
+  }
 
-    (derived_sm->*Func)();
+  void setLimits(size_t max_steps, uint64_t max_nanoseconds = 0)
+  {
+    this->max_steps_ = max_steps;
+    this->max_nanoseconds_ = max_nanoseconds;
   }
+  size_t maxSteps() const { return this->max_steps_; }
+  uint64_t maxNanoseconds() const { return this->max_nanoseconds_; }
+
+  // Events left by an engine that ran out of budget
+  size_t pending() const { return this->events_.size(); }
+
+  // Events dropped because the budget was full, since construction
+  uint64_t dropped() const { return this->dropped_; }
+
+private:
+  friend class StateMachine;
+
+  size_t max_steps_;
+  uint64_t max_nanoseconds_;
+
+  // events_ starts with this many internal events, then external ones
+  size_t internal_count_;
+  uint64_t dropped_;
+  FixedEventRing<CAPACITY> events_;
 };
 
-struct StateMapRow
+class StateMachine;
+class EventScheduler;
+class StateTimers;
+class SnapshotFields;
+
+template <class SM>
+class DirectEngine;
+
+// Engine of machines without DIRECT_STATE_ENGINE: the state map is looked
+// up through the virtual getStateMap() and getStateMapEx(), and actions
+// are called through its pointers
+struct MapEngine
 {
-  const StateBase *const state;
 };
 
-struct StateMapRowEx
+struct EventQueue
 {
-  const StateBase *const state;
-  const GuardBase *const guard;
-  const EntryBase *const entry;
-  const ExitBase *const exit;
+  // Link used by schedulers to queue the machine itself
+  struct ScheduleNode : MpscNode
+  {
+    StateMachine *sm;
+  };
+
+  EventQueue(StateMachine *sm, EventScheduler *scheduler_)
+      : pending(0), scheduler(scheduler_)
+  {
+    this->schedule_node.sm = sm;
+  }
+
+  MpscQueue queue;
+  std::atomic<size_t> pending;
+  EventScheduler *const scheduler;
+  ScheduleNode schedule_node;
 };
 
 class StateMachine
 {
 public:
-  enum
+  enum : StateIndex
   {
-    EVENT_IGNORED = 0xFE,
-    CANNOT_HAPPEN
+    EVENT_IGNORED = STATE_INDEX_EVENT_IGNORED,
+    CANNOT_HAPPEN = STATE_INDEX_CANNOT_HAPPEN
   };
 
-  StateMachine(size_t max_states, uint8_t initial_state = 0);
-  virtual ~StateMachine() {}
-  uint8_t getCurrentState() { return this->current_state_; }
-  size_t getMaxStates() { return this->max_states_; }
+  StateMachine(size_t max_states, StateIndex initial_state = 0);
+  virtual ~StateMachine();
+  StateIndex getCurrentState() const { return this->current_state_; }
+  size_t getMaxStates() const { return this->max_states_; }
+
+  // Switch to thread-safe event injection. External events are pushed onto
+  // a lock-free queue and drained by whichever caller finds the machine
+  // idle, so state actions still run to completion on one thread at a
+  // time and producers never wait on each other. With a scheduler, the
+  // queue is drained by the scheduler instead of the caller. Must be
+  // called before the machine is shared between threads, or while it is
+  // idle to move it to another scheduler.
+  void enableEventQueue(EventScheduler *scheduler = nullptr);
+  bool isEventQueueEnabled() const { return this->event_queue_ != nullptr; }
+
+  // True while an engine that ran out of budget has events pending, see
+  // EngineBudget. event_generated_ is only left set between calls then.
+  bool isEnginePending() const
+  {
+    return this->event_generated_ && this->engine_events_ == nullptr;
+  }
+
+  // Run the pending events of a suspended engine within a fresh budget.
+  // Returns true if it ran out again. Machines with an event queue are
+  // resumed by whoever drains the queue instead.
+  bool resumeEngine();
+
+  // External event by id, looked up in the machine's event map (see
+  // BEGIN_EVENT_MAP), so routers, queues and decoders can raise any event
+  // without a wrapper per event. data is forwarded as by externalEvent,
+  // and so is the result.
+  template <class DataArg>
+  bool dispatch(size_t event_id, DataArg &&data)
+  {
+    return this->dispatch(event_id, std::forward<DataArg>(data), MapEngine());
+  }
+  bool dispatch(size_t event_id) { return this->dispatch(event_id, nullptr); }
+
+  // Event map of the machine, or nullptr if it has none
+  virtual const EventTable *getEventTable() { return nullptr; }
+
+  // Compact binary record of the current state, the deferred events and
+  // the fields named by snapshotFields(), see StateSnapshotHeader. Taken
+  // while the machine is idle. Deferred events are kept as their new
+  // state, so a machine with queued or pending events, or with deferred
+  // events that go through a transition map or carry a payload, cannot be
+  // saved and snapshotSize() returns 0. saveSnapshot() then refuses too:
+  // it returns the record size, or 0, writing nothing, if the machine
+  // cannot be saved or the record does not fit in size bytes.
+  size_t snapshotSize();
+  size_t saveSnapshot(void *record, size_t size);
+
+  // Restore a record saved by a machine of the same type, without running
+  // any action. Returns false, leaving the machine as it was, if the
+  // record is malformed or its version, StateIndex size or fields differ.
+  bool loadSnapshot(const void *record, size_t size);
+
+#ifdef STATE_MACHINE_ENABLE_METRICS
+  // Record engine metrics into metrics, or stop with nullptr. Call while
+  // the machine is idle. metrics must cover getMaxStates() states and
+  // outlive the machine; see StateMachineMetrics for sharing it between
+  // machines.
+  void enableMetrics(StateMachineMetrics *metrics)
+  {
+    assert(metrics == nullptr || metrics->getMaxStates() >= this->max_states_);
+    this->metrics_ = metrics;
+  }
+  StateMachineMetrics *getMetrics() const { return this->metrics_; }
+#endif
+
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+  // Id identifying this machine in FlightRecorder dumps
+  uint32_t getRecorderId() const { return this->recorder_id_; }
+#endif
+
+#ifdef STATE_MACHINE_ENABLE_STATE_BOARD
+  // Publish the current state, the engine steps and the time of the last
+  // one to slot, see StateBoard, or stop with nullptr. Call while the
+  // machine is idle. The slot is written on every engine step by the
+  // thread running it, so give each machine its own slot.
+  void publishState(StateBoardSlot *slot)
+  {
+    this->board_slot_ = slot;
+    this->publishStep(0);
+  }
+  StateBoardSlot *getStateSlot() const { return this->board_slot_; }
+#endif
+
+#ifdef STATE_MACHINE_ENABLE_COROUTINES
+  // Awaitables, see state_machine_coro.hpp. enteredState() resumes once
+  // the machine is in state, at once if it already is. nextTransition()
+  // resumes after the next state action the engine runs.
+  StateAwaiter enteredState(StateIndex state)
+  {
+    return StateAwaiter(*this, state, this->current_state_ == state);
+  }
+  StateAwaiter nextTransition()
+  {
+    return StateAwaiter(*this, StateAwaiter::ANY_STATE, false);
+  }
+#endif
 
 protected:
-  void externalEvent(
-      uint8_t new_state,
+  // Default parent transition, shadowed by PARENT_TRANSITION
+  enum : StateIndex
+  {
+    PARENT_STATE = CANNOT_HAPPEN
+  };
+
+  // Engine run by END_TRANSITION_MAP, shadowed by DIRECT_STATE_ENGINE
+  using StateEngine = MapEngine;
+
+  // dispatch() on engine
+  template <class DataArg, class Engine>
+  bool dispatch(size_t event_id, DataArg &&data, Engine engine)
+  {
+    const EventTable *table = this->getEventTable();
+    assert(table != nullptr && event_id < table->events());
+    return this->generateEvent(table->row(event_id), table->states(), CANNOT_HAPPEN,
+                        std::forward<DataArg>(data),
+                        table->recorderEvent(event_id), engine);
+  }
+
+  // Events are queued on the running engine's stack, without allocating.
+  // Internal events may be generated by state, entry and exit actions and
+  // run in order once the current step is done. External events the
+  // machine sends itself from an action run after all internal events.
+  // Each queue holds STATE_MACHINE_ENGINE_QUEUE_SIZE events; an event that
+  // does not fit, or does not fit the EngineBudget of a suspended machine,
+  // is dropped and the call returns false. Every other outcome, including
+  // an ignored event, returns true.
+  bool externalEvent(
+      StateIndex new_state,
       std::shared_ptr<const EventData> data_ptr = nullptr);
-  void internalEvent(
-      uint8_t new_state,
+  bool internalEvent(
+      StateIndex new_state,
       std::shared_ptr<const EventData> data_ptr = nullptr);
 
+  // Payloads passed by reference are copied into inline storage when they
+  // fit, so small events are dispatched without any heap allocation.
+  template <class Data, class = typename std::enable_if<
+                            std::is_base_of<EventData, Data>::value>::type>
+  bool externalEvent(StateIndex new_state, std::shared_ptr<Data> data_ptr)
+  {
+    return this->generateEvent(nullptr, 0, new_state, std::move(data_ptr));
+  }
+
+  template <class Data, class = typename std::enable_if<
+                            std::is_base_of<EventData, Data>::value>::type>
+  bool internalEvent(StateIndex new_state, std::shared_ptr<Data> data_ptr)
+  {
+    return this->queueInternalEvent(new_state, std::move(data_ptr));
+  }
+
+  template <class Data, class = typename std::enable_if<
+                            std::is_base_of<EventData, Data>::value>::type>
+  bool externalEvent(StateIndex new_state, const Data &data)
+  {
+    return this->generateEvent(nullptr, 0, new_state, data);
+  }
+
+  template <class Data, class = typename std::enable_if<
+                            std::is_base_of<EventData, Data>::value>::type>
+  bool internalEvent(StateIndex new_state, const Data &data)
+  {
+    return this->queueInternalEvent(new_state, data);
+  }
+
+  // Keep the event the running action was called for and replay it,
+  // through its transition map, after the next change of state. The
+  // machine provides the storage through getDeferredEvents(). Returns
+  // false, and the event is dropped, if that storage is full. Deferred
+  // events that do not fit the engine's queue on replay stay deferred,
+  // in order, until the next change of state.
+  bool deferEvent();
+
+  // External event driven by a transition map. States beyond the end of
+  // the map belong to a derived machine and take parent_state instead.
+  // event names the event function in flight recorder dumps, engine picks
+  // the engine that runs it.
+  template <size_t N, class DataArg, class Engine = MapEngine>
+  bool externalEvent(
+      const StateIndex (&transitions)[N],
+      StateIndex parent_state,
+      DataArg &&data,
+      uint16_t event = 0,
+      Engine engine = Engine())
+  {
+    return this->generateEvent(transitions, N, parent_state,
+                        std::forward<DataArg>(data), event, engine);
+  }
+
 private:
-  const size_t max_states_;
-  uint8_t current_state_;
-  uint8_t new_state_;
+  // Pointers first and the state fields last, so that with 8-bit state
+  // ids the base is a vptr, two pointers and four bytes, and a derived
+  // class's first small member lands in the tail padding.
+  std::unique_ptr<EventQueue> event_queue_;
 
+  // Events raised while an engine runs, on the stack of the running
+  // engine; nullptr while no engine runs. Defined in state_engine.hpp.
+  struct EngineEvents;
+  EngineEvents *engine_events_;
+#ifdef STATE_MACHINE_ENABLE_METRICS
+  StateMachineMetrics *metrics_;
+#endif
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+  uint32_t recorder_id_;
+  uint16_t recorder_event_; // event of the next engine step
+#endif
+#ifdef STATE_MACHINE_ENABLE_STATE_BOARD
+  StateBoardSlot *board_slot_;
+#endif
+#ifdef STATE_MACHINE_ENABLE_COROUTINES
+  StateAwaiter *waiters_; // suspended coroutines, in await order
+#endif
+
+  const StateIndex max_states_;
+  StateIndex current_state_;
+  StateIndex new_state_;
   bool event_generated_;
 
-  std::shared_ptr<const EventData> event_data_ptr;
   virtual const StateMapRow *getStateMap() = 0;
   virtual const StateMapRowEx *getStateMapEx() = 0;
 
-  void setCurrentState(uint8_t new_state)
+  // Parents of the states of an extended map, or nullptr for a flat
+  // machine. Overridden by the most derived machine, see StateHierarchy.
+  virtual const StateHierarchy *getStateHierarchy() { return nullptr; }
+
+  void setCurrentState(StateIndex new_state)
   {
     this->current_state_ = new_state;
   }
 
-  void stateEngine(void);
-  void stateEngine(const StateMapRow *const state_map_ptr);
-  void stateEngine(const StateMapRowEx *const state_map_ex_ptr);
+  // Storage for deferEvent(), or nullptr if the machine never defers
+  virtual EventRing *getDeferredEvents() { return nullptr; }
+
+  // Limit on each engine run, or nullptr to run until no event is left
+  virtual EngineBudget *getEngineBudget() { return nullptr; }
+
+  // Timers of the machine, or nullptr if it has none, see timer_wheel.hpp
+  virtual StateTimers *getStateTimers() { return nullptr; }
+
+  // Fields kept in snapshots besides the state, see SnapshotFields
+  virtual void snapshotFields(SnapshotFields &fields) { (void)fields; }
+
+  // Cancel the timers bound to state, which the running engine is exiting
+  void exitStateTimers(StateIndex state);
+
+  // New event at the back of ring, for the caller to fill in its payload.
+  // A full ring returns nullptr, and the caller reports the dropped event:
+  // raise STATE_MACHINE_ENGINE_QUEUE_SIZE or the DeferredEvents capacity.
+  static QueuedEvent *queueEvent(
+      EventRing &ring,
+      const StateIndex *transitions,
+      size_t size,
+      StateIndex state,
+      uint16_t event_id)
+  {
+    QueuedEvent *event = ring.push(transitions, size, state);
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+    if (event != nullptr)
+    {
+      event->event = event_id;
+    }
+#else
+    (void)event_id;
+#endif
+    return event;
+  }
+
+  EventRing &internalEvents();
+  EventRing &externalEvents();
+
+  template <class DataArg>
+  bool queueInternalEvent(StateIndex new_state, DataArg &&data)
+  {
+    QueuedEvent *event =
+        queueEvent(this->internalEvents(), nullptr, 0, new_state, 0);
+    if (event == nullptr)
+    {
+      return false;
+    }
+    event->data.set(std::forward<DataArg>(data));
+    return true;
+  }
+
+  StateIndex lookupTransition(
+      const StateIndex *transitions,
+      size_t size,
+      StateIndex state) const
+  {
+    if (transitions == nullptr)
+    {
+      return state;
+    }
+    if (this->current_state_ < size)
+    {
+      return transitions[this->current_state_];
+    }
+    assert(this->current_state_ < this->max_states_);
+    return state;
+  }
+
+  // Returns false if the event was dropped because a queue was full
+  template <class DataArg, class Engine = MapEngine>
+  bool generateEvent(
+      const StateIndex *transitions,
+      size_t size,
+      StateIndex state,
+      DataArg &&data,
+      uint16_t event_id = 0,
+      Engine engine = Engine())
+  {
+    if (this->event_queue_ != nullptr)
+    {
+      QueuedEvent *event = new QueuedEvent(transitions, size, state);
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+      event->event = event_id;
+#endif
+      event->data.set(std::forward<DataArg>(data));
+      this->postEvent(event);
+      return true;
+    }
+
+    if (this->engine_events_ != nullptr)
+    {
+      // Sent by one of the machine's own actions: runs once the internal
+      // events are done
+      QueuedEvent *event = queueEvent(
+          this->externalEvents(), transitions, size, state, event_id);
+      if (event == nullptr)
+      {
+        return false;
+      }
+      event->data.set(std::forward<DataArg>(data));
+      return true;
+    }
+
+    if (this->event_generated_)
+    {
+      // The engine ran out of budget: runs after the events it left
+      EngineBudget &budget = *this->getEngineBudget();
+      QueuedEvent *event =
+          queueEvent(budget.events_, transitions, size, state, event_id);
+      if (event != nullptr)
+      {
+        event->data.set(std::forward<DataArg>(data));
+      }
+      else
+      {
+        ++budget.dropped_;
+      }
+      this->resumeEngine();
+      return event != nullptr;
+    }
+
+    StateIndex new_state = this->lookupTransition(transitions, size, state);
+    this->recordEventMetrics(new_state);
+    this->recordEvent(event_id, new_state);
+    if (new_state != EVENT_IGNORED)
+    {
+      // Generate the event
+      EventPayload payload;
+      payload.set(std::forward<DataArg>(data));
+      this->event_generated_ = true;
+      this->new_state_ = new_state;
+
+      // Execute the state engine. This function call will only return
+      // when all state machine events are processed.
+      this->stateEngine(transitions, size, state, event_id, payload, engine);
+    }
+    return true;
+  }
+
+  // Metrics hooks of the engines, empty unless STATE_MACHINE_ENABLE_METRICS
+  // is defined. Timestamps are only taken with metrics attached,
+  // and then only for sampled actions.
+  uint64_t metricsNow() const
+  {
+#ifdef STATE_MACHINE_ENABLE_METRICS
+    return this->metrics_ != nullptr ? this->metrics_->startTiming() : 0;
+#else
+    return 0;
+#endif
+  }
+
+  void recordEventMetrics(StateIndex new_state)
+  {
+#ifdef STATE_MACHINE_ENABLE_METRICS
+    if (this->metrics_ != nullptr)
+    {
+      if (new_state == EVENT_IGNORED)
+      {
+        this->metrics_->recordIgnored();
+      }
+      else
+      {
+        this->metrics_->recordEvent();
+      }
+    }
+#else
+    (void)new_state;
+#endif
+  }
+
+  void recordGuardMetrics(StateIndex state, bool passed)
+  {
+#ifdef STATE_MACHINE_ENABLE_METRICS
+    if (this->metrics_ != nullptr)
+    {
+      this->metrics_->recordGuard(state, passed);
+    }
+#else
+    (void)state;
+    (void)passed;
+#endif
+  }
+
+  void recordExitMetrics(StateIndex state, uint64_t start)
+  {
+#ifdef STATE_MACHINE_ENABLE_METRICS
+    if (this->metrics_ != nullptr)
+    {
+      this->metrics_->recordExit(state, start);
+    }
+#else
+    (void)state;
+    (void)start;
+#endif
+  }
+
+  void recordEntryMetrics(StateIndex state, uint64_t start)
+  {
+#ifdef STATE_MACHINE_ENABLE_METRICS
+    if (this->metrics_ != nullptr)
+    {
+      this->metrics_->recordEntry(state, start);
+    }
+#else
+    (void)state;
+    (void)start;
+#endif
+  }
+
+  // State action of to has run, started at start
+  void recordActionMetrics(StateIndex from, StateIndex to, uint64_t start)
+  {
+#ifdef STATE_MACHINE_ENABLE_METRICS
+    if (this->metrics_ != nullptr)
+    {
+      this->metrics_->recordAction(to, start);
+      this->metrics_->recordTransition(from, to);
+    }
+#else
+    (void)from;
+    (void)to;
+    (void)start;
+#endif
+  }
+
+  // Flight recorder hooks, empty unless STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+  // is defined. recordEvent() is called once per external event; ignored
+  // events are recorded there, others on the engine's first step.
+  // recordStep() also logs the step to StateLog when
+  // STATE_MACHINE_ENABLE_TRANSITION_LOG is defined.
+  void recordEvent(uint16_t event, StateIndex new_state)
+  {
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+    if (new_state == EVENT_IGNORED)
+    {
+      FlightRecorder::record(
+          this->recorder_id_, event, this->current_state_, new_state);
+    }
+    else
+    {
+      this->recorder_event_ = event;
+    }
+#else
+    (void)event;
+    (void)new_state;
+#endif
+  }
+
+  void recordStep(bool guard_passed)
+  {
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+    uint16_t event = this->recorder_event_;
+    if (!guard_passed)
+    {
+      event |= FlightRecord::GUARD_FAILED;
+    }
+    FlightRecorder::record(
+        this->recorder_id_, event, this->current_state_, this->new_state_);
+    this->recorder_event_ = FlightRecord::NO_EVENT;
+#endif
+#ifdef STATE_MACHINE_ENABLE_TRANSITION_LOG
+    STATE_LOG_INFO("machine %p: state %u -> %u%s",
+                   static_cast<const void *>(this), this->current_state_,
+                   this->new_state_, guard_passed ? "" : " (guard failed)");
+#endif
+    (void)guard_passed;
+  }
+
+  // State board hook, empty unless STATE_MACHINE_ENABLE_STATE_BOARD is
+  // defined. Called once the current state is set, with the engine steps
+  // taken to reach it.
+  void publishStep(uint64_t steps)
+  {
+#ifdef STATE_MACHINE_ENABLE_STATE_BOARD
+    if (this->board_slot_ != nullptr)
+    {
+      this->board_slot_->write(this->current_state_, steps,
+                               MetricsClock::now());
+    }
+#else
+    (void)steps;
+#endif
+  }
+
+  // Coroutine hooks, empty unless STATE_MACHINE_ENABLE_COROUTINES is
+  // defined. notifyWaiters() marks the waiters a step satisfies; they are
+  // resumed by resumeWaiters() once the engine has finished.
+  void notifyWaiters(StateIndex from)
+  {
+#ifdef STATE_MACHINE_ENABLE_COROUTINES
+    if (this->waiters_ != nullptr)
+    {
+      this->fireWaiters(from, this->current_state_);
+    }
+#else
+    (void)from;
+#endif
+  }
+
+  void resumeWaiters()
+  {
+#ifdef STATE_MACHINE_ENABLE_COROUTINES
+    if (this->waiters_ != nullptr)
+    {
+      this->resumeFiredWaiters();
+    }
+#endif
+  }
+
+#ifdef STATE_MACHINE_ENABLE_COROUTINES
+  friend class StateAwaiter;
+
+  void addWaiter(StateAwaiter *waiter);
+  void removeWaiter(StateAwaiter *waiter);
+  void fireWaiters(StateIndex from, StateIndex to);
+  void resumeFiredWaiters();
+#endif
+
+  friend class EventScheduler;
+  friend class StateTimers;
+  template <class SM>
+  friend class DirectEngine;
+
+  void postEvent(QueuedEvent *event);
+  void dispatchEvent(QueuedEvent *event);
+  bool runEvents(size_t max_events);
+
+  // Run the pending event with payload data, then the events its actions
+  // generate. transitions, size and state describe the event for
+  // deferEvent().
+  void stateEngine(
+      const StateIndex *transitions,
+      size_t size,
+      StateIndex state,
+      uint16_t event_id,
+      EventPayload &data,
+      MapEngine engine = MapEngine());
+  template <class SM>
+  void stateEngine(
+      const StateIndex *transitions,
+      size_t size,
+      StateIndex state,
+      uint16_t event_id,
+      EventPayload &data,
+      DirectEngine<SM> engine);
+
+  // Engine loops of the flat and extended maps, calling the actions of
+  // each state through Actions, see state_engine.hpp
+  template <class Actions>
+  void stateEngine(const Actions &actions, EventPayload &data);
+  template <class Actions>
+  void stateEngine(
+      const Actions &actions,
+      const StateHierarchy *hierarchy,
+      EventPayload &data);
+
+  // Run the loaded event and the events queued behind it, on the engine
+  // of the machine's state map
+  void runEngine(EngineEvents &events, EventPayload &data);
+
+  // Event of the engine about to run, and its budget
+  void startEngine(
+      EngineEvents &events,
+      const StateIndex *transitions,
+      size_t size,
+      StateIndex state,
+      uint16_t event_id);
+
+  // The engine has run out of events or budget
+  void stopEngine(EngineEvents &events);
+
+  // Finish the step that left previous_state, then load the next queued
+  // event into data, leaving event_generated_ false if there is none or
+  // the budget is spent
+  void nextEvent(StateIndex previous_state, EventPayload &data);
+  void loadEvent(EngineEvents &events, EventPayload &data);
+  bool loadExternalEvent(EngineEvents &events, EventRing &ring,
+                         EventPayload &data);
+
+  // Budget of the engine about to run, see EngineBudget
+  void startBudget(EngineEvents &events);
+  bool budgetSpent(EngineEvents &events);
+
+  // Move the events still queued to the budget, for resumeEngine()
+  void suspendEngine(EngineEvents &events);
+
+  // Exit and entry actions of a transition to new_state_ in a hierarchy
+  template <class Actions>
+  void runTransitionActions(
+      const Actions &actions,
+      const StateHierarchy &hierarchy,
+      const EventPayload &data);
 };
 
-#define STATE_DECLARE(stateMachine, stateName, eventData) \
-  void ST_##stateName(std::shared_ptr<const eventData>);  \
-  StateAction<stateMachine, eventData, &stateMachine::ST_##stateName> stateName;
+// Runs machines whose event queue has become non-empty. schedule() is
+// called once each time a machine goes from idle to having events; the
+// scheduler then owns the machine and must call runEvents() until it
+// returns false, on one thread at a time.
+class EventScheduler
+{
+public:
+  virtual ~EventScheduler() {}
+  virtual void schedule(StateMachine *sm) = 0;
+
+protected:
+  // Dispatch up to max_events queued events, returns true if more remain
+  static bool runEvents(StateMachine *sm, size_t max_events)
+  {
+    return sm->runEvents(max_events);
+  }
+
+  static MpscNode *scheduleNode(StateMachine *sm)
+  {
+    return &sm->event_queue_->schedule_node;
+  }
+
+  static StateMachine *scheduledMachine(MpscNode *node)
+  {
+    return static_cast<EventQueue::ScheduleNode *>(node)->sm;
+  }
+};
+
+#define STATE_DECLARE(stateMachine, stateName, eventData)                    \
+  void ST_##stateName(std::shared_ptr<const eventData>);                     \
+  static void stateName(StateMachine *sm, const EventPayload &data)          \
+  {                                                                          \
+    StateAction<stateMachine, eventData, &stateMachine::ST_##stateName>::    \
+        invoke(sm, data);                                                    \
+  }
 
 #define STATE_DEFINE(stateMachine, stateName, eventData) \
   void stateMachine::ST_##stateName(std::shared_ptr<const eventData> data)
 
-#define GUARD_DECLARE(stateMachine, guardName, eventData) \
-  bool GD_##guardName(std::shared_ptr<const eventData>);  \
-  GuardCondition<stateMachine, eventData, &stateMachine::GD_##guardName> guardName;
+#define GUARD_DECLARE(stateMachine, guardName, eventData)                    \
+  bool GD_##guardName(std::shared_ptr<const eventData>);                     \
+  static bool guardName(StateMachine *sm, const EventPayload &data)          \
+  {                                                                          \
+    return GuardCondition<stateMachine, eventData,                           \
+                          &stateMachine::GD_##guardName>::invoke(sm, data);  \
+  }
 
 #define GUARD_DEFINE(stateMachine, guardName, eventData) \
   bool stateMachine::GD_##guardName(std::shared_ptr<const eventData> data)
 
-#define ENTRY_DECLARE(stateMachine, entryName, eventData) \
-  void EN_##entryName(std::shared_ptr<const eventData>);  \
-  EntryAction<stateMachine, eventData, &stateMachine::EN_##entryName> entryName;
+#define ENTRY_DECLARE(stateMachine, entryName, eventData)                    \
+  void EN_##entryName(std::shared_ptr<const eventData>);                     \
+  static void entryName(StateMachine *sm, const EventPayload &data)          \
+  {                                                                          \
+    EntryAction<stateMachine, eventData, &stateMachine::EN_##entryName>::    \
+        invoke(sm, data);                                                    \
+  }
 
 #define ENTRY_DEFINE(stateMachine, entryName, eventData) \
   void stateMachine::EN_##entryName(std::shared_ptr<const eventData> data)
 
-#define EXIT_DECLARE(stateMachine, exitName) \
-  void EX_##exitName(void);                  \
-  ExitAction<stateMachine, &stateMachine::EX_##exitName> exitName;
+#define EXIT_DECLARE(stateMachine, exitName)                                 \
+  void EX_##exitName(void);                                                  \
+  static void exitName(StateMachine *sm)                                     \
+  {                                                                          \
+    ExitAction<stateMachine, &stateMachine::EX_##exitName>::invoke(sm);      \
+  }
 
 #define EXIT_DEFINE(stateMachine, exitName) \
   void stateMachine::EX_##exitName(void)
@@ -195,19 +1524,63 @@ private:
 #define TRANSITION_MAP_ENTRY(entry) \
   entry,
 
-#define END_TRANSITION_MAP(data)                       \
-  assert(getCurrentState() < ST_MAX_STATES);           \
-  externalEvent(TRANSITIONS[getCurrentState()], data); \
-  static_assert((sizeof(TRANSITIONS) / sizeof(uint8_t)) == ST_MAX_STATES, "STATE SIZE IS INVAILD");
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+// Registers the name of the enclosing event function on its first call
+#define RECORD_EVENT_NAME() \
+  static const uint16_t RECORDED_EVENT = FlightRecorder::eventId(__func__);
+#define RECORDED_EVENT_ID RECORDED_EVENT
+#else
+#define RECORD_EVENT_NAME()
+#define RECORDED_EVENT_ID 0
+#endif
+
+#define END_TRANSITION_MAP(data)                                                     \
+  RECORD_EVENT_NAME()                                                                \
+  externalEvent(TRANSITIONS, PARENT_STATE, data, RECORDED_EVENT_ID, StateEngine());  \
+  static_assert((sizeof(TRANSITIONS) / sizeof(TRANSITIONS[0])) == ST_MAX_STATES, "STATE SIZE IS INVAILD"); \
+  static_assert(static_cast<size_t>(ST_MAX_STATES) < EVENT_IGNORED,                  \
+                "Too many states for StateIndex, see STATE_MACHINE_STATE_INDEX_TYPE");
 
-#define PARENT_TRANSITION(state)            \
-  if (getCurrentState() >= ST_MAX_STATES && \
-      getCurrentState() < getMaxStates())   \
-  {                                         \
-    externalEvent(state);                   \
-    return;                                 \
+// Event map of a machine: one row per external event, listing the new
+// state for every state of the most derived machine, in event id order.
+// Placed in the class next to the state map; the events are numbered by an
+// enum ending in EV_MAX_EVENTS and raised with dispatch():
+//
+//   BEGIN_EVENT_MAP()
+//     EVENT_MAP_ENTRY(EV_HALT,
+//                     EVENT_IGNORED, // ST_IDLE
+//                     ST_STOP)       // ST_START
+//   END_EVENT_MAP()
+#define BEGIN_EVENT_MAP()                                        \
+  virtual const EventTable *getEventTable()                      \
+  {                                                              \
+    static constexpr EventMapRow<ST_MAX_STATES> EVENT_MAP_ROWS[] = {
+
+#define EVENT_MAP_ENTRY(eventName, ...) \
+  makeEventMapRow<ST_MAX_STATES>(eventName, #eventName, __VA_ARGS__),
+
+#define END_EVENT_MAP()                                                          \
+  }                                                                              \
+  ;                                                                              \
+  static_assert((sizeof(EVENT_MAP_ROWS) / sizeof(EVENT_MAP_ROWS[0])) == EV_MAX_EVENTS, \
+                "Invalid size of EVENT_MAP");                                   \
+  static constexpr auto EVENT_MAP = makeDenseEventMap(EVENT_MAP_ROWS);           \
+  static_assert(EVENT_MAP.ordered, "Events must be listed in id order");         \
+  static_assert(eventMapFitsBase(                                                \
+                    static_cast<std::remove_pointer<decltype(this)>::type *>(    \
+                        nullptr),                                                \
+                    EVENT_MAP_ROWS),                                             \
+                "Event map must start with the events of its base machine");    \
+  static const EventTable EVENT_TABLE(EVENT_MAP);                                \
+  return &EVENT_TABLE;                                                           \
   }
 
+// Transition taken when the current state belongs to a derived machine.
+// Declares a local that shadows StateMachine::PARENT_STATE so that the
+// lookup happens in END_TRANSITION_MAP, on the thread running the engine.
+#define PARENT_TRANSITION(state) \
+  const StateIndex PARENT_STATE = state;
+
 #define STATE_MAP_ENTRY(stateName) \
   stateName
 
@@ -220,3 +1593,40 @@ private:
   {                                                                       \
     stateName, guardName, entryName, exitName                             \
   }
+
+// Runs the events the machine raises through END_TRANSITION_MAP and
+// dispatch() on an engine compiled for it, see DirectEngine. One line at
+// the top of the class body of the most derived machine:
+//
+//   class Motor : public StateMachine
+//   {
+//     DIRECT_STATE_ENGINE(Motor)
+//   public:
+//     ...
+//
+// dispatch() called through a StateMachine reference still runs the map
+// engine. Defining STATE_MACHINE_DISABLE_DIRECT_ENGINE puts every machine
+// back on the map engine, to compare the two.
+#ifndef STATE_MACHINE_DISABLE_DIRECT_ENGINE
+#define DIRECT_STATE_ENGINE(stateMachine)                                 \
+  friend class DirectEngine<stateMachine>;                                \
+  using StateEngine = DirectEngine<stateMachine>;                         \
+                                                                          \
+public:                                                                   \
+  template <class DataArg>                                                \
+  bool dispatch(size_t event_id, DataArg &&data)                          \
+  {                                                                       \
+    return this->StateMachine::dispatch(                                  \
+        event_id, std::forward<DataArg>(data), StateEngine());            \
+  }                                                                       \
+  bool dispatch(size_t event_id)                                          \
+  {                                                                       \
+    return this->dispatch(event_id, nullptr);                             \
+  }                                                                       \
+                                                                          \
+private:
+#else
+#define DIRECT_STATE_ENGINE(stateMachine)
+#endif
+
+#include "state_engine.hpp"
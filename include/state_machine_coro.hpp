@@ -0,0 +1,129 @@
+#pragma once
+
+#include "state_index.hpp"
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+// C++20 coroutine layer, compiled in with STATE_MACHINE_ENABLE_COROUTINES.
+// A coroutine co_awaits a machine's transitions instead of polling it:
+//
+//   StateTask runTest(CentrifugeTest &test)
+//   {
+//     test.start();
+//     co_await test.completed(); // enteredState(ST_COMPLETED)
+//   }
+//
+// The awaiting coroutine is suspended without holding a thread, and is
+// resumed by the thread running the machine's engine once the engine has
+// finished the event that made the transition. An awaiter reports the
+// first step that satisfies it; steps the same event runs after that one
+// are not seen by the coroutine's next co_await. Await a machine from the
+// thread that drives it, or while it is idle.
+
+class StateMachine;
+
+// Step of the engine that ran the action of to, coming from from (equal
+// for a self transition)
+struct StateTransition
+{
+  StateIndex from;
+  StateIndex to;
+};
+
+// Awaitable returned by StateMachine::enteredState() and nextTransition()
+class StateAwaiter
+{
+public:
+  // Sentinel of state_ for nextTransition()
+  static const StateIndex ANY_STATE = STATE_INDEX_CANNOT_HAPPEN;
+
+  StateAwaiter(StateMachine &sm, StateIndex state, bool ready);
+  ~StateAwaiter();
+
+  StateAwaiter(const StateAwaiter &) = delete;
+  StateAwaiter &operator=(const StateAwaiter &) = delete;
+
+  bool await_ready() const noexcept { return this->ready_; }
+  void await_suspend(std::coroutine_handle<> handle) noexcept;
+  StateTransition await_resume() const noexcept { return this->transition_; }
+
+private:
+  friend class StateMachine;
+
+  StateMachine &sm_;
+  StateAwaiter *next_; // in the machine's list of waiters
+  std::coroutine_handle<> handle_;
+  StateTransition transition_;
+  StateIndex state_;
+  bool ready_;
+  bool linked_; // in the machine's list
+  bool fired_;  // transition_ is set, resumed once the engine is done
+};
+
+// Coroutine type for sequences that drive machines. It starts eagerly, runs
+// until its first co_await and is then resumed by the engines it waits on.
+// The task owns the coroutine frame; destroying a suspended task stops
+// waiting. Exceptions escaping the coroutine are rethrown by get().
+class StateTask
+{
+public:
+  struct promise_type
+  {
+    std::exception_ptr exception;
+
+    StateTask get_return_object()
+    {
+      return StateTask(
+          std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { this->exception = std::current_exception(); }
+  };
+
+  StateTask(StateTask &&other) noexcept
+      : handle_(std::exchange(other.handle_, nullptr))
+  {
+  }
+  StateTask &operator=(StateTask &&other) noexcept
+  {
+    if (this != &other)
+    {
+      this->reset();
+      this->handle_ = std::exchange(other.handle_, nullptr);
+    }
+    return *this;
+  }
+  ~StateTask() { this->reset(); }
+
+  bool done() const { return !this->handle_ || this->handle_.done(); }
+
+  // Rethrow the exception the finished coroutine ended with, if any
+  void get() const
+  {
+    if (this->handle_ && this->handle_.promise().exception)
+    {
+      std::rethrow_exception(this->handle_.promise().exception);
+    }
+  }
+
+private:
+  std::coroutine_handle<promise_type> handle_;
+
+  explicit StateTask(std::coroutine_handle<promise_type> handle)
+      : handle_(handle)
+  {
+  }
+
+  void reset()
+  {
+    if (this->handle_)
+    {
+      this->handle_.destroy();
+      this->handle_ = nullptr;
+    }
+  }
+};
@@ -0,0 +1,302 @@
+#pragma once
+
+#include "static_state_machine.hpp"
+#include "state_snapshot.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cinttypes>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+#if defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+// Structure-of-arrays container for N machines of one StaticStateMachine
+// type. The current states live in one contiguous array, so applying an
+// event to the whole fleet is a table gather over that array (one byte
+// shuffle per 16 machines when SSSE3 is available, state ids are 8-bit and
+// the machine has at most 16 states). Lanes that take a transition are then bucketed by target
+// state and run group by group; EVENT_IGNORED lanes are skipped 16 at a
+// time without touching their machine.
+//
+// Events must reach fleet members through apply(). After calling an event
+// function on a member directly, call refresh() to resync the state array.
+template <class SM>
+class StateMachineFleet
+{
+  using Map = typename StaticStateMachine<SM>::template MapOf<>;
+
+public:
+
+  explicit StateMachineFleet(size_t count)
+      : machines_(count), states_(count)
+  {
+    this->refresh();
+  }
+
+  size_t size() const { return this->machines_.size(); }
+  SM &operator[](size_t index) { return this->machines_[index]; }
+  const SM &operator[](size_t index) const { return this->machines_[index]; }
+
+  // Current state of every machine, contiguous
+  const StateIndex *states() const { return this->states_.data(); }
+
+  void refresh()
+  {
+    for (size_t i = 0; i < this->machines_.size(); ++i)
+    {
+      this->states_[i] = this->machines_[i].getCurrentState();
+    }
+  }
+
+  // Apply an event without payload to every machine, returns the number
+  // of machines that took a transition
+  template <class Event>
+  size_t apply()
+  {
+    return this->applyEvent<Event, NoEventData>(nullptr);
+  }
+
+  // The payload is shared by every machine and must outlive the call
+  template <class Event, class Data>
+  size_t apply(const Data &data)
+  {
+    return this->applyEvent<Event>(&data);
+  }
+
+  // Write the state and snapshotFields() of every machine to a checkpoint
+  // file at path, see FleetCheckpointHeader. Taken between events.
+  bool saveCheckpoint(const char *path)
+  {
+    this->refresh();
+
+    SnapshotFields measure(SnapshotFields::MEASURE);
+    if (!this->machines_.empty())
+    {
+      this->machines_[0].visitSnapshotFields(measure);
+    }
+    const size_t field_size = measure.size();
+    const size_t count = this->machines_.size();
+
+    FleetCheckpointHeader header;
+    header.magic = FleetCheckpointHeader::MAGIC;
+    header.version = FleetCheckpointHeader::VERSION;
+    header.state_size = sizeof(StateIndex);
+    header.max_states = static_cast<uint32_t>(Map::SIZE);
+    header.field_size = static_cast<uint32_t>(field_size);
+    header.reserved = 0;
+    header.count = count;
+    header.states_offset = alignCheckpoint(sizeof(header));
+    header.fields_offset =
+        alignCheckpoint(header.states_offset + count * sizeof(StateIndex));
+
+    CheckpointFile file;
+    if (!file.create(path, header.fields_offset + count * field_size))
+    {
+      return false;
+    }
+    unsigned char *data = file.writableData();
+    std::memcpy(data, &header, sizeof(header));
+    std::memcpy(data + header.states_offset, this->states_.data(),
+                count * sizeof(StateIndex));
+    for (size_t i = 0; i < count; ++i)
+    {
+      SnapshotFields fields(SnapshotFields::SAVE,
+                            data + header.fields_offset + i * field_size,
+                            field_size);
+      this->machines_[i].visitSnapshotFields(fields);
+    }
+    return file.sync();
+  }
+
+  bool loadCheckpoint(const char *path)
+  {
+    CheckpointFile file;
+    return file.open(path) && this->restore(file);
+  }
+
+  // Restore every machine from a mapped checkpoint of a fleet of the same
+  // machine type and size, without running any action. The states are
+  // copied out of the mapping in one block and the fields read in place,
+  // so the cost depends only on the size of the file. Returns false,
+  // leaving the fleet as it was, if the checkpoint does not match.
+  bool restore(const CheckpointFile &file)
+  {
+    const FleetCheckpointHeader *header = file.header();
+    const size_t count = this->machines_.size();
+    if (header == nullptr || header->max_states != Map::SIZE ||
+        header->count != count)
+    {
+      return false;
+    }
+
+    SnapshotFields measure(SnapshotFields::MEASURE);
+    if (count != 0)
+    {
+      this->machines_[0].visitSnapshotFields(measure);
+    }
+    if (count != 0 && measure.size() != header->field_size)
+    {
+      return false;
+    }
+
+    const StateIndex *states = reinterpret_cast<const StateIndex *>(
+        file.data() + header->states_offset);
+    for (size_t i = 0; i < count; ++i)
+    {
+      if (states[i] >= Map::SIZE)
+      {
+        return false;
+      }
+    }
+
+    std::copy(states, states + count, this->states_.begin());
+    const unsigned char *fields = file.data() + header->fields_offset;
+    for (size_t i = 0; i < count; ++i)
+    {
+      SM &sm = this->machines_[i];
+      sm.current_state_ = this->states_[i];
+      SnapshotFields loader(
+          SnapshotFields::LOAD,
+          const_cast<unsigned char *>(fields + i * header->field_size),
+          header->field_size);
+      sm.visitSnapshotFields(loader);
+    }
+    return true;
+  }
+
+private:
+  std::vector<SM> machines_;
+  std::vector<StateIndex> states_;
+  std::array<std::vector<uint32_t>, Map::SIZE> buckets_;
+
+  template <class Data>
+  struct GroupRunner
+  {
+    StateMachineFleet &fleet;
+    const std::vector<uint32_t> &lanes;
+    const Data *data;
+
+    template <class S>
+    void visit()
+    {
+      for (uint32_t lane : this->lanes)
+      {
+        SM &sm = this->fleet.machines_[lane];
+        EventPayload payload;
+        if (this->data != nullptr)
+        {
+          payload.borrow(*this->data);
+        }
+        sm.template startEngineAt<S>(payload);
+        this->fleet.states_[lane] = sm.getCurrentState();
+      }
+    }
+  };
+
+  template <class Event, class Data>
+  size_t applyEvent(const Data *data)
+  {
+    static_assert(Event::SIZE == Map::SIZE ||
+                      (Event::SIZE < Map::SIZE && Event::PARENT != SM::CANNOT_HAPPEN),
+                  "Transition map does not cover every state");
+
+    // Transition table padded to every state of the machine
+    StateIndex table[Map::SIZE > 16 ? Map::SIZE : 16];
+    const StateIndex parent = Event::PARENT;
+    std::fill(std::begin(table), std::end(table), parent);
+    std::copy(Event::table(), Event::table() + Event::SIZE, table);
+
+    for (auto &bucket : this->buckets_)
+    {
+      bucket.clear();
+    }
+    this->bucketLanes(table);
+
+    size_t active = 0;
+    for (StateIndex state = 0; state < Map::SIZE; ++state)
+    {
+      const std::vector<uint32_t> &lanes = this->buckets_[state];
+      if (!lanes.empty())
+      {
+        GroupRunner<Data> runner{*this, lanes, data};
+        Map::Dispatch::visit(state, runner);
+        active += lanes.size();
+      }
+    }
+    return active;
+  }
+
+  static uint64_t alignCheckpoint(uint64_t offset)
+  {
+    const uint64_t alignment = FleetCheckpointHeader::ALIGNMENT;
+    return (offset + alignment - 1) / alignment * alignment;
+  }
+
+  // Lanes whose event is ignored are skipped. A CANNOT_HAPPEN asserts
+  // and, in release builds, leaves the lane in its state, as the dispatch
+  // of a single machine does; it must never index the buckets.
+  void addLane(StateIndex new_state, uint32_t lane)
+  {
+    if (new_state >= Map::SIZE)
+    {
+      assert(new_state == SM::EVENT_IGNORED);
+      return;
+    }
+    this->buckets_[new_state].push_back(lane);
+  }
+
+  void bucketLanes(const StateIndex *table)
+  {
+    const size_t count = this->states_.size();
+    const StateIndex *states = this->states_.data();
+    size_t i = 0;
+
+#if defined(__SSSE3__)
+    if (sizeof(StateIndex) == 1 && Map::SIZE <= 16)
+    {
+      const __m128i lookup =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(table));
+      const __m128i ignored = _mm_set1_epi8(static_cast<char>(SM::EVENT_IGNORED));
+      const __m128i cannot_happen =
+          _mm_set1_epi8(static_cast<char>(SM::CANNOT_HAPPEN));
+      uint8_t next[16];
+      for (; i + 16 <= count; i += 16)
+      {
+        __m128i current =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(states + i));
+        __m128i gathered = _mm_shuffle_epi8(lookup, current);
+        unsigned impossible = static_cast<unsigned>(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(gathered, cannot_happen)));
+        assert(impossible == 0);
+        unsigned active =
+            ~(static_cast<unsigned>(_mm_movemask_epi8(
+                  _mm_cmpeq_epi8(gathered, ignored))) |
+              impossible) &
+            0xFFFFu;
+        if (active == 0)
+        {
+          continue;
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(next), gathered);
+        while (active != 0)
+        {
+          unsigned bit = __builtin_ctz(active);
+          active &= active - 1;
+          this->addLane(next[bit], static_cast<uint32_t>(i + bit));
+        }
+      }
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+      this->addLane(table[states[i]], static_cast<uint32_t>(i));
+    }
+  }
+};
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define STATE_MACHINE_METRICS_TSC 1
+#endif
+
+// Instrumentation of the state engines, compiled in with
+// STATE_MACHINE_ENABLE_METRICS. Without it none of this is referenced by
+// StateMachine and the engines carry no extra code or members.
+
+// Cheapest monotonic tick source available: the TSC on x86, steady_clock
+// nanoseconds elsewhere
+struct MetricsClock
+{
+  static uint64_t now()
+  {
+#ifdef STATE_MACHINE_METRICS_TSC
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+  }
+
+  // Calibrated once, on first use
+  static double nsPerTick()
+  {
+#ifdef STATE_MACHINE_METRICS_TSC
+    static const double ns_per_tick = calibrate();
+    return ns_per_tick;
+#else
+    return 1.0;
+#endif
+  }
+
+private:
+#ifdef STATE_MACHINE_METRICS_TSC
+  static double calibrate()
+  {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t start_ticks = now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    auto stop = std::chrono::steady_clock::now();
+    uint64_t stop_ticks = now();
+
+    double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+    return stop_ticks > start_ticks ? ns / (stop_ticks - start_ticks) : 1.0;
+  }
+#endif
+};
+
+// Counter with a single writer. Increments are a relaxed load and store
+// rather than a locked add, and readers on other threads see a value that
+// is at most a few increments stale.
+class MetricsCounter
+{
+public:
+  MetricsCounter() : value_(0) {}
+
+  void add(uint64_t n = 1)
+  {
+    this->value_.store(
+        this->value_.load(std::memory_order_relaxed) + n,
+        std::memory_order_relaxed);
+  }
+
+  uint64_t load() const { return this->value_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> value_;
+};
+
+// Log2-bucketed latency histogram. Bucket 0 counts samples of 0 ticks and
+// bucket i samples in [2^(i-1), 2^i) ticks.
+class LatencyHistogram
+{
+public:
+  static const size_t BUCKETS = 48;
+
+  void record(uint64_t ticks)
+  {
+    size_t bucket = 0;
+#if defined(__GNUC__)
+    bucket = ticks == 0 ? 0 : 64 - __builtin_clzll(ticks);
+#else
+    for (uint64_t rest = ticks; rest != 0; rest >>= 1)
+    {
+      ++bucket;
+    }
+#endif
+    this->buckets_[bucket < BUCKETS ? bucket : BUCKETS - 1].add();
+  }
+
+  struct Snapshot
+  {
+    uint64_t counts[BUCKETS];
+    double ns_per_tick;
+
+    uint64_t count() const
+    {
+      uint64_t total = 0;
+      for (uint64_t count : this->counts)
+      {
+        total += count;
+      }
+      return total;
+    }
+
+    // Upper bound of bucket i in nanoseconds
+    double bucketLimitNs(size_t bucket) const
+    {
+      return static_cast<double>(uint64_t(1) << bucket) * this->ns_per_tick;
+    }
+
+    // Upper bound of the bucket holding the given quantile (0..1), or 0
+    // when nothing was recorded
+    double quantileNs(double quantile) const
+    {
+      uint64_t total = this->count();
+      if (total == 0)
+      {
+        return 0.0;
+      }
+      uint64_t rank = static_cast<uint64_t>(quantile * (total - 1)) + 1;
+      uint64_t seen = 0;
+      for (size_t bucket = 0; bucket < BUCKETS; ++bucket)
+      {
+        seen += this->counts[bucket];
+        if (seen >= rank)
+        {
+          return this->bucketLimitNs(bucket);
+        }
+      }
+      return this->bucketLimitNs(BUCKETS - 1);
+    }
+  };
+
+  Snapshot snapshot() const
+  {
+    Snapshot snapshot;
+    for (size_t bucket = 0; bucket < BUCKETS; ++bucket)
+    {
+      snapshot.counts[bucket] = this->buckets_[bucket].load();
+    }
+    snapshot.ns_per_tick = MetricsClock::nsPerTick();
+    return snapshot;
+  }
+
+private:
+  MetricsCounter buckets_[BUCKETS];
+};
+
+// Metrics of the machines attached to it. Counters are written by the
+// engine running the event, so attach one instance per machine, or share
+// it only between machines that run on the same thread. Snapshots may be
+// taken from any thread at any time.
+//
+// Counts are exact. Latencies are timed for one action in
+// 2^sample_shift, since reading the clock costs more than the counters.
+class StateMachineMetrics
+{
+public:
+  explicit StateMachineMetrics(size_t max_states, unsigned sample_shift = 0)
+      : max_states_(max_states),
+        sample_mask_((uint64_t(1) << sample_shift) - 1),
+        sample_count_(0),
+        states_(new PerState[max_states]),
+        transitions_(new MetricsCounter[max_states * max_states])
+  {
+  }
+
+  StateMachineMetrics(const StateMachineMetrics &) = delete;
+  StateMachineMetrics &operator=(const StateMachineMetrics &) = delete;
+
+  size_t getMaxStates() const { return this->max_states_; }
+
+  // Recording, called by the state engines
+
+  void recordEvent() { this->events_.add(); }
+  void recordIgnored() { this->ignored_.add(); }
+
+  void recordGuard(size_t state, bool passed)
+  {
+    assert(state < this->max_states_);
+    if (passed)
+    {
+      this->states_[state].guard_passed.add();
+    }
+    else
+    {
+      this->states_[state].guard_failed.add();
+    }
+  }
+
+  // State action of to ran, coming from state from (equal for a self
+  // transition)
+  void recordTransition(size_t from, size_t to)
+  {
+    assert(from < this->max_states_ && to < this->max_states_);
+    this->states_[to].entries.add();
+    this->transitions_[from * this->max_states_ + to].add();
+  }
+
+  // Start time of an action about to run, or 0 if it isn't sampled
+  uint64_t startTiming()
+  {
+    if ((this->sample_count_++ & this->sample_mask_) != 0)
+    {
+      return 0;
+    }
+    return MetricsClock::now();
+  }
+
+  // Action latencies, given the start time from startTiming()
+  void recordAction(size_t state, uint64_t start)
+  {
+    record(this->states_[state].action, start);
+  }
+  void recordEntry(size_t state, uint64_t start)
+  {
+    record(this->states_[state].entry, start);
+  }
+  void recordExit(size_t state, uint64_t start)
+  {
+    record(this->states_[state].exit, start);
+  }
+
+  struct StateSnapshot
+  {
+    uint64_t entries;
+    uint64_t guard_passed;
+    uint64_t guard_failed;
+    LatencyHistogram::Snapshot action;
+    LatencyHistogram::Snapshot entry;
+    LatencyHistogram::Snapshot exit;
+  };
+
+  struct Snapshot
+  {
+    uint64_t events;  // external events that reached the engine
+    uint64_t ignored; // external events dropped as EVENT_IGNORED
+    std::vector<StateSnapshot> states;
+    std::vector<uint64_t> transitions; // [from * states.size() + to]
+
+    uint64_t transitionCount(size_t from, size_t to) const
+    {
+      return this->transitions[from * this->states.size() + to];
+    }
+  };
+
+  Snapshot snapshot() const
+  {
+    Snapshot snapshot;
+    snapshot.events = this->events_.load();
+    snapshot.ignored = this->ignored_.load();
+    snapshot.states.resize(this->max_states_);
+    for (size_t state = 0; state < this->max_states_; ++state)
+    {
+      const PerState &source = this->states_[state];
+      StateSnapshot &target = snapshot.states[state];
+      target.entries = source.entries.load();
+      target.guard_passed = source.guard_passed.load();
+      target.guard_failed = source.guard_failed.load();
+      target.action = source.action.snapshot();
+      target.entry = source.entry.snapshot();
+      target.exit = source.exit.snapshot();
+    }
+    snapshot.transitions.resize(this->max_states_ * this->max_states_);
+    for (size_t i = 0; i < snapshot.transitions.size(); ++i)
+    {
+      snapshot.transitions[i] = this->transitions_[i].load();
+    }
+    return snapshot;
+  }
+
+private:
+  struct PerState
+  {
+    MetricsCounter entries;
+    MetricsCounter guard_passed;
+    MetricsCounter guard_failed;
+    LatencyHistogram action;
+    LatencyHistogram entry;
+    LatencyHistogram exit;
+  };
+
+  const size_t max_states_;
+  const uint64_t sample_mask_;
+  uint64_t sample_count_;
+  MetricsCounter events_;
+  MetricsCounter ignored_;
+  std::unique_ptr<PerState[]> states_;
+  std::unique_ptr<MetricsCounter[]> transitions_;
+
+  static void record(LatencyHistogram &histogram, uint64_t start)
+  {
+    if (start != 0)
+    {
+      histogram.record(MetricsClock::now() - start);
+    }
+  }
+};
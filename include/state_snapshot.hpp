@@ -0,0 +1,157 @@
+#pragma once
+
+#include "state_index.hpp"
+
+#include <cassert>
+#include <cinttypes>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
+// Fields a machine keeps across restarts, named by its snapshotFields()
+// override. The same override sizes, saves and loads a snapshot, so the
+// fields are listed once:
+//
+//   void Motor::snapshotFields(SnapshotFields &fields)
+//   {
+//     fields.field(this->current_speed_);
+//   }
+//
+// Fields are copied as bytes in host byte order and must be trivially
+// copyable. Pointers mean nothing to another process; keep ids instead.
+class SnapshotFields
+{
+public:
+  enum Mode
+  {
+    MEASURE,
+    SAVE,
+    LOAD
+  };
+
+  explicit SnapshotFields(Mode mode, void *buffer = nullptr, size_t size = 0)
+      : mode_(mode),
+        buffer_(static_cast<unsigned char *>(buffer)),
+        capacity_(size),
+        offset_(0)
+  {
+  }
+
+  template <class T>
+  void field(T &value)
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Snapshot fields are copied as bytes");
+    this->bytes(&value, sizeof(T));
+  }
+
+  void bytes(void *data, size_t size)
+  {
+    if (this->mode_ != MEASURE && this->offset_ + size <= this->capacity_)
+    {
+      if (this->mode_ == SAVE)
+      {
+        std::memcpy(this->buffer_ + this->offset_, data, size);
+      }
+      else
+      {
+        std::memcpy(data, this->buffer_ + this->offset_, size);
+      }
+    }
+    this->offset_ += size;
+  }
+
+  Mode mode() const { return this->mode_; }
+
+  // Bytes named so far. Saving or loading went past the buffer if this
+  // exceeds its size.
+  size_t size() const { return this->offset_; }
+  bool fits() const { return this->offset_ <= this->capacity_; }
+
+private:
+  const Mode mode_;
+  unsigned char *const buffer_;
+  const size_t capacity_;
+  size_t offset_;
+};
+
+// Layout of a StateMachine snapshot record, all integers in host byte
+// order and without padding:
+//   StateSnapshotHeader
+//   StateIndex current_state
+//   pending_count x StateIndex, new states of the deferred events
+//   field_size bytes named by snapshotFields()
+struct StateSnapshotHeader
+{
+  static const uint8_t VERSION = 1;
+
+  uint8_t version;
+  uint8_t state_size; // sizeof(StateIndex) of the saving build
+  uint16_t pending_count;
+  uint32_t field_size;
+};
+
+static_assert(sizeof(StateSnapshotHeader) == 8,
+              "StateSnapshotHeader must stay packed");
+
+// Layout of a StateMachineFleet checkpoint file, all integers in host byte
+// order:
+//   FleetCheckpointHeader
+//   count x StateIndex, the current states, at states_offset
+//   count x field_size bytes named by snapshotFields(), at fields_offset
+// Both arrays start on an ALIGNMENT boundary, so a mapped checkpoint is
+// used in place.
+struct FleetCheckpointHeader
+{
+  static const uint32_t MAGIC = 0x4B434D53; // "SMCK"
+  static const uint32_t VERSION = 1;
+  static const uint64_t ALIGNMENT = 64;
+
+  uint32_t magic;
+  uint32_t version;
+  uint32_t state_size; // sizeof(StateIndex) of the saving build
+  uint32_t max_states;
+  uint32_t field_size; // per machine
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t states_offset;
+  uint64_t fields_offset;
+};
+
+// Checkpoint file mapped into memory, read-only once opened or writable
+// once created. The mapping is released by close() or the destructor.
+class CheckpointFile
+{
+public:
+  CheckpointFile() : data_(nullptr), size_(0), writable_(false) {}
+  ~CheckpointFile() { this->close(); }
+
+  CheckpointFile(const CheckpointFile &) = delete;
+  CheckpointFile &operator=(const CheckpointFile &) = delete;
+
+  // Replace path with a file of size bytes mapped for writing
+  bool create(const char *path, size_t size);
+  bool open(const char *path);
+
+  // Flush a created file to disk, returns false on error
+  bool sync();
+  void close();
+
+  bool isOpen() const { return this->data_ != nullptr; }
+  const unsigned char *data() const { return this->data_; }
+  unsigned char *writableData()
+  {
+    assert(this->writable_);
+    return this->data_;
+  }
+  size_t size() const { return this->size_; }
+
+  // Header of a checkpoint, or nullptr if the file is not one of this
+  // build: wrong magic, version or StateIndex size, or arrays past its end
+  const FleetCheckpointHeader *header() const;
+
+private:
+  unsigned char *data_;
+  size_t size_;
+  bool writable_;
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "static_state_machine.hpp"
+
+// CentrifugeTest ported to the compile-time front end. The SelfTest base
+// states are declared directly, and cancel() keeps its parent transition
+// through ParentTransitions.
+class StaticCentrifugeTest : public StaticStateMachine<StaticCentrifugeTest>
+{
+public:
+  StaticCentrifugeTest();
+
+  void start();
+  void poll();
+  void cancel();
+
+  bool isPollActive() { return this->poll_active_; }
+
+private:
+  friend class StaticStateMachine<StaticCentrifugeTest>;
+
+  bool poll_active_;
+  int32_t speed_;
+
+  void startPoll() { this->poll_active_ = true; }
+  void stopPoll() { this->poll_active_ = false; }
+
+  void snapshotFields(SnapshotFields &fields);
+
+  enum States
+  {
+    // SelfTest states
+    ST_IDLE,
+    ST_COMPLETED,
+    ST_FAILED,
+    ST_SELF_TEST_MAX_STATES,
+
+    ST_START_TEST = ST_SELF_TEST_MAX_STATES,
+    ST_ACCELERATION,
+    ST_WAIT_FOR_ACCELERATION,
+    ST_DECELERATION,
+    ST_WAIT_FOR_DECELERATION,
+    ST_MAX_STATES
+  };
+
+  void ST_Idle(const NoEventData &data);
+  void EN_EntryIdle(const NoEventData &data);
+  void ST_Completed(const NoEventData &data);
+  void ST_Failed(const NoEventData &data);
+  void ST_StartTest(const NoEventData &data);
+  bool GD_GuardStartTest(const NoEventData &data);
+  void ST_Acceleration(const NoEventData &data);
+  void ST_WaitForAcceleration(const NoEventData &data);
+  void EX_ExitWaitForAcceleration(void);
+  void ST_Deceleration(const NoEventData &data);
+  void ST_WaitForDeceleration(const NoEventData &data);
+  void EX_ExitWaitForDeceleration(void);
+
+  using Self = StaticCentrifugeTest;
+  using StateMapType = StateMap<
+      State<ST_IDLE, NoEventData, &Self::ST_Idle,
+            nullptr, &Self::EN_EntryIdle>,
+      State<ST_COMPLETED, NoEventData, &Self::ST_Completed>,
+      State<ST_FAILED, NoEventData, &Self::ST_Failed>,
+      State<ST_START_TEST, NoEventData, &Self::ST_StartTest,
+            &Self::GD_GuardStartTest>,
+      State<ST_ACCELERATION, NoEventData, &Self::ST_Acceleration>,
+      State<ST_WAIT_FOR_ACCELERATION, NoEventData, &Self::ST_WaitForAcceleration,
+            nullptr, nullptr, &Self::EX_ExitWaitForAcceleration>,
+      State<ST_DECELERATION, NoEventData, &Self::ST_Deceleration>,
+      State<ST_WAIT_FOR_DECELERATION, NoEventData, &Self::ST_WaitForDeceleration,
+            nullptr, nullptr, &Self::EX_ExitWaitForDeceleration>>;
+  static_assert(StateMapType::SIZE == ST_MAX_STATES, "Invalid size of STATE_MAP");
+
+public:
+  // Events, also usable with StateMachineFleet
+  using Start = Transitions<
+      ST_START_TEST, // ST_IDLE
+      CANNOT_HAPPEN, // ST_COMPLETED
+      CANNOT_HAPPEN, // ST_FAILED
+      EVENT_IGNORED, // ST_START_TEST
+      EVENT_IGNORED, // ST_ACCELERATION
+      EVENT_IGNORED, // ST_WAIT_FOR_ACCELERATION
+      EVENT_IGNORED, // ST_DECELERATION
+      EVENT_IGNORED  // ST_WAIT_FOR_DECELERATION
+      >;
+  using Poll = Transitions<
+      EVENT_IGNORED,            // ST_IDLE
+      EVENT_IGNORED,            // ST_COMPLETED
+      EVENT_IGNORED,            // ST_FAILED
+      EVENT_IGNORED,            // ST_START_TEST
+      ST_WAIT_FOR_ACCELERATION, // ST_ACCELERATION
+      ST_WAIT_FOR_ACCELERATION, // ST_WAIT_FOR_ACCELERATION
+      ST_WAIT_FOR_DECELERATION, // ST_DECELERATION
+      ST_WAIT_FOR_DECELERATION  // ST_WAIT_FOR_DECELERATION
+      >;
+  // SelfTest event, every CentrifugeTest state takes the parent transition
+  using Cancel = ParentTransitions<
+      ST_FAILED,     // parent transition
+      EVENT_IGNORED, // ST_IDLE
+      CANNOT_HAPPEN, // ST_COMPLETED
+      CANNOT_HAPPEN  // ST_FAILED
+      >;
+};
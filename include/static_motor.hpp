@@ -0,0 +1,60 @@
+#pragma once
+
+#include "static_state_machine.hpp"
+#include "motor.hpp"
+
+// Motor ported to the compile-time front end
+class StaticMotor : public StaticStateMachine<StaticMotor>
+{
+public:
+  StaticMotor();
+
+  // External event
+  void setSpeed(const MotorData &data);
+  void halt();
+
+private:
+  friend class StaticStateMachine<StaticMotor>;
+
+  int current_speed_;
+
+  void snapshotFields(SnapshotFields &fields);
+
+  enum States
+  {
+    ST_IDLE,
+    ST_STOP,
+    ST_START,
+    ST_CHANGE_SPEED,
+    ST_MAX_STATES
+  };
+
+  // States
+  void ST_Idle(const NoEventData &data);
+  void ST_Stop(const NoEventData &data);
+  void ST_Start(const MotorData &data);
+  void ST_ChangeSpeed(const MotorData &data);
+
+  // State map
+  using StateMapType = StateMap<
+      State<ST_IDLE, NoEventData, &StaticMotor::ST_Idle>,
+      State<ST_STOP, NoEventData, &StaticMotor::ST_Stop>,
+      State<ST_START, MotorData, &StaticMotor::ST_Start>,
+      State<ST_CHANGE_SPEED, MotorData, &StaticMotor::ST_ChangeSpeed>>;
+  static_assert(StateMapType::SIZE == ST_MAX_STATES, "Invalid size of STATE_MAP");
+
+public:
+  // Events, also usable with StateMachineFleet
+  using SetSpeed = Transitions<
+      ST_START,        // ST_IDLE
+      CANNOT_HAPPEN,   // ST_STOP
+      ST_CHANGE_SPEED, // ST_START
+      ST_CHANGE_SPEED  // ST_CHANGE_SPEED
+      >;
+  using Halt = Transitions<
+      EVENT_IGNORED, // ST_IDLE
+      CANNOT_HAPPEN, // ST_STOP
+      ST_STOP,       // ST_START
+      ST_STOP        // ST_CHANGE_SPEED
+      >;
+};
@@ -0,0 +1,478 @@
+#pragma once
+
+#include "state_machine.hpp"
+
+#include <cassert>
+#include <cinttypes>
+#include <type_traits>
+
+// Compile-time front end. States, their guard/entry/exit actions and the
+// transition map of every event are types, so dispatch compiles down to a
+// switch over the state id with each action called directly: no virtual
+// calls, no per-instance action objects and no state map lookups.
+//
+// A machine derives from StaticStateMachine<Derived> and declares
+//   using StateMapType = StateMap<State<...>, ...>;  // in state id order
+//   using SomeEvent = Transitions<...>;               // one per event
+// Actions take their payload by const reference.
+
+template <class SM, class... States>
+struct StaticStateDispatch;
+
+template <class SM>
+class StateMachineFleet;
+
+template <class SM>
+class StaticStateMachine
+{
+public:
+  enum : StateIndex
+  {
+    EVENT_IGNORED = STATE_INDEX_EVENT_IGNORED,
+    CANNOT_HAPPEN = STATE_INDEX_CANNOT_HAPPEN
+  };
+
+  StateIndex getCurrentState() const { return this->current_state_; }
+  static size_t getMaxStates() { return MapOf<>::SIZE; }
+
+#ifdef STATE_MACHINE_ENABLE_METRICS
+  // Same contract as StateMachine::enableMetrics. Events applied through
+  // StateMachineFleet are counted, ignored ones are not.
+  void enableMetrics(StateMachineMetrics *metrics)
+  {
+    assert(metrics == nullptr || metrics->getMaxStates() >= getMaxStates());
+    this->metrics_ = metrics;
+  }
+  StateMachineMetrics *getMetrics() const { return this->metrics_; }
+#endif
+
+protected:
+  explicit StaticStateMachine(StateIndex initial_state = 0)
+      : internal_events_(nullptr),
+#ifdef STATE_MACHINE_ENABLE_METRICS
+        metrics_(nullptr),
+#endif
+        current_state_(initial_state),
+        new_state_(0),
+        event_generated_(false)
+  {
+  }
+
+  // One state. Unused guard/entry/exit actions are left as nullptr and
+  // compile away.
+  template <StateIndex Id,
+            class Data,
+            void (SM::*Action)(const Data &),
+            bool (SM::*Guard)(const Data &) = nullptr,
+            void (SM::*Entry)(const Data &) = nullptr,
+            void (SM::*Exit)(void) = nullptr>
+  struct State
+  {
+    using DataType = Data;
+    static const StateIndex ID = Id;
+
+    static void action(SM &sm, const Data &data) { (sm.*Action)(data); }
+    static bool guard(SM &sm, const Data &data)
+    {
+      if (Guard == nullptr)
+      {
+        return true;
+      }
+      bool passed = (sm.*Guard)(data);
+      sm.recordGuardMetrics(Id, passed);
+      return passed;
+    }
+    static void entry(SM &sm, const Data &data)
+    {
+      if (Entry != nullptr)
+      {
+        uint64_t start = sm.metricsNow();
+        (sm.*Entry)(data);
+        sm.recordEntryMetrics(Id, start);
+      }
+    }
+    static void exit(SM &sm)
+    {
+      if (Exit != nullptr)
+      {
+        uint64_t start = sm.metricsNow();
+        (sm.*Exit)();
+        sm.recordExitMetrics(Id, start);
+      }
+    }
+  };
+
+  template <class... States>
+  struct StateMap
+  {
+    static const size_t SIZE = sizeof...(States);
+
+    static constexpr bool ordered()
+    {
+      const StateIndex ids[] = {States::ID...};
+      for (size_t i = 0; i < SIZE; ++i)
+      {
+        if (ids[i] != i)
+        {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    static_assert(ordered(), "States must be listed in id order");
+    static_assert(SIZE < EVENT_IGNORED, "Too many states");
+
+    using Dispatch = StaticStateDispatch<SM, States...>;
+  };
+
+  // Transition map of one event, indexed by the current state. States past
+  // the end of the map belong to a derived machine and go to Parent.
+  template <StateIndex Parent, StateIndex... NewStates>
+  struct ParentTransitions
+  {
+    static const size_t SIZE = sizeof...(NewStates);
+    static const StateIndex PARENT = Parent;
+
+    static const StateIndex *table()
+    {
+      static const StateIndex TRANSITIONS[] = {NewStates...};
+      return TRANSITIONS;
+    }
+
+    static StateIndex lookup(StateIndex current)
+    {
+      return current < SIZE ? table()[current] : Parent;
+    }
+  };
+
+  template <StateIndex... NewStates>
+  using Transitions = ParentTransitions<CANNOT_HAPPEN, NewStates...>;
+
+  template <class Event>
+  void externalEvent()
+  {
+    StateIndex new_state = this->lookupTransition<Event>();
+    this->recordIgnoredMetrics(new_state);
+    if (new_state != EVENT_IGNORED)
+    {
+      // An empty payload is delivered as NoEventData
+      EventPayload payload;
+      this->startEngine(new_state, payload);
+    }
+  }
+
+  // The payload is only referenced, the caller keeps it alive
+  template <class Event, class Data>
+  void externalEvent(const Data &data)
+  {
+    static_assert(std::is_base_of<EventData, Data>::value,
+                  "Payload must derive from EventData");
+
+    StateIndex new_state = this->lookupTransition<Event>();
+    this->recordIgnoredMetrics(new_state);
+    if (new_state != EVENT_IGNORED)
+    {
+      EventPayload payload;
+      payload.borrow(data);
+      this->startEngine(new_state, payload);
+    }
+  }
+
+  // Fields kept in fleet checkpoints besides the state, see
+  // SnapshotFields. Shadowed by machines that have fields of their own.
+  void snapshotFields(SnapshotFields &fields) { (void)fields; }
+
+  // Queued behind the internal events already generated, see
+  // StateMachine::internalEvent. Returns false, and the event is dropped,
+  // if STATE_MACHINE_ENGINE_QUEUE_SIZE events are queued already.
+  bool internalEvent(StateIndex new_state)
+  {
+    return this->queueInternalEvent(new_state) != nullptr;
+  }
+
+  // Copied into inline storage, see EventPayload
+  template <class Data>
+  bool internalEvent(StateIndex new_state, const Data &data)
+  {
+    QueuedEvent *event = this->queueInternalEvent(new_state);
+    if (event == nullptr)
+    {
+      return false;
+    }
+    event->data.store(data);
+    return true;
+  }
+
+private:
+  template <class, class...>
+  friend struct StaticStateDispatch;
+  friend class StateMachineFleet<SM>;
+
+  // The derived state map, reachable by friends of this class
+  template <class Derived = SM>
+  using MapOf = typename Derived::StateMapType;
+
+  // Internal events of the running engine, on its stack
+  EventRing *internal_events_;
+#ifdef STATE_MACHINE_ENABLE_METRICS
+  StateMachineMetrics *metrics_;
+#endif
+  StateIndex current_state_;
+  StateIndex new_state_;
+  bool event_generated_;
+
+  void visitSnapshotFields(SnapshotFields &fields)
+  {
+    static_cast<SM &>(*this).snapshotFields(fields);
+  }
+
+  QueuedEvent *queueInternalEvent(StateIndex new_state)
+  {
+    // Internal events may only be generated by the engine's actions.
+    // nullptr when the queue is full, see internalEvent().
+    assert(this->internal_events_ != nullptr);
+    return this->internal_events_->push(nullptr, 0, new_state);
+  }
+
+  // Load the next internal event into payload, leaving event_generated_
+  // false if there is none
+  void nextEvent(EventPayload &payload)
+  {
+    EventRing &events = *this->internal_events_;
+    if (events.empty())
+    {
+      payload.reset();
+      return;
+    }
+    this->new_state_ = events.front().state;
+    this->event_generated_ = true;
+    payload.moveFrom(events.front().data);
+    events.pop();
+  }
+
+  // Metrics hooks, empty unless STATE_MACHINE_ENABLE_METRICS is defined
+  uint64_t metricsNow() const
+  {
+#ifdef STATE_MACHINE_ENABLE_METRICS
+    return this->metrics_ != nullptr ? this->metrics_->startTiming() : 0;
+#else
+    return 0;
+#endif
+  }
+
+  void recordIgnoredMetrics(StateIndex new_state)
+  {
+#ifdef STATE_MACHINE_ENABLE_METRICS
+    if (this->metrics_ != nullptr && new_state == EVENT_IGNORED)
+    {
+      this->metrics_->recordIgnored();
+    }
+#else
+    (void)new_state;
+#endif
+  }
+
+  void recordEventMetrics()
+  {
+#ifdef STATE_MACHINE_ENABLE_METRICS
+    if (this->metrics_ != nullptr)
+    {
+      this->metrics_->recordEvent();
+    }
+#endif
+  }
+
+  void recordGuardMetrics(StateIndex state, bool passed)
+  {
+#ifdef STATE_MACHINE_ENABLE_METRICS
+    if (this->metrics_ != nullptr)
+    {
+      this->metrics_->recordGuard(state, passed);
+    }
+#else
+    (void)state;
+    (void)passed;
+#endif
+  }
+
+  void recordExitMetrics(StateIndex state, uint64_t start)
+  {
+#ifdef STATE_MACHINE_ENABLE_METRICS
+    if (this->metrics_ != nullptr)
+    {
+      this->metrics_->recordExit(state, start);
+    }
+#else
+    (void)state;
+    (void)start;
+#endif
+  }
+
+  void recordEntryMetrics(StateIndex state, uint64_t start)
+  {
+#ifdef STATE_MACHINE_ENABLE_METRICS
+    if (this->metrics_ != nullptr)
+    {
+      this->metrics_->recordEntry(state, start);
+    }
+#else
+    (void)state;
+    (void)start;
+#endif
+  }
+
+  template <class S>
+  void recordActionMetrics(StateIndex from, uint64_t start)
+  {
+#ifdef STATE_MACHINE_ENABLE_METRICS
+    if (this->metrics_ != nullptr)
+    {
+      this->metrics_->recordAction(S::ID, start);
+      this->metrics_->recordTransition(from, S::ID);
+    }
+#else
+    (void)from;
+    (void)start;
+#endif
+  }
+
+  template <class Event>
+  StateIndex lookupTransition() const
+  {
+    using Map = typename SM::StateMapType;
+    static_assert(Event::SIZE == Map::SIZE ||
+                      (Event::SIZE < Map::SIZE && Event::PARENT != CANNOT_HAPPEN),
+                  "Transition map does not cover every state");
+    return Event::lookup(this->current_state_);
+  }
+
+  void startEngine(StateIndex new_state, EventPayload &payload)
+  {
+    this->recordEventMetrics();
+    this->new_state_ = new_state;
+    this->event_generated_ = true;
+    this->stateEngine(payload);
+  }
+
+  // Run an event whose new state S was looked up by the caller
+  template <class S>
+  void startEngineAt(EventPayload &payload)
+  {
+    this->recordEventMetrics();
+    FixedEventRing<STATE_MACHINE_ENGINE_QUEUE_SIZE> events;
+    EventRing *const outer_events = this->internal_events_;
+    this->internal_events_ = &events;
+
+    this->event_generated_ = false;
+    this->executeState<S>(payload);
+    this->nextEvent(payload);
+    this->runEngine(payload);
+
+    this->internal_events_ = outer_events;
+  }
+
+  void stateEngine(EventPayload &payload)
+  {
+    FixedEventRing<STATE_MACHINE_ENGINE_QUEUE_SIZE> events;
+    EventRing *const outer_events = this->internal_events_;
+    this->internal_events_ = &events;
+
+    this->runEngine(payload);
+
+    this->internal_events_ = outer_events;
+  }
+
+  void runEngine(EventPayload &payload)
+  {
+    using Map = typename SM::StateMapType;
+    SM &sm = static_cast<SM &>(*this);
+
+    while (this->event_generated_)
+    {
+      assert(this->new_state_ < Map::SIZE);
+      this->event_generated_ = false;
+      Map::Dispatch::execute(sm, this->new_state_, payload);
+      this->nextEvent(payload);
+    }
+  }
+
+  template <class S>
+  void executeState(const EventPayload &payload)
+  {
+    using Map = typename SM::StateMapType;
+    SM &sm = static_cast<SM &>(*this);
+    const typename S::DataType &data =
+        payload.template ref<typename S::DataType>();
+
+    if (!S::guard(sm, data))
+    {
+      return;
+    }
+
+    StateIndex previous_state = this->current_state_;
+    if (S::ID != previous_state)
+    {
+      Map::Dispatch::exit(sm, previous_state);
+      S::entry(sm, data);
+    }
+
+    this->current_state_ = S::ID;
+    uint64_t start = this->metricsNow();
+    S::action(sm, data);
+    this->recordActionMetrics<S>(previous_state, start);
+  }
+};
+
+// Chain of comparisons on constant ids, folded into a switch by the compiler
+template <class SM>
+struct StaticStateDispatch<SM>
+{
+  static void execute(SM &, StateIndex, const EventPayload &) { assert(false); }
+  static void exit(SM &, StateIndex) {}
+
+  template <class Visitor>
+  static void visit(StateIndex, Visitor &) { assert(false); }
+};
+
+template <class SM, class S, class... Rest>
+struct StaticStateDispatch<SM, S, Rest...>
+{
+  static void execute(SM &sm, StateIndex state, const EventPayload &payload)
+  {
+    if (state == S::ID)
+    {
+      sm.template executeState<S>(payload);
+    }
+    else
+    {
+      StaticStateDispatch<SM, Rest...>::execute(sm, state, payload);
+    }
+  }
+
+  static void exit(SM &sm, StateIndex state)
+  {
+    if (state == S::ID)
+    {
+      S::exit(sm);
+    }
+    else
+    {
+      StaticStateDispatch<SM, Rest...>::exit(sm, state);
+    }
+  }
+
+  // Call visitor.visit<S>() for the state whose id matches
+  template <class Visitor>
+  static void visit(StateIndex state, Visitor &visitor)
+  {
+    if (state == S::ID)
+    {
+      visitor.template visit<S>();
+    }
+    else
+    {
+      StaticStateDispatch<SM, Rest...>::visit(state, visitor);
+    }
+  }
+};
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "state_machine.hpp"
+
+#include <cassert>
+#include <cinttypes>
+#include <cstddef>
+#include <vector>
+
+class StateTimers;
+
+// Handle of an armed timer, 0 for none. Handles of fired or cancelled
+// timers stay invalid when their slot is reused, so cancelling one late is
+// harmless.
+using TimerId = uint64_t;
+
+// Called when a timer fires, with the state it was armed with
+using TimerFunc = void (*)(StateMachine *sm, StateIndex state);
+
+// Hierarchical timing wheel driving the timers of a set of machines. Time
+// is counted in ticks of the caller's choosing and moves forward only
+// through advance(), which fires every timer due by then from the calling
+// thread. A timer is placed in one of 256 slots of one of four levels
+// depending on how far away it is and cascaded down a level each time the
+// level below wraps, so arming and cancelling are O(1) and advancing costs
+// O(1) per tick plus the timers due, whatever the number of timers
+// outstanding. Timers live in one pooled array; a wheel used with many
+// timers can be sized up front to avoid growing it while they are armed.
+//
+// The wheel, its StateTimers and their machines are used from one thread.
+class TimerWheel
+{
+public:
+  static const size_t LEVELS = 4;
+  static const size_t SLOT_BITS = 8;
+  static const size_t SLOTS = 1 << SLOT_BITS;
+
+  // Longest delay a timer can be armed with
+  static const uint64_t MAX_TICKS = UINT32_MAX;
+
+  explicit TimerWheel(uint64_t now = 0, size_t capacity = 0);
+
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+
+  uint64_t now() const { return this->next_ - 1; }
+
+  // Number of timers armed
+  size_t size() const { return this->count_; }
+
+  // Move time forward to now, firing the timers due in tick order. Timers
+  // armed by the fired events are due at the earliest on the next tick.
+  void advance(uint64_t now);
+  void tick() { this->advance(this->now() + 1); }
+
+private:
+  friend class StateTimers;
+
+  static const uint32_t NONE = 0;
+  static const uint32_t PENDING = LEVELS * SLOTS; // timers of the tick run
+  static const uint32_t FIRST_TIMER = PENDING + 1;
+
+  // Slot lists are circular, through a sentinel node per slot at the
+  // start of nodes_. Owner lists end with NONE.
+  struct Node
+  {
+    uint64_t expires;
+    uint32_t prev;
+    uint32_t next; // or next free node
+    uint32_t owner_prev;
+    uint32_t owner_next;
+    uint32_t generation;
+    StateIndex state;
+    StateIndex bound_state; // exiting it cancels the timer
+    TimerFunc func;         // nullptr while the node is free
+    StateTimers *owner;
+  };
+
+  std::vector<Node> nodes_;
+  uint32_t free_;
+  size_t count_;
+  uint64_t next_; // next tick to run
+
+  TimerId arm(
+      StateTimers *owner,
+      uint64_t ticks,
+      TimerFunc func,
+      StateIndex state,
+      StateIndex bound_state);
+  bool cancel(TimerId id);
+  void release(uint32_t index);
+
+  void link(uint32_t index);
+  void linkBefore(uint32_t index, uint32_t sentinel);
+  void unlink(uint32_t index);
+  void cascade(size_t level, size_t slot);
+
+  static uint32_t slotOf(size_t level, size_t slot)
+  {
+    return static_cast<uint32_t>(level * SLOTS + slot);
+  }
+
+  static uint32_t indexOf(TimerId id) { return static_cast<uint32_t>(id); }
+  static uint32_t generationOf(TimerId id)
+  {
+    return static_cast<uint32_t>(id >> 32);
+  }
+};
+
+// Timers of one machine, a member of machines that use timers and returned
+// by their getStateTimers() override:
+//
+//   StateTimers timers_{*this, wheel};
+//   virtual StateTimers *getStateTimers() { return &this->timers_; }
+//
+// startTimer() posts an event to the machine after a delay. A state timer
+// is bound to the state being run or entered when it is armed and is
+// cancelled when that state exits, so a state timeout needs no cleanup in
+// the states that leave it first:
+//
+//   ENTRY_DEFINE(Motor, EntrySpinUp, NoEventData)
+//   {
+//     this->timers_.startStateTimer(100, ST_STALLED);
+//   }
+//
+// Self transitions do not exit a state and keep its timers. In a
+// StateHierarchy, an ancestor's entry action passes its own state to bind
+// a timer to it rather than to the leaf being entered. Timers still armed
+// when the machine is destroyed are cancelled.
+class StateTimers
+{
+public:
+  StateTimers(StateMachine &sm, TimerWheel &wheel)
+      : sm_(sm), wheel_(wheel), head_(TimerWheel::NONE), count_(0)
+  {
+  }
+  ~StateTimers() { this->cancelAll(); }
+
+  StateTimers(const StateTimers &) = delete;
+  StateTimers &operator=(const StateTimers &) = delete;
+
+  TimerWheel &getWheel() const { return this->wheel_; }
+
+  // Number of timers armed
+  size_t size() const { return this->count_; }
+
+  // External event to new_state after ticks
+  TimerId startTimer(uint64_t ticks, StateIndex new_state)
+  {
+    return this->wheel_.arm(
+        this, ticks, &StateTimers::fire, new_state, NOT_BOUND);
+  }
+
+  // Event function of SM called after ticks, through its transition map
+  template <class SM, void (SM::*Event)()>
+  TimerId startTimer(uint64_t ticks)
+  {
+    return this->wheel_.arm(
+        this, ticks, &TimerEvent<SM, Event>::invoke, 0, NOT_BOUND);
+  }
+
+  // Same, cancelled when the current state exits
+  TimerId startStateTimer(uint64_t ticks, StateIndex new_state)
+  {
+    return this->startStateTimer(ticks, new_state, this->activeState());
+  }
+
+  TimerId startStateTimer(
+      uint64_t ticks,
+      StateIndex new_state,
+      StateIndex state)
+  {
+    return this->wheel_.arm(this, ticks, &StateTimers::fire, new_state, state);
+  }
+
+  template <class SM, void (SM::*Event)()>
+  TimerId startStateTimer(uint64_t ticks)
+  {
+    return this->wheel_.arm(this, ticks, &TimerEvent<SM, Event>::invoke, 0,
+                            this->activeState());
+  }
+
+  // Returns false if the timer already fired or was cancelled
+  bool cancel(TimerId id);
+  void cancelAll();
+
+private:
+  friend class TimerWheel;
+  friend class StateMachine;
+
+  static const StateIndex NOT_BOUND = STATE_INDEX_CANNOT_HAPPEN;
+
+  template <class SM, void (SM::*Event)()>
+  struct TimerEvent
+  {
+    static void invoke(StateMachine *sm, StateIndex state)
+    {
+      (void)state;
+      (static_cast<SM *>(sm)->*Event)();
+    }
+  };
+
+  StateMachine &sm_;
+  TimerWheel &wheel_;
+  uint32_t head_; // first armed timer
+  size_t count_;
+
+  static void fire(StateMachine *sm, StateIndex state);
+
+  // State whose actions are running, or the current state while idle
+  StateIndex activeState() const;
+
+  // Called by the engine for every state it exits
+  void exitState(StateIndex state);
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Chase-Lev work-stealing deque of pointers. The owning thread pushes and
+// takes at the bottom; any other thread may steal from the top. The ring
+// grows on demand and retired rings are kept until destruction, so thieves
+// never read freed memory.
+template <class T>
+class WorkStealingDeque
+{
+public:
+  explicit WorkStealingDeque(size_t capacity = 1024)
+      : top_(0), bottom_(0), array_(new Array(capacity))
+  {
+    this->retired_.push_back(this->array_.load(std::memory_order_relaxed));
+  }
+
+  ~WorkStealingDeque()
+  {
+    for (Array *array : this->retired_)
+    {
+      delete array;
+    }
+  }
+
+  WorkStealingDeque(const WorkStealingDeque &) = delete;
+  WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+  // Owner only
+  void push(T *item)
+  {
+    int64_t bottom = this->bottom_.load(std::memory_order_relaxed);
+    int64_t top = this->top_.load(std::memory_order_acquire);
+    Array *array = this->array_.load(std::memory_order_relaxed);
+    if (bottom - top > static_cast<int64_t>(array->capacity) - 1)
+    {
+      array = this->grow(array, top, bottom);
+    }
+    array->put(bottom, item);
+    std::atomic_thread_fence(std::memory_order_release);
+    this->bottom_.store(bottom + 1, std::memory_order_relaxed);
+  }
+
+  // Owner only, returns nullptr when empty
+  T *take()
+  {
+    int64_t bottom = this->bottom_.load(std::memory_order_relaxed) - 1;
+    Array *array = this->array_.load(std::memory_order_relaxed);
+    this->bottom_.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = this->top_.load(std::memory_order_relaxed);
+
+    if (top > bottom)
+    {
+      this->bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    T *item = array->get(bottom);
+    if (top == bottom)
+    {
+      // Last item, race against thieves for it
+      if (!this->top_.compare_exchange_strong(
+              top, top + 1,
+              std::memory_order_seq_cst, std::memory_order_relaxed))
+      {
+        item = nullptr;
+      }
+      this->bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+    return item;
+  }
+
+  // Any thread, returns nullptr when empty or when losing a race
+  T *steal()
+  {
+    int64_t top = this->top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t bottom = this->bottom_.load(std::memory_order_acquire);
+    if (top >= bottom)
+    {
+      return nullptr;
+    }
+
+    Array *array = this->array_.load(std::memory_order_acquire);
+    T *item = array->get(top);
+    if (!this->top_.compare_exchange_strong(
+            top, top + 1,
+            std::memory_order_seq_cst, std::memory_order_relaxed))
+    {
+      return nullptr;
+    }
+    return item;
+  }
+
+  bool empty() const
+  {
+    return this->top_.load(std::memory_order_relaxed) >=
+           this->bottom_.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Array
+  {
+    explicit Array(size_t capacity_)
+        : capacity(capacity_), mask(capacity_ - 1),
+          items(new std::atomic<T *>[capacity_])
+    {
+      // Capacity must be a power of two
+      assert((capacity_ & (capacity_ - 1)) == 0);
+    }
+    ~Array() { delete[] this->items; }
+
+    void put(int64_t index, T *item)
+    {
+      this->items[index & this->mask].store(item, std::memory_order_relaxed);
+    }
+    T *get(int64_t index) const
+    {
+      return this->items[index & this->mask].load(std::memory_order_relaxed);
+    }
+
+    const size_t capacity;
+    const int64_t mask;
+    std::atomic<T *> *const items;
+  };
+
+  // Padding keeps thieves' top_ off the owner's cache line
+  std::atomic<int64_t> top_;
+  char padding_[64 - sizeof(std::atomic<int64_t>)];
+  std::atomic<int64_t> bottom_;
+  std::atomic<Array *> array_;
+  std::vector<Array *> retired_;
+
+  Array *grow(Array *array, int64_t top, int64_t bottom)
+  {
+    Array *bigger = new Array(array->capacity * 2);
+    for (int64_t i = top; i < bottom; ++i)
+    {
+      bigger->put(i, array->get(i));
+    }
+    this->retired_.push_back(bigger);
+    this->array_.store(bigger, std::memory_order_release);
+    return bigger;
+  }
+};
@@ -0,0 +1,384 @@
+#include "bench_util.hpp"
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace
+{
+std::atomic<uint64_t> allocation_count(0);
+}
+
+void *operator new(size_t size)
+{
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  void *ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr)
+  {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void *operator new[](size_t size)
+{
+  return ::operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept
+{
+  return ::operator new(size, tag);
+}
+
+void operator delete(void *ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+  std::free(ptr);
+}
+
+#ifdef __cpp_aligned_new
+// Over-aligned types, C++17 and later. aligned_alloc wants the size to be
+// a multiple of the alignment.
+void *operator new(size_t size, std::align_val_t align, const std::nothrow_t &) noexcept
+{
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  size_t alignment = static_cast<size_t>(align);
+  size_t rounded = (size + alignment - 1) & ~(alignment - 1);
+  return std::aligned_alloc(alignment, rounded == 0 ? alignment : rounded);
+}
+
+void *operator new(size_t size, std::align_val_t align)
+{
+  void *ptr = ::operator new(size, align, std::nothrow);
+  if (ptr == nullptr)
+  {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void *operator new[](size_t size, std::align_val_t align)
+{
+  return ::operator new(size, align);
+}
+
+void *operator new[](size_t size, std::align_val_t align,
+                     const std::nothrow_t &tag) noexcept
+{
+  return ::operator new(size, align, tag);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+  std::free(ptr);
+}
+#endif
+
+uint64_t allocationCount()
+{
+  return allocation_count.load(std::memory_order_relaxed);
+}
+
+void benchCheck(bool condition, const char *text, const char *file, int line)
+{
+  if (!condition)
+  {
+    std::fprintf(stderr, "FAILED: %s:%d: %s\n", file, line, text);
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+BenchState::BenchState(uint64_t iterations)
+    : iterations_(iterations),
+      events_(0),
+      allocations_(0),
+      start_allocations_(0),
+      seconds_(0.0),
+      running_(false)
+{
+}
+
+void BenchState::startTiming()
+{
+  this->start_allocations_ = allocationCount();
+  this->running_ = true;
+  this->start_ = std::chrono::steady_clock::now();
+}
+
+void BenchState::stopTiming()
+{
+  if (this->running_)
+  {
+    auto stop = std::chrono::steady_clock::now();
+    this->seconds_ += std::chrono::duration<double>(stop - this->start_).count();
+    this->allocations_ += allocationCount() - this->start_allocations_;
+    this->running_ = false;
+  }
+}
+
+void BenchSuite::add(const char *name, BenchFunction function, bool no_alloc)
+{
+  this->entries_.push_back(Entry{name, function, no_alloc});
+}
+
+BenchResult BenchSuite::measure(const Entry &entry, double min_seconds)
+{
+  // Warm up caches and function-local statics first
+  {
+    BenchState warmup(100);
+    entry.function(warmup);
+  }
+
+  uint64_t iterations = 1000;
+  while (true)
+  {
+    BenchState state(iterations);
+    entry.function(state);
+    state.stopTiming();
+
+    if (state.seconds() >= min_seconds || iterations >= (1ULL << 34))
+    {
+      double events = state.events() > 0 ? state.events() : 1;
+      BenchResult result;
+      result.name = entry.name;
+      result.events = state.events();
+      result.ns_per_event = state.seconds() * 1e9 / events;
+      result.allocs_per_event = state.allocations() / events;
+      result.events_per_sec = events / state.seconds();
+      return result;
+    }
+
+    // Aim a little past the target so the next round usually finishes
+    double scale = state.seconds() > 0.0 ? 1.5 * min_seconds / state.seconds() : 10.0;
+    if (scale < 2.0)
+    {
+      scale = 2.0;
+    }
+    else if (scale > 100.0)
+    {
+      scale = 100.0;
+    }
+    iterations = static_cast<uint64_t>(iterations * scale);
+  }
+}
+
+int BenchSuite::run(int argc, char **argv)
+{
+  const char *filter = nullptr;
+  bool json = false;
+  double min_seconds = 0.2;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+    {
+      filter = argv[++i];
+    }
+    else if (std::strcmp(argv[i], "--json") == 0)
+    {
+      json = true;
+    }
+    else if (std::strcmp(argv[i], "--min-time") == 0 && i + 1 < argc)
+    {
+      min_seconds = std::atof(argv[++i]);
+    }
+    else
+    {
+      std::fprintf(stderr,
+                   "usage: %s [--filter <substring>] [--json] [--min-time <seconds>]\n",
+                   argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  int status = EXIT_SUCCESS;
+  bool first = true;
+  if (json)
+  {
+    std::printf("[\n");
+  }
+  else
+  {
+    std::printf("%-36s %12s %14s %16s\n",
+                "benchmark", "ns/event", "allocs/event", "events/sec");
+  }
+
+  for (const Entry &entry : this->entries_)
+  {
+    if (filter != nullptr && std::strstr(entry.name, filter) == nullptr)
+    {
+      continue;
+    }
+
+    BenchResult result = measure(entry, min_seconds);
+    if (json)
+    {
+      std::printf("%s  {\"name\": \"%s\", \"events\": %llu, \"ns_per_event\": %.3f, "
+                  "\"allocs_per_event\": %.4f, \"events_per_sec\": %.0f}",
+                  first ? "" : ",\n", result.name.c_str(),
+                  static_cast<unsigned long long>(result.events),
+                  result.ns_per_event, result.allocs_per_event,
+                  result.events_per_sec);
+    }
+    else
+    {
+      std::printf("%-36s %12.2f %14.4f %16.0f\n",
+                  result.name.c_str(), result.ns_per_event,
+                  result.allocs_per_event, result.events_per_sec);
+    }
+    first = false;
+
+    if (entry.no_alloc && result.allocs_per_event != 0.0)
+    {
+      std::fprintf(stderr, "FAILED: %s allocated %.4f times per event\n",
+                   entry.name, result.allocs_per_event);
+      status = EXIT_FAILURE;
+    }
+  }
+
+  if (json)
+  {
+    std::printf("\n]\n");
+  }
+  return status;
+}
+
+PercentileHistogram::PercentileHistogram()
+    : counts_(bucketOf(UINT64_MAX) + 1, 0), count_(0), max_(0)
+{
+}
+
+size_t PercentileHistogram::bucketOf(uint64_t ns)
+{
+  const uint64_t exact = 1ULL << SUB_BITS;
+  if (ns < exact)
+  {
+    return static_cast<size_t>(ns);
+  }
+  unsigned exponent = SUB_BITS;
+  while (exponent < 63 && (ns >> (exponent + 1)) != 0)
+  {
+    ++exponent;
+  }
+  // The top SUB_BITS bits of ns, the leading one included
+  uint64_t sub = ns >> (exponent - (SUB_BITS - 1));
+  return static_cast<size_t>(exact + (exponent - SUB_BITS) * (exact / 2) +
+                             (sub - exact / 2));
+}
+
+uint64_t PercentileHistogram::bucketTop(size_t bucket)
+{
+  const uint64_t exact = 1ULL << SUB_BITS;
+  if (bucket < exact)
+  {
+    return bucket;
+  }
+  unsigned exponent = static_cast<unsigned>(SUB_BITS + (bucket - exact) / (exact / 2));
+  uint64_t sub = exact / 2 + (bucket - exact) % (exact / 2);
+  unsigned shift = exponent - (SUB_BITS - 1);
+  return ((sub + 1) << shift) - 1;
+}
+
+void PercentileHistogram::record(uint64_t ns)
+{
+  ++this->counts_[bucketOf(ns)];
+  ++this->count_;
+  if (ns > this->max_)
+  {
+    this->max_ = ns;
+  }
+}
+
+void PercentileHistogram::merge(const PercentileHistogram &other)
+{
+  for (size_t i = 0; i < this->counts_.size(); ++i)
+  {
+    this->counts_[i] += other.counts_[i];
+  }
+  this->count_ += other.count_;
+  if (other.max_ > this->max_)
+  {
+    this->max_ = other.max_;
+  }
+}
+
+uint64_t PercentileHistogram::percentile(double percent) const
+{
+  if (this->count_ == 0)
+  {
+    return 0;
+  }
+  uint64_t rank = static_cast<uint64_t>(std::ceil(percent / 100.0 * this->count_));
+  if (rank < 1)
+  {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < this->counts_.size(); ++i)
+  {
+    seen += this->counts_[i];
+    if (seen >= rank)
+    {
+      uint64_t top = bucketTop(i);
+      return top < this->max_ ? top : this->max_;
+    }
+  }
+  return this->max_;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Number of operator new calls made by the process so far, every
+// overload included: plain, nothrow and aligned, single and array
+uint64_t allocationCount();
+
+// Benchmarks that check the behaviour they measure fail the run with
+// BENCH_CHECK, naming the condition that did not hold
+#define BENCH_CHECK(condition) \
+  benchCheck((condition), #condition, __FILE__, __LINE__)
+void benchCheck(bool condition, const char *text, const char *file, int line);
+
+class BenchState
+{
+public:
+  explicit BenchState(uint64_t iterations);
+
+  uint64_t iterations() const { return this->iterations_; }
+
+  // Exclude setup from the measurement by calling these around the hot loop
+  void startTiming();
+  void stopTiming();
+
+  void addEvents(uint64_t events) { this->events_ += events; }
+
+  uint64_t events() const { return this->events_; }
+  uint64_t allocations() const { return this->allocations_; }
+  double seconds() const { return this->seconds_; }
+
+private:
+  const uint64_t iterations_;
+  uint64_t events_;
+  uint64_t allocations_;
+  uint64_t start_allocations_;
+  double seconds_;
+  bool running_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+struct BenchResult
+{
+  std::string name;
+  uint64_t events;
+  double ns_per_event;
+  double allocs_per_event;
+  double events_per_sec;
+};
+
+using BenchFunction = void (*)(BenchState &state);
+
+class BenchSuite
+{
+public:
+  // Benchmarks flagged no_alloc fail the suite if they allocate
+  void add(const char *name, BenchFunction function, bool no_alloc = false);
+
+  // Parses --filter <substring>, --json and --min-time <seconds>, runs the
+  // selected benchmarks and returns the process exit code
+  int run(int argc, char **argv);
+
+private:
+  struct Entry
+  {
+    const char *name;
+    BenchFunction function;
+    bool no_alloc;
+  };
+
+  std::vector<Entry> entries_;
+
+  static BenchResult measure(const Entry &entry, double min_seconds);
+};
+
+// Latency histogram in the manner of HdrHistogram: values below 128 ns are
+// counted exactly, and each power of two above is split into 64 buckets,
+// so percentiles are within 1.6% of the recorded values, where the engine
+// metrics' log2 LatencyHistogram is only within a factor of two. Recording
+// is a few shifts and an increment, cheap enough for every event of a run.
+class PercentileHistogram
+{
+public:
+  PercentileHistogram();
+
+  void record(uint64_t ns);
+  void merge(const PercentileHistogram &other);
+
+  uint64_t count() const { return this->count_; }
+  uint64_t max() const { return this->max_; }
+
+  // Smallest recorded value at or above percent percent of the values,
+  // rounded up to the top of its bucket; 0 when empty
+  uint64_t percentile(double percent) const;
+
+private:
+  static const unsigned SUB_BITS = 7;
+
+  std::vector<uint64_t> counts_;
+  uint64_t count_;
+  uint64_t max_;
+
+  static size_t bucketOf(uint64_t ns);
+  static uint64_t bucketTop(size_t bucket);
+};
@@ -1,5 +1,6 @@
 #include <centrifuge_test.hpp>
-#include <iostream>
+#include <state_snapshot.hpp>
+#include <state_log.hpp>
 
 CentrifugeTest::CentrifugeTest() : SelfTest(ST_MAX_STATES),
                                    poll_active_(false),
@@ -7,42 +8,20 @@ CentrifugeTest::CentrifugeTest() : SelfTest(ST_MAX_STATES),
 {
 }
 
+void CentrifugeTest::snapshotFields(SnapshotFields &fields)
+{
+  fields.field(this->poll_active_);
+  fields.field(this->speed_);
+}
+
 void CentrifugeTest::start()
 {
-  static const uint8_t TRANSITIONS[] = {
-      ST_START_TEST, // ST_IDLE
-      CANNOT_HAPPEN, // ST_COMPLETED
-      CANNOT_HAPPEN, // ST_FAILED
-      EVENT_IGNORED, // ST_START_TEST
-      EVENT_IGNORED, // ST_ACCELERATION
-      EVENT_IGNORED, // ST_WAIT_FOR_ACCELERATION
-      EVENT_IGNORED, // ST_DECELERATION
-      EVENT_IGNORED, // ST_WAIT_FOR_DECELERATION
-  };
-  assert(this->getCurrentState() < ST_MAX_STATES);
-  this->externalEvent(TRANSITIONS[this->getCurrentState()], nullptr);
-  static_assert(
-      (sizeof(TRANSITIONS) / sizeof(uint8_t)) == ST_MAX_STATES,
-      "Invalid size of TRANSITIONS");
+  this->dispatch(EV_START);
 }
 
 void CentrifugeTest::poll()
 {
-  static const uint8_t TRANSITIONS[] = {
-      EVENT_IGNORED,            // ST_IDLE
-      EVENT_IGNORED,            // ST_COMPLETED
-      EVENT_IGNORED,            // ST_FAILED
-      EVENT_IGNORED,            // ST_START_TEST
-      ST_WAIT_FOR_ACCELERATION, // ST_ACCELERATION
-      ST_WAIT_FOR_ACCELERATION, // ST_WAIT_FOR_ACCELERATION
-      ST_WAIT_FOR_DECELERATION, // ST_DECELERATION
-      ST_WAIT_FOR_DECELERATION, // ST_WAIT_FOR_DECELERATION
-  };
-  assert(this->getCurrentState() < ST_MAX_STATES);
-  this->externalEvent(TRANSITIONS[this->getCurrentState()], nullptr);
-  static_assert(
-      (sizeof(TRANSITIONS) / sizeof(uint8_t)) == ST_MAX_STATES,
-      "Invalid size of TRANSITIONS");
+  this->dispatch(EV_POLL);
 }
 
 STATE_DEFINE(
@@ -51,7 +30,7 @@ STATE_DEFINE(
     NoEventData)
 {
   (void)data;
-  std::cout << "CentrifugeTest::ST_Idle" << std::endl;
+  STATE_LOG_INFO("CentrifugeTest::ST_Idle");
 
   SelfTest::ST_Idle(data);
   this->stopPoll();
@@ -63,7 +42,7 @@ STATE_DEFINE(
     NoEventData)
 {
   (void)data;
-  std::cout << "CentrifugeTest::GD_StartTest" << std::endl;
+  STATE_LOG_INFO("CentrifugeTest::GD_StartTest");
   this->internalEvent(ST_ACCELERATION);
 }
 
@@ -73,15 +52,15 @@ GUARD_DEFINE(
     NoEventData)
 {
   (void)data;
-  std::cout << "CentrifugeTest::GD_GuardStartTest" << std::endl;
+  STATE_LOG_INFO("CentrifugeTest::GD_GuardStartTest");
   if (this->speed_ == 0)
   {
-    std::cout << "centrifugeTest::ActionAccepted" << std::endl;
+    STATE_LOG_INFO("centrifugeTest::ActionAccepted");
     return true;
   }
   else
   {
-    std::cout << "centrifugeTest::ActionCancled" << std::endl;
+    STATE_LOG_INFO("centrifugeTest::ActionCancled");
     return false;
   }
 }
@@ -92,7 +71,7 @@ STATE_DEFINE(
     NoEventData)
 {
   (void)data;
-  std::cout << "CentrifugeTest::ST_Acceleration" << std::endl;
+  STATE_LOG_INFO("CentrifugeTest::ST_Acceleration");
   this->startPoll();
 }
 
@@ -102,7 +81,7 @@ STATE_DEFINE(
     NoEventData)
 {
   (void)data;
-  std::cout << "CentrifugeTest::ST_WaitForAcceleration : Speed is " << this->speed_ << std::endl;
+  STATE_LOG_INFO("CentrifugeTest::ST_WaitForAcceleration : Speed is %d", this->speed_);
   if (++this->speed_ >= 5)
   {
     this->internalEvent(ST_DECELERATION);
@@ -113,7 +92,7 @@ EXIT_DEFINE(
     CentrifugeTest,
     ExitWaitForAcceleration)
 {
-  std::cout << "CentrifugeTest::EX_ExitWaitForAcceleration" << std::endl;
+  STATE_LOG_INFO("CentrifugeTest::EX_ExitWaitForAcceleration");
   this->stopPoll();
 }
 
@@ -123,7 +102,7 @@ STATE_DEFINE(
     NoEventData)
 {
   (void)data;
-  std::cout << "CentrifugeTest::ST_Deceleration" << std::endl;
+  STATE_LOG_INFO("CentrifugeTest::ST_Deceleration");
   this->startPoll();
 }
 
@@ -133,7 +112,7 @@ STATE_DEFINE(
     NoEventData)
 {
   (void)data;
-  std::cout << "CentrifugeTest::ST_WaitForDeceleration : Speed is " << this->speed_ << std::endl;
+  STATE_LOG_INFO("CentrifugeTest::ST_WaitForDeceleration : Speed is %d", this->speed_);
   if (this->speed_-- == 0)
   {
     this->internalEvent(ST_COMPLETED);
@@ -144,6 +123,6 @@ EXIT_DEFINE(
     CentrifugeTest,
     ExitWaitForDeceleration)
 {
-  std::cout << "CentrifugeTest::EX_ExitWaitForDeceleration" << std::endl;
+  STATE_LOG_INFO("CentrifugeTest::EX_ExitWaitForDeceleration");
   this->stopPoll();
 }
\ No newline at end of file
@@ -0,0 +1,53 @@
+#include <centrifuge_test.hpp>
+#include <state_log.hpp>
+#include <cstdlib>
+#include <vector>
+
+// Runs several centrifuge tests, each as a coroutine that waits for its
+// test to complete instead of polling it. The main loop only ticks the
+// tests that are spinning.
+static StateTask runTest(CentrifugeTest &test, size_t id)
+{
+  test.start();
+  StateTransition transition = co_await test.completed();
+  STATE_LOG_INFO("test %zu completed, from state %u", id,
+                 static_cast<unsigned>(transition.from));
+}
+
+int main(void)
+{
+  StateLog::start(stdout);
+
+  const size_t test_count = 3;
+  std::vector<CentrifugeTest> tests(test_count);
+  std::vector<StateTask> tasks;
+  for (size_t i = 0; i < test_count; ++i)
+  {
+    tasks.push_back(runTest(tests[i], i));
+  }
+
+  bool running = true;
+  while (running)
+  {
+    running = false;
+    for (size_t i = 0; i < test_count; ++i)
+    {
+      if (!tasks[i].done())
+      {
+        running = true;
+        if (tests[i].isPollActive())
+        {
+          tests[i].poll();
+        }
+      }
+    }
+  }
+
+  for (const StateTask &task : tasks)
+  {
+    task.get();
+  }
+
+  StateLog::stop();
+  return EXIT_SUCCESS;
+}
@@ -1,8 +1,15 @@
 #include <centrifuge_test.hpp>
+#include <state_log.hpp>
 #include <cstdlib>
 
 int main(void)
 {
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+  // Decode with flight_recorder_decode centrifuge_test.flight
+  FlightRecorder::installCrashHandler("centrifuge_test.flight");
+#endif
+  StateLog::start(stdout);
+
   auto test = std::make_shared<CentrifugeTest>();
   test->cancel();
   test->start();
@@ -10,5 +17,10 @@ int main(void)
   {
     test->poll();
   }
+
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+  FlightRecorder::dumpToFile("centrifuge_test.flight");
+#endif
+  StateLog::stop();
   return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,49 @@
+#include "chart_motor.hpp"
+#include "state_log.hpp"
+
+ChartMotor::ChartMotor() : StateMachine(ST_MAX_STATES, INITIAL_STATE),
+                           current_speed_(0)
+{
+}
+
+// set motor speed external event
+void ChartMotor::setSpeed(const MotorData &data)
+{
+  this->dispatch(EV_SET_SPEED, data);
+}
+
+// halt motor external event
+void ChartMotor::halt()
+{
+  this->dispatch(EV_HALT);
+}
+
+// state machine sits here when motor is not running
+STATE_DEFINE(ChartMotor, Idle, NoEventData)
+{
+  (void)data; // cast to avoid gcc unused warning
+  STATE_LOG_INFO("ChartMotor::ST_Idle");
+}
+
+// stop the motor
+STATE_DEFINE(ChartMotor, Stop, NoEventData)
+{
+  (void)data; // cast to avoid gcc unused warning
+  STATE_LOG_INFO("ChartMotor::ST_Stop");
+  this->current_speed_ = 0;
+  this->internalEvent(ST_IDLE);
+}
+
+// start the motor going
+STATE_DEFINE(ChartMotor, Start, MotorData)
+{
+  STATE_LOG_INFO("ChartMotor::ST_Start : Speed is %d", data->speed);
+  this->current_speed_ = data->speed;
+}
+
+// changes the motor speed once the motor is moving
+STATE_DEFINE(ChartMotor, ChangeSpeed, MotorData)
+{
+  STATE_LOG_INFO("ChartMotor::ST_ChangeSpeed : Speed is %d", data->speed);
+  this->current_speed_ = data->speed;
+}
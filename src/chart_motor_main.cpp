@@ -0,0 +1,21 @@
+#include "chart_motor.hpp"
+#include "state_log.hpp"
+#include <cstdlib>
+
+int main(void)
+{
+  StateLog::start(stdout);
+
+  ChartMotor motor;
+  MotorData data;
+  data.speed = 100;
+  motor.setSpeed(data);
+
+  data.speed = 200;
+  motor.setSpeed(data);
+
+  motor.halt();
+
+  StateLog::stop();
+  return EXIT_SUCCESS;
+}
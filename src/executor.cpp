@@ -0,0 +1,187 @@
+#include "executor.hpp"
+#include <cassert>
+
+namespace
+{
+// Worker the calling thread belongs to, if any
+thread_local const Executor *current_executor = nullptr;
+thread_local void *current_worker = nullptr;
+}
+
+Executor::Executor(size_t thread_count, size_t batch_size)
+    : batch_size_(batch_size),
+      next_worker_(0),
+      active_machines_(0),
+      epoch_(0),
+      sleepers_(0),
+      stopping_(false)
+{
+  if (thread_count == 0)
+  {
+    thread_count = 1;
+  }
+  assert(batch_size_ > 0);
+
+  for (size_t i = 0; i < thread_count; ++i)
+  {
+    this->workers_.emplace_back(new Worker(i));
+  }
+  for (auto &worker : this->workers_)
+  {
+    Worker *self = worker.get();
+    worker->thread = std::thread([this, self]() { this->run(*self); });
+  }
+}
+
+Executor::~Executor()
+{
+  this->stopping_.store(true);
+  {
+    std::lock_guard<std::mutex> lock(this->park_mutex_);
+    this->epoch_.fetch_add(1);
+  }
+  this->park_cv_.notify_all();
+
+  for (auto &worker : this->workers_)
+  {
+    worker->thread.join();
+  }
+}
+
+void Executor::attach(StateMachine &sm)
+{
+  sm.enableEventQueue(this);
+}
+
+void Executor::waitIdle()
+{
+  while (this->active_machines_.load(std::memory_order_acquire) != 0)
+  {
+    std::this_thread::yield();
+  }
+}
+
+uint64_t Executor::getStealCount() const
+{
+  uint64_t steals = 0;
+  for (const auto &worker : this->workers_)
+  {
+    steals += worker->steals.load(std::memory_order_relaxed);
+  }
+  return steals;
+}
+
+void Executor::schedule(StateMachine *sm)
+{
+  this->active_machines_.fetch_add(1, std::memory_order_relaxed);
+
+  if (current_executor == this)
+  {
+    // Events posted from a state action stay on this worker, where they
+    // can be stolen by idle ones
+    static_cast<Worker *>(current_worker)->deque.push(sm);
+  }
+  else
+  {
+    size_t index = this->next_worker_.fetch_add(1, std::memory_order_relaxed);
+    Worker &worker = *this->workers_[index % this->workers_.size()];
+    worker.inbox.push(scheduleNode(sm));
+  }
+  this->wakeWorker();
+}
+
+void Executor::wakeWorker()
+{
+  // Pairs with the sleeper count/epoch check in run(), see there
+  this->epoch_.fetch_add(1);
+  if (this->sleepers_.load() != 0)
+  {
+    {
+      std::lock_guard<std::mutex> lock(this->park_mutex_);
+    }
+    this->park_cv_.notify_one();
+  }
+}
+
+StateMachine *Executor::findWork(Worker &self)
+{
+  // Move newly scheduled machines into the deque, where they can be stolen
+  MpscNode *node;
+  while ((node = self.inbox.pop()) != nullptr)
+  {
+    self.deque.push(scheduledMachine(node));
+  }
+
+  StateMachine *sm = self.deque.take();
+  if (sm != nullptr)
+  {
+    return sm;
+  }
+
+  size_t count = this->workers_.size();
+  for (size_t i = 1; i < count; ++i)
+  {
+    Worker &victim = *this->workers_[(self.index + i) % count];
+    sm = victim.deque.steal();
+    if (sm != nullptr)
+    {
+      self.steals.store(self.steals.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+      return sm;
+    }
+  }
+  return nullptr;
+}
+
+void Executor::run(Worker &self)
+{
+  current_executor = this;
+  current_worker = &self;
+
+  while (true)
+  {
+    StateMachine *sm = this->findWork(self);
+    if (sm != nullptr)
+    {
+      if (runEvents(sm, this->batch_size_))
+      {
+        // Still owned, queue behind the machines already waiting here
+        self.inbox.push(scheduleNode(sm));
+      }
+      else
+      {
+        this->active_machines_.fetch_sub(1, std::memory_order_release);
+      }
+      continue;
+    }
+
+    if (this->stopping_.load())
+    {
+      break;
+    }
+
+    // Announce the sleeper before the final check. A scheduler either sees
+    // the sleeper and notifies, or published its work (and bumped the
+    // epoch) before the check below and the wait returns immediately.
+    uint64_t epoch = this->epoch_.load();
+    this->sleepers_.fetch_add(1);
+    sm = this->findWork(self);
+    if (sm == nullptr)
+    {
+      std::unique_lock<std::mutex> lock(this->park_mutex_);
+      this->park_cv_.wait(lock, [this, epoch]() {
+        return this->epoch_.load() != epoch || this->stopping_.load();
+      });
+    }
+    this->sleepers_.fetch_sub(1);
+
+    if (sm != nullptr)
+    {
+      // Put it back so the regular path above runs it
+      self.deque.push(sm);
+    }
+  }
+
+  current_executor = nullptr;
+  current_worker = nullptr;
+}
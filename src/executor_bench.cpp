@@ -0,0 +1,227 @@
+#include "executor.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+class TokenData : public EventData
+{
+public:
+  uint32_t hops;
+};
+
+// Forwards every token it receives to the next machine until the token's
+// hop count runs out, so load spreads over the whole fleet. Counts the
+// events it ran, and the times an action started while another of its
+// actions was still running, which the executor must never allow.
+class Relay : public StateMachine
+{
+public:
+  Relay()
+      : StateMachine(ST_MAX_STATES), next_(nullptr), work_(0), received_(0),
+        running_(false), overlaps_(0)
+  {
+  }
+
+  void setNext(Relay *next) { this->next_ = next; }
+  void token(const TokenData &data);
+
+  // Read once the executor is idle
+  uint64_t received() const { return this->received_; }
+  uint64_t overlaps() const { return this->overlaps_.load(); }
+
+private:
+  Relay *next_;
+  uint64_t work_;
+  uint64_t received_;
+  std::atomic<bool> running_;
+  std::atomic<uint64_t> overlaps_;
+
+  enum States
+  {
+    ST_IDLE,
+    ST_FORWARD,
+    ST_MAX_STATES
+  };
+
+  STATE_DECLARE(Relay, Idle, NoEventData)
+  STATE_DECLARE(Relay, Forward, TokenData)
+
+  virtual const StateMapRowEx *getStateMapEx() { return nullptr; }
+  virtual const StateMapRow *getStateMap()
+  {
+    static const StateMapRow STATE_MAP[]{
+        &Idle,
+        &Forward,
+    };
+    static_assert(
+        (sizeof(STATE_MAP) / sizeof(StateMapRow)) == ST_MAX_STATES,
+        "Invalid size of STATE_MAP");
+    return &STATE_MAP[0];
+  }
+};
+
+void Relay::token(const TokenData &data)
+{
+  static const StateIndex TRANSITIONS[] = {
+      TRANSITION_MAP_ENTRY(ST_FORWARD) // ST_IDLE
+      TRANSITION_MAP_ENTRY(ST_FORWARD) // ST_FORWARD
+  };
+  END_TRANSITION_MAP(data)
+}
+
+STATE_DEFINE(Relay, Idle, NoEventData)
+{
+  (void)data;
+}
+
+STATE_DEFINE(Relay, Forward, TokenData)
+{
+  if (this->running_.exchange(true, std::memory_order_acquire))
+  {
+    this->overlaps_.fetch_add(1, std::memory_order_relaxed);
+  }
+  ++this->received_;
+
+  // A little work per event, roughly what a small state action costs
+  for (uint32_t i = 0; i < 64; ++i)
+  {
+    this->work_ = this->work_ * 6364136223846793005ULL + i;
+  }
+
+  if (data->hops > 0)
+  {
+    TokenData next;
+    next.hops = data->hops - 1;
+    this->next_->token(next);
+  }
+  this->running_.store(false, std::memory_order_release);
+}
+
+struct BenchRun
+{
+  double events_per_sec;
+  uint64_t events; // run by the fleet
+  uint64_t overlaps;
+  uint64_t steals;
+};
+
+static uint64_t fleetEvents(const std::vector<Relay> &relays)
+{
+  uint64_t events = 0;
+  for (const Relay &relay : relays)
+  {
+    events += relay.received();
+  }
+  return events;
+}
+
+static uint64_t fleetOverlaps(const std::vector<Relay> &relays)
+{
+  uint64_t overlaps = 0;
+  for (const Relay &relay : relays)
+  {
+    overlaps += relay.overlaps();
+  }
+  return overlaps;
+}
+
+static BenchRun runBench(
+    std::vector<Relay> &relays,
+    size_t threads,
+    size_t batch_size,
+    size_t tokens,
+    uint32_t hops)
+{
+  Executor executor(threads, batch_size);
+  size_t machines = relays.size();
+  for (Relay &relay : relays)
+  {
+    executor.attach(relay);
+  }
+  uint64_t events = fleetEvents(relays);
+  uint64_t overlaps = fleetOverlaps(relays);
+
+  auto start = std::chrono::steady_clock::now();
+  TokenData data;
+  data.hops = hops;
+  for (size_t i = 0; i < tokens; ++i)
+  {
+    relays[i % machines].token(data);
+  }
+  executor.waitIdle();
+  auto stop = std::chrono::steady_clock::now();
+
+  BenchRun run;
+  double seconds = std::chrono::duration<double>(stop - start).count();
+  run.events_per_sec = static_cast<double>(tokens) * (hops + 1) / seconds;
+  run.events = fleetEvents(relays) - events;
+  run.overlaps = fleetOverlaps(relays) - overlaps;
+  run.steals = executor.getStealCount();
+  return run;
+}
+
+int main(int argc, char **argv)
+{
+  size_t machines = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+  size_t tokens = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 20000;
+  uint32_t hops = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 100;
+  size_t batch_size = argc > 4 ? std::strtoul(argv[4], nullptr, 10)
+                               : Executor::DEFAULT_BATCH_SIZE;
+
+  std::vector<size_t> thread_counts = {1, 2, 4};
+  size_t hardware = std::max<size_t>(1, std::thread::hardware_concurrency());
+  if (std::find(thread_counts.begin(), thread_counts.end(), hardware) ==
+      thread_counts.end())
+  {
+    thread_counts.push_back(hardware);
+  }
+
+  // The fleet is reused across runs, only the executor is rebuilt
+  std::vector<Relay> relays(machines);
+  for (size_t i = 0; i < machines; ++i)
+  {
+    // Stride through the fleet so consecutive hops land on other workers
+    relays[i].setNext(&relays[(i * 7 + 1) % machines]);
+  }
+
+  printf("machines=%zu tokens=%zu hops=%u batch=%zu hardware_threads=%zu\n",
+         machines, tokens, hops, batch_size, hardware);
+  printf("%8s %16s %10s %10s\n", "threads", "events/sec", "speedup",
+         "steals");
+
+  // Every token runs once per hop plus once where it was sent, and a
+  // machine's actions never overlap
+  uint64_t expected = static_cast<uint64_t>(tokens) * (hops + 1);
+  int status = EXIT_SUCCESS;
+  double baseline = 0.0;
+  for (size_t threads : thread_counts)
+  {
+    BenchRun run = runBench(relays, threads, batch_size, tokens, hops);
+    if (baseline == 0.0)
+    {
+      baseline = run.events_per_sec;
+    }
+    printf("%8zu %16.0f %9.2fx %10" PRIu64 "\n", threads, run.events_per_sec,
+           run.events_per_sec / baseline, run.steals);
+    if (run.events != expected)
+    {
+      fprintf(stderr, "FAILED: %zu threads ran %" PRIu64
+                      " events, expected %" PRIu64 "\n",
+              threads, run.events, expected);
+      status = EXIT_FAILURE;
+    }
+    if (run.overlaps != 0)
+    {
+      fprintf(stderr, "FAILED: %zu threads ran a machine on two workers at "
+                      "once %" PRIu64 " times\n",
+              threads, run.overlaps);
+      status = EXIT_FAILURE;
+    }
+  }
+  return status;
+}
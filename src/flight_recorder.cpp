@@ -0,0 +1,192 @@
+#include "flight_recorder.hpp"
+
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+const size_t MAX_EVENTS = 4096;
+
+// Registries are append-only so the crash handler can walk them without
+// locks
+std::atomic<uint32_t> event_count(0);
+std::atomic<const char *> event_names[MAX_EVENTS];
+
+std::atomic<uint32_t> machine_count(0);
+std::atomic<uint32_t> thread_count(0);
+
+// Calibrated clock, read by the crash handler
+std::atomic<double> ns_per_tick(0.0);
+
+char crash_path[256];
+
+const int CRASH_SIGNALS[] = {SIGSEGV, SIGABRT, SIGBUS, SIGILL, SIGFPE};
+
+bool writeAll(int fd, const void *data, size_t size)
+{
+  const char *bytes = static_cast<const char *>(data);
+  while (size > 0)
+  {
+    ssize_t written = ::write(fd, bytes, size);
+    if (written < 0)
+    {
+      return false;
+    }
+    bytes += written;
+    size -= static_cast<size_t>(written);
+  }
+  return true;
+}
+
+void crashHandler(int signal)
+{
+  int fd = ::open(crash_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0)
+  {
+    FlightRecorder::dump(fd);
+    ::close(fd);
+  }
+
+  // SA_RESETHAND restored the default action, rerun it
+  ::raise(signal);
+}
+} // namespace
+
+std::atomic<FlightRecorder::Buffer *> FlightRecorder::buffers_(nullptr);
+
+uint16_t FlightRecorder::eventId(const char *name)
+{
+  uint32_t index = event_count.fetch_add(1, std::memory_order_acq_rel);
+  if (index >= MAX_EVENTS)
+  {
+    // Registry full, later events are recorded without a name
+    return FlightRecord::NO_EVENT;
+  }
+  event_names[index].store(name, std::memory_order_release);
+  // Ids start at 1, NO_EVENT is 0
+  return static_cast<uint16_t>(index + 1);
+}
+
+uint32_t FlightRecorder::nextMachineId()
+{
+  return machine_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+FlightRecorder::Buffer *FlightRecorder::createBuffer()
+{
+  Buffer *buffer = new Buffer();
+  buffer->thread = thread_count.fetch_add(1, std::memory_order_relaxed);
+  buffer->head.store(0, std::memory_order_relaxed);
+
+  Buffer *next = buffers_.load(std::memory_order_relaxed);
+  do
+  {
+    buffer->next = next;
+  } while (!buffers_.compare_exchange_weak(
+      next, buffer, std::memory_order_release, std::memory_order_relaxed));
+  return buffer;
+}
+
+bool FlightRecorder::dump(int fd)
+{
+  Buffer *first = buffers_.load(std::memory_order_acquire);
+
+  FlightDumpHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = FlightDumpHeader::MAGIC;
+  header.version = FlightDumpHeader::VERSION;
+  header.record_size = sizeof(FlightRecord);
+  header.state_size = sizeof(StateIndex);
+  header.capacity = CAPACITY;
+  header.ns_per_tick = ns_per_tick.load(std::memory_order_relaxed);
+  header.event_count = event_count.load(std::memory_order_acquire);
+  if (header.event_count > MAX_EVENTS)
+  {
+    header.event_count = MAX_EVENTS;
+  }
+  for (Buffer *buffer = first; buffer != nullptr; buffer = buffer->next)
+  {
+    ++header.thread_count;
+  }
+  if (!writeAll(fd, &header, sizeof(header)))
+  {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < header.event_count; ++i)
+  {
+    // A name still being registered is written as empty
+    const char *name = event_names[i].load(std::memory_order_acquire);
+    if (name == nullptr)
+    {
+      name = "";
+    }
+    uint32_t length = static_cast<uint32_t>(std::strlen(name));
+    if (!writeAll(fd, &length, sizeof(length)) || !writeAll(fd, name, length))
+    {
+      return false;
+    }
+  }
+
+  for (Buffer *buffer = first; buffer != nullptr; buffer = buffer->next)
+  {
+    FlightDumpThread thread;
+    thread.thread = buffer->thread;
+    thread.head = buffer->head.load(std::memory_order_acquire);
+    thread.record_count =
+        static_cast<uint32_t>(thread.head < CAPACITY ? thread.head : CAPACITY);
+    if (!writeAll(fd, &thread, sizeof(thread)))
+    {
+      return false;
+    }
+
+    // Oldest first: the part after the head, then the part before it
+    size_t start = static_cast<size_t>(thread.head - thread.record_count) &
+                   (CAPACITY - 1);
+    size_t tail = CAPACITY - start;
+    if (tail > thread.record_count)
+    {
+      tail = thread.record_count;
+    }
+    if (!writeAll(fd, &buffer->records[start], tail * sizeof(FlightRecord)) ||
+        !writeAll(fd, &buffer->records[0],
+                  (thread.record_count - tail) * sizeof(FlightRecord)))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool FlightRecorder::dumpToFile(const char *path)
+{
+  ns_per_tick.store(MetricsClock::nsPerTick(), std::memory_order_relaxed);
+
+  int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    return false;
+  }
+  bool result = dump(fd);
+  return ::close(fd) == 0 && result;
+}
+
+void FlightRecorder::installCrashHandler(const char *path)
+{
+  ns_per_tick.store(MetricsClock::nsPerTick(), std::memory_order_relaxed);
+
+  std::strncpy(crash_path, path, sizeof(crash_path) - 1);
+  crash_path[sizeof(crash_path) - 1] = '\0';
+
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = crashHandler;
+  action.sa_flags = SA_RESETHAND;
+  sigemptyset(&action.sa_mask);
+  for (int signal : CRASH_SIGNALS)
+  {
+    ::sigaction(signal, &action, nullptr);
+  }
+}
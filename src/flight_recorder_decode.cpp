@@ -0,0 +1,191 @@
+#include "flight_recorder.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Pretty-prints a FlightRecorder dump, records of every thread merged in
+// time order.
+//
+//   flight_recorder_decode <dump> [--machine <id>] [--last <count>]
+
+namespace
+{
+struct DecodedRecord
+{
+  FlightRecord record;
+  uint32_t thread;
+};
+
+bool readAll(FILE *file, void *data, size_t size)
+{
+  return size == 0 || std::fread(data, size, 1, file) == 1;
+}
+
+std::string stateName(StateIndex state)
+{
+  // Sentinels shared by StateMachine and StaticStateMachine
+  if (state == STATE_INDEX_EVENT_IGNORED)
+  {
+    return "IGNORED";
+  }
+  if (state == STATE_INDEX_CANNOT_HAPPEN)
+  {
+    return "CANNOT_HAPPEN";
+  }
+  return std::to_string(state);
+}
+
+int usage(const char *program)
+{
+  std::fprintf(stderr, "usage: %s <dump> [--machine <id>] [--last <count>]\n",
+               program);
+  return EXIT_FAILURE;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    return usage(argv[0]);
+  }
+
+  const char *path = argv[1];
+  bool filter_machine = false;
+  uint32_t machine = 0;
+  size_t last = 0;
+  for (int i = 2; i < argc; ++i)
+  {
+    if (std::strcmp(argv[i], "--machine") == 0 && i + 1 < argc)
+    {
+      filter_machine = true;
+      machine = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    }
+    else if (std::strcmp(argv[i], "--last") == 0 && i + 1 < argc)
+    {
+      last = std::strtoul(argv[++i], nullptr, 10);
+    }
+    else
+    {
+      return usage(argv[0]);
+    }
+  }
+
+  FILE *file = std::fopen(path, "rb");
+  if (file == nullptr)
+  {
+    std::fprintf(stderr, "cannot open %s\n", path);
+    return EXIT_FAILURE;
+  }
+
+  FlightDumpHeader header;
+  if (!readAll(file, &header, sizeof(header)) ||
+      header.magic != FlightDumpHeader::MAGIC)
+  {
+    std::fprintf(stderr, "%s is not a flight recorder dump\n", path);
+    std::fclose(file);
+    return EXIT_FAILURE;
+  }
+  if (header.version != FlightDumpHeader::VERSION ||
+      header.record_size != sizeof(FlightRecord))
+  {
+    std::fprintf(stderr, "unsupported dump version %u (record size %u)\n",
+                 header.version, header.record_size);
+    std::fclose(file);
+    return EXIT_FAILURE;
+  }
+  if (header.state_size != sizeof(StateIndex))
+  {
+    std::fprintf(stderr,
+                 "dump has %u-byte state ids, rebuild with a matching "
+                 "STATE_MACHINE_STATE_INDEX_TYPE\n",
+                 header.state_size);
+    std::fclose(file);
+    return EXIT_FAILURE;
+  }
+
+  std::vector<std::string> events(header.event_count);
+  for (std::string &event : events)
+  {
+    uint32_t length = 0;
+    if (!readAll(file, &length, sizeof(length)))
+    {
+      break;
+    }
+    event.resize(length);
+    if (!readAll(file, &event[0], length))
+    {
+      break;
+    }
+  }
+
+  std::vector<DecodedRecord> records;
+  for (uint32_t t = 0; t < header.thread_count; ++t)
+  {
+    FlightDumpThread thread;
+    if (!readAll(file, &thread, sizeof(thread)))
+    {
+      std::fprintf(stderr, "dump truncated in thread %u\n", t);
+      break;
+    }
+    for (uint32_t i = 0; i < thread.record_count; ++i)
+    {
+      DecodedRecord decoded;
+      decoded.thread = thread.thread;
+      if (!readAll(file, &decoded.record, sizeof(decoded.record)))
+      {
+        break;
+      }
+      if (!filter_machine || decoded.record.machine == machine)
+      {
+        records.push_back(decoded);
+      }
+    }
+  }
+  std::fclose(file);
+
+  std::stable_sort(
+      records.begin(), records.end(),
+      [](const DecodedRecord &a, const DecodedRecord &b) {
+        return a.record.timestamp < b.record.timestamp;
+      });
+  size_t first = last != 0 && records.size() > last ? records.size() - last : 0;
+
+  std::printf("%u threads, %u records per thread, %zu records shown\n",
+              header.thread_count, header.capacity, records.size() - first);
+  std::printf("%14s %7s %8s %-24s %14s    %-14s\n",
+              header.ns_per_tick > 0.0 ? "time_us" : "ticks", "thread",
+              "machine", "event", "from", "to");
+
+  uint64_t origin = records.empty() ? 0 : records[first].record.timestamp;
+  for (size_t i = first; i < records.size(); ++i)
+  {
+    const FlightRecord &record = records[i].record;
+    uint16_t event = record.event & FlightRecord::EVENT_MASK;
+    const char *event_name = "-";
+    if (event != FlightRecord::NO_EVENT && event <= events.size())
+    {
+      event_name = events[event - 1].c_str();
+    }
+
+    uint64_t ticks = record.timestamp - origin;
+    if (header.ns_per_tick > 0.0)
+    {
+      std::printf("%14.3f ", ticks * header.ns_per_tick / 1000.0);
+    }
+    else
+    {
+      std::printf("%14" PRIu64 " ", ticks);
+    }
+    std::printf("%7u %8u %-24s %14s -> %-14s%s\n", records[i].thread,
+                record.machine, event_name, stateName(record.from).c_str(),
+                stateName(record.to).c_str(),
+                (record.event & FlightRecord::GUARD_FAILED) ? " guard failed"
+                                                             : "");
+  }
+  return EXIT_SUCCESS;
+}
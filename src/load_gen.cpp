@@ -0,0 +1,566 @@
+#include "bench_util.hpp"
+#include "centrifuge_test.hpp"
+#include "event_pool.hpp"
+#include "motor.hpp"
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+// Open-loop load generator: raises a weighted mix of events on fleets of
+// Motor and CentrifugeTest machines at a fixed rate, and reports latency
+// percentiles per event type.
+//
+// Each event has an intended send time on a fixed schedule. Its latency is
+// measured from that time, not from when it was actually sent, so an event
+// stuck behind a slow one is charged for the wait it would have had in a
+// real system, instead of the stall hiding behind a send that came late
+// (coordinated omission). Service times, measured from the actual send,
+// are reported alongside to show the difference.
+//
+// The mix covers transitions with payloads (set_speed), events ignored in
+// the machine's current state (halt on an idle motor, poll or cancel on an
+// idle centrifuge) and starts rejected by the centrifuge's guard after a
+// cancelled run left it with speed.
+
+namespace
+{
+
+enum Operation
+{
+  OP_SET_SPEED,
+  OP_HALT,
+  OP_START,
+  OP_POLL,
+  OP_CANCEL,
+  OP_COUNT
+};
+
+const char *const OPERATION_NAMES[OP_COUNT] = {
+    "motor.set_speed",
+    "motor.halt",
+    "centrifuge.start",
+    "centrifuge.poll",
+    "centrifuge.cancel",
+};
+
+// Event raised by each operation, in its machine's event map
+const size_t OPERATION_EVENTS[OP_COUNT] = {
+    Motor::EV_SET_SPEED,
+    Motor::EV_HALT,
+    CentrifugeTest::EV_START,
+    CentrifugeTest::EV_POLL,
+    CentrifugeTest::EV_CANCEL,
+};
+
+bool isMotorOperation(size_t op)
+{
+  return op == OP_SET_SPEED || op == OP_HALT;
+}
+
+// Motor payload padded to Size bytes
+template <size_t Size>
+class SizedMotorData : public MotorData
+{
+  static_assert(Size > sizeof(MotorData), "Payload smaller than MotorData");
+  unsigned char padding_[Size - sizeof(MotorData)];
+};
+
+template <size_t Size>
+std::shared_ptr<MotorData> makePayload(bool pooled)
+{
+  if (pooled)
+  {
+    return EventPool<SizedMotorData<Size>>::make();
+  }
+  return std::make_shared<SizedMotorData<Size>>();
+}
+
+struct PayloadSize
+{
+  size_t size;
+  std::shared_ptr<MotorData> (*make)(bool pooled);
+};
+
+const PayloadSize PAYLOAD_SIZES[] = {
+    {64, &makePayload<64>},
+    {256, &makePayload<256>},
+    {1024, &makePayload<1024>},
+    {4096, &makePayload<4096>},
+};
+
+struct Options
+{
+  size_t motors = 64;
+  size_t centrifuges = 64;
+  double rate = 200000.0; // events per second, 0 for a closed loop
+  double duration = 5.0;
+  double warmup = 1.0;
+  size_t payload = 0; // bytes, 0 for MotorData passed by reference
+  bool pooled = false;
+  uint64_t seed = 1;
+  bool json = false;
+  unsigned weights[OP_COUNT] = {40, 15, 15, 25, 5};
+};
+
+struct Report
+{
+  PercentileHistogram latency[OP_COUNT];
+  PercentileHistogram service[OP_COUNT];
+  uint64_t events = 0;
+  uint64_t allocations = 0;
+  uint64_t restarts = 0;
+  double seconds = 0.0;
+};
+
+uint64_t nowNs()
+{
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+class LoadGenerator
+{
+public:
+  explicit LoadGenerator(const Options &options)
+      : options_(options), rng_(options.seed != 0 ? options.seed : 1),
+        total_weight_(0), payload_(nullptr)
+  {
+    for (size_t i = 0; i < options.motors; ++i)
+    {
+      this->motors_.emplace_back(new Motor());
+    }
+    for (size_t i = 0; i < options.centrifuges; ++i)
+    {
+      this->centrifuges_.emplace_back(new CentrifugeTest());
+    }
+
+    // Event types without machines to take them are left out of the mix
+    for (size_t op = 0; op < OP_COUNT; ++op)
+    {
+      bool fleet = isMotorOperation(op) ? options.motors > 0 : options.centrifuges > 0;
+      this->total_weight_ += fleet ? options.weights[op] : 0;
+      this->cumulative_[op] = this->total_weight_;
+    }
+
+    if (options.payload > 0)
+    {
+      for (const PayloadSize &size : PAYLOAD_SIZES)
+      {
+        if (size.size >= options.payload)
+        {
+          this->payload_ = &size;
+          break;
+        }
+      }
+    }
+  }
+
+  bool valid() const
+  {
+    return this->total_weight_ > 0 &&
+           (this->options_.payload == 0 || this->payload_ != nullptr);
+  }
+
+  size_t payloadSize() const
+  {
+    return this->payload_ != nullptr ? this->payload_->size : sizeof(MotorData);
+  }
+
+  // Send events for seconds, recording into report if it is not null
+  void run(double seconds, Report *report)
+  {
+    uint64_t allocations = 0;
+    uint64_t restarts = 0;
+    uint64_t start = nowNs();
+    uint64_t end = start + static_cast<uint64_t>(seconds * 1e9);
+    double interval = this->options_.rate > 0.0 ? 1e9 / this->options_.rate : 0.0;
+    uint64_t done = start;
+    uint64_t events = 0;
+
+    for (uint64_t i = 0;; ++i)
+    {
+      size_t op = this->pick();
+      size_t index = this->random() % this->fleetSize(op);
+      restarts += this->restartIfFinished(op, index);
+
+      uint64_t intended;
+      uint64_t sent;
+      if (interval > 0.0)
+      {
+        intended = start + static_cast<uint64_t>(i * interval);
+        if (intended >= end)
+        {
+          break;
+        }
+
+        // Spin rather than sleep: sleeps are far coarser than an event
+        while ((sent = nowNs()) < intended)
+        {
+        }
+      }
+      else
+      {
+        sent = nowNs();
+        intended = sent;
+        if (sent >= end)
+        {
+          break;
+        }
+      }
+
+      uint64_t send_allocations = allocationCount();
+      this->send(op, index);
+      done = nowNs();
+      allocations += allocationCount() - send_allocations;
+      ++events;
+
+      if (report != nullptr)
+      {
+        report->latency[op].record(done - intended);
+        report->service[op].record(done - sent);
+      }
+    }
+
+    if (report != nullptr)
+    {
+      report->events = events;
+      report->allocations = allocations;
+      report->restarts = restarts;
+      report->seconds = (done - start) / 1e9;
+    }
+  }
+
+private:
+  const Options &options_;
+  uint64_t rng_;
+  std::vector<std::unique_ptr<Motor>> motors_;
+  std::vector<std::unique_ptr<CentrifugeTest>> centrifuges_;
+  unsigned cumulative_[OP_COUNT];
+  unsigned total_weight_;
+  const PayloadSize *payload_;
+
+  // xorshift64*
+  uint64_t random()
+  {
+    this->rng_ ^= this->rng_ >> 12;
+    this->rng_ ^= this->rng_ << 25;
+    this->rng_ ^= this->rng_ >> 27;
+    return this->rng_ * 2685821657736338717ULL;
+  }
+
+  size_t pick()
+  {
+    uint64_t draw = this->random() % this->total_weight_;
+    size_t op = 0;
+    while (draw >= this->cumulative_[op])
+    {
+      ++op;
+    }
+    return op;
+  }
+
+  size_t fleetSize(size_t op) const
+  {
+    return isMotorOperation(op) ? this->motors_.size() : this->centrifuges_.size();
+  }
+
+  StateMachine &machine(size_t op, size_t index)
+  {
+    if (isMotorOperation(op))
+    {
+      return *this->motors_[index];
+    }
+    return *this->centrifuges_[index];
+  }
+
+  // A centrifuge test that has completed takes no more starts or cancels
+  // (CANNOT_HAPPEN in its event map); replace it with a fresh one before
+  // the send is timed. Returns 1 if the machine was replaced.
+  uint64_t restartIfFinished(size_t op, size_t index)
+  {
+    StateMachine &sm = this->machine(op, index);
+    const EventTable &table = *sm.getEventTable();
+    if (table.row(OPERATION_EVENTS[op])[sm.getCurrentState()] !=
+        StateMachine::CANNOT_HAPPEN)
+    {
+      return 0;
+    }
+    assert(!isMotorOperation(op));
+    this->centrifuges_[index].reset(new CentrifugeTest());
+    return 1;
+  }
+
+  void send(size_t op, size_t index)
+  {
+    if (isMotorOperation(op))
+    {
+      Motor &motor = *this->motors_[index];
+      if (op == OP_HALT)
+      {
+        motor.halt();
+      }
+      else if (this->payload_ != nullptr)
+      {
+        std::shared_ptr<MotorData> data = this->payload_->make(this->options_.pooled);
+        data->speed = static_cast<int>(this->random() % 1000);
+        motor.setSpeed(std::move(data));
+      }
+      else
+      {
+        MotorData data;
+        data.speed = static_cast<int>(this->random() % 1000);
+        motor.setSpeed(data);
+      }
+      return;
+    }
+
+    CentrifugeTest &centrifuge = *this->centrifuges_[index];
+    switch (op)
+    {
+    case OP_START:
+      centrifuge.start();
+      break;
+    case OP_POLL:
+      centrifuge.poll();
+      break;
+    default:
+      centrifuge.cancel();
+      break;
+    }
+  }
+};
+
+bool parseMix(const char *mix, unsigned weights[OP_COUNT])
+{
+  unsigned parsed[OP_COUNT] = {0, 0, 0, 0, 0};
+  const char *cursor = mix;
+  while (*cursor != '\0')
+  {
+    const char *equals = std::strchr(cursor, '=');
+    if (equals == nullptr)
+    {
+      return false;
+    }
+    size_t length = static_cast<size_t>(equals - cursor);
+    size_t op = 0;
+    for (; op < OP_COUNT; ++op)
+    {
+      // Names are accepted with or without their machine prefix
+      const char *name = OPERATION_NAMES[op];
+      const char *bare = std::strchr(name, '.') + 1;
+      if ((std::strlen(name) == length && std::strncmp(name, cursor, length) == 0) ||
+          (std::strlen(bare) == length && std::strncmp(bare, cursor, length) == 0))
+      {
+        break;
+      }
+    }
+    if (op == OP_COUNT)
+    {
+      return false;
+    }
+    char *end;
+    parsed[op] = static_cast<unsigned>(std::strtoul(equals + 1, &end, 10));
+    if (end == equals + 1 || (*end != ',' && *end != '\0'))
+    {
+      return false;
+    }
+    cursor = *end == ',' ? end + 1 : end;
+  }
+  std::memcpy(weights, parsed, sizeof(parsed));
+  return true;
+}
+
+void printTable(const char *title, const PercentileHistogram (&histograms)[OP_COUNT])
+{
+  PercentileHistogram all;
+  for (const PercentileHistogram &histogram : histograms)
+  {
+    all.merge(histogram);
+  }
+
+  std::printf("\n%s\n", title);
+  std::printf("%-20s %10s %10s %10s %10s %10s\n",
+              "event", "count", "p50", "p99", "p99.9", "max");
+  for (size_t op = 0; op <= OP_COUNT; ++op)
+  {
+    const PercentileHistogram &histogram = op < OP_COUNT ? histograms[op] : all;
+    if (histogram.count() == 0)
+    {
+      continue;
+    }
+    std::printf("%-20s %10llu %10llu %10llu %10llu %10llu\n",
+                op < OP_COUNT ? OPERATION_NAMES[op] : "all",
+                static_cast<unsigned long long>(histogram.count()),
+                static_cast<unsigned long long>(histogram.percentile(50.0)),
+                static_cast<unsigned long long>(histogram.percentile(99.0)),
+                static_cast<unsigned long long>(histogram.percentile(99.9)),
+                static_cast<unsigned long long>(histogram.max()));
+  }
+}
+
+void printJsonTable(const char *key, const PercentileHistogram (&histograms)[OP_COUNT])
+{
+  PercentileHistogram all;
+  for (const PercentileHistogram &histogram : histograms)
+  {
+    all.merge(histogram);
+  }
+
+  std::printf("  \"%s\": {", key);
+  bool first = true;
+  for (size_t op = 0; op <= OP_COUNT; ++op)
+  {
+    const PercentileHistogram &histogram = op < OP_COUNT ? histograms[op] : all;
+    if (histogram.count() == 0)
+    {
+      continue;
+    }
+    std::printf("%s\n    \"%s\": {\"count\": %llu, \"p50\": %llu, \"p99\": %llu, "
+                "\"p99_9\": %llu, \"max\": %llu}",
+                first ? "" : ",", op < OP_COUNT ? OPERATION_NAMES[op] : "all",
+                static_cast<unsigned long long>(histogram.count()),
+                static_cast<unsigned long long>(histogram.percentile(50.0)),
+                static_cast<unsigned long long>(histogram.percentile(99.0)),
+                static_cast<unsigned long long>(histogram.percentile(99.9)),
+                static_cast<unsigned long long>(histogram.max()));
+    first = false;
+  }
+  std::printf("\n  }");
+}
+
+int usage(const char *program)
+{
+  std::fprintf(stderr,
+               "usage: %s [--motors <count>] [--centrifuges <count>]\n"
+               "       [--rate <events/s, 0 for a closed loop>] [--duration <seconds>]\n"
+               "       [--warmup <seconds>] [--payload <bytes, 0 inline, up to 4096>]\n"
+               "       [--pooled] [--mix <event>=<weight>,...] [--seed <n>] [--json]\n"
+               "events: set_speed, halt, start, poll, cancel\n",
+               program);
+  return EXIT_FAILURE;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  Options options;
+  for (int i = 1; i < argc; ++i)
+  {
+    bool has_value = i + 1 < argc;
+    if (std::strcmp(argv[i], "--motors") == 0 && has_value)
+    {
+      options.motors = std::strtoul(argv[++i], nullptr, 10);
+    }
+    else if (std::strcmp(argv[i], "--centrifuges") == 0 && has_value)
+    {
+      options.centrifuges = std::strtoul(argv[++i], nullptr, 10);
+    }
+    else if (std::strcmp(argv[i], "--rate") == 0 && has_value)
+    {
+      options.rate = std::atof(argv[++i]);
+    }
+    else if (std::strcmp(argv[i], "--duration") == 0 && has_value)
+    {
+      options.duration = std::atof(argv[++i]);
+    }
+    else if (std::strcmp(argv[i], "--warmup") == 0 && has_value)
+    {
+      options.warmup = std::atof(argv[++i]);
+    }
+    else if (std::strcmp(argv[i], "--payload") == 0 && has_value)
+    {
+      options.payload = std::strtoul(argv[++i], nullptr, 10);
+    }
+    else if (std::strcmp(argv[i], "--pooled") == 0)
+    {
+      options.pooled = true;
+    }
+    else if (std::strcmp(argv[i], "--mix") == 0 && has_value)
+    {
+      if (!parseMix(argv[++i], options.weights))
+      {
+        return usage(argv[0]);
+      }
+    }
+    else if (std::strcmp(argv[i], "--seed") == 0 && has_value)
+    {
+      options.seed = std::strtoull(argv[++i], nullptr, 10);
+    }
+    else if (std::strcmp(argv[i], "--json") == 0)
+    {
+      options.json = true;
+    }
+    else
+    {
+      return usage(argv[0]);
+    }
+  }
+
+  LoadGenerator generator(options);
+  if (!generator.valid() || options.rate < 0.0 || options.duration <= 0.0)
+  {
+    return usage(argv[0]);
+  }
+
+  // The example states log through StateLog, left stopped so that only
+  // the engine is measured
+  Report report;
+  generator.run(options.warmup, nullptr);
+  generator.run(options.duration, &report);
+
+  double events = report.events > 0 ? report.events : 1;
+  double events_per_sec = report.seconds > 0.0 ? report.events / report.seconds : 0.0;
+  if (options.json)
+  {
+    std::printf("{\n  \"config\": {\"motors\": %zu, \"centrifuges\": %zu, "
+                "\"rate\": %.0f, \"duration\": %.3f, \"payload\": %zu, "
+                "\"payload_inline\": %s, \"pooled\": %s, \"seed\": %llu},\n",
+                options.motors, options.centrifuges, options.rate,
+                options.duration, generator.payloadSize(),
+                options.payload == 0 ? "true" : "false",
+                options.pooled ? "true" : "false",
+                static_cast<unsigned long long>(options.seed));
+    std::printf("  \"events\": %llu,\n  \"seconds\": %.3f,\n"
+                "  \"events_per_sec\": %.0f,\n  \"allocs_per_event\": %.4f,\n"
+                "  \"restarts\": %llu,\n",
+                static_cast<unsigned long long>(report.events), report.seconds,
+                events_per_sec, report.allocations / events,
+                static_cast<unsigned long long>(report.restarts));
+    printJsonTable("latency_ns", report.latency);
+    std::printf(",\n");
+    printJsonTable("service_ns", report.service);
+    std::printf("\n}\n");
+  }
+  else
+  {
+    std::printf("%zu motors, %zu centrifuges, ", options.motors, options.centrifuges);
+    if (options.rate > 0.0)
+    {
+      std::printf("%.0f events/s", options.rate);
+    }
+    else
+    {
+      std::printf("closed loop");
+    }
+    std::printf(" for %.1f s, %zu byte payloads%s\n", options.duration,
+                generator.payloadSize(),
+                options.payload == 0 ? " inline" : options.pooled ? " pooled" : "");
+    std::printf("%llu events in %.2f s: %.0f events/s, %.4f allocs/event, "
+                "%llu completed tests restarted\n",
+                static_cast<unsigned long long>(report.events), report.seconds,
+                events_per_sec, report.allocations / events,
+                static_cast<unsigned long long>(report.restarts));
+    printTable("latency from intended send time (ns), corrected for coordinated omission",
+               report.latency);
+    printTable("service time from actual send (ns)", report.service);
+  }
+  return EXIT_SUCCESS;
+}
@@ -1,50 +1,47 @@
 #include "motor.hpp"
-
-#include <iostream>
-
-using namespace std;
+#include "state_log.hpp"
+#include "state_snapshot.hpp"
 
 Motor::Motor() : StateMachine(ST_MAX_STATES),
                  current_speed_(0)
 {
 }
 
+void Motor::snapshotFields(SnapshotFields &fields)
+{
+  fields.field(this->current_speed_);
+}
+
 // set motor speed external event
 void Motor::setSpeed(std::shared_ptr<MotorData> data)
 {
-  static const uint8_t TRANSITIONS[] = {
-      TRANSITION_MAP_ENTRY(ST_START)        // ST_IDLE
-      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN)   // ST_STOP
-      TRANSITION_MAP_ENTRY(ST_CHANGE_SPEED) // ST_START
-      TRANSITION_MAP_ENTRY(ST_CHANGE_SPEED) // ST_CHANGE_SPEED
-  };
-  END_TRANSITION_MAP(data)
+  this->dispatch(EV_SET_SPEED, std::move(data));
+}
+
+// set motor speed external event, payload copied inline without allocating
+void Motor::setSpeed(const MotorData &data)
+{
+  this->dispatch(EV_SET_SPEED, data);
 }
 
 // halt motor external event
 void Motor::halt()
 {
-  static const uint8_t TRANSITIONS[] = {
-      TRANSITION_MAP_ENTRY(EVENT_IGNORED) // ST_IDLE
-      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_STOP
-      TRANSITION_MAP_ENTRY(ST_STOP)       // ST_START
-      TRANSITION_MAP_ENTRY(ST_STOP)       // ST_CHANGE_SPEED
-  };
-  END_TRANSITION_MAP(nullptr)
+  this->dispatch(EV_HALT);
 }
 
 // state machine sits here when motor is not running
 STATE_DEFINE(Motor, Idle, NoEventData)
 {
   (void)data; // cast to avoid gcc unused warning
-  cout << "Motor::ST_Idle" << endl;
+  STATE_LOG_INFO("Motor::ST_Idle");
 }
 
 // stop the motor
 STATE_DEFINE(Motor, Stop, NoEventData)
 {
   (void)data; // cast to avoid gcc unused warning
-  cout << "Motor::ST_Stop" << endl;
+  STATE_LOG_INFO("Motor::ST_Stop");
   this->current_speed_ = 0;
   this->internalEvent(ST_IDLE);
 }
@@ -52,13 +49,13 @@ STATE_DEFINE(Motor, Stop, NoEventData)
 // start the motor going
 STATE_DEFINE(Motor, Start, MotorData)
 {
-  cout << "Motor::ST_Start : Speed is " << data->speed << endl;
+  STATE_LOG_INFO("Motor::ST_Start : Speed is %d", data->speed);
   this->current_speed_ = data->speed;
 }
 
 // changes the motor speed once the motor is moving
 STATE_DEFINE(Motor, ChangeSpeed, MotorData)
 {
-  cout << "Motor::ST_ChangeSpeed : Speed is " << data->speed << endl;
+  STATE_LOG_INFO("Motor::ST_ChangeSpeed : Speed is %d", data->speed);
   this->current_speed_ = data->speed;
 }
@@ -1,8 +1,11 @@
 #include "motor.hpp"
+#include "state_log.hpp"
 #include <cstdlib>
 
 int main(void)
 {
+  StateLog::start(stdout);
+
   auto motor = std::make_shared<Motor>();
   auto data = std::make_shared<MotorData>();
   data->speed = 100;
@@ -13,5 +16,6 @@ int main(void)
 
   motor->halt();
 
+  StateLog::stop();
   return EXIT_SUCCESS;
 }
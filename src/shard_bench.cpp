@@ -0,0 +1,255 @@
+#include "shard_runtime.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+class TokenData : public EventData
+{
+public:
+  static const size_t EXTERNAL = SIZE_MAX;
+
+  uint32_t hops;
+  size_t sender; // index of the sending relay, or EXTERNAL
+  uint64_t seq;  // tokens the sender sent this relay before
+};
+
+// Forwards every token it receives to the next machine, on whatever shard
+// owns it, until the token's hop count runs out. Every relay has one
+// predecessor, so tokens from it, and from outside the runtime, must
+// arrive in the order they were sent, backlog or not.
+class Relay : public StateMachine
+{
+public:
+  enum Events
+  {
+    EV_TOKEN,
+    EV_MAX_EVENTS
+  };
+
+  explicit Relay(ShardRuntime &runtime)
+      : StateMachine(ST_MAX_STATES), runtime_(runtime), next_{nullptr, 0},
+        index_(0), previous_(0), work_(0), sent_(0), from_previous_(0),
+        from_outside_(0), received_(0), out_of_order_(0)
+  {
+  }
+
+  void link(size_t index, const ShardAddress &next, size_t previous)
+  {
+    this->index_ = index;
+    this->next_ = next;
+    this->previous_ = previous;
+  }
+
+  // Read once the runtime is idle
+  uint64_t received() const { return this->received_; }
+  uint64_t outOfOrder() const { return this->out_of_order_; }
+
+private:
+  ShardRuntime &runtime_;
+  ShardAddress next_;
+  size_t index_;
+  size_t previous_;
+  uint64_t work_;
+  uint64_t sent_;
+  uint64_t from_previous_;
+  uint64_t from_outside_;
+  uint64_t received_;
+  uint64_t out_of_order_;
+
+  enum States
+  {
+    ST_IDLE,
+    ST_FORWARD,
+    ST_MAX_STATES
+  };
+
+  STATE_DECLARE(Relay, Idle, NoEventData)
+  STATE_DECLARE(Relay, Forward, TokenData)
+
+  virtual const StateMapRowEx *getStateMapEx() { return nullptr; }
+  virtual const StateMapRow *getStateMap()
+  {
+    static const StateMapRow STATE_MAP[]{
+        &Idle,
+        &Forward,
+    };
+    static_assert(
+        (sizeof(STATE_MAP) / sizeof(StateMapRow)) == ST_MAX_STATES,
+        "Invalid size of STATE_MAP");
+    return &STATE_MAP[0];
+  }
+
+  BEGIN_EVENT_MAP()
+    EVENT_MAP_ENTRY(EV_TOKEN,
+                    ST_FORWARD,  // ST_IDLE
+                    ST_FORWARD)  // ST_FORWARD
+  END_EVENT_MAP()
+};
+
+STATE_DEFINE(Relay, Idle, NoEventData)
+{
+  (void)data;
+}
+
+STATE_DEFINE(Relay, Forward, TokenData)
+{
+  uint64_t &expected = data->sender == TokenData::EXTERNAL
+                           ? this->from_outside_
+                           : this->from_previous_;
+  if (data->seq != expected ||
+      (data->sender != TokenData::EXTERNAL && data->sender != this->previous_))
+  {
+    ++this->out_of_order_;
+  }
+  expected = data->seq + 1;
+  ++this->received_;
+
+  // A little work per event, roughly what a small state action costs
+  for (uint32_t i = 0; i < 64; ++i)
+  {
+    this->work_ = this->work_ * 6364136223846793005ULL + i;
+  }
+
+  if (data->hops > 0)
+  {
+    TokenData next;
+    next.hops = data->hops - 1;
+    next.sender = this->index_;
+    next.seq = this->sent_++;
+    this->runtime_.send(this->next_, EV_TOKEN, next);
+  }
+}
+
+struct BenchRun
+{
+  double events_per_sec;
+  uint64_t events; // run by the fleet
+  uint64_t out_of_order;
+  uint64_t backlogged;
+};
+
+static BenchRun runBench(
+    size_t shards,
+    size_t machines,
+    size_t tokens,
+    uint32_t hops,
+    size_t ring_capacity)
+{
+  ShardRuntime runtime(shards, true, ring_capacity);
+
+  // Relay i lives on shard i % shards, created there
+  std::vector<std::unique_ptr<Relay>> relays(machines);
+  for (size_t i = 0; i < machines; ++i)
+  {
+    runtime.execute(i % shards, [&runtime, &relays, i]() {
+      relays[i].reset(new Relay(runtime));
+    });
+  }
+  runtime.waitIdle();
+
+  std::vector<ShardAddress> addresses;
+  for (size_t i = 0; i < machines; ++i)
+  {
+    addresses.push_back(runtime.adopt(*relays[i], i % shards));
+  }
+  // Stride through the fleet so consecutive hops land on other shards. A
+  // stride coprime with the fleet size gives every relay one predecessor.
+  size_t stride = machines % 7 != 0 ? 7 : 1;
+  std::vector<size_t> previous(machines);
+  for (size_t i = 0; i < machines; ++i)
+  {
+    previous[(i * stride + 1) % machines] = i;
+  }
+  for (size_t i = 0; i < machines; ++i)
+  {
+    relays[i]->link(i, addresses[(i * stride + 1) % machines], previous[i]);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  TokenData data;
+  data.hops = hops;
+  data.sender = TokenData::EXTERNAL;
+  for (size_t i = 0; i < tokens; ++i)
+  {
+    data.seq = i / machines;
+    runtime.send(addresses[i % machines], Relay::EV_TOKEN, data);
+  }
+  runtime.waitIdle();
+  auto stop = std::chrono::steady_clock::now();
+
+  BenchRun run;
+  double seconds = std::chrono::duration<double>(stop - start).count();
+  run.events_per_sec = static_cast<double>(tokens) * (hops + 1) / seconds;
+  run.events = 0;
+  run.out_of_order = 0;
+  for (const auto &relay : relays)
+  {
+    run.events += relay->received();
+    run.out_of_order += relay->outOfOrder();
+  }
+  run.backlogged = runtime.getBackloggedCount();
+
+  // Machines are destroyed on their shards too
+  for (size_t i = 0; i < machines; ++i)
+  {
+    runtime.execute(i % shards, [&relays, i]() { relays[i].reset(); });
+  }
+  runtime.waitIdle();
+  return run;
+}
+
+int main(int argc, char **argv)
+{
+  size_t machines = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+  size_t tokens = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 20000;
+  uint32_t hops = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 100;
+  size_t ring_capacity = argc > 4 ? std::strtoul(argv[4], nullptr, 10)
+                                  : ShardRuntime::DEFAULT_RING_CAPACITY;
+
+  std::vector<size_t> shard_counts = {1, 2, 4};
+  size_t hardware = std::max<size_t>(1, std::thread::hardware_concurrency());
+  if (std::find(shard_counts.begin(), shard_counts.end(), hardware) ==
+      shard_counts.end())
+  {
+    shard_counts.push_back(hardware);
+  }
+
+  printf("machines=%zu tokens=%zu hops=%u ring=%zu hardware_threads=%zu\n",
+         machines, tokens, hops, ring_capacity, hardware);
+  printf("%8s %16s %10s %10s\n", "shards", "events/sec", "speedup",
+         "backlogged");
+
+  // Every token runs once per hop plus once where it was sent, in order
+  uint64_t expected = static_cast<uint64_t>(tokens) * (hops + 1);
+  int status = EXIT_SUCCESS;
+  double baseline = 0.0;
+  for (size_t shards : shard_counts)
+  {
+    BenchRun run = runBench(shards, machines, tokens, hops, ring_capacity);
+    if (baseline == 0.0)
+    {
+      baseline = run.events_per_sec;
+    }
+    printf("%8zu %16.0f %9.2fx %10" PRIu64 "\n", shards, run.events_per_sec,
+           run.events_per_sec / baseline, run.backlogged);
+    if (run.events != expected)
+    {
+      fprintf(stderr, "FAILED: %zu shards ran %" PRIu64
+                      " events, expected %" PRIu64 "\n",
+              shards, run.events, expected);
+      status = EXIT_FAILURE;
+    }
+    if (run.out_of_order != 0)
+    {
+      fprintf(stderr, "FAILED: %zu shards delivered %" PRIu64
+                      " tokens out of order\n",
+              shards, run.out_of_order);
+      status = EXIT_FAILURE;
+    }
+  }
+  return status;
+}
@@ -0,0 +1,260 @@
+#include "shard_runtime.hpp"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+thread_local ShardRuntime::Shard *ShardRuntime::current_shard_ = nullptr;
+
+ShardRuntime::ShardRuntime(
+    size_t shard_count,
+    bool pin_threads,
+    size_t ring_capacity,
+    size_t batch_size)
+    : pin_threads_(pin_threads),
+      ring_capacity_(ring_capacity),
+      batch_size_(batch_size),
+      external_sent_(0),
+      ready_(0),
+      stopping_(false)
+{
+  if (shard_count == 0)
+  {
+    shard_count = 1;
+  }
+  assert(ring_capacity_ > 0 && batch_size_ > 0);
+
+  for (size_t i = 0; i < shard_count; ++i)
+  {
+    this->shards_.emplace_back(new Shard(this, i, shard_count));
+  }
+  for (auto &shard : this->shards_)
+  {
+    Shard *self = shard.get();
+    shard->thread = std::thread([this, self]() { this->run(*self); });
+  }
+
+  // Rings are created by the shards reading them
+  while (this->ready_.load(std::memory_order_acquire) != shard_count)
+  {
+    std::this_thread::yield();
+  }
+}
+
+ShardRuntime::~ShardRuntime()
+{
+  this->stopping_.store(true, std::memory_order_release);
+  for (auto &shard : this->shards_)
+  {
+    shard->thread.join();
+  }
+}
+
+void ShardRuntime::execute(size_t shard, std::function<void()> task)
+{
+  assert(shard < this->shards_.size());
+  Shard &target = *this->shards_[shard];
+  this->external_sent_.fetch_add(1, std::memory_order_release);
+  std::lock_guard<std::mutex> lock(target.task_mutex);
+  target.tasks.push_back(std::move(task));
+  target.has_tasks.store(true, std::memory_order_release);
+}
+
+void ShardRuntime::waitIdle() const
+{
+  // Every message is counted as sent before it is counted as received, and
+  // the messages a machine sends are counted before the one it is running.
+  // Received counts read first adding up to the sent counts read after
+  // means nothing was in flight in between.
+  while (true)
+  {
+    uint64_t received = 0;
+    for (const auto &shard : this->shards_)
+    {
+      received += shard->received.load(std::memory_order_acquire);
+    }
+    uint64_t sent = this->external_sent_.load(std::memory_order_acquire);
+    for (const auto &shard : this->shards_)
+    {
+      sent += shard->sent.load(std::memory_order_acquire);
+    }
+    if (received == sent)
+    {
+      return;
+    }
+    std::this_thread::yield();
+  }
+}
+
+uint64_t ShardRuntime::getBackloggedCount() const
+{
+  uint64_t backlogged = 0;
+  for (const auto &shard : this->shards_)
+  {
+    backlogged += shard->backlogged.load(std::memory_order_relaxed);
+  }
+  return backlogged;
+}
+
+ShardMessage *ShardRuntime::claimExternal(size_t to)
+{
+  assert(to < this->shards_.size());
+  Shard &shard = *this->shards_[to];
+  // Wait for room without the lock, so no sender holds it for as long as
+  // the shard is behind and the others get their turn as room frees up
+  for (;;)
+  {
+    shard.external_mutex.lock();
+    ShardMessage *message = shard.inbound.back()->claim();
+    if (message != nullptr)
+    {
+      return message;
+    }
+    shard.external_mutex.unlock();
+    std::this_thread::yield();
+  }
+}
+
+void ShardRuntime::run(Shard &self)
+{
+  if (this->pin_threads_)
+  {
+    this->pin(self.index);
+  }
+  current_shard_ = &self;
+
+  size_t shard_count = this->shards_.size();
+  for (size_t i = 0; i <= shard_count; ++i)
+  {
+    self.inbound.emplace_back(new Ring(this->ring_capacity_));
+  }
+  this->ready_.fetch_add(1, std::memory_order_release);
+
+  size_t idle_rounds = 0;
+  while (!this->stopping_.load(std::memory_order_acquire))
+  {
+    if (self.has_tasks.load(std::memory_order_acquire))
+    {
+      this->runTasks(self);
+    }
+    if (self.backlog_count != 0)
+    {
+      this->flushBacklog(self);
+    }
+
+    size_t ran = 0;
+    for (auto &ring : self.inbound)
+    {
+      ran += this->drain(self, *ring);
+    }
+
+    if (ran != 0)
+    {
+      idle_rounds = 0;
+    }
+    else if (++idle_rounds >= 64)
+    {
+      std::this_thread::yield();
+    }
+  }
+
+  // Drop what was not run, releasing the payloads
+  for (auto &ring : self.inbound)
+  {
+    ShardMessage *message;
+    while ((message = ring->front()) != nullptr)
+    {
+      message->payload.reset();
+      ring->pop();
+    }
+  }
+  current_shard_ = nullptr;
+}
+
+size_t ShardRuntime::drain(Shard &self, Ring &ring)
+{
+  size_t count = 0;
+  ShardMessage *message;
+  while (count < this->batch_size_ && (message = ring.front()) != nullptr)
+  {
+    message->sm->dispatch(message->event, message->payload);
+    message->payload.reset();
+    ring.pop();
+    ++count;
+    self.received.store(self.received.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_release);
+  }
+  return count;
+}
+
+void ShardRuntime::flushBacklog(Shard &self)
+{
+  for (size_t to = 0; to < self.backlog.size(); ++to)
+  {
+    std::deque<ShardMessage> &backlog = self.backlog[to];
+    Ring &ring = *this->shards_[to]->inbound[self.index];
+    while (!backlog.empty())
+    {
+      ShardMessage *message = ring.claim();
+      if (message == nullptr)
+      {
+        break;
+      }
+      ShardMessage &waiting = backlog.front();
+      message->sm = waiting.sm;
+      message->event = waiting.event;
+      message->payload.moveFrom(waiting.payload);
+      ring.publish();
+      backlog.pop_front();
+      --self.backlog_count;
+    }
+  }
+}
+
+void ShardRuntime::runTasks(Shard &self)
+{
+  std::vector<std::function<void()>> tasks;
+  {
+    std::lock_guard<std::mutex> lock(self.task_mutex);
+    tasks.swap(self.tasks);
+    self.has_tasks.store(false, std::memory_order_relaxed);
+  }
+  for (auto &task : tasks)
+  {
+    task();
+    self.received.store(self.received.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_release);
+  }
+}
+
+void ShardRuntime::pin(size_t index)
+{
+#ifdef __linux__
+  // Pin to the index-th CPU the process may run on
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+  {
+    return;
+  }
+  int count = CPU_COUNT(&allowed);
+  if (count == 0)
+  {
+    return;
+  }
+  int nth = static_cast<int>(index % count);
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+  {
+    if (CPU_ISSET(cpu, &allowed) && nth-- == 0)
+    {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      return;
+    }
+  }
+#else
+  (void)index;
+#endif
+}
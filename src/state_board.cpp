@@ -0,0 +1,171 @@
+#include "state_board.hpp"
+#include "state_machine_metrics.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+// Names like "/motors" are shared memory objects, see StateBoard
+bool isSharedMemory(const char *name)
+{
+  return name[0] == '/' && std::strchr(name + 1, '/') == nullptr;
+}
+
+int openSegment(const char *name, int flags, mode_t mode)
+{
+  if (isSharedMemory(name))
+  {
+    return ::shm_open(name, flags, mode);
+  }
+  return ::open(name, flags, mode);
+}
+
+// Attempts at reading a slot before giving up, so a writer that died
+// mid-write cannot hang a monitor
+const int READ_ATTEMPTS = 1000;
+
+uint64_t alignUp(uint64_t value)
+{
+  return (value + StateBoardHeader::ALIGNMENT - 1) &
+         ~(StateBoardHeader::ALIGNMENT - 1);
+}
+} // namespace
+
+bool StateBoard::create(const char *name, size_t capacity)
+{
+  this->close();
+  uint64_t slots_offset = alignUp(sizeof(StateBoardHeader));
+  size_t size = static_cast<size_t>(
+      slots_offset + uint64_t(capacity) * sizeof(StateBoardSlot));
+
+  int fd = openSegment(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    return false;
+  }
+  void *data = MAP_FAILED;
+  if (::ftruncate(fd, static_cast<off_t>(size)) == 0)
+  {
+    data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (data == MAP_FAILED)
+  {
+    return false;
+  }
+  this->data_ = static_cast<unsigned char *>(data);
+  this->size_ = size;
+  this->writable_ = true;
+
+  // The segment starts zeroed, so the slots are empty already
+  StateBoardHeader *header = reinterpret_cast<StateBoardHeader *>(data);
+  header->magic = StateBoardHeader::MAGIC;
+  header->version = StateBoardHeader::VERSION;
+  header->slot_size = sizeof(StateBoardSlot);
+  header->reserved = 0;
+  header->ns_per_tick = MetricsClock::nsPerTick();
+  header->capacity = capacity;
+  header->slots_offset = slots_offset;
+  header->count.store(0, std::memory_order_release);
+  return true;
+}
+
+bool StateBoard::open(const char *name)
+{
+  this->close();
+  int fd = openSegment(name, O_RDONLY, 0);
+  if (fd < 0)
+  {
+    return false;
+  }
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (::fstat(fd, &st) == 0 &&
+      static_cast<size_t>(st.st_size) >= sizeof(StateBoardHeader))
+  {
+    data = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                  MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (data == MAP_FAILED)
+  {
+    return false;
+  }
+  this->data_ = static_cast<unsigned char *>(data);
+  this->size_ = static_cast<size_t>(st.st_size);
+  this->writable_ = false;
+
+  // The slots must lie within the segment, checked without overflowing
+  const StateBoardHeader *header = this->header();
+  uint64_t size = this->size_;
+  if (header->magic != StateBoardHeader::MAGIC ||
+      header->version != StateBoardHeader::VERSION ||
+      header->slot_size != sizeof(StateBoardSlot) ||
+      header->slots_offset > size ||
+      header->capacity > (size - header->slots_offset) / sizeof(StateBoardSlot))
+  {
+    this->close();
+    return false;
+  }
+  return true;
+}
+
+void StateBoard::close()
+{
+  if (this->data_ != nullptr)
+  {
+    ::munmap(this->data_, this->size_);
+    this->data_ = nullptr;
+    this->size_ = 0;
+    this->writable_ = false;
+  }
+}
+
+bool StateBoard::unlink(const char *name)
+{
+  if (isSharedMemory(name))
+  {
+    return ::shm_unlink(name) == 0;
+  }
+  return ::unlink(name) == 0;
+}
+
+StateBoardSlot *StateBoard::attach()
+{
+  assert(this->writable_);
+  StateBoardHeader *header = reinterpret_cast<StateBoardHeader *>(this->data_);
+  uint64_t index = header->count.load(std::memory_order_relaxed);
+  do
+  {
+    if (index >= header->capacity)
+    {
+      return nullptr;
+    }
+  } while (!header->count.compare_exchange_weak(
+      index, index + 1, std::memory_order_release, std::memory_order_relaxed));
+  return this->slots() + index;
+}
+
+bool StateBoard::read(size_t index, PublishedState &out) const
+{
+  if (index >= this->size())
+  {
+    return false;
+  }
+  const StateBoardSlot &slot = this->slots()[index];
+  for (int attempt = 0; attempt < READ_ATTEMPTS; ++attempt)
+  {
+    if (slot.read(out))
+    {
+      return true;
+    }
+    std::this_thread::yield();
+  }
+  return false;
+}
@@ -0,0 +1,790 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Generates the enums, state declarations, state map and event map of
+// StateMachine classes from a state chart description, so that they are
+// written once instead of kept in sync by hand. Run by the build:
+//
+//   state_chart_gen <chart> <header> [--prune]
+//
+// A chart describes one or more machines, one statement per line, with
+// comments starting at '#':
+//
+//   machine Motor
+//     state Idle                         # first state is the initial one
+//     state Start MotorData              # payload type, NoEventData if none
+//     state Stop guard=GuardStop entry=EntryStop exit=ExitStop
+//     initial Idle                       # optional
+//     layout auto                        # auto, dense or compressed
+//     internal Stop -> Idle              # internal event raised by Stop
+//     event SetSpeed
+//       Idle -> Start                    # listed states take a transition
+//       Stop -> !                        # CANNOT_HAPPEN
+//       Start -> -                       # EVENT_IGNORED
+//       * -> Start                       # every state not listed,
+//                                        # EVENT_IGNORED without it
+//
+// For machine Motor the header defines struct MotorChart, holding the
+// Events and States enums (EV_ and ST_ followed by the names in upper
+// snake case) and INITIAL_STATE, and the macro MOTOR_CHART() placed in the
+// body of a class deriving from both StateMachine and MotorChart. State
+// actions are named ST_ followed by the name as written, so a state name
+// already in upper case, or two names with the same upper snake case, is
+// rejected as a collision:
+//
+//   class Motor : public StateMachine, public MotorChart
+//   {
+//     ...
+//   private:
+//     MOTOR_CHART()
+//   };
+//
+// The class defines the actions with STATE_DEFINE and friends.
+//
+// The event map of each machine is dense, or row-compressed when events
+// share rows and sharing them saves a quarter of the map or more. States
+// that cannot be reached from the initial state through event and
+// internal transitions are reported, and left out of the machine with
+// --prune.
+
+namespace
+{
+struct State
+{
+  std::string name;
+  std::string data;
+  std::string guard;
+  std::string entry;
+  std::string exit;
+  bool reachable;
+};
+
+const int IGNORED = -1;
+const int CANNOT_HAPPEN = -2;
+const int LISTED_IGNORED = -3; // "-" while parsing, not replaced by "*"
+
+struct Event
+{
+  std::string name;
+  std::vector<int> transitions; // per state, or IGNORED / CANNOT_HAPPEN
+  bool has_default;
+  int default_state;
+};
+
+struct Machine
+{
+  std::string name;
+  std::vector<State> states;
+  std::vector<Event> events;
+  std::vector<std::pair<int, int>> internals;
+  int initial;
+  std::string layout;
+};
+
+struct Parser
+{
+  const char *path;
+  int line;
+  std::vector<Machine> machines;
+
+  bool fail(const std::string &message) const
+  {
+    std::fprintf(stderr, "%s:%d: %s\n", this->path, this->line,
+                 message.c_str());
+    return false;
+  }
+
+  int stateId(const Machine &machine, const std::string &name) const
+  {
+    for (size_t state = 0; state < machine.states.size(); ++state)
+    {
+      if (machine.states[state].name == name)
+      {
+        return static_cast<int>(state);
+      }
+    }
+    return IGNORED;
+  }
+
+  bool parse(std::istream &in);
+  bool statement(const std::vector<std::string> &words);
+  bool transition(Machine &machine, const std::vector<std::string> &words);
+};
+
+bool validName(const std::string &name)
+{
+  if (name.empty() || !(std::isalpha(static_cast<unsigned char>(name[0])) ||
+                        name[0] == '_'))
+  {
+    return false;
+  }
+  for (char c : name)
+  {
+    if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_')
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// ChangeSpeed -> CHANGE_SPEED
+std::string upperSnake(const std::string &name)
+{
+  std::string result;
+  for (size_t i = 0; i < name.size(); ++i)
+  {
+    unsigned char c = static_cast<unsigned char>(name[i]);
+    if (i > 0 && std::isupper(c) &&
+        (std::islower(static_cast<unsigned char>(name[i - 1])) ||
+         (i + 1 < name.size() &&
+          std::islower(static_cast<unsigned char>(name[i + 1])))) &&
+        name[i - 1] != '_')
+    {
+      result += '_';
+    }
+    result += static_cast<char>(std::toupper(c));
+  }
+  return result;
+}
+
+bool Parser::parse(std::istream &in)
+{
+  std::string text;
+  this->line = 0;
+  while (std::getline(in, text))
+  {
+    ++this->line;
+    text = text.substr(0, text.find('#'));
+    std::istringstream stream(text);
+    std::vector<std::string> words;
+    std::string word;
+    while (stream >> word)
+    {
+      words.push_back(word);
+    }
+    if (!words.empty() && !this->statement(words))
+    {
+      return false;
+    }
+  }
+  if (this->machines.empty())
+  {
+    return this->fail("no machine described");
+  }
+  for (Machine &machine : this->machines)
+  {
+    if (machine.states.empty())
+    {
+      return this->fail("machine " + machine.name + " has no states");
+    }
+    for (Event &event : machine.events)
+    {
+      for (int &transition : event.transitions)
+      {
+        if (transition == IGNORED && event.has_default)
+        {
+          transition = event.default_state;
+        }
+        else if (transition == LISTED_IGNORED)
+        {
+          transition = IGNORED;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool Parser::statement(const std::vector<std::string> &words)
+{
+  const std::string &keyword = words[0];
+  if (keyword == "machine")
+  {
+    if (words.size() != 2 || !validName(words[1]))
+    {
+      return this->fail("expected: machine <name>");
+    }
+    Machine machine;
+    machine.name = words[1];
+    machine.initial = 0;
+    machine.layout = "auto";
+    this->machines.push_back(machine);
+    return true;
+  }
+  if (this->machines.empty())
+  {
+    return this->fail("'" + keyword + "' outside of a machine");
+  }
+
+  Machine &machine = this->machines.back();
+  if (keyword == "state")
+  {
+    if (words.size() < 2 || !validName(words[1]))
+    {
+      return this->fail("expected: state <name> [<data>] [guard=<name>] "
+                        "[entry=<name>] [exit=<name>]");
+    }
+    if (!machine.events.empty())
+    {
+      return this->fail("states must be listed before the events");
+    }
+    if (this->stateId(machine, words[1]) != IGNORED)
+    {
+      return this->fail("state " + words[1] + " listed twice");
+    }
+
+    // STATE_DECLARE names the action ST_<name> and the enum names the
+    // state ST_<NAME>; neither may be taken by another state or by the
+    // other of the pair
+    std::string enumerator = upperSnake(words[1]);
+    if (enumerator == words[1])
+    {
+      return this->fail("state " + words[1] + " is named ST_" + words[1] +
+                        " as both enumerator and action, give it a mixed "
+                        "case name");
+    }
+    for (const State &other : machine.states)
+    {
+      if (upperSnake(other.name) == enumerator ||
+          other.name == enumerator || upperSnake(other.name) == words[1])
+      {
+        return this->fail("states " + other.name + " and " + words[1] +
+                          " both generate ST_" +
+                          (upperSnake(other.name) == words[1] ? words[1]
+                                                              : enumerator));
+      }
+    }
+    State state;
+    state.name = words[1];
+    state.data = "NoEventData";
+    state.reachable = false;
+    for (size_t i = 2; i < words.size(); ++i)
+    {
+      size_t equals = words[i].find('=');
+      std::string key = words[i].substr(0, equals);
+      std::string value =
+          equals == std::string::npos ? "" : words[i].substr(equals + 1);
+      if (equals == std::string::npos && i == 2 && validName(key))
+      {
+        state.data = key;
+      }
+      else if (key == "guard" && validName(value))
+      {
+        state.guard = value;
+      }
+      else if (key == "entry" && validName(value))
+      {
+        state.entry = value;
+      }
+      else if (key == "exit" && validName(value))
+      {
+        state.exit = value;
+      }
+      else
+      {
+        return this->fail("unexpected '" + words[i] + "'");
+      }
+    }
+    machine.states.push_back(state);
+    return true;
+  }
+  if (keyword == "initial")
+  {
+    int state = words.size() == 2 ? this->stateId(machine, words[1]) : IGNORED;
+    if (state == IGNORED)
+    {
+      return this->fail("expected: initial <listed state>");
+    }
+    machine.initial = state;
+    return true;
+  }
+  if (keyword == "layout")
+  {
+    if (words.size() != 2 ||
+        (words[1] != "auto" && words[1] != "dense" && words[1] != "compressed"))
+    {
+      return this->fail("expected: layout auto|dense|compressed");
+    }
+    machine.layout = words[1];
+    return true;
+  }
+  if (keyword == "internal")
+  {
+    int from = words.size() == 4 ? this->stateId(machine, words[1]) : IGNORED;
+    int to = words.size() == 4 ? this->stateId(machine, words[3]) : IGNORED;
+    if (from == IGNORED || words[2] != "->" || to == IGNORED)
+    {
+      return this->fail("expected: internal <state> -> <state>");
+    }
+    if (std::find(machine.internals.begin(), machine.internals.end(),
+                  std::make_pair(from, to)) != machine.internals.end())
+    {
+      return this->fail("internal " + words[1] + " -> " + words[3] +
+                        " listed twice");
+    }
+    machine.internals.push_back(std::make_pair(from, to));
+    return true;
+  }
+  if (keyword == "event")
+  {
+    if (words.size() != 2 || !validName(words[1]))
+    {
+      return this->fail("expected: event <name>");
+    }
+    for (const Event &event : machine.events)
+    {
+      if (event.name == words[1])
+      {
+        return this->fail("event " + words[1] + " listed twice");
+      }
+    }
+    Event event;
+    event.name = words[1];
+    event.transitions.assign(machine.states.size(), IGNORED);
+    event.has_default = false;
+    event.default_state = IGNORED;
+    machine.events.push_back(event);
+    return true;
+  }
+  return this->transition(machine, words);
+}
+
+bool Parser::transition(Machine &machine, const std::vector<std::string> &words)
+{
+  if (machine.events.empty())
+  {
+    return this->fail("unknown statement '" + words[0] + "'");
+  }
+  if (words.size() != 3 || words[1] != "->")
+  {
+    return this->fail("expected: <state>|* -> <state>|!|-");
+  }
+
+  int to = words[2] == "!"   ? CANNOT_HAPPEN
+           : words[2] == "-" ? LISTED_IGNORED
+                             : this->stateId(machine, words[2]);
+  if (to == IGNORED)
+  {
+    return this->fail("unknown state " + words[2]);
+  }
+
+  Event &event = machine.events.back();
+  if (words[0] == "*")
+  {
+    if (event.has_default)
+    {
+      return this->fail("event " + event.name + " has two defaults");
+    }
+    event.has_default = true;
+    event.default_state = to == LISTED_IGNORED ? IGNORED : to;
+    return true;
+  }
+
+  int from = this->stateId(machine, words[0]);
+  if (from == IGNORED)
+  {
+    return this->fail("unknown state " + words[0]);
+  }
+  if (event.transitions[from] != IGNORED)
+  {
+    return this->fail("event " + event.name + " lists " + words[0] + " twice");
+  }
+  event.transitions[from] = to;
+  return true;
+}
+
+// Marks the states reachable from the initial state
+void markReachable(Machine &machine)
+{
+  std::vector<int> pending(1, machine.initial);
+  machine.states[machine.initial].reachable = true;
+  while (!pending.empty())
+  {
+    int from = pending.back();
+    pending.pop_back();
+
+    std::vector<int> next;
+    for (const Event &event : machine.events)
+    {
+      next.push_back(event.transitions[from]);
+    }
+    for (const std::pair<int, int> &internal : machine.internals)
+    {
+      if (internal.first == from)
+      {
+        next.push_back(internal.second);
+      }
+    }
+    for (int to : next)
+    {
+      if (to >= 0 && !machine.states[to].reachable)
+      {
+        machine.states[to].reachable = true;
+        pending.push_back(to);
+      }
+    }
+  }
+}
+
+// Drops the unreachable states, renumbering the others
+void prune(Machine &machine)
+{
+  std::vector<int> ids(machine.states.size(), IGNORED);
+  std::vector<State> states;
+  for (size_t state = 0; state < machine.states.size(); ++state)
+  {
+    if (machine.states[state].reachable)
+    {
+      ids[state] = static_cast<int>(states.size());
+      states.push_back(machine.states[state]);
+    }
+  }
+
+  for (Event &event : machine.events)
+  {
+    std::vector<int> transitions;
+    for (size_t state = 0; state < event.transitions.size(); ++state)
+    {
+      if (ids[state] != IGNORED)
+      {
+        int to = event.transitions[state];
+        transitions.push_back(to >= 0 ? ids[to] : to);
+      }
+    }
+    event.transitions = transitions;
+  }
+  machine.initial = ids[machine.initial];
+  machine.states = states;
+}
+
+std::string stateName(const Machine &machine, int state)
+{
+  if (state == IGNORED)
+  {
+    return "EVENT_IGNORED";
+  }
+  if (state == CANNOT_HAPPEN)
+  {
+    return "CANNOT_HAPPEN";
+  }
+  return "ST_" + upperSnake(machine.states[state].name);
+}
+
+std::string transitionList(const Machine &machine, const Event &event)
+{
+  std::string list;
+  for (size_t state = 0; state < event.transitions.size(); ++state)
+  {
+    list += (state > 0 ? ", " : "") + stateName(machine, event.transitions[state]);
+  }
+  return list;
+}
+
+// Lines of a macro definition, joined with aligned continuations
+class MacroWriter
+{
+public:
+  void add(const std::string &line) { this->lines_.push_back(line); }
+
+  std::string str() const
+  {
+    size_t width = 0;
+    for (const std::string &line : this->lines_)
+    {
+      width = std::max(width, line.size());
+    }
+    std::string text;
+    for (size_t i = 0; i < this->lines_.size(); ++i)
+    {
+      text += this->lines_[i];
+      if (i + 1 < this->lines_.size())
+      {
+        text += std::string(width + 1 - this->lines_[i].size(), ' ') + '\\';
+      }
+      text += '\n';
+    }
+    return text;
+  }
+
+private:
+  std::vector<std::string> lines_;
+};
+
+void writeMachine(std::ostream &out, const Machine &machine,
+                  const std::vector<std::string> &pruned)
+{
+  const std::string &name = machine.name;
+  const size_t states = machine.states.size();
+  const size_t events = machine.events.size();
+
+  // Identical rows are stored once in a compressed map
+  std::vector<std::vector<int>> rows;
+  std::vector<size_t> row_of;
+  for (const Event &event : machine.events)
+  {
+    size_t row = std::find(rows.begin(), rows.end(), event.transitions) - rows.begin();
+    if (row == rows.size())
+    {
+      rows.push_back(event.transitions);
+    }
+    row_of.push_back(row);
+  }
+
+  // Sized with one-byte state ids and two-byte row indexes
+  size_t dense_size = events * states;
+  size_t compressed_size = rows.size() * states + 2 * events;
+  bool compressed = machine.layout == "compressed" ||
+                    (machine.layout == "auto" && events > 0 &&
+                     compressed_size * 4 <= dense_size * 3);
+
+  out << "\n// " << name << ": " << states << " states, " << events
+      << " events, ";
+  if (compressed)
+  {
+    out << "compressed event map of " << rows.size() << " rows\n";
+  }
+  else
+  {
+    out << "dense event map\n";
+  }
+  if (!pruned.empty())
+  {
+    out << "// Pruned, unreachable:";
+    for (const std::string &state : pruned)
+    {
+      out << " " << state;
+    }
+    out << "\n";
+  }
+
+  out << "struct " << name << "Chart\n{\n";
+  out << "  enum Events\n  {\n";
+  for (const Event &event : machine.events)
+  {
+    out << "    EV_" << upperSnake(event.name) << ",\n";
+  }
+  out << "    EV_MAX_EVENTS\n  };\n\n";
+  out << "  enum States\n  {\n";
+  for (size_t state = 0; state < states; ++state)
+  {
+    out << "    " << stateName(machine, static_cast<int>(state)) << ",\n";
+  }
+  out << "    ST_MAX_STATES\n  };\n\n";
+  out << "  static const StateIndex INITIAL_STATE = "
+      << stateName(machine, machine.initial) << ";\n\n";
+  out << "  static_assert(static_cast<size_t>(ST_MAX_STATES) < "
+         "STATE_INDEX_EVENT_IGNORED,\n"
+         "                \"Too many states for StateIndex, see "
+         "STATE_MACHINE_STATE_INDEX_TYPE\");\n";
+  out << "};\n\n";
+
+  bool extended = false;
+  for (const State &state : machine.states)
+  {
+    extended = extended || !state.guard.empty() || !state.entry.empty() ||
+               !state.exit.empty();
+  }
+
+  MacroWriter macro;
+  macro.add("#define " + upperSnake(name) + "_CHART()");
+
+  // Actions shared by several states are declared once
+  std::set<std::string> declared;
+  for (const State &state : machine.states)
+  {
+    macro.add("  STATE_DECLARE(" + name + ", " + state.name + ", " +
+              state.data + ")");
+    if (!state.guard.empty() && declared.insert(state.guard).second)
+    {
+      macro.add("  GUARD_DECLARE(" + name + ", " + state.guard + ", " +
+                state.data + ")");
+    }
+    if (!state.entry.empty() && declared.insert(state.entry).second)
+    {
+      macro.add("  ENTRY_DECLARE(" + name + ", " + state.entry + ", " +
+                state.data + ")");
+    }
+    if (!state.exit.empty() && declared.insert(state.exit).second)
+    {
+      macro.add("  EXIT_DECLARE(" + name + ", " + state.exit + ")");
+    }
+  }
+
+  if (extended)
+  {
+    macro.add("  virtual const StateMapRow *getStateMap() { return nullptr; }");
+    macro.add("  virtual const StateMapRowEx *getStateMapEx()");
+    macro.add("  {");
+    macro.add("    static const StateMapRowEx STATE_MAP[] = {");
+    for (const State &state : machine.states)
+    {
+      macro.add("        STATE_MAP_ENTRY_ALL_EX(&" + state.name + ", " +
+                (state.guard.empty() ? "nullptr" : "&" + state.guard) + ", " +
+                (state.entry.empty() ? "nullptr" : "&" + state.entry) + ", " +
+                (state.exit.empty() ? "nullptr" : "&" + state.exit) + "),");
+    }
+  }
+  else
+  {
+    macro.add("  virtual const StateMapRowEx *getStateMapEx() { return nullptr; }");
+    macro.add("  virtual const StateMapRow *getStateMap()");
+    macro.add("  {");
+    macro.add("    static const StateMapRow STATE_MAP[]{");
+    for (const State &state : machine.states)
+    {
+      macro.add("        &" + state.name + ",");
+    }
+  }
+  macro.add("    };");
+  macro.add("    static_assert(");
+  macro.add(std::string("        (sizeof(STATE_MAP) / sizeof(") +
+            (extended ? "StateMapRowEx" : "StateMapRow") +
+            ")) == ST_MAX_STATES,");
+  macro.add("        \"Invalid size of STATE_MAP\");");
+  macro.add("    return &STATE_MAP[0];");
+  macro.add("  }");
+
+  if (compressed)
+  {
+    // Rows are checked like EVENT_MAP_ENTRY rows, and the row indexes and
+    // names against the Events enum
+    macro.add("  virtual const EventTable *getEventTable()");
+    macro.add("  {");
+    macro.add("    static constexpr EventMapRow<ST_MAX_STATES> "
+              "EVENT_MAP_ROWS[] = {");
+    for (size_t row = 0; row < rows.size(); ++row)
+    {
+      Event shared;
+      shared.transitions = rows[row];
+      macro.add("        makeEventMapRow<ST_MAX_STATES>(" +
+                std::to_string(row) + ", nullptr, " +
+                transitionList(machine, shared) + "),");
+    }
+    macro.add("    };");
+    std::string indexes;
+    std::string names;
+    for (size_t event = 0; event < events; ++event)
+    {
+      indexes += (event > 0 ? ", " : "") + std::to_string(row_of[event]);
+      names += std::string(event > 0 ? ", " : "") + "\"EV_" +
+               upperSnake(machine.events[event].name) + "\"";
+    }
+    macro.add("    static constexpr uint16_t EVENT_MAP_ROW_OF[] = {" + indexes +
+              "};");
+    macro.add("    static constexpr const char *EVENT_MAP_NAMES[] = {" +
+              names + "};");
+    macro.add("    static_assert(");
+    macro.add("        (sizeof(EVENT_MAP_ROW_OF) / sizeof(EVENT_MAP_ROW_OF[0])) "
+              "== EV_MAX_EVENTS &&");
+    macro.add("            (sizeof(EVENT_MAP_NAMES) / sizeof(EVENT_MAP_NAMES[0])) "
+              "== EV_MAX_EVENTS,");
+    macro.add("        \"Invalid size of EVENT_MAP\");");
+    macro.add("    static constexpr auto EVENT_MAP = makeCompressedEventMap(");
+    macro.add("        EVENT_MAP_ROWS, EVENT_MAP_ROW_OF, EVENT_MAP_NAMES);");
+    macro.add("    static const EventTable EVENT_TABLE(EVENT_MAP);");
+    macro.add("    return &EVENT_TABLE;");
+    macro.add("  }");
+  }
+  else
+  {
+    macro.add("  BEGIN_EVENT_MAP()");
+    for (const Event &event : machine.events)
+    {
+      macro.add("    EVENT_MAP_ENTRY(EV_" + upperSnake(event.name) + ", " +
+                transitionList(machine, event) + ")");
+    }
+    macro.add("  END_EVENT_MAP()");
+  }
+
+  out << "// Declarations, state map and event map of " << name
+      << ", placed in its class\n";
+  out << macro.str();
+}
+
+int usage(const char *program)
+{
+  std::fprintf(stderr, "usage: %s <chart> <header> [--prune]\n", program);
+  return EXIT_FAILURE;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+  if (argc < 3 || argc > 4)
+  {
+    return usage(argv[0]);
+  }
+  bool prune_states = false;
+  if (argc == 4)
+  {
+    if (std::strcmp(argv[3], "--prune") != 0)
+    {
+      return usage(argv[0]);
+    }
+    prune_states = true;
+  }
+
+  Parser parser;
+  parser.path = argv[1];
+  std::ifstream in(parser.path);
+  if (!in)
+  {
+    std::fprintf(stderr, "cannot open %s\n", parser.path);
+    return EXIT_FAILURE;
+  }
+  if (!parser.parse(in))
+  {
+    return EXIT_FAILURE;
+  }
+
+  std::string source = parser.path;
+  source = source.substr(source.find_last_of("/\\") + 1);
+
+  std::ostringstream out;
+  out << "// Generated by state_chart_gen from " << source
+      << ", do not edit.\n";
+  out << "#pragma once\n\n#include \"state_machine.hpp\"\n";
+  for (Machine &machine : parser.machines)
+  {
+    markReachable(machine);
+    std::vector<std::string> unreachable;
+    for (const State &state : machine.states)
+    {
+      if (!state.reachable)
+      {
+        unreachable.push_back(state.name);
+        std::fprintf(stderr, "%s: %s: state %s is unreachable%s\n",
+                     parser.path, machine.name.c_str(), state.name.c_str(),
+                     prune_states ? ", pruned" : "");
+      }
+    }
+    if (prune_states)
+    {
+      prune(machine);
+    }
+    else
+    {
+      unreachable.clear();
+    }
+    writeMachine(out, machine, unreachable);
+  }
+
+  std::ofstream header(argv[2]);
+  header << out.str();
+  header.close();
+  if (!header)
+  {
+    std::fprintf(stderr, "cannot write %s\n", argv[2]);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,47 @@
+#include "state_hierarchy.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+StateHierarchy::StateHierarchy(const StateIndex *parents, size_t size)
+    : size_(size),
+      depths_(new StateIndex[size]),
+      offsets_(new size_t[size])
+{
+  assert(size < STATE_INDEX_EVENT_IGNORED);
+
+  size_t total = 0;
+  for (size_t state = 0; state < size; ++state)
+  {
+    // Parents must be states of the machine, without cycles: a chain of
+    // ancestors longer than the machine has states has a cycle in it
+    size_t depth = 0;
+    for (StateIndex parent = parents[state]; parent != NO_PARENT;
+         parent = parents[parent])
+    {
+      if (parent >= size || ++depth >= size)
+      {
+        std::fprintf(stderr,
+                     "StateHierarchy: state %zu has %s\n", state,
+                     parent >= size ? "a parent outside the machine"
+                                    : "a cycle among its ancestors");
+        std::abort();
+      }
+    }
+    this->depths_[state] = static_cast<StateIndex>(depth);
+    this->offsets_[state] = total;
+    total += depth + 1;
+  }
+
+  this->paths_.reset(new StateIndex[total]);
+  for (size_t state = 0; state < size; ++state)
+  {
+    StateIndex *path = &this->paths_[this->offsets_[state]];
+    StateIndex ancestor = static_cast<StateIndex>(state);
+    for (size_t depth = this->depths_[state] + size_t(1); depth-- > 0;)
+    {
+      path[depth] = ancestor;
+      ancestor = parents[ancestor];
+    }
+  }
+}
@@ -0,0 +1,371 @@
+#include "state_log.hpp"
+
+#include <chrono>
+#include <cstdarg>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+namespace
+{
+const char *const LEVEL_NAMES[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+// Formatted lines are written out once this much is pending
+const size_t OUTPUT_SIZE = 64 * 1024;
+
+// Longest formatted line, longer ones are cut
+const size_t LINE_SIZE = 1024;
+
+FILE *output = nullptr;
+std::thread thread;
+uint64_t start_ticks = 0;
+double ns_per_tick = 1.0;
+
+// flush() asks for a pass with flush_request_, the logging thread answers
+// with flush_done_ once it has found every buffer empty since
+std::atomic<uint64_t> flush_request(0);
+std::atomic<uint64_t> flush_done(0);
+
+// Lines being formatted by the logging thread
+char pending[OUTPUT_SIZE];
+size_t pending_size = 0;
+
+void writePending()
+{
+  if (pending_size > 0)
+  {
+    std::fwrite(pending, 1, pending_size, output);
+    pending_size = 0;
+  }
+}
+
+// Append to line at *size, cutting at LINE_SIZE - 1
+void appendFormatted(char *line, size_t *size, const char *spec, ...)
+{
+  va_list args;
+  va_start(args, spec);
+  int length = std::vsnprintf(line + *size, LINE_SIZE - *size, spec, args);
+  va_end(args);
+  if (length > 0)
+  {
+    *size += static_cast<size_t>(length);
+    if (*size > LINE_SIZE - 1)
+    {
+      *size = LINE_SIZE - 1;
+    }
+  }
+}
+
+// Argument index of record as an int, for a * width or precision
+bool starArg(const LogRecord &record, size_t index, int *value)
+{
+  if (index >= record.count)
+  {
+    return false;
+  }
+  const LogRecord::Arg &arg = record.args[index];
+  switch (record.types[index])
+  {
+  case LogRecord::INT:
+    *value = static_cast<int>(arg.i);
+    return true;
+  case LogRecord::UINT:
+    *value = static_cast<int>(arg.u);
+    return true;
+  default:
+    return false;
+  }
+}
+
+// One conversion of the record's format, at most "%-+ #0" flags, width,
+// precision, a length modifier and the conversion, rewritten for the
+// type the argument was stored as. A * width or precision is replaced by
+// the argument at *index, taken before the converted one.
+void formatArg(char *line, size_t *size, const char *spec, size_t length,
+               const LogRecord &record, size_t *index)
+{
+  char conversion = spec[length - 1];
+
+  // Drop the length modifier, each case below supplies its own
+  char base[48];
+  size_t base_length = 0;
+  for (size_t i = 0; i + 1 < length && base_length < sizeof(base) - 16; ++i)
+  {
+    if (spec[i] == '*')
+    {
+      int value;
+      if (!starArg(record, (*index)++, &value))
+      {
+        appendFormatted(line, size, "%s", "(?)");
+        return;
+      }
+      if (value < 0 && base[base_length - 1] == '.')
+      {
+        // A negative precision is taken as if it were omitted
+        --base_length;
+        continue;
+      }
+      base_length += static_cast<size_t>(std::snprintf(
+          base + base_length, sizeof(base) - base_length, "%d", value));
+    }
+    else if (std::strchr("hljztL", spec[i]) == nullptr)
+    {
+      base[base_length++] = spec[i];
+    }
+  }
+
+  if (*index >= record.count)
+  {
+    appendFormatted(line, size, "%s", "(missing)");
+    return;
+  }
+
+  LogRecord::ArgType type =
+      static_cast<LogRecord::ArgType>(record.types[*index]);
+  const LogRecord::Arg &arg = record.args[*index];
+  ++*index;
+  switch (conversion)
+  {
+  case 'd':
+  case 'i':
+  case 'o':
+  case 'u':
+  case 'x':
+  case 'X':
+  case 'c':
+  {
+    long long value = type == LogRecord::INT      ? arg.i
+                      : type == LogRecord::DOUBLE ? static_cast<long long>(arg.d)
+                                                  : static_cast<long long>(arg.u);
+    if (conversion == 'c')
+    {
+      base[base_length++] = 'c';
+      base[base_length] = '\0';
+      appendFormatted(line, size, base, static_cast<int>(value));
+      return;
+    }
+    base[base_length++] = 'l';
+    base[base_length++] = 'l';
+    base[base_length++] = conversion;
+    base[base_length] = '\0';
+    appendFormatted(line, size, base, value);
+    return;
+  }
+  case 'e':
+  case 'E':
+  case 'f':
+  case 'F':
+  case 'g':
+  case 'G':
+  case 'a':
+  case 'A':
+  {
+    double value = type == LogRecord::DOUBLE ? arg.d
+                   : type == LogRecord::INT  ? static_cast<double>(arg.i)
+                                             : static_cast<double>(arg.u);
+    base[base_length++] = conversion;
+    base[base_length] = '\0';
+    appendFormatted(line, size, base, value);
+    return;
+  }
+  case 's':
+    base[base_length++] = 's';
+    base[base_length] = '\0';
+    appendFormatted(line, size, base,
+                    type == LogRecord::STRING ? record.text + arg.u : "(?)");
+    return;
+  case 'p':
+    appendFormatted(line, size, "%p", arg.p);
+    return;
+  default:
+    appendFormatted(line, size, "%s", "(?)");
+    return;
+  }
+}
+
+void formatRecord(const LogRecord &record)
+{
+  char line[LINE_SIZE];
+  size_t size = 0;
+  double seconds =
+      static_cast<double>(static_cast<int64_t>(record.timestamp - start_ticks)) *
+      ns_per_tick * 1e-9;
+  appendFormatted(line, &size, "[%12.6f] %s ", seconds,
+                  LEVEL_NAMES[record.level & 3]);
+
+  size_t index = 0;
+  const char *format = record.format;
+  while (*format != '\0' && size < LINE_SIZE - 1)
+  {
+    if (*format != '%')
+    {
+      line[size++] = *format++;
+      continue;
+    }
+    if (format[1] == '%')
+    {
+      line[size++] = '%';
+      format += 2;
+      continue;
+    }
+
+    // Spec up to and including the conversion character
+    size_t length = 1;
+    while (format[length] != '\0' &&
+           std::strchr("diouxXcsfFeEgGaAp", format[length]) == nullptr)
+    {
+      ++length;
+    }
+    if (format[length] == '\0')
+    {
+      break;
+    }
+    ++length;
+    formatArg(line, &size, format, length, record, &index);
+    format += length;
+  }
+  line[size++] = '\n';
+
+  if (pending_size + size > OUTPUT_SIZE)
+  {
+    writePending();
+  }
+  std::memcpy(pending + pending_size, line, size);
+  pending_size += size;
+}
+} // namespace
+
+std::atomic<StateLog::Buffer *> StateLog::buffers_(nullptr);
+std::atomic<bool> StateLog::running_(false);
+
+StateLog::Buffer *StateLog::acquireBuffer()
+{
+  // Take over the buffer of a thread that has exited
+  for (Buffer *buffer = buffers_.load(std::memory_order_acquire);
+       buffer != nullptr; buffer = buffer->next)
+  {
+    bool in_use = false;
+    if (!buffer->in_use.load(std::memory_order_relaxed) &&
+        buffer->in_use.compare_exchange_strong(
+            in_use, true, std::memory_order_acquire,
+            std::memory_order_relaxed))
+    {
+      return buffer;
+    }
+  }
+
+  Buffer *buffer = new Buffer();
+  Buffer *next = buffers_.load(std::memory_order_relaxed);
+  do
+  {
+    buffer->next = next;
+  } while (!buffers_.compare_exchange_weak(
+      next, buffer, std::memory_order_release, std::memory_order_relaxed));
+  return buffer;
+}
+
+void StateLog::start(FILE *out)
+{
+  if (running())
+  {
+    return;
+  }
+  output = out;
+  ns_per_tick = MetricsClock::nsPerTick();
+  start_ticks = MetricsClock::now();
+  running_.store(true, std::memory_order_release);
+  thread = std::thread(run);
+}
+
+void StateLog::stop()
+{
+  if (!running())
+  {
+    return;
+  }
+  running_.store(false, std::memory_order_release);
+  thread.join();
+}
+
+void StateLog::flush()
+{
+  if (!running())
+  {
+    return;
+  }
+  uint64_t request = flush_request.fetch_add(1, std::memory_order_acq_rel) + 1;
+  while (flush_done.load(std::memory_order_acquire) < request &&
+         running())
+  {
+    std::this_thread::yield();
+  }
+}
+
+void StateLog::run()
+{
+  // Drop counts already reported, per buffer in list order
+  std::vector<uint64_t> reported;
+
+  for (;;)
+  {
+    // Loaded before the pass, so the pass sees every record logged
+    // before the request
+    uint64_t request = flush_request.load(std::memory_order_acquire);
+    bool stopping = !running();
+
+    size_t count = 0;
+    size_t index = 0;
+    Buffer *first = buffers_.load(std::memory_order_acquire);
+    size_t buffers = 0;
+    for (Buffer *buffer = first; buffer != nullptr; buffer = buffer->next)
+    {
+      ++buffers;
+    }
+    if (reported.size() < buffers)
+    {
+      // New buffers are added at the front
+      reported.insert(reported.begin(), buffers - reported.size(), 0);
+    }
+
+    for (Buffer *buffer = first; buffer != nullptr; buffer = buffer->next)
+    {
+      LogRecord *record;
+      while ((record = buffer->ring.front()) != nullptr)
+      {
+        formatRecord(*record);
+        buffer->ring.pop();
+        ++count;
+      }
+
+      uint64_t dropped = buffer->dropped.load(std::memory_order_relaxed);
+      if (dropped != reported[index])
+      {
+        char line[LINE_SIZE];
+        size_t size = 0;
+        appendFormatted(line, &size, "[%12s] WARN  %" PRIu64
+                                     " log records dropped, buffer full\n",
+                        "", dropped - reported[index]);
+        if (pending_size + size > OUTPUT_SIZE)
+        {
+          writePending();
+        }
+        std::memcpy(pending + pending_size, line, size);
+        pending_size += size;
+        reported[index] = dropped;
+      }
+      ++index;
+    }
+
+    if (count == 0)
+    {
+      writePending();
+      std::fflush(output);
+      flush_done.store(request, std::memory_order_release);
+      if (stopping)
+      {
+        return;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+  }
+}
@@ -1,170 +1,594 @@
 #include "state_machine.hpp"
+#include "event_pool.hpp"
+#include "state_engine.hpp"
+#include "timer_wheel.hpp"
 #include <cinttypes>
 #include <cassert>
+#include <chrono>
+#include <thread>
+
+static uint64_t budgetNow()
+{
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+void *QueuedEvent::operator new(size_t size)
+{
+  assert(size == sizeof(QueuedEvent));
+  (void)size;
+  return BlockPool<QueuedEvent>::allocate();
+}
+
+void QueuedEvent::operator delete(void *ptr)
+{
+  if (ptr != nullptr)
+  {
+    BlockPool<QueuedEvent>::deallocate(ptr);
+  }
+}
+
+static void moveEventData(QueuedEvent &from, QueuedEvent &to)
+{
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+  to.event = from.event;
+#endif
+  to.data.moveFrom(from.data);
+}
+
+// Move the event at the front of from to the back of to. Returns false,
+// leaving both rings as they were, if to is full.
+static bool moveEvent(EventRing &from, EventRing &to)
+{
+  QueuedEvent &event = from.front();
+  QueuedEvent *moved = to.push(event.transitions, event.size, event.state);
+  if (moved == nullptr)
+  {
+    return false;
+  }
+  moveEventData(event, *moved);
+  from.pop();
+  return true;
+}
 
 StateMachine::StateMachine(
     size_t max_states,
-    uint8_t initial_state)
-    : max_states_(max_states),
+    StateIndex initial_state)
+    : engine_events_(nullptr),
+#ifdef STATE_MACHINE_ENABLE_METRICS
+      metrics_(nullptr),
+#endif
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+      recorder_id_(FlightRecorder::nextMachineId()),
+      recorder_event_(FlightRecord::NO_EVENT),
+#endif
+#ifdef STATE_MACHINE_ENABLE_STATE_BOARD
+      board_slot_(nullptr),
+#endif
+#ifdef STATE_MACHINE_ENABLE_COROUTINES
+      waiters_(nullptr),
+#endif
+      max_states_(static_cast<StateIndex>(max_states)),
       current_state_(initial_state),
-      new_state_(false),
-      event_generated_(false),
-      event_data_ptr(nullptr)
+      new_state_(0),
+      event_generated_(false)
 {
-  assert(max_states_ < EVENT_IGNORED);
+  assert(max_states < EVENT_IGNORED);
 }
 
-void StateMachine::externalEvent(
-    uint8_t new_state,
+StateMachine::~StateMachine()
+{
+#ifdef STATE_MACHINE_ENABLE_COROUTINES
+  // Coroutines must not outlive the machines they wait on
+  assert(this->waiters_ == nullptr);
+#endif
+  if (this->event_queue_ != nullptr)
+  {
+    // Nothing may be posted once the machine is being destroyed
+    assert(this->event_queue_->pending.load() == 0);
+    MpscNode *node;
+    while ((node = this->event_queue_->queue.pop()) != nullptr)
+    {
+      delete static_cast<QueuedEvent *>(node);
+    }
+  }
+}
+
+void StateMachine::enableEventQueue(EventScheduler *scheduler)
+{
+  if (this->event_queue_ == nullptr ||
+      this->event_queue_->scheduler != scheduler)
+  {
+    // Moving to another scheduler is only allowed while idle
+    assert(this->event_queue_ == nullptr ||
+           this->event_queue_->pending.load() == 0);
+    this->event_queue_.reset(new EventQueue(this, scheduler));
+  }
+}
+
+bool StateMachine::externalEvent(
+    StateIndex new_state,
     std::shared_ptr<const EventData> data_ptr)
 {
-  if (new_state != EVENT_IGNORED)
+  return this->generateEvent(nullptr, 0, new_state, std::move(data_ptr));
+}
+
+void StateMachine::postEvent(QueuedEvent *event)
+{
+  EventQueue &queue = *this->event_queue_;
+  queue.queue.push(event);
+
+  // Whoever takes pending from zero drains the queue, or hands the machine
+  // to the scheduler; everyone else returns immediately.
+  if (queue.pending.fetch_add(1, std::memory_order_acq_rel) != 0)
+  {
+    return;
+  }
+
+  if (queue.scheduler != nullptr)
+  {
+    queue.scheduler->schedule(this);
+    return;
+  }
+
+  while (this->runEvents(SIZE_MAX))
   {
-    // TODO - capture software lock here for thread-safety if necessary
+  }
+}
 
-    // Generate the event
-    this->internalEvent(new_state, data_ptr);
+bool StateMachine::runEvents(size_t max_events)
+{
+  EventQueue &queue = *this->event_queue_;
 
-    // Execute the state engine. This function call will only return
-    // when all state machine events are processed.
-    this->stateEngine();
+  // A suspended engine keeps one count of pending, so that the machine
+  // stays owned until it has finished
+  size_t held = 0;
+  if (this->isEnginePending())
+  {
+    held = 1;
+    if (this->resumeEngine())
+    {
+      return true;
+    }
+  }
 
-    // TODO - release software lock here
+  // Only events already counted are taken, so pending can't drop below
+  // zero and ownership is released exactly when it reaches zero.
+  size_t count = queue.pending.load(std::memory_order_acquire) - held;
+  if (count > max_events)
+  {
+    count = max_events;
   }
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    MpscNode *node;
+    while ((node = queue.queue.pop()) == nullptr)
+    {
+      // A producer has claimed a slot but not linked it in yet
+      std::this_thread::yield();
+    }
+    this->dispatchEvent(static_cast<QueuedEvent *>(node));
+    if (this->isEnginePending())
+    {
+      // Out of budget: hold one count for the engine and yield
+      queue.pending.fetch_sub(i + held, std::memory_order_acq_rel);
+      return true;
+    }
+  }
+
+  count += held;
+  return queue.pending.fetch_sub(count, std::memory_order_acq_rel) != count;
 }
 
-void StateMachine::internalEvent(
-    uint8_t new_state,
+void StateMachine::dispatchEvent(QueuedEvent *event)
+{
+  StateIndex new_state = this->lookupTransition(
+      event->transitions, event->size, event->state);
+  this->recordEventMetrics(new_state);
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+  this->recordEvent(event->event, new_state);
+#endif
+  if (new_state != EVENT_IGNORED)
+  {
+    this->event_generated_ = true;
+    this->new_state_ = new_state;
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+    uint16_t event_id = event->event;
+#else
+    uint16_t event_id = 0;
+#endif
+    this->stateEngine(
+        event->transitions, event->size, event->state, event_id, event->data);
+  }
+  delete event;
+}
+
+bool StateMachine::internalEvent(
+    StateIndex new_state,
     std::shared_ptr<const EventData> data_ptr)
 {
-  if (data_ptr == nullptr)
+  // A null payload is left empty and delivered as noEventData()
+  return this->queueInternalEvent(new_state, std::move(data_ptr));
+}
+
+bool StateMachine::deferEvent()
+{
+  // Only the actions run by an engine have an event to defer
+  assert(this->engine_events_ != nullptr);
+  assert(this->engine_events_->deferred != nullptr);
+
+  // Queued once the step is done. Replaying makes room before that, so a
+  // ring with room now still has room then.
+  if (this->engine_events_->deferred->full())
+  {
+    return false;
+  }
+  this->engine_events_->defer = true;
+  return true;
+}
+
+EventRing &StateMachine::internalEvents()
+{
+  // Internal events may only be generated by the engine's actions
+  assert(this->engine_events_ != nullptr);
+  return this->engine_events_->internal;
+}
+
+EventRing &StateMachine::externalEvents()
+{
+  assert(this->engine_events_ != nullptr);
+  return this->engine_events_->external;
+}
+
+void StateMachine::stateEngine(
+    const StateIndex *transitions,
+    size_t size,
+    StateIndex state,
+    uint16_t event_id,
+    EventPayload &data,
+    MapEngine)
+{
+  // The machine's own events are queued rather than run recursively, so
+  // one engine at a time runs per machine
+  assert(this->engine_events_ == nullptr);
+  EngineEvents events(this->getDeferredEvents(), this->getStateTimers(),
+                      this->getEngineBudget());
+  this->startEngine(events, transitions, size, state, event_id);
+  this->runEngine(events, data);
+}
+
+void StateMachine::startEngine(
+    EngineEvents &events,
+    const StateIndex *transitions,
+    size_t size,
+    StateIndex state,
+    uint16_t event_id)
+{
+  events.transitions = transitions;
+  events.size = size;
+  events.state = state;
+  events.event_id = event_id;
+  this->startBudget(events);
+}
+
+bool StateMachine::resumeEngine()
+{
+  assert(this->engine_events_ == nullptr);
+  if (!this->event_generated_)
   {
-    data_ptr = std::make_shared<NoEventData>();
+    return false;
   }
 
-  this->event_data_ptr = data_ptr;
-  event_generated_ = true;
-  this->new_state_ = new_state;
+  EngineEvents events(this->getDeferredEvents(), this->getStateTimers(),
+                      this->getEngineBudget());
+  this->startBudget(events);
+
+  // Internal events go back to the front, the external ones are taken
+  // from the budget before any sent from now on
+  EngineBudget &budget = *events.budget;
+  for (; budget.internal_count_ > 0; --budget.internal_count_)
+  {
+    // They came from an internal queue, so they fit one
+    bool moved = moveEvent(budget.events_, events.internal);
+    assert(moved);
+    (void)moved;
+  }
+
+  EventPayload data;
+  this->event_generated_ = false;
+  this->loadEvent(events, data);
+  this->runEngine(events, data);
+  return this->event_generated_;
 }
 
-void StateMachine::stateEngine(void)
+void StateMachine::runEngine(EngineEvents &events, EventPayload &data)
 {
+  this->engine_events_ = &events;
+
   const StateMapRow *state_map_ptr = this->getStateMap();
   if (state_map_ptr != nullptr)
   {
-    this->stateEngine(state_map_ptr);
+    this->stateEngine(MapActions(state_map_ptr), data);
   }
   else
   {
     const StateMapRowEx *state_map_ex_ptr = this->getStateMapEx();
     if (state_map_ex_ptr != nullptr)
     {
-      this->stateEngine(state_map_ex_ptr);
+      this->stateEngine(MapActionsEx(state_map_ex_ptr),
+                        this->getStateHierarchy(), data);
     }
     else
     {
       assert(false);
     }
   }
+
+  this->stopEngine(events);
 }
 
-void StateMachine::stateEngine(
-    const StateMapRow *const state_map_ptr)
+void StateMachine::stopEngine(EngineEvents &events)
 {
-  auto data_ptr_tmp = std::make_shared<const EventData>();
-  while (this->event_generated_)
+  this->engine_events_ = nullptr;
+
+  // Left set while the budget holds events, see isEnginePending()
+  this->event_generated_ =
+      events.budget != nullptr && !events.budget->events_.empty();
+  this->resumeWaiters();
+}
+
+void StateMachine::startBudget(EngineEvents &events)
+{
+  events.steps = 0;
+  events.deadline = 0;
+  if (events.budget != nullptr && events.budget->max_nanoseconds_ != 0)
   {
-    assert(this->new_state_ < this->max_states_);
-    const StateBase *state = state_map_ptr[this->new_state_].state;
-    data_ptr_tmp = this->event_data_ptr;
-    this->event_data_ptr.reset();
-    this->event_generated_ = false;
-    this->setCurrentState(this->new_state_);
+    events.deadline = budgetNow() + events.budget->max_nanoseconds_;
+  }
+}
 
-    assert(state != nullptr);
-    state->invokeStateAction(
-        this,
-        data_ptr_tmp);
+bool StateMachine::budgetSpent(EngineEvents &events)
+{
+  const EngineBudget &budget = *events.budget;
+  ++events.steps;
+  return (budget.max_steps_ != 0 && events.steps >= budget.max_steps_) ||
+         (events.deadline != 0 && budgetNow() >= events.deadline);
+}
 
-    // If event data was used, then delete it
-    if (data_ptr_tmp)
+void StateMachine::suspendEngine(EngineEvents &events)
+{
+  // Internal events first, then the external events left by an earlier
+  // run, then those sent during this one. The internal events always
+  // fit; the newest external events that do not are dropped and counted.
+  EngineBudget &budget = *events.budget;
+  EventRing &pending = budget.events_;
+  EventRing &internal = events.internal;
+  while (pending.size() + internal.size() > pending.capacity())
+  {
+    pending.popBack();
+    ++budget.dropped_;
+  }
+  budget.internal_count_ = internal.size();
+  for (size_t i = internal.size(); i > 0; --i)
+  {
+    QueuedEvent &event = internal[i - 1];
+    QueuedEvent *moved =
+        pending.pushFront(event.transitions, event.size, event.state);
+    moveEventData(event, *moved);
+  }
+  internal.clear();
+  while (!events.external.empty())
+  {
+    if (!moveEvent(events.external, pending))
     {
-      data_ptr_tmp.reset();
+      events.external.pop();
+      ++budget.dropped_;
     }
   }
 }
 
-void StateMachine::stateEngine(
-    const StateMapRowEx *const state_map_ex_ptr)
+void StateMachine::nextEvent(StateIndex previous_state, EventPayload &data)
+{
+  EngineEvents &events = *this->engine_events_;
+  EventRing *deferred = events.deferred;
+
+  // Events deferred before this step are replayed once it changed state,
+  // in the order they were deferred and after the internal events. Those
+  // that do not fit the external queue stay at the front of the deferred
+  // ring and are replayed after the next change of state.
+  if (this->current_state_ != previous_state && deferred != nullptr)
+  {
+    while (!deferred->empty() && !events.external.full())
+    {
+      QueuedEvent &event = deferred->front();
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+      uint16_t event_id = event.event;
+#else
+      uint16_t event_id = 0;
+#endif
+      QueuedEvent *replay = queueEvent(events.external, event.transitions,
+                                       event.size, event.state, event_id);
+      replay->data.moveFrom(event.data);
+      deferred->pop();
+    }
+  }
+
+  if (events.defer)
+  {
+    events.defer = false;
+    // deferEvent() checked for room
+    QueuedEvent *event = queueEvent(*deferred, events.transitions,
+                                    events.size, events.state, events.event_id);
+    event->data.moveFrom(data);
+  }
+
+  if (events.budget != nullptr && this->budgetSpent(events) &&
+      (!events.internal.empty() || !events.external.empty() ||
+       !events.budget->events_.empty()))
+  {
+    this->suspendEngine(events);
+    data.reset();
+    return;
+  }
+
+  this->loadEvent(events, data);
+}
+
+void StateMachine::loadEvent(EngineEvents &events, EventPayload &data)
 {
-  auto data_ptr_tmp = std::make_shared<const EventData>();
+  if (!events.internal.empty())
+  {
+    QueuedEvent &event = events.internal.front();
+    this->event_generated_ = true;
+    this->new_state_ = event.state;
+    data.moveFrom(event.data);
+    events.transitions = nullptr;
+    events.size = 0;
+    events.state = event.state;
+    events.event_id = 0;
+    events.internal.pop();
+    return;
+  }
 
-  // While events are being generated keep executing states
-  while (this->event_generated_)
+  // Events left by a suspended run are older than any sent since
+  if ((events.budget != nullptr &&
+       this->loadExternalEvent(events, events.budget->events_, data)) ||
+      this->loadExternalEvent(events, events.external, data))
   {
-    // Error check that the new state is valid before proceeding
-    assert(this->new_state_ < this->max_states_);
+    return;
+  }
 
-    // Get the pointers from the state map
-    const StateBase *state = state_map_ex_ptr[this->new_state_].state;
-    const GuardBase *guard = state_map_ex_ptr[this->new_state_].guard;
-    const EntryBase *entry = state_map_ex_ptr[this->new_state_].entry;
-    const ExitBase *exit = state_map_ex_ptr[this->current_state_].exit;
+  // Delete the used event data
+  data.reset();
+}
 
-    // Copy of event data pointer
-    data_ptr_tmp = this->event_data_ptr;
+bool StateMachine::loadExternalEvent(
+    EngineEvents &events,
+    EventRing &ring,
+    EventPayload &data)
+{
+  while (!ring.empty())
+  {
+    QueuedEvent &event = ring.front();
+    StateIndex new_state =
+        this->lookupTransition(event.transitions, event.size, event.state);
+    this->recordEventMetrics(new_state);
+#ifdef STATE_MACHINE_ENABLE_FLIGHT_RECORDER
+    this->recordEvent(event.event, new_state);
+    events.event_id = event.event;
+#endif
+    if (new_state != EVENT_IGNORED)
+    {
+      this->event_generated_ = true;
+      this->new_state_ = new_state;
+      data.moveFrom(event.data);
+      events.transitions = event.transitions;
+      events.size = event.size;
+      events.state = event.state;
+      ring.pop();
+      return true;
+    }
+    ring.pop();
+  }
+  return false;
+}
 
-    // Event data used up, reset the pointer
-    this->event_data_ptr.reset();
+void StateMachine::exitStateTimers(StateIndex state)
+{
+  StateTimers *timers = this->engine_events_->timers;
+  if (timers != nullptr && timers->size() != 0)
+  {
+    timers->exitState(state);
+  }
+}
+
+#ifdef STATE_MACHINE_ENABLE_COROUTINES
+StateAwaiter::StateAwaiter(StateMachine &sm, StateIndex state, bool ready)
+    : sm_(sm),
+      next_(nullptr),
+      transition_{sm.getCurrentState(), sm.getCurrentState()},
+      state_(state),
+      ready_(ready),
+      linked_(false),
+      fired_(false)
+{
+}
 
-    // Event used up, reset the flag
-    this->event_generated_ = false;
+StateAwaiter::~StateAwaiter()
+{
+  // The coroutine was destroyed while suspended
+  if (this->linked_)
+  {
+    this->sm_.removeWaiter(this);
+  }
+}
 
-    // Execute the guard condition
-    bool guard_result = true;
-    if (guard != nullptr)
+void StateAwaiter::await_suspend(std::coroutine_handle<> handle) noexcept
+{
+  this->handle_ = handle;
+  this->sm_.addWaiter(this);
+}
+
+void StateMachine::addWaiter(StateAwaiter *waiter)
+{
+  StateAwaiter **link = &this->waiters_;
+  while (*link != nullptr)
+  {
+    link = &(*link)->next_;
+  }
+  *link = waiter;
+  waiter->next_ = nullptr;
+  waiter->linked_ = true;
+}
+
+void StateMachine::removeWaiter(StateAwaiter *waiter)
+{
+  for (StateAwaiter **link = &this->waiters_; *link != nullptr;
+       link = &(*link)->next_)
+  {
+    if (*link == waiter)
     {
-      guard_result = guard->invokeGuardCondition(
-          this,
-          data_ptr_tmp);
+      *link = waiter->next_;
+      waiter->linked_ = false;
+      return;
     }
+  }
+}
 
-    // If the guard condition succeeds
-    if (guard_result == true)
+void StateMachine::fireWaiters(StateIndex from, StateIndex to)
+{
+  for (StateAwaiter *waiter = this->waiters_; waiter != nullptr;
+       waiter = waiter->next_)
+  {
+    if (!waiter->fired_ &&
+        (waiter->state_ == StateAwaiter::ANY_STATE || waiter->state_ == to))
     {
-      // Transitioning to a new state?
-      if (this->new_state_ != this->current_state_)
-      {
-        // Execute the state exit action on current state before switching to new state
-        if (exit != nullptr)
-        {
-          exit->invokeExitAction(this);
-        }
-
-        // Execute the state entry action on the new state
-        if (entry != nullptr)
-        {
-          entry->invokeEntryAction(this, data_ptr_tmp);
-        }
-
-        // Ensure exit/entry actions didn't call InternalEvent by accident
-        assert(this->event_generated_ == false);
-      }
-
-      // Switch to the new current state
-      this->setCurrentState(this->new_state_);
-
-      // Execute the state action passing in event data
-      assert(state != nullptr);
-      state->invokeStateAction(
-          this,
-          data_ptr_tmp);
+      waiter->fired_ = true;
+      waiter->transition_ = StateTransition{from, to};
     }
+  }
+}
 
-    // If event data was used, then delete it
-    if (data_ptr_tmp)
+void StateMachine::resumeFiredWaiters()
+{
+  // Resumed coroutines may await again or destroy other waiters, so look
+  // for the next fired one from the head each time
+  for (;;)
+  {
+    StateAwaiter *waiter = this->waiters_;
+    while (waiter != nullptr && !waiter->fired_)
+    {
+      waiter = waiter->next_;
+    }
+    if (waiter == nullptr)
     {
-      data_ptr_tmp.reset();
+      return;
     }
+    this->removeWaiter(waiter);
+    waiter->handle_.resume();
   }
 }
+#endif
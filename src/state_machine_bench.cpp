@@ -0,0 +1,2037 @@
+#include "bench_util.hpp"
+#include "event_pool.hpp"
+#include "motor.hpp"
+#include "centrifuge_test.hpp"
+#include "static_motor.hpp"
+#include "static_centrifuge_test.hpp"
+#include "state_log.hpp"
+#include "state_machine_fleet.hpp"
+#include "timer_wheel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <initializer_list>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+
+// Per-instance footprint of the example machines. Action descriptors are
+// per-type static data, so a machine is the base (a vptr, two pointers and
+// a few bytes of state) plus its own fields, the first of which land in
+// the base's tail padding. The bounds follow sizeof(StateIndex). Metrics,
+// the flight recorder and the state board add a pointer or an id each,
+// coroutine support a waiter list.
+#if !defined(STATE_MACHINE_ENABLE_METRICS) && \
+    !defined(STATE_MACHINE_ENABLE_FLIGHT_RECORDER) && \
+    !defined(STATE_MACHINE_ENABLE_COROUTINES) && \
+    !defined(STATE_MACHINE_ENABLE_STATE_BOARD)
+constexpr size_t alignUp(size_t size, size_t alignment)
+{
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+// End of a member of type T placed at or after offset
+template <class T>
+constexpr size_t after(size_t offset)
+{
+  return alignUp(offset, alignof(T)) + sizeof(T);
+}
+
+constexpr size_t objectSize(size_t end) { return alignUp(end, alignof(void *)); }
+
+// Bytes used by the members of each base: pointers, state ids and a flag
+const size_t STATE_MACHINE_BYTES =
+    3 * sizeof(void *) + 3 * sizeof(StateIndex) + sizeof(bool);
+const size_t STATIC_STATE_MACHINE_BYTES =
+    sizeof(void *) + 2 * sizeof(StateIndex) + sizeof(bool);
+
+static_assert(sizeof(StateMachine) <= objectSize(STATE_MACHINE_BYTES),
+              "StateMachine footprint grew");
+static_assert(sizeof(Motor) <= objectSize(after<int>(STATE_MACHINE_BYTES)),
+              "Motor footprint grew");
+static_assert(sizeof(CentrifugeTest) <=
+                  objectSize(after<int32_t>(after<bool>(STATE_MACHINE_BYTES))),
+              "CentrifugeTest footprint grew");
+static_assert(sizeof(StaticMotor) <=
+                  objectSize(after<int>(STATIC_STATE_MACHINE_BYTES)),
+              "StaticMotor footprint grew");
+static_assert(sizeof(StaticCentrifugeTest) <=
+                  objectSize(after<int32_t>(
+                      after<bool>(STATIC_STATE_MACHINE_BYTES))),
+              "StaticCentrifugeTest footprint grew");
+#endif
+
+// Every benchmark counts external events: one call of an event function,
+// whatever number of states it runs through.
+//
+// Motor and CentrifugeTest run their events on DirectEngine, except for
+// dispatch through a StateMachine reference and base class events such
+// as cancel; state_machine_bench_map_engine runs them all on the map
+// engine for comparison.
+
+// Scratch file of this process, so bench binaries run side by side by
+// ctest -j never share one
+static std::string scratchPath(const char *name)
+{
+  return "state_machine_bench." + std::to_string(::getpid()) + "." + name;
+}
+
+// Basic map, payload copied inline: Motor stays in ST_ChangeSpeed
+static void motorChangeSpeedInline(BenchState &state)
+{
+  Motor motor;
+  MotorData data;
+  data.speed = 1;
+  motor.setSpeed(data);
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    data.speed = static_cast<int>(i);
+    motor.setSpeed(data);
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+}
+
+// Basic map, one shared payload reused for every event
+static void motorChangeSpeedShared(BenchState &state)
+{
+  Motor motor;
+  auto data = std::make_shared<MotorData>();
+  data->speed = 1;
+  motor.setSpeed(data);
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    data->speed = static_cast<int>(i);
+    motor.setSpeed(data);
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+}
+
+// Basic map, fresh make_shared payload per event as in motor_main.cpp
+static void motorChangeSpeedMakeShared(BenchState &state)
+{
+  Motor motor;
+  motor.setSpeed(std::make_shared<MotorData>());
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    auto data = std::make_shared<MotorData>();
+    data->speed = static_cast<int>(i);
+    motor.setSpeed(data);
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+}
+
+// Basic map, fresh payload per event from the MotorData pool
+static void motorChangeSpeedPooled(BenchState &state)
+{
+  Motor motor;
+  motor.setSpeed(EventPool<MotorData>::make());
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    auto data = EventPool<MotorData>::make();
+    data->speed = static_cast<int>(i);
+    motor.setSpeed(data);
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+}
+
+// Basic map, fresh payload per event from an arena reset every batch
+static void motorChangeSpeedArena(BenchState &state)
+{
+  const uint64_t batch = 256;
+  Motor motor;
+  EventArena arena;
+  motor.setSpeed(arena.make<MotorData>());
+  BENCH_CHECK(arena.reset());
+
+  // A payload still held keeps the arena from being reused under it
+  auto held = arena.make<MotorData>();
+  BENCH_CHECK(!arena.reset() && arena.live() == 1);
+  held.reset();
+  BENCH_CHECK(arena.reset());
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    auto data = arena.make<MotorData>();
+    data->speed = static_cast<int>(i);
+    motor.setSpeed(data);
+    data.reset();
+    if (i % batch == batch - 1)
+    {
+      BENCH_CHECK(arena.reset());
+    }
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+}
+
+// Internal event chain: setSpeed -> ST_Start, halt -> ST_Stop -> ST_Idle
+static void motorStartHaltChain(BenchState &state)
+{
+  Motor motor;
+  MotorData data;
+  data.speed = 1;
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    motor.setSpeed(data);
+    motor.halt();
+  }
+  state.stopTiming();
+  state.addEvents(2 * state.iterations());
+}
+
+// EVENT_IGNORED: halt while in ST_Idle
+static void motorHaltIgnored(BenchState &state)
+{
+  Motor motor;
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    motor.halt();
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+}
+
+// Same chain raised by event id, as a router decoding messages would
+static void motorDispatchById(BenchState &state)
+{
+  Motor motor;
+  StateMachine &sm = motor;
+  MotorData data;
+  data.speed = 1;
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    BENCH_CHECK(sm.dispatch(Motor::EV_SET_SPEED, data));
+    BENCH_CHECK(sm.getCurrentState() == Motor::ST_START);
+    BENCH_CHECK(sm.dispatch(Motor::EV_HALT));
+    BENCH_CHECK(sm.getCurrentState() == Motor::ST_IDLE);
+  }
+  state.stopTiming();
+  state.addEvents(2 * state.iterations());
+}
+
+// Direct engine machine with a thousand states when StateIndex is wide
+// enough, which each event moves one state on. Its engine must build
+// however many states a machine has.
+class WideRing : public StateMachine
+{
+  DIRECT_STATE_ENGINE(WideRing)
+
+public:
+  enum States
+  {
+    ST_MAX_STATES = sizeof(StateIndex) > 1 ? 1000 : 200
+  };
+
+  WideRing() : StateMachine(ST_MAX_STATES) {}
+
+  void next();
+
+  uint64_t steps() const { return this->steps_; }
+
+private:
+  using Transitions = StateIndex[ST_MAX_STATES];
+
+  uint64_t steps_ = 0;
+
+  STATE_DECLARE(WideRing, Step, NoEventData)
+
+  template <size_t... I>
+  static const Transitions &successors(std::index_sequence<I...>)
+  {
+    static const Transitions NEXT{
+        static_cast<StateIndex>((I + 1) % ST_MAX_STATES)...};
+    return NEXT;
+  }
+
+  template <size_t... I>
+  static const StateMapRow *stateMap(std::index_sequence<I...>)
+  {
+    static const StateMapRow STATE_MAP[]{((void)I, StateMapRow{&Step})...};
+    return &STATE_MAP[0];
+  }
+
+  virtual const StateMapRowEx *getStateMapEx() { return nullptr; }
+  virtual const StateMapRow *getStateMap()
+  {
+    return stateMap(std::make_index_sequence<ST_MAX_STATES>());
+  }
+};
+
+void WideRing::next()
+{
+  const Transitions &TRANSITIONS =
+      successors(std::make_index_sequence<ST_MAX_STATES>());
+  END_TRANSITION_MAP(nullptr)
+}
+
+STATE_DEFINE(WideRing, Step, NoEventData)
+{
+  (void)data;
+  ++this->steps_;
+}
+
+static void wideRingNext(BenchState &state)
+{
+  WideRing ring;
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    ring.next();
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+  BENCH_CHECK(ring.steps() == state.iterations());
+  BENCH_CHECK(ring.getCurrentState() ==
+              state.iterations() % WideRing::ST_MAX_STATES);
+}
+
+// Extended map: start (guard), acceleration and deceleration polls (exit
+// actions) up to ST_Completed. A test can only run once, so the fleet is
+// built before timing starts.
+static void centrifugeFullCycle(BenchState &state)
+{
+  std::vector<CentrifugeTest> tests(state.iterations());
+
+  state.startTiming();
+  uint64_t events = 0;
+  for (CentrifugeTest &test : tests)
+  {
+    test.start();
+    ++events;
+    while (test.isPollActive())
+    {
+      test.poll();
+      ++events;
+    }
+  }
+  state.stopTiming();
+  state.addEvents(events);
+}
+
+// Extended map, base class event: cancel in ST_Idle is EVENT_IGNORED
+static void centrifugeCancelIgnored(BenchState &state)
+{
+  CentrifugeTest test;
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    test.cancel();
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+}
+
+// Extended map, EVENT_IGNORED: poll while in ST_Idle
+static void centrifugePollIgnored(BenchState &state)
+{
+  CentrifugeTest test;
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    test.poll();
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+}
+
+// Compile-time front end counterparts of the benchmarks above
+static void staticMotorChangeSpeed(BenchState &state)
+{
+  StaticMotor motor;
+  MotorData data;
+  data.speed = 1;
+  motor.setSpeed(data);
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    data.speed = static_cast<int>(i);
+    motor.setSpeed(data);
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+}
+
+static void staticMotorStartHaltChain(BenchState &state)
+{
+  StaticMotor motor;
+  MotorData data;
+  data.speed = 1;
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    motor.setSpeed(data);
+    motor.halt();
+  }
+  state.stopTiming();
+  state.addEvents(2 * state.iterations());
+}
+
+static void staticMotorHaltIgnored(BenchState &state)
+{
+  StaticMotor motor;
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    motor.halt();
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+}
+
+static void staticCentrifugeFullCycle(BenchState &state)
+{
+  std::vector<StaticCentrifugeTest> tests(state.iterations());
+
+  state.startTiming();
+  uint64_t events = 0;
+  for (StaticCentrifugeTest &test : tests)
+  {
+    test.start();
+    ++events;
+    while (test.isPollActive())
+    {
+      test.poll();
+      ++events;
+    }
+  }
+  state.stopTiming();
+  state.addEvents(events);
+}
+
+#ifdef STATE_MACHINE_ENABLE_METRICS
+// Metrics attached, against the same benchmarks above without. Latencies
+// are timed for every action, or one in 64 when sampled.
+static void motorChangeSpeedMetrics(BenchState &state, unsigned sample_shift)
+{
+  Motor motor;
+  StateMachineMetrics metrics(motor.getMaxStates(), sample_shift);
+  motor.enableMetrics(&metrics);
+  MotorData data;
+  data.speed = 1;
+  motor.setSpeed(data);
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    data.speed = static_cast<int>(i);
+    motor.setSpeed(data);
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+}
+
+static void motorChangeSpeedTimed(BenchState &state)
+{
+  motorChangeSpeedMetrics(state, 0);
+}
+
+static void motorChangeSpeedSampled(BenchState &state)
+{
+  motorChangeSpeedMetrics(state, 6);
+}
+
+static void motorStartHaltChainMetrics(BenchState &state)
+{
+  Motor motor;
+  StateMachineMetrics metrics(motor.getMaxStates());
+  motor.enableMetrics(&metrics);
+  MotorData data;
+  data.speed = 1;
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    motor.setSpeed(data);
+    motor.halt();
+  }
+  state.stopTiming();
+  state.addEvents(2 * state.iterations());
+}
+
+static void staticMotorChangeSpeedMetrics(BenchState &state)
+{
+  StaticMotor motor;
+  StateMachineMetrics metrics(motor.getMaxStates());
+  motor.enableMetrics(&metrics);
+  MotorData data;
+  data.speed = 1;
+  motor.setSpeed(data);
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    data.speed = static_cast<int>(i);
+    motor.setSpeed(data);
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+}
+#endif
+
+#ifdef STATE_MACHINE_ENABLE_STATE_BOARD
+// Motor publishing to a state board, against motor/change_speed_inline,
+// alone and while another thread reads its slot in a loop as a monitor
+// would. The board lives in a file of this process under /tmp rather
+// than /dev/shm so the benchmark runs where shared memory objects are not
+// available.
+static void motorChangeSpeedBoard(BenchState &state, bool monitored)
+{
+  std::string name = "/tmp/" + scratchPath("board");
+  const char *path = name.c_str();
+  StateBoard board;
+  if (!board.create(path, 1))
+  {
+    std::cerr << "cannot create " << path << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  Motor motor;
+  motor.publishState(board.attach());
+  MotorData data;
+  data.speed = 1;
+  motor.setSpeed(data);
+
+  std::atomic<bool> done(false);
+  std::thread monitor;
+  if (monitored)
+  {
+    monitor = std::thread([&board, &done]() {
+      PublishedState published;
+      while (!done.load(std::memory_order_relaxed))
+      {
+        board.read(0, published);
+      }
+    });
+  }
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    data.speed = static_cast<int>(i);
+    motor.setSpeed(data);
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+
+  done.store(true, std::memory_order_relaxed);
+  if (monitored)
+  {
+    monitor.join();
+  }
+
+  // The first event started the motor, every later one changed its speed
+  PublishedState published;
+  BENCH_CHECK(board.read(0, published));
+  BENCH_CHECK(published.state == Motor::ST_CHANGE_SPEED);
+  BENCH_CHECK(published.transitions == state.iterations() + 1);
+  motor.publishState(nullptr);
+  board.close();
+  StateBoard::unlink(path);
+}
+
+static void motorChangeSpeedPublished(BenchState &state)
+{
+  motorChangeSpeedBoard(state, false);
+}
+
+static void motorChangeSpeedMonitored(BenchState &state)
+{
+  motorChangeSpeedBoard(state, true);
+}
+#endif
+
+// Fleet of StaticCentrifugeTest against per-object loops. One event is one
+// machine receiving poll()/start(), whether or not it is ignored.
+static const size_t FLEET_SIZE = 100000;
+
+static uint64_t fleetRounds(const BenchState &state, uint64_t events_per_round)
+{
+  uint64_t rounds = state.iterations() / events_per_round;
+  return rounds > 0 ? rounds : 1;
+}
+
+static bool sameCheckpoint(const char *a, const char *b)
+{
+  CheckpointFile first;
+  CheckpointFile second;
+  return first.open(a) && second.open(b) && first.size() == second.size() &&
+         std::memcmp(first.data(), second.data(), first.size()) == 0;
+}
+
+// The fleet must leave every machine in the state and with the fields the
+// per-object loop leaves it, started every stride machines and polled
+// until done
+static void checkFleetMatchesLoop(StateMachineFleet<StaticCentrifugeTest> &fleet,
+                                  size_t stride)
+{
+  StateMachineFleet<StaticCentrifugeTest> loop(fleet.size());
+  for (size_t i = 0; i < loop.size(); i += stride)
+  {
+    loop[i].start();
+  }
+  bool active = true;
+  while (active)
+  {
+    active = false;
+    for (size_t i = 0; i < loop.size(); ++i)
+    {
+      loop[i].poll();
+      active |= loop[i].isPollActive();
+    }
+  }
+  loop.refresh();
+  BENCH_CHECK(std::equal(loop.states(), loop.states() + loop.size(),
+                         fleet.states()));
+
+  std::string fleet_path = scratchPath("fleet");
+  std::string loop_path = scratchPath("loop");
+  BENCH_CHECK(fleet.saveCheckpoint(fleet_path.c_str()));
+  BENCH_CHECK(loop.saveCheckpoint(loop_path.c_str()));
+  BENCH_CHECK(sameCheckpoint(fleet_path.c_str(), loop_path.c_str()));
+  std::remove(fleet_path.c_str());
+  std::remove(loop_path.c_str());
+}
+
+// Every machine in ST_Idle: poll is EVENT_IGNORED for all of them
+static void fleetPollIdle(BenchState &state)
+{
+  StateMachineFleet<StaticCentrifugeTest> fleet(FLEET_SIZE);
+  uint64_t rounds = fleetRounds(state, FLEET_SIZE);
+
+  state.startTiming();
+  for (uint64_t round = 0; round < rounds; ++round)
+  {
+    fleet.apply<StaticCentrifugeTest::Poll>();
+  }
+  state.stopTiming();
+  state.addEvents(rounds * FLEET_SIZE);
+}
+
+static void loopPollIdle(BenchState &state)
+{
+  std::vector<StaticCentrifugeTest> tests(FLEET_SIZE);
+  uint64_t rounds = fleetRounds(state, FLEET_SIZE);
+
+  state.startTiming();
+  for (uint64_t round = 0; round < rounds; ++round)
+  {
+    for (StaticCentrifugeTest &test : tests)
+    {
+      test.poll();
+    }
+  }
+  state.stopTiming();
+  state.addEvents(rounds * FLEET_SIZE);
+}
+
+static void loopPollIdleVirtual(BenchState &state)
+{
+  std::vector<CentrifugeTest> tests(FLEET_SIZE);
+  uint64_t rounds = fleetRounds(state, FLEET_SIZE);
+
+  state.startTiming();
+  for (uint64_t round = 0; round < rounds; ++round)
+  {
+    for (CentrifugeTest &test : tests)
+    {
+      test.poll();
+    }
+  }
+  state.stopTiming();
+  state.addEvents(rounds * FLEET_SIZE);
+}
+
+// One machine in `stride` is started, then the fleet is polled until every
+// test has completed. Tests only run once, so each round gets a new fleet,
+// whose lane buckets allocate while they grow on the first events.
+static void fleetCycle(BenchState &state, size_t stride)
+{
+  uint64_t rounds = fleetRounds(state, 13 * FLEET_SIZE);
+  uint64_t events = 0;
+  for (uint64_t round = 0; round < rounds; ++round)
+  {
+    StateMachineFleet<StaticCentrifugeTest> fleet(FLEET_SIZE);
+    if (stride > 1)
+    {
+      // Start the selected machines before timing, leave the rest idle
+      for (size_t i = 0; i < FLEET_SIZE; i += stride)
+      {
+        fleet[i].start();
+      }
+      fleet.refresh();
+    }
+
+    state.startTiming();
+    if (stride == 1)
+    {
+      fleet.apply<StaticCentrifugeTest::Start>();
+      events += FLEET_SIZE;
+    }
+    do
+    {
+      events += FLEET_SIZE;
+    } while (fleet.apply<StaticCentrifugeTest::Poll>() != 0);
+    state.stopTiming();
+
+    if (round == 0)
+    {
+      checkFleetMatchesLoop(fleet, stride);
+    }
+  }
+  state.addEvents(events);
+}
+
+static void loopCycle(BenchState &state, size_t stride)
+{
+  uint64_t rounds = fleetRounds(state, 13 * FLEET_SIZE);
+  uint64_t events = 0;
+  for (uint64_t round = 0; round < rounds; ++round)
+  {
+    std::vector<StaticCentrifugeTest> tests(FLEET_SIZE);
+    if (stride > 1)
+    {
+      for (size_t i = 0; i < FLEET_SIZE; i += stride)
+      {
+        tests[i].start();
+      }
+    }
+
+    state.startTiming();
+    if (stride == 1)
+    {
+      for (StaticCentrifugeTest &test : tests)
+      {
+        test.start();
+      }
+      events += FLEET_SIZE;
+    }
+    bool active = true;
+    while (active)
+    {
+      active = false;
+      for (StaticCentrifugeTest &test : tests)
+      {
+        test.poll();
+        active |= test.isPollActive();
+      }
+      events += FLEET_SIZE;
+    }
+    state.stopTiming();
+  }
+  state.addEvents(events);
+}
+
+static void fleetCycleAll(BenchState &state) { fleetCycle(state, 1); }
+static void loopCycleAll(BenchState &state) { loopCycle(state, 1); }
+static void fleetCycleSparse(BenchState &state) { fleetCycle(state, 16); }
+static void loopCycleSparse(BenchState &state) { loopCycle(state, 16); }
+
+// Two leaves under a chain of ancestors. Toggling between them exits one
+// leaf and enters the other whatever the depth, so the nested variant
+// should cost the same as the flat one running the same two actions.
+class NestedLeaves : public StateMachine
+{
+public:
+  explicit NestedLeaves(bool nested)
+      : StateMachine(ST_MAX_STATES, ST_LEFT), nested_(nested)
+  {
+  }
+
+  void toggle();
+
+private:
+  bool nested_;
+
+  enum States
+  {
+    ST_OUTER_0,
+    ST_OUTER_1,
+    ST_OUTER_2,
+    ST_OUTER_3,
+    ST_OUTER_4,
+    ST_OUTER_5,
+    ST_OUTER_6,
+    ST_OUTER_7,
+    ST_LEFT,
+    ST_RIGHT,
+    ST_MAX_STATES
+  };
+
+  STATE_DECLARE(NestedLeaves, Outer, NoEventData)
+  ENTRY_DECLARE(NestedLeaves, EntryOuter, NoEventData)
+  EXIT_DECLARE(NestedLeaves, ExitOuter)
+  STATE_DECLARE(NestedLeaves, Leaf, NoEventData)
+  ENTRY_DECLARE(NestedLeaves, EntryLeaf, NoEventData)
+  EXIT_DECLARE(NestedLeaves, ExitLeaf)
+
+  virtual const StateMapRow *getStateMap() { return nullptr; }
+  virtual const StateMapRowEx *getStateMapEx()
+  {
+    static const StateMapRowEx STATE_MAP[] = {
+        STATE_MAP_ENTRY_ALL_EX(&Outer, nullptr, &EntryOuter, &ExitOuter),
+        STATE_MAP_ENTRY_ALL_EX(&Outer, nullptr, &EntryOuter, &ExitOuter),
+        STATE_MAP_ENTRY_ALL_EX(&Outer, nullptr, &EntryOuter, &ExitOuter),
+        STATE_MAP_ENTRY_ALL_EX(&Outer, nullptr, &EntryOuter, &ExitOuter),
+        STATE_MAP_ENTRY_ALL_EX(&Outer, nullptr, &EntryOuter, &ExitOuter),
+        STATE_MAP_ENTRY_ALL_EX(&Outer, nullptr, &EntryOuter, &ExitOuter),
+        STATE_MAP_ENTRY_ALL_EX(&Outer, nullptr, &EntryOuter, &ExitOuter),
+        STATE_MAP_ENTRY_ALL_EX(&Outer, nullptr, &EntryOuter, &ExitOuter),
+        STATE_MAP_ENTRY_ALL_EX(&Leaf, nullptr, &EntryLeaf, &ExitLeaf),
+        STATE_MAP_ENTRY_ALL_EX(&Leaf, nullptr, &EntryLeaf, &ExitLeaf)};
+    static_assert(
+        (sizeof(STATE_MAP) / sizeof(StateMapRowEx)) == ST_MAX_STATES,
+        "Invalid size of STATE_MAP");
+    return &STATE_MAP[0];
+  }
+
+  virtual const StateHierarchy *getStateHierarchy()
+  {
+    static const StateIndex PARENTS[] = {
+        StateHierarchy::NO_PARENT, // ST_OUTER_0
+        ST_OUTER_0,                // ST_OUTER_1
+        ST_OUTER_1,                // ST_OUTER_2
+        ST_OUTER_2,                // ST_OUTER_3
+        ST_OUTER_3,                // ST_OUTER_4
+        ST_OUTER_4,                // ST_OUTER_5
+        ST_OUTER_5,                // ST_OUTER_6
+        ST_OUTER_6,                // ST_OUTER_7
+        ST_OUTER_7,                // ST_LEFT
+        ST_OUTER_7,                // ST_RIGHT
+    };
+    static_assert((sizeof(PARENTS) / sizeof(StateIndex)) == ST_MAX_STATES,
+                  "Invalid size of PARENTS");
+    static const StateHierarchy HIERARCHY(PARENTS);
+    return this->nested_ ? &HIERARCHY : nullptr;
+  }
+};
+
+void NestedLeaves::toggle()
+{
+  static const StateIndex TRANSITIONS[] = {
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_OUTER_0
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_OUTER_1
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_OUTER_2
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_OUTER_3
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_OUTER_4
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_OUTER_5
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_OUTER_6
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_OUTER_7
+      TRANSITION_MAP_ENTRY(ST_RIGHT)      // ST_LEFT
+      TRANSITION_MAP_ENTRY(ST_LEFT)       // ST_RIGHT
+  };
+  END_TRANSITION_MAP(nullptr)
+}
+
+STATE_DEFINE(NestedLeaves, Outer, NoEventData) { (void)data; }
+ENTRY_DEFINE(NestedLeaves, EntryOuter, NoEventData) { (void)data; }
+EXIT_DEFINE(NestedLeaves, ExitOuter) {}
+STATE_DEFINE(NestedLeaves, Leaf, NoEventData) { (void)data; }
+ENTRY_DEFINE(NestedLeaves, EntryLeaf, NoEventData) { (void)data; }
+EXIT_DEFINE(NestedLeaves, ExitLeaf) {}
+
+static void nestedToggle(BenchState &state, bool nested)
+{
+  NestedLeaves machine(nested);
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    machine.toggle();
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+}
+
+static void hierarchyToggleFlat(BenchState &state) { nestedToggle(state, false); }
+static void hierarchyToggleNested(BenchState &state) { nestedToggle(state, true); }
+
+// Three levels: ROOT holds A and B, which hold A1 and B1; C is a second
+// top level state. Entry and exit actions append +state and -state to a
+// trace, so each transition's exit/entry order can be checked.
+class ThreeLevels : public StateMachine
+{
+public:
+  enum States
+  {
+    ST_ROOT,
+    ST_A,
+    ST_A1,
+    ST_B,
+    ST_B1,
+    ST_C,
+    ST_MAX_STATES
+  };
+
+  ThreeLevels() : StateMachine(ST_MAX_STATES, ST_A1), trace_size_(0) {}
+
+  void goTo(StateIndex state)
+  {
+    this->trace_size_ = 0;
+    this->externalEvent(state);
+  }
+
+  // Actions run by the last goTo(), +(state + 1) entered, -(state + 1)
+  // exited
+  bool traced(std::initializer_list<int> expected) const
+  {
+    return expected.size() == this->trace_size_ &&
+           std::equal(expected.begin(), expected.end(), this->trace_);
+  }
+
+private:
+  int trace_[16];
+  size_t trace_size_;
+
+  void trace(int step)
+  {
+    assert(this->trace_size_ < 16);
+    this->trace_[this->trace_size_++] = step;
+  }
+
+  STATE_DECLARE(ThreeLevels, Any, NoEventData)
+  ENTRY_DECLARE(ThreeLevels, EntryRoot, NoEventData)
+  EXIT_DECLARE(ThreeLevels, ExitRoot)
+  ENTRY_DECLARE(ThreeLevels, EntryA, NoEventData)
+  EXIT_DECLARE(ThreeLevels, ExitA)
+  ENTRY_DECLARE(ThreeLevels, EntryA1, NoEventData)
+  EXIT_DECLARE(ThreeLevels, ExitA1)
+  ENTRY_DECLARE(ThreeLevels, EntryB, NoEventData)
+  EXIT_DECLARE(ThreeLevels, ExitB)
+  ENTRY_DECLARE(ThreeLevels, EntryB1, NoEventData)
+  EXIT_DECLARE(ThreeLevels, ExitB1)
+  ENTRY_DECLARE(ThreeLevels, EntryC, NoEventData)
+  EXIT_DECLARE(ThreeLevels, ExitC)
+
+  virtual const StateMapRow *getStateMap() { return nullptr; }
+  virtual const StateMapRowEx *getStateMapEx()
+  {
+    static const StateMapRowEx STATE_MAP[] = {
+        STATE_MAP_ENTRY_ALL_EX(&Any, nullptr, &EntryRoot, &ExitRoot),
+        STATE_MAP_ENTRY_ALL_EX(&Any, nullptr, &EntryA, &ExitA),
+        STATE_MAP_ENTRY_ALL_EX(&Any, nullptr, &EntryA1, &ExitA1),
+        STATE_MAP_ENTRY_ALL_EX(&Any, nullptr, &EntryB, &ExitB),
+        STATE_MAP_ENTRY_ALL_EX(&Any, nullptr, &EntryB1, &ExitB1),
+        STATE_MAP_ENTRY_ALL_EX(&Any, nullptr, &EntryC, &ExitC)};
+    static_assert(
+        (sizeof(STATE_MAP) / sizeof(StateMapRowEx)) == ST_MAX_STATES,
+        "Invalid size of STATE_MAP");
+    return &STATE_MAP[0];
+  }
+
+  virtual const StateHierarchy *getStateHierarchy()
+  {
+    static const StateIndex PARENTS[] = {
+        StateHierarchy::NO_PARENT, // ST_ROOT
+        ST_ROOT,                   // ST_A
+        ST_A,                      // ST_A1
+        ST_ROOT,                   // ST_B
+        ST_B,                      // ST_B1
+        StateHierarchy::NO_PARENT, // ST_C
+    };
+    static_assert((sizeof(PARENTS) / sizeof(StateIndex)) == ST_MAX_STATES,
+                  "Invalid size of PARENTS");
+    static const StateHierarchy HIERARCHY(PARENTS);
+    return &HIERARCHY;
+  }
+};
+
+STATE_DEFINE(ThreeLevels, Any, NoEventData) { (void)data; }
+ENTRY_DEFINE(ThreeLevels, EntryRoot, NoEventData) { (void)data; trace(1 + ST_ROOT); }
+EXIT_DEFINE(ThreeLevels, ExitRoot) { trace(-1 - ST_ROOT); }
+ENTRY_DEFINE(ThreeLevels, EntryA, NoEventData) { (void)data; trace(1 + ST_A); }
+EXIT_DEFINE(ThreeLevels, ExitA) { trace(-1 - ST_A); }
+ENTRY_DEFINE(ThreeLevels, EntryA1, NoEventData) { (void)data; trace(1 + ST_A1); }
+EXIT_DEFINE(ThreeLevels, ExitA1) { trace(-1 - ST_A1); }
+ENTRY_DEFINE(ThreeLevels, EntryB, NoEventData) { (void)data; trace(1 + ST_B); }
+EXIT_DEFINE(ThreeLevels, ExitB) { trace(-1 - ST_B); }
+ENTRY_DEFINE(ThreeLevels, EntryB1, NoEventData) { (void)data; trace(1 + ST_B1); }
+EXIT_DEFINE(ThreeLevels, ExitB1) { trace(-1 - ST_B1); }
+ENTRY_DEFINE(ThreeLevels, EntryC, NoEventData) { (void)data; trace(1 + ST_C); }
+EXIT_DEFINE(ThreeLevels, ExitC) { trace(-1 - ST_C); }
+
+// One round through the three levels per iteration, checking every step:
+// between cousins, up to an ancestor, across top level states and back
+// down three levels
+static void hierarchyThreeLevelOrder(BenchState &state)
+{
+  using S = ThreeLevels;
+  const int ROOT = 1 + S::ST_ROOT, A = 1 + S::ST_A, A1 = 1 + S::ST_A1,
+            B = 1 + S::ST_B, B1 = 1 + S::ST_B1, C = 1 + S::ST_C;
+  ThreeLevels machine;
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    machine.goTo(S::ST_B1);
+    BENCH_CHECK(machine.traced({-A1, -A, B, B1}));
+    machine.goTo(S::ST_B);
+    BENCH_CHECK(machine.traced({-B1}));
+    machine.goTo(S::ST_C);
+    BENCH_CHECK(machine.traced({-B, -ROOT, C}));
+    machine.goTo(S::ST_A1);
+    BENCH_CHECK(machine.traced({-C, ROOT, A, A1}));
+  }
+  state.stopTiming();
+  state.addEvents(4 * state.iterations());
+}
+
+// Machine whose ARMED state times out unless kicked back to IDLE first,
+// exercising a state timer armed on entry and cancelled on exit
+class Watchdog : public StateMachine
+{
+public:
+  static const uint64_t TIMEOUT = 1000;
+
+  explicit Watchdog(TimerWheel &wheel)
+      : StateMachine(ST_MAX_STATES), timers_(*this, wheel)
+  {
+  }
+
+  void kick();
+
+  bool isIdle() const { return this->getCurrentState() == ST_IDLE; }
+  bool isArmed() const { return this->getCurrentState() == ST_ARMED; }
+  bool isExpired() const { return this->getCurrentState() == ST_EXPIRED; }
+  size_t armedTimers() const { return this->timers_.size(); }
+  size_t exits() const { return this->exits_; }
+
+private:
+  StateTimers timers_;
+  size_t exits_ = 0;
+
+  enum States
+  {
+    ST_IDLE,
+    ST_ARMED,
+    ST_EXPIRED,
+    ST_MAX_STATES
+  };
+
+  STATE_DECLARE(Watchdog, Idle, NoEventData)
+  STATE_DECLARE(Watchdog, Armed, NoEventData)
+  ENTRY_DECLARE(Watchdog, EntryArmed, NoEventData)
+  EXIT_DECLARE(Watchdog, ExitArmed)
+  STATE_DECLARE(Watchdog, Expired, NoEventData)
+
+  virtual const StateMapRow *getStateMap() { return nullptr; }
+  virtual const StateMapRowEx *getStateMapEx()
+  {
+    static const StateMapRowEx STATE_MAP[] = {
+        STATE_MAP_ENTRY_ALL_EX(&Idle, nullptr, nullptr, nullptr),
+        STATE_MAP_ENTRY_ALL_EX(&Armed, nullptr, &EntryArmed, &ExitArmed),
+        STATE_MAP_ENTRY_ALL_EX(&Expired, nullptr, nullptr, nullptr)};
+    static_assert(
+        (sizeof(STATE_MAP) / sizeof(StateMapRowEx)) == ST_MAX_STATES,
+        "Invalid size of STATE_MAP");
+    return &STATE_MAP[0];
+  }
+
+  virtual StateTimers *getStateTimers() { return &this->timers_; }
+};
+
+void Watchdog::kick()
+{
+  static const StateIndex TRANSITIONS[] = {
+      TRANSITION_MAP_ENTRY(ST_ARMED) // ST_IDLE
+      TRANSITION_MAP_ENTRY(ST_IDLE)  // ST_ARMED
+      TRANSITION_MAP_ENTRY(ST_ARMED) // ST_EXPIRED
+  };
+  END_TRANSITION_MAP(nullptr)
+}
+
+STATE_DEFINE(Watchdog, Idle, NoEventData) { (void)data; }
+STATE_DEFINE(Watchdog, Armed, NoEventData) { (void)data; }
+ENTRY_DEFINE(Watchdog, EntryArmed, NoEventData)
+{
+  (void)data;
+  this->timers_.startStateTimer(TIMEOUT, ST_EXPIRED);
+}
+EXIT_DEFINE(Watchdog, ExitArmed) { ++this->exits_; }
+STATE_DEFINE(Watchdog, Expired, NoEventData) { (void)data; }
+
+// Records the tick at which each of its states is entered by a timer,
+// one state per level of the wheel
+class TimerTrace : public StateMachine
+{
+public:
+  enum States
+  {
+    ST_LEVEL0,
+    ST_LEVEL1,
+    ST_LEVEL2,
+    ST_LEVEL3,
+    ST_MAX_STATES
+  };
+
+  explicit TimerTrace(TimerWheel &wheel)
+      : StateMachine(ST_MAX_STATES), timers_(*this, wheel)
+  {
+  }
+
+  StateTimers &timers() { return this->timers_; }
+
+  size_t fired() const { return this->fired_; }
+  StateIndex firedState(size_t index) const { return this->states_[index]; }
+  uint64_t firedTick(size_t index) const { return this->ticks_[index]; }
+
+private:
+  StateTimers timers_;
+  StateIndex states_[ST_MAX_STATES];
+  uint64_t ticks_[ST_MAX_STATES];
+  size_t fired_ = 0;
+
+  STATE_DECLARE(TimerTrace, Fired, NoEventData)
+
+  virtual const StateMapRowEx *getStateMapEx() { return nullptr; }
+  virtual const StateMapRow *getStateMap()
+  {
+    static const StateMapRow STATE_MAP[]{
+        &Fired,
+        &Fired,
+        &Fired,
+        &Fired,
+    };
+    static_assert(
+        (sizeof(STATE_MAP) / sizeof(StateMapRow)) == ST_MAX_STATES,
+        "Invalid size of STATE_MAP");
+    return &STATE_MAP[0];
+  }
+
+  virtual StateTimers *getStateTimers() { return &this->timers_; }
+};
+
+STATE_DEFINE(TimerTrace, Fired, NoEventData)
+{
+  (void)data;
+  assert(this->fired_ < ST_MAX_STATES);
+  this->states_[this->fired_] = this->getCurrentState();
+  this->ticks_[this->fired_] = this->timers_.getWheel().now();
+  ++this->fired_;
+}
+
+// Timers placed on each level of the wheel, armed longest first, must
+// fire on their own tick and not one before, shortest first
+static void checkTimerLevels()
+{
+  using T = TimerTrace;
+  const uint64_t TICKS[T::ST_MAX_STATES] = {
+      5, 300, 70000, (uint64_t(1) << 24) + 3};
+
+  TimerWheel wheel(0, T::ST_MAX_STATES);
+  TimerTrace trace(wheel);
+  for (size_t level = T::ST_MAX_STATES; level-- > 0;)
+  {
+    trace.timers().startTimer(TICKS[level], static_cast<StateIndex>(level));
+  }
+  for (size_t level = 0; level < T::ST_MAX_STATES; ++level)
+  {
+    wheel.advance(TICKS[level] - 1);
+    BENCH_CHECK(trace.fired() == level);
+    wheel.advance(TICKS[level]);
+    BENCH_CHECK(trace.fired() == level + 1);
+    BENCH_CHECK(trace.firedState(level) == level);
+    BENCH_CHECK(trace.firedTick(level) == TICKS[level]);
+  }
+  BENCH_CHECK(wheel.size() == 0);
+}
+
+// A fired timer's handle must not cancel the timer that reuses its node
+static void checkStaleCancel()
+{
+  TimerWheel wheel(0, 1);
+  Watchdog watchdog(wheel);
+  StateTimers timers(watchdog, wheel);
+
+  TimerId fired = timers.startTimer(1, 0);
+  wheel.tick();
+  BENCH_CHECK(timers.size() == 0);
+  TimerId armed = timers.startTimer(1, 0);
+  BENCH_CHECK(static_cast<uint32_t>(armed) == static_cast<uint32_t>(fired));
+  BENCH_CHECK(!timers.cancel(fired));
+  BENCH_CHECK(timers.size() == 1);
+  BENCH_CHECK(timers.cancel(armed));
+  BENCH_CHECK(!timers.cancel(armed));
+  BENCH_CHECK(timers.size() == 0);
+}
+
+static const size_t OUTSTANDING_TIMERS = 1000000;
+
+// Arm and cancel one timer next to a million outstanding ones
+static void timerArmCancel(BenchState &state)
+{
+  TimerWheel wheel(0, OUTSTANDING_TIMERS + 1);
+  Watchdog watchdog(wheel);
+  StateTimers timers(watchdog, wheel);
+  for (size_t i = 0; i < OUTSTANDING_TIMERS; ++i)
+  {
+    timers.startTimer(1 + (i * 7919) % TimerWheel::MAX_TICKS, 0);
+  }
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    BENCH_CHECK(timers.cancel(timers.startTimer(1 + i % 100000, 0)));
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+  BENCH_CHECK(timers.size() == OUTSTANDING_TIMERS);
+
+  checkStaleCancel();
+}
+
+// Fire timers spread over as many ticks, cascading through the levels
+static void timerFire(BenchState &state)
+{
+  checkTimerLevels();
+
+  TimerWheel wheel(0, state.iterations());
+  Watchdog watchdog(wheel);
+  StateTimers timers(watchdog, wheel);
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    timers.startTimer<Watchdog, &Watchdog::kick>(
+        1 + (i * 7919) % state.iterations());
+  }
+
+  state.startTiming();
+  wheel.advance(state.iterations());
+  state.stopTiming();
+  state.addEvents(state.iterations());
+  BENCH_CHECK(wheel.size() == 0);
+}
+
+// Enter a state arming a timeout, leave it before the timeout: the exit
+// cancels the timer. Then let it time out.
+static void timerStateTimeout(BenchState &state)
+{
+  TimerWheel wheel(0, 1);
+  Watchdog watchdog(wheel);
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    watchdog.kick();
+    BENCH_CHECK(watchdog.armedTimers() == (i % 2 == 0 ? 1 : 0));
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+
+  // Kicked out of ARMED on every odd kick, through its exit action
+  BENCH_CHECK(watchdog.exits() == state.iterations() / 2);
+  if (watchdog.isArmed())
+  {
+    watchdog.kick();
+  }
+  BENCH_CHECK(watchdog.isIdle() && watchdog.armedTimers() == 0);
+  wheel.advance(wheel.now() + 2 * Watchdog::TIMEOUT);
+  BENCH_CHECK(watchdog.isIdle());
+
+  watchdog.kick();
+  wheel.advance(wheel.now() + Watchdog::TIMEOUT - 1);
+  BENCH_CHECK(watchdog.isArmed());
+  wheel.tick();
+  BENCH_CHECK(watchdog.isExpired() && watchdog.armedTimers() == 0);
+}
+
+class RequestData : public EventData
+{
+public:
+  explicit RequestData(int id_ = -1) : id(id_) {}
+  int id;
+};
+
+// Requests submitted while the gate is locked are deferred and replayed
+// once it opens, more of them than the engine's external queue holds.
+// burst() queues one internal event more than fits.
+class Gate : public StateMachine
+{
+public:
+  static const size_t DEFERRED = STATE_MACHINE_ENGINE_QUEUE_SIZE + 4;
+
+  Gate() : StateMachine(ST_MAX_STATES) {}
+
+  void submit(int id);
+  void lock();
+  void unlock();
+  void burst();
+
+  // Requests handled, in order
+  const int *handled() const { return this->handled_; }
+  size_t handledCount() const { return this->handled_count_; }
+
+  size_t refused() const { return this->refused_; }
+  size_t opened() const { return this->opened_; }
+  bool isOpen() const { return this->getCurrentState() == ST_OPEN; }
+
+private:
+  DeferredEvents<DEFERRED> deferred_;
+  int handled_[DEFERRED];
+  size_t handled_count_ = 0;
+  size_t refused_ = 0;
+  size_t opened_ = 0;
+
+  enum States
+  {
+    ST_OPEN,
+    ST_LOCKED,
+    ST_HANDLE,
+    ST_BURST,
+    ST_MAX_STATES
+  };
+
+  STATE_DECLARE(Gate, Open, RequestData)
+  STATE_DECLARE(Gate, Locked, RequestData)
+  STATE_DECLARE(Gate, Handle, RequestData)
+  STATE_DECLARE(Gate, Burst, RequestData)
+
+  virtual const StateMapRowEx *getStateMapEx() { return nullptr; }
+  virtual const StateMapRow *getStateMap()
+  {
+    static const StateMapRow STATE_MAP[]{
+        &Open,
+        &Locked,
+        &Handle,
+        &Burst,
+    };
+    static_assert(
+        (sizeof(STATE_MAP) / sizeof(StateMapRow)) == ST_MAX_STATES,
+        "Invalid size of STATE_MAP");
+    return &STATE_MAP[0];
+  }
+
+  virtual EventRing *getDeferredEvents() { return &this->deferred_; }
+};
+
+void Gate::submit(int id)
+{
+  static const StateIndex TRANSITIONS[] = {
+      TRANSITION_MAP_ENTRY(ST_HANDLE)     // ST_OPEN
+      TRANSITION_MAP_ENTRY(ST_LOCKED)     // ST_LOCKED
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_HANDLE
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_BURST
+  };
+  END_TRANSITION_MAP(RequestData(id))
+}
+
+void Gate::lock()
+{
+  static const StateIndex TRANSITIONS[] = {
+      TRANSITION_MAP_ENTRY(ST_LOCKED)     // ST_OPEN
+      TRANSITION_MAP_ENTRY(EVENT_IGNORED) // ST_LOCKED
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_HANDLE
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_BURST
+  };
+  END_TRANSITION_MAP(RequestData())
+}
+
+void Gate::unlock()
+{
+  static const StateIndex TRANSITIONS[] = {
+      TRANSITION_MAP_ENTRY(EVENT_IGNORED) // ST_OPEN
+      TRANSITION_MAP_ENTRY(ST_OPEN)       // ST_LOCKED
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_HANDLE
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_BURST
+  };
+  END_TRANSITION_MAP(RequestData())
+}
+
+void Gate::burst()
+{
+  static const StateIndex TRANSITIONS[] = {
+      TRANSITION_MAP_ENTRY(ST_BURST)      // ST_OPEN
+      TRANSITION_MAP_ENTRY(EVENT_IGNORED) // ST_LOCKED
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_HANDLE
+      TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_BURST
+  };
+  END_TRANSITION_MAP(RequestData())
+}
+
+STATE_DEFINE(Gate, Open, RequestData)
+{
+  (void)data;
+  ++this->opened_;
+}
+
+STATE_DEFINE(Gate, Locked, RequestData)
+{
+  if (data->id >= 0 && !this->deferEvent())
+  {
+    ++this->refused_;
+  }
+}
+
+STATE_DEFINE(Gate, Handle, RequestData)
+{
+  assert(this->handled_count_ < DEFERRED);
+  this->handled_[this->handled_count_++] = data->id;
+  this->internalEvent(ST_OPEN, RequestData());
+}
+
+STATE_DEFINE(Gate, Burst, RequestData)
+{
+  (void)data;
+  for (size_t i = 0; i <= STATE_MACHINE_ENGINE_QUEUE_SIZE; ++i)
+  {
+    if (!this->internalEvent(ST_OPEN, RequestData()))
+    {
+      ++this->refused_;
+    }
+  }
+}
+
+// Fill the deferred ring past the engine's external queue, overflow it by
+// one, then open the gate: every deferred request must be handled, in
+// submission order, and only the overflowing one refused. A burst of
+// internal events one past the queue must refuse exactly one.
+static void deferReplayOrder(BenchState &state)
+{
+  uint64_t events = 0;
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    Gate gate;
+    gate.lock();
+    for (size_t id = 0; id <= Gate::DEFERRED; ++id)
+    {
+      gate.submit(static_cast<int>(id));
+    }
+    BENCH_CHECK(gate.refused() == 1);
+    gate.unlock();
+    BENCH_CHECK(gate.isOpen());
+    BENCH_CHECK(gate.handledCount() == Gate::DEFERRED);
+    for (size_t id = 0; id < Gate::DEFERRED; ++id)
+    {
+      BENCH_CHECK(gate.handled()[id] == static_cast<int>(id));
+    }
+
+    size_t opened = gate.opened();
+    gate.burst();
+    BENCH_CHECK(gate.refused() == 2);
+    BENCH_CHECK(gate.opened() == opened + STATE_MACHINE_ENGINE_QUEUE_SIZE);
+    events += Gate::DEFERRED + 4;
+  }
+  state.stopTiming();
+  state.addEvents(events);
+}
+
+class SequenceData : public EventData
+{
+public:
+  SequenceData(size_t producer_ = 0, uint64_t seq_ = 0)
+      : producer(producer_), seq(seq_)
+  {
+  }
+  size_t producer;
+  uint64_t seq;
+};
+
+// Thread-safe machine recording the events of several producers: each
+// producer's events must arrive once each and in the order it posted
+// them, and no two actions may overlap
+class Sequencer : public StateMachine
+{
+public:
+  static const size_t MAX_PRODUCERS = 8;
+
+  Sequencer() : StateMachine(ST_MAX_STATES), in_action_(false)
+  {
+    std::fill(this->next_, this->next_ + MAX_PRODUCERS, 0);
+    this->enableEventQueue();
+  }
+
+  void post(size_t producer, uint64_t seq);
+
+  uint64_t received() const { return this->received_; }
+  uint64_t next(size_t producer) const { return this->next_[producer]; }
+  uint64_t outOfOrder() const { return this->out_of_order_; }
+  uint64_t overlaps() const { return this->overlaps_; }
+
+private:
+  std::atomic<bool> in_action_;
+  uint64_t next_[MAX_PRODUCERS];
+  uint64_t received_ = 0;
+  uint64_t out_of_order_ = 0;
+  uint64_t overlaps_ = 0;
+
+  enum States
+  {
+    ST_RECORD,
+    ST_MAX_STATES
+  };
+
+  STATE_DECLARE(Sequencer, Record, SequenceData)
+
+  virtual const StateMapRowEx *getStateMapEx() { return nullptr; }
+  virtual const StateMapRow *getStateMap()
+  {
+    static const StateMapRow STATE_MAP[]{
+        &Record,
+    };
+    static_assert(
+        (sizeof(STATE_MAP) / sizeof(StateMapRow)) == ST_MAX_STATES,
+        "Invalid size of STATE_MAP");
+    return &STATE_MAP[0];
+  }
+};
+
+void Sequencer::post(size_t producer, uint64_t seq)
+{
+  static const StateIndex TRANSITIONS[] = {
+      TRANSITION_MAP_ENTRY(ST_RECORD) // ST_RECORD
+  };
+  END_TRANSITION_MAP(SequenceData(producer, seq))
+}
+
+STATE_DEFINE(Sequencer, Record, SequenceData)
+{
+  if (this->in_action_.exchange(true, std::memory_order_acquire))
+  {
+    ++this->overlaps_;
+  }
+  if (data->seq != this->next_[data->producer])
+  {
+    ++this->out_of_order_;
+  }
+  this->next_[data->producer] = data->seq + 1;
+  ++this->received_;
+  this->in_action_.store(false, std::memory_order_release);
+}
+
+// One thread posting to a queued machine: it finds the machine idle and
+// drains its own event, which must not allocate once the node pool is warm
+static void queuePost(BenchState &state)
+{
+  Sequencer sequencer;
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    sequencer.post(0, i);
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+
+  BENCH_CHECK(sequencer.received() == state.iterations());
+  BENCH_CHECK(sequencer.next(0) == state.iterations());
+  BENCH_CHECK(sequencer.outOfOrder() == 0);
+}
+
+// Several threads posting to one queued machine at once. Allocations are
+// reported rather than refused: the node pool grows while events are
+// posted faster than the draining thread runs them.
+static void queueMultiProducer(BenchState &state)
+{
+  const size_t PRODUCERS = 4;
+  static_assert(PRODUCERS <= Sequencer::MAX_PRODUCERS, "too many producers");
+
+  Sequencer sequencer;
+  std::atomic<bool> go(false);
+  std::vector<std::thread> producers;
+  for (size_t producer = 0; producer < PRODUCERS; ++producer)
+  {
+    producers.emplace_back([&, producer]() {
+      while (!go.load(std::memory_order_acquire))
+      {
+        std::this_thread::yield();
+      }
+      for (uint64_t i = 0; i < state.iterations(); ++i)
+      {
+        sequencer.post(producer, i);
+      }
+    });
+  }
+
+  state.startTiming();
+  go.store(true, std::memory_order_release);
+  for (std::thread &producer : producers)
+  {
+    producer.join();
+  }
+  state.stopTiming();
+  state.addEvents(PRODUCERS * state.iterations());
+
+  BENCH_CHECK(sequencer.received() == PRODUCERS * state.iterations());
+  for (size_t producer = 0; producer < PRODUCERS; ++producer)
+  {
+    BENCH_CHECK(sequencer.next(producer) == state.iterations());
+  }
+  BENCH_CHECK(sequencer.outOfOrder() == 0);
+  BENCH_CHECK(sequencer.overlaps() == 0);
+}
+
+// Machine counting down through a long chain of internal events, run in
+// one go or a few steps per call with an EngineBudget
+class Countdown : public StateMachine
+{
+public:
+  explicit Countdown(size_t max_steps)
+      : StateMachine(ST_MAX_STATES), budget_(max_steps)
+  {
+  }
+
+  void start();
+
+  // One more count, sent as an external event
+  bool step() { return this->externalEvent(ST_COUNTING); }
+
+  const EngineBudget &budget() const { return this->budget_; }
+
+private:
+  EngineBudget budget_;
+  int remaining_ = 0;
+
+  enum States
+  {
+    ST_IDLE,
+    ST_COUNTING,
+    ST_MAX_STATES
+  };
+
+  STATE_DECLARE(Countdown, Idle, NoEventData)
+  STATE_DECLARE(Countdown, Counting, NoEventData)
+
+  virtual const StateMapRowEx *getStateMapEx() { return nullptr; }
+  virtual const StateMapRow *getStateMap()
+  {
+    static const StateMapRow STATE_MAP[]{
+        &Idle,
+        &Counting,
+    };
+    static_assert(
+        (sizeof(STATE_MAP) / sizeof(StateMapRow)) == ST_MAX_STATES,
+        "Invalid size of STATE_MAP");
+    return &STATE_MAP[0];
+  }
+
+  virtual EngineBudget *getEngineBudget()
+  {
+    return this->budget_.maxSteps() != 0 ? &this->budget_ : nullptr;
+  }
+};
+
+static const int COUNTDOWN_STEPS = 1000;
+
+void Countdown::start()
+{
+  static const StateIndex TRANSITIONS[] = {
+      TRANSITION_MAP_ENTRY(ST_COUNTING)   // ST_IDLE
+      TRANSITION_MAP_ENTRY(EVENT_IGNORED) // ST_COUNTING
+  };
+  END_TRANSITION_MAP(nullptr)
+}
+
+STATE_DEFINE(Countdown, Idle, NoEventData) { (void)data; }
+STATE_DEFINE(Countdown, Counting, NoEventData)
+{
+  (void)data;
+  if (this->remaining_ == 0)
+  {
+    this->remaining_ = COUNTDOWN_STEPS;
+  }
+  this->internalEvent(--this->remaining_ > 0 ? ST_COUNTING : ST_IDLE);
+}
+
+static void countdownChain(BenchState &state, size_t max_steps)
+{
+  Countdown countdown(max_steps);
+  uint64_t resumes = 0;
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    countdown.start();
+    while (countdown.resumeEngine())
+    {
+      ++resumes;
+    }
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations() * (COUNTDOWN_STEPS + 1));
+  assert(max_steps == 0 || resumes > 0);
+  (void)resumes;
+}
+
+// A thousand internal events run to completion, then bounded to 16 steps
+// per call; the difference is the cost of suspending and resuming
+static void countdownUnbounded(BenchState &state) { countdownChain(state, 0); }
+static void countdownBudget16(BenchState &state) { countdownChain(state, 16); }
+
+// Events sent to a machine suspended after every step pile up in its
+// budget until it is full; the sends after that are refused and counted,
+// and none of the events it holds are lost
+static void budgetFullWhileSuspended(BenchState &state)
+{
+  static const size_t REFUSED = 3;
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    Countdown countdown(1);
+    countdown.start();
+    BENCH_CHECK(countdown.isEnginePending());
+    BENCH_CHECK(countdown.budget().pending() == 1);
+
+    // Each send resumes the engine for one step, which replaces the
+    // internal event it ran, so the budget grows by one per send
+    for (size_t sent = 1; sent < EngineBudget::CAPACITY; ++sent)
+    {
+      BENCH_CHECK(countdown.step());
+      BENCH_CHECK(countdown.budget().pending() == sent + 1);
+    }
+    for (size_t refused = 1; refused <= REFUSED; ++refused)
+    {
+      BENCH_CHECK(!countdown.step());
+      BENCH_CHECK(countdown.budget().dropped() == refused);
+      BENCH_CHECK(countdown.budget().pending() == EngineBudget::CAPACITY);
+    }
+
+    // Stopping again with a full budget keeps every event it holds
+    BENCH_CHECK(countdown.resumeEngine());
+    BENCH_CHECK(countdown.budget().pending() == EngineBudget::CAPACITY);
+    BENCH_CHECK(countdown.budget().dropped() == REFUSED);
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations() * (EngineBudget::CAPACITY + REFUSED + 1));
+}
+
+// A snapshot loaded into a fresh machine must give it the same state and
+// fields, so that it saves the same record. Records of another version or
+// StateIndex width must be refused, leaving the machine as it was, and a
+// machine holding a deferred event that goes through a transition map
+// with a payload must refuse to be saved.
+static void checkSnapshot(const Motor &motor, const unsigned char *record,
+                          size_t size)
+{
+  Motor copy;
+  BENCH_CHECK(copy.loadSnapshot(record, size));
+  BENCH_CHECK(copy.getCurrentState() == motor.getCurrentState());
+  unsigned char saved[64];
+  BENCH_CHECK(copy.saveSnapshot(saved, sizeof(saved)) == size);
+  BENCH_CHECK(std::memcmp(saved, record, size) == 0);
+
+  StateSnapshotHeader header;
+  std::memcpy(&header, record, sizeof(header));
+  header.version = StateSnapshotHeader::VERSION + 1;
+  std::memcpy(saved, &header, sizeof(header));
+  Motor fresh;
+  BENCH_CHECK(!fresh.loadSnapshot(saved, size));
+  header.version = StateSnapshotHeader::VERSION;
+  header.state_size = 2 * sizeof(StateIndex);
+  std::memcpy(saved, &header, sizeof(header));
+  BENCH_CHECK(!fresh.loadSnapshot(saved, size));
+  BENCH_CHECK(fresh.getCurrentState() == Motor().getCurrentState());
+
+  Gate gate;
+  gate.lock();
+  BENCH_CHECK(gate.snapshotSize() != 0);
+  gate.submit(1);
+  BENCH_CHECK(gate.snapshotSize() == 0);
+  BENCH_CHECK(gate.saveSnapshot(saved, sizeof(saved)) == 0);
+  gate.unlock();
+}
+
+// Save and restore one machine's snapshot record
+static void snapshotMotorRoundTrip(BenchState &state)
+{
+  Motor motor;
+  MotorData data;
+  data.speed = 100;
+  motor.setSpeed(data);
+  unsigned char record[64];
+  size_t expected = motor.snapshotSize();
+  BENCH_CHECK(expected != 0);
+  BENCH_CHECK(motor.saveSnapshot(record, sizeof(record)) == expected);
+  checkSnapshot(motor, record, expected);
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    size_t size = motor.saveSnapshot(record, sizeof(record));
+    BENCH_CHECK(motor.loadSnapshot(record, size));
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+}
+
+// Copy of the checkpoint at from with the header field at offset replaced
+static bool writeCheckpointCopy(const char *from, const char *to,
+                                size_t offset, uint32_t value)
+{
+  CheckpointFile source;
+  CheckpointFile copy;
+  if (!source.open(from) || !copy.create(to, source.size()))
+  {
+    return false;
+  }
+  std::memcpy(copy.writableData(), source.data(), source.size());
+  std::memcpy(copy.writableData() + offset, &value, sizeof(value));
+  return copy.sync();
+}
+
+// A fleet restored from the checkpoint must save the same checkpoint, and
+// checkpoints of another version or StateIndex width must be refused,
+// leaving the fleet as it was
+static void checkRestoredFleet(const StateMachineFleet<StaticCentrifugeTest> &fleet,
+                               const CheckpointFile &file, const char *path)
+{
+  StateMachineFleet<StaticCentrifugeTest> restored(fleet.size());
+  BENCH_CHECK(restored.restore(file));
+  BENCH_CHECK(std::equal(fleet.states(), fleet.states() + fleet.size(),
+                         restored.states()));
+  std::string restored_path = scratchPath("restored");
+  BENCH_CHECK(restored.saveCheckpoint(restored_path.c_str()));
+  BENCH_CHECK(sameCheckpoint(path, restored_path.c_str()));
+
+  // Never started, unlike the fleet saved
+  StateMachineFleet<StaticCentrifugeTest> idle(fleet.size());
+  const uint32_t VERSION = FleetCheckpointHeader::VERSION + 1;
+  const uint32_t STATE_SIZE = 2 * sizeof(StateIndex);
+  const std::pair<size_t, uint32_t> corruptions[] = {
+      {offsetof(FleetCheckpointHeader, version), VERSION},
+      {offsetof(FleetCheckpointHeader, state_size), STATE_SIZE}};
+  for (const auto &corruption : corruptions)
+  {
+    BENCH_CHECK(writeCheckpointCopy(path, restored_path.c_str(),
+                                    corruption.first, corruption.second));
+    CheckpointFile corrupted;
+    BENCH_CHECK(corrupted.open(restored_path.c_str()));
+    BENCH_CHECK(corrupted.header() == nullptr);
+    BENCH_CHECK(!idle.restore(corrupted));
+    BENCH_CHECK(std::count(idle.states(), idle.states() + idle.size(),
+                           idle.states()[0]) ==
+                static_cast<std::ptrdiff_t>(idle.size()));
+    BENCH_CHECK(idle.states()[0] != fleet.states()[0]);
+  }
+  std::remove(restored_path.c_str());
+}
+
+// Restore a fleet from a mapped checkpoint, one event per machine
+static void checkpointRestoreFleet(BenchState &state)
+{
+  std::string path = scratchPath("checkpoint");
+  StateMachineFleet<StaticCentrifugeTest> fleet(FLEET_SIZE);
+  fleet.apply<StaticCentrifugeTest::Start>();
+  BENCH_CHECK(fleet.saveCheckpoint(path.c_str()));
+  CheckpointFile file;
+  BENCH_CHECK(file.open(path.c_str()));
+  checkRestoredFleet(fleet, file, path.c_str());
+  uint64_t rounds = fleetRounds(state, FLEET_SIZE);
+
+  state.startTiming();
+  for (uint64_t i = 0; i < rounds; ++i)
+  {
+    BENCH_CHECK(fleet.restore(file));
+  }
+  state.stopTiming();
+  state.addEvents(rounds * FLEET_SIZE);
+
+  file.close();
+  std::remove(path.c_str());
+}
+
+// One transition line per event, as the example states print them: a
+// synchronous formatted write flushed per line, as std::endl does, against
+// an asynchronous log record. Both write to the null device, and the
+// asynchronous logger is flushed between batches outside the timing, so
+// the numbers are the cost on the calling thread.
+static const uint64_t LOG_BATCH = StateLog::BUFFER_SIZE / 2;
+
+static void logStdioLine(BenchState &state)
+{
+  FILE *out = std::fopen("/dev/null", "w");
+  if (out == nullptr)
+  {
+    std::cerr << "cannot open /dev/null" << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  Motor motor;
+
+  state.startTiming();
+  for (uint64_t i = 0; i < state.iterations(); ++i)
+  {
+    std::fprintf(out, "machine %p: state %u -> %u\n",
+                 static_cast<const void *>(&motor),
+                 static_cast<unsigned>(i & 3), static_cast<unsigned>(i & 7));
+    std::fflush(out);
+  }
+  state.stopTiming();
+  state.addEvents(state.iterations());
+
+  std::fclose(out);
+}
+
+static void logAsyncLine(BenchState &state)
+{
+  FILE *out = std::fopen("/dev/null", "w");
+  if (out == nullptr)
+  {
+    std::cerr << "cannot open /dev/null" << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  Motor motor;
+  StateLog::start(out);
+
+  // The thread's buffer is made by its first record
+  STATE_LOG_INFO("warm up");
+  StateLog::flush();
+
+  for (uint64_t done = 0; done < state.iterations(); done += LOG_BATCH)
+  {
+    uint64_t end = std::min(done + LOG_BATCH, state.iterations());
+    state.startTiming();
+    for (uint64_t i = done; i < end; ++i)
+    {
+      STATE_LOG_INFO("machine %p: state %u -> %u",
+                     static_cast<const void *>(&motor),
+                     static_cast<unsigned>(i & 3), static_cast<unsigned>(i & 7));
+    }
+    state.stopTiming();
+    StateLog::flush();
+  }
+  state.addEvents(state.iterations());
+
+  StateLog::stop();
+  std::fclose(out);
+}
+
+// A record with strings and * arguments. The strings are copied by the
+// log call, so the line checked before timing prints them as they were
+// although the buffer changed right after the call, and cut where the
+// record's text runs out.
+static void logAsyncStrings(BenchState &state)
+{
+  char name[8];
+  char text[80];
+  std::memset(text, 'a', sizeof(text) - 1);
+  text[sizeof(text) - 1] = '\0';
+
+  FILE *check = std::tmpfile();
+  FILE *out = std::fopen("/dev/null", "w");
+  if (check == nullptr || out == nullptr)
+  {
+    std::cerr << "cannot open the log files" << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  StateLog::start(check);
+  std::strcpy(name, "abc");
+  STATE_LOG_INFO("%s|%*d|%.*f|%s", name, 5, 42, 2, 3.14159, text);
+  std::strcpy(name, "xyz");
+  StateLog::stop();
+
+  char line[256];
+  std::rewind(check);
+  BENCH_CHECK(std::fgets(line, sizeof(line), check) != nullptr);
+  std::string expected = "abc|   42|3.14|" +
+                         std::string(LogRecord::TEXT_SIZE - 5, 'a') + "\n";
+  std::string got = line;
+  BENCH_CHECK(got.size() > expected.size() &&
+              got.compare(got.size() - expected.size(), std::string::npos,
+                          expected) == 0);
+  std::fclose(check);
+
+  StateLog::start(out);
+  for (uint64_t done = 0; done < state.iterations(); done += LOG_BATCH)
+  {
+    uint64_t end = std::min(done + LOG_BATCH, state.iterations());
+    state.startTiming();
+    for (uint64_t i = done; i < end; ++i)
+    {
+      STATE_LOG_INFO("%s: %*u", name, 6, static_cast<unsigned>(i));
+    }
+    state.stopTiming();
+    StateLog::flush();
+  }
+  state.addEvents(state.iterations());
+
+  StateLog::stop();
+  std::fclose(out);
+}
+
+int main(int argc, char **argv)
+{
+  // The example states log through StateLog, which only the log/
+  // benchmarks start, so the others measure the engine alone
+  BenchSuite suite;
+  suite.add("motor/change_speed_inline", motorChangeSpeedInline, true);
+  suite.add("motor/change_speed_shared", motorChangeSpeedShared, true);
+  suite.add("motor/change_speed_make_shared", motorChangeSpeedMakeShared);
+  suite.add("motor/change_speed_pooled", motorChangeSpeedPooled, true);
+  suite.add("motor/change_speed_arena", motorChangeSpeedArena, true);
+  suite.add("motor/start_halt_chain", motorStartHaltChain, true);
+  suite.add("motor/halt_ignored", motorHaltIgnored, true);
+  suite.add("motor/dispatch_by_id", motorDispatchById, true);
+  suite.add("direct/wide_ring", wideRingNext, true);
+  suite.add("centrifuge/full_cycle", centrifugeFullCycle, true);
+  suite.add("centrifuge/cancel_ignored", centrifugeCancelIgnored, true);
+  suite.add("centrifuge/poll_ignored", centrifugePollIgnored, true);
+  suite.add("static_motor/change_speed", staticMotorChangeSpeed, true);
+  suite.add("static_motor/start_halt_chain", staticMotorStartHaltChain, true);
+  suite.add("static_motor/halt_ignored", staticMotorHaltIgnored, true);
+  suite.add("static_centrifuge/full_cycle", staticCentrifugeFullCycle, true);
+#ifdef STATE_MACHINE_ENABLE_METRICS
+  suite.add("metrics/motor/change_speed", motorChangeSpeedTimed, true);
+  suite.add("metrics/motor/change_speed_sampled", motorChangeSpeedSampled, true);
+  suite.add("metrics/motor/start_halt_chain", motorStartHaltChainMetrics, true);
+  suite.add("metrics/static_motor/change_speed", staticMotorChangeSpeedMetrics, true);
+#endif
+#ifdef STATE_MACHINE_ENABLE_STATE_BOARD
+  suite.add("board/motor/change_speed", motorChangeSpeedPublished, true);
+  suite.add("board/motor/change_speed_monitored", motorChangeSpeedMonitored, true);
+#endif
+  suite.add("fleet/poll_idle", fleetPollIdle, true);
+  suite.add("loop/poll_idle", loopPollIdle, true);
+  suite.add("loop/poll_idle_virtual", loopPollIdleVirtual, true);
+  suite.add("fleet/cycle_all", fleetCycleAll);
+  suite.add("loop/cycle_all", loopCycleAll, true);
+  suite.add("fleet/cycle_sparse", fleetCycleSparse);
+  suite.add("loop/cycle_sparse", loopCycleSparse, true);
+  suite.add("hierarchy/toggle_flat", hierarchyToggleFlat, true);
+  suite.add("hierarchy/toggle_nested", hierarchyToggleNested, true);
+  suite.add("hierarchy/three_level_order", hierarchyThreeLevelOrder, true);
+  suite.add("timer/arm_cancel_1m_outstanding", timerArmCancel, true);
+  suite.add("timer/fire", timerFire, true);
+  suite.add("timer/state_timeout", timerStateTimeout, true);
+  suite.add("defer/replay_order", deferReplayOrder, true);
+  suite.add("queue/post", queuePost, true);
+  suite.add("queue/multi_producer", queueMultiProducer);
+  suite.add("budget/countdown_unbounded", countdownUnbounded, true);
+  suite.add("budget/countdown_16_steps", countdownBudget16, true);
+  suite.add("budget/full_while_suspended", budgetFullWhileSuspended, true);
+  suite.add("snapshot/motor_round_trip", snapshotMotorRoundTrip, true);
+  suite.add("checkpoint/restore_fleet", checkpointRestoreFleet, true);
+  suite.add("log/stdio_line", logStdioLine, true);
+  suite.add("log/async_line", logAsyncLine, true);
+  suite.add("log/async_strings", logAsyncStrings, true);
+  return suite.run(argc, argv);
+}
@@ -0,0 +1,132 @@
+#include "state_board.hpp"
+#include "state_machine_metrics.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <thread>
+
+// Reads the state of every machine on a StateBoard published by another
+// process: how many machines are in each state, the engine steps taken
+// since the last pass, and with --list one line per machine.
+//
+//   state_monitor <board> [--list] [--interval <ms> [--count <passes>]]
+
+namespace
+{
+int usage(const char *program)
+{
+  std::fprintf(stderr,
+               "usage: %s <board> [--list] [--interval <ms> "
+               "[--count <passes>]]\n",
+               program);
+  return EXIT_FAILURE;
+}
+
+// Seconds since timestamp, 0 for a slot never written
+double ageSeconds(uint64_t timestamp, uint64_t now, double ns_per_tick)
+{
+  if (timestamp == 0 || timestamp > now)
+  {
+    return 0.0;
+  }
+  return static_cast<double>(now - timestamp) * ns_per_tick * 1e-9;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    return usage(argv[0]);
+  }
+
+  const char *name = argv[1];
+  bool list = false;
+  unsigned long interval = 0;
+  unsigned long passes = 0; // forever
+  for (int i = 2; i < argc; ++i)
+  {
+    if (std::strcmp(argv[i], "--list") == 0)
+    {
+      list = true;
+    }
+    else if (std::strcmp(argv[i], "--interval") == 0 && i + 1 < argc)
+    {
+      interval = std::strtoul(argv[++i], nullptr, 10);
+    }
+    else if (std::strcmp(argv[i], "--count") == 0 && i + 1 < argc)
+    {
+      passes = std::strtoul(argv[++i], nullptr, 10);
+    }
+    else
+    {
+      return usage(argv[0]);
+    }
+  }
+  if (interval == 0 && passes == 0)
+  {
+    passes = 1;
+  }
+
+  StateBoard board;
+  if (!board.open(name))
+  {
+    std::fprintf(stderr, "cannot open state board %s\n", name);
+    return EXIT_FAILURE;
+  }
+  double ns_per_tick = board.header()->ns_per_tick;
+
+  uint64_t previous_steps = 0;
+  for (unsigned long pass = 0; passes == 0 || pass < passes; ++pass)
+  {
+    if (pass > 0)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+    }
+
+    std::map<uint32_t, size_t> states;
+    uint64_t steps = 0;
+    size_t unreadable = 0;
+    uint64_t now = MetricsClock::now();
+    size_t size = board.size();
+    for (size_t i = 0; i < size; ++i)
+    {
+      PublishedState published;
+      if (!board.read(i, published))
+      {
+        ++unreadable;
+        continue;
+      }
+      ++states[published.state];
+      steps += published.transitions;
+      if (list)
+      {
+        std::printf("%8zu  state %-6u steps %-12" PRIu64 " last %.6f s ago\n",
+                    i, published.state, published.transitions,
+                    ageSeconds(published.timestamp, now, ns_per_tick));
+      }
+    }
+
+    std::printf("%zu of %zu machines, %" PRIu64 " steps", size,
+                board.capacity(), steps);
+    if (pass > 0)
+    {
+      std::printf(" (+%" PRIu64 ")", steps - previous_steps);
+    }
+    std::printf("\n");
+    for (const auto &state : states)
+    {
+      std::printf("  state %-6u %zu\n", state.first, state.second);
+    }
+    if (unreadable != 0)
+    {
+      std::printf("  %zu slots left mid-write\n", unreadable);
+    }
+    std::fflush(stdout);
+    previous_steps = steps;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,250 @@
+#include "state_snapshot.hpp"
+#include "state_machine.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+size_t StateMachine::snapshotSize()
+{
+  // Snapshots are taken between events
+  assert(this->engine_events_ == nullptr);
+  if (this->isEnginePending() ||
+      (this->event_queue_ != nullptr &&
+       this->event_queue_->pending.load(std::memory_order_acquire) != 0))
+  {
+    return 0;
+  }
+
+  size_t pending_count = 0;
+  EventRing *deferred = this->getDeferredEvents();
+  if (deferred != nullptr)
+  {
+    for (size_t i = 0; i < deferred->size(); ++i)
+    {
+      const QueuedEvent &event = (*deferred)[i];
+      if (event.transitions != nullptr || event.data.get() != noEventData())
+      {
+        return 0;
+      }
+    }
+    pending_count = deferred->size();
+  }
+  if (pending_count > UINT16_MAX)
+  {
+    return 0;
+  }
+
+  SnapshotFields fields(SnapshotFields::MEASURE);
+  this->snapshotFields(fields);
+  return sizeof(StateSnapshotHeader) +
+         (1 + pending_count) * sizeof(StateIndex) + fields.size();
+}
+
+size_t StateMachine::saveSnapshot(void *record, size_t size)
+{
+  size_t record_size = this->snapshotSize();
+  if (record_size == 0 || record_size > size)
+  {
+    return 0;
+  }
+
+  EventRing *deferred = this->getDeferredEvents();
+  size_t pending_count = deferred != nullptr ? deferred->size() : 0;
+  size_t field_size = record_size - sizeof(StateSnapshotHeader) -
+                      (1 + pending_count) * sizeof(StateIndex);
+
+  StateSnapshotHeader header;
+  header.version = StateSnapshotHeader::VERSION;
+  header.state_size = sizeof(StateIndex);
+  header.pending_count = static_cast<uint16_t>(pending_count);
+  header.field_size = static_cast<uint32_t>(field_size);
+
+  unsigned char *out = static_cast<unsigned char *>(record);
+  std::memcpy(out, &header, sizeof(header));
+  out += sizeof(header);
+  std::memcpy(out, &this->current_state_, sizeof(StateIndex));
+  out += sizeof(StateIndex);
+  for (size_t i = 0; i < pending_count; ++i)
+  {
+    std::memcpy(out, &(*deferred)[i].state, sizeof(StateIndex));
+    out += sizeof(StateIndex);
+  }
+
+  SnapshotFields fields(SnapshotFields::SAVE, out, field_size);
+  this->snapshotFields(fields);
+  assert(fields.size() == field_size);
+  return record_size;
+}
+
+bool StateMachine::loadSnapshot(const void *record, size_t size)
+{
+  assert(this->engine_events_ == nullptr);
+
+  StateSnapshotHeader header;
+  if (size < sizeof(header))
+  {
+    return false;
+  }
+  std::memcpy(&header, record, sizeof(header));
+  if (header.version != StateSnapshotHeader::VERSION ||
+      header.state_size != sizeof(StateIndex))
+  {
+    return false;
+  }
+
+  SnapshotFields measure(SnapshotFields::MEASURE);
+  this->snapshotFields(measure);
+  if (measure.size() != header.field_size ||
+      size != sizeof(header) +
+                  (1 + size_t(header.pending_count)) * sizeof(StateIndex) +
+                  header.field_size)
+  {
+    return false;
+  }
+
+  // Check everything before changing the machine
+  const unsigned char *in = static_cast<const unsigned char *>(record);
+  in += sizeof(header);
+  StateIndex current_state;
+  std::memcpy(&current_state, in, sizeof(StateIndex));
+  in += sizeof(StateIndex);
+  if (current_state >= this->max_states_)
+  {
+    return false;
+  }
+  const unsigned char *pending = in;
+  for (size_t i = 0; i < header.pending_count; ++i)
+  {
+    StateIndex state;
+    std::memcpy(&state, pending + i * sizeof(StateIndex), sizeof(StateIndex));
+    if (state >= this->max_states_)
+    {
+      return false;
+    }
+  }
+  EventRing *deferred = this->getDeferredEvents();
+  if (header.pending_count != 0 &&
+      (deferred == nullptr || deferred->capacity() < header.pending_count))
+  {
+    return false;
+  }
+
+  this->setCurrentState(current_state);
+  this->publishStep(0);
+  if (deferred != nullptr)
+  {
+    deferred->clear();
+    for (size_t i = 0; i < header.pending_count; ++i)
+    {
+      StateIndex state;
+      std::memcpy(&state, in, sizeof(StateIndex));
+      in += sizeof(StateIndex);
+      queueEvent(*deferred, nullptr, 0, state, 0);
+    }
+  }
+
+  SnapshotFields fields(
+      SnapshotFields::LOAD,
+      const_cast<unsigned char *>(pending) +
+          size_t(header.pending_count) * sizeof(StateIndex),
+      header.field_size);
+  this->snapshotFields(fields);
+  return true;
+}
+
+bool CheckpointFile::create(const char *path, size_t size)
+{
+  this->close();
+  int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    return false;
+  }
+  void *data = MAP_FAILED;
+  if (::ftruncate(fd, static_cast<off_t>(size)) == 0)
+  {
+    data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (data == MAP_FAILED)
+  {
+    return false;
+  }
+  this->data_ = static_cast<unsigned char *>(data);
+  this->size_ = size;
+  this->writable_ = true;
+  return true;
+}
+
+bool CheckpointFile::open(const char *path)
+{
+  this->close();
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    return false;
+  }
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (::fstat(fd, &st) == 0 && st.st_size > 0)
+  {
+    data = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                  MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (data == MAP_FAILED)
+  {
+    return false;
+  }
+  this->data_ = static_cast<unsigned char *>(data);
+  this->size_ = static_cast<size_t>(st.st_size);
+  this->writable_ = false;
+  return true;
+}
+
+bool CheckpointFile::sync()
+{
+  return this->data_ != nullptr &&
+         ::msync(this->data_, this->size_, MS_SYNC) == 0;
+}
+
+void CheckpointFile::close()
+{
+  if (this->data_ != nullptr)
+  {
+    ::munmap(this->data_, this->size_);
+    this->data_ = nullptr;
+    this->size_ = 0;
+    this->writable_ = false;
+  }
+}
+
+const FleetCheckpointHeader *CheckpointFile::header() const
+{
+  if (this->size_ < sizeof(FleetCheckpointHeader))
+  {
+    return nullptr;
+  }
+  const FleetCheckpointHeader *header =
+      reinterpret_cast<const FleetCheckpointHeader *>(this->data_);
+  if (header->magic != FleetCheckpointHeader::MAGIC ||
+      header->version != FleetCheckpointHeader::VERSION ||
+      header->state_size != sizeof(StateIndex))
+  {
+    return nullptr;
+  }
+
+  // Both arrays must lie within the file, checked without overflowing
+  uint64_t size = this->size_;
+  if (header->states_offset > size ||
+      header->count > (size - header->states_offset) / sizeof(StateIndex) ||
+      header->fields_offset > size ||
+      (header->field_size != 0 &&
+       header->count > (size - header->fields_offset) / header->field_size))
+  {
+    return nullptr;
+  }
+  return header;
+}
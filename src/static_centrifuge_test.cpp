@@ -0,0 +1,115 @@
+#include <static_centrifuge_test.hpp>
+#include <state_snapshot.hpp>
+#include <state_log.hpp>
+
+StaticCentrifugeTest::StaticCentrifugeTest() : poll_active_(false),
+                                               speed_(0)
+{
+}
+
+void StaticCentrifugeTest::snapshotFields(SnapshotFields &fields)
+{
+  fields.field(this->poll_active_);
+  fields.field(this->speed_);
+}
+
+void StaticCentrifugeTest::start()
+{
+  this->externalEvent<Start>();
+}
+
+void StaticCentrifugeTest::poll()
+{
+  this->externalEvent<Poll>();
+}
+
+void StaticCentrifugeTest::cancel()
+{
+  this->externalEvent<Cancel>();
+}
+
+void StaticCentrifugeTest::ST_Idle(const NoEventData &data)
+{
+  (void)data;
+  STATE_LOG_INFO("StaticCentrifugeTest::ST_Idle");
+  this->stopPoll();
+}
+
+void StaticCentrifugeTest::EN_EntryIdle(const NoEventData &data)
+{
+  (void)data;
+  STATE_LOG_INFO("StaticCentrifugeTest::EntryIdle");
+}
+
+void StaticCentrifugeTest::ST_Completed(const NoEventData &data)
+{
+  (void)data;
+  STATE_LOG_INFO("StaticCentrifugeTest::Completed");
+}
+
+void StaticCentrifugeTest::ST_Failed(const NoEventData &data)
+{
+  (void)data;
+  STATE_LOG_INFO("StaticCentrifugeTest::Failed");
+  this->internalEvent(ST_IDLE);
+}
+
+void StaticCentrifugeTest::ST_StartTest(const NoEventData &data)
+{
+  (void)data;
+  STATE_LOG_INFO("StaticCentrifugeTest::ST_StartTest");
+  this->internalEvent(ST_ACCELERATION);
+}
+
+bool StaticCentrifugeTest::GD_GuardStartTest(const NoEventData &data)
+{
+  (void)data;
+  STATE_LOG_INFO("StaticCentrifugeTest::GD_GuardStartTest");
+  return this->speed_ == 0;
+}
+
+void StaticCentrifugeTest::ST_Acceleration(const NoEventData &data)
+{
+  (void)data;
+  STATE_LOG_INFO("StaticCentrifugeTest::ST_Acceleration");
+  this->startPoll();
+}
+
+void StaticCentrifugeTest::ST_WaitForAcceleration(const NoEventData &data)
+{
+  (void)data;
+  STATE_LOG_INFO("StaticCentrifugeTest::ST_WaitForAcceleration : Speed is %d", this->speed_);
+  if (++this->speed_ >= 5)
+  {
+    this->internalEvent(ST_DECELERATION);
+  }
+}
+
+void StaticCentrifugeTest::EX_ExitWaitForAcceleration(void)
+{
+  STATE_LOG_INFO("StaticCentrifugeTest::EX_ExitWaitForAcceleration");
+  this->stopPoll();
+}
+
+void StaticCentrifugeTest::ST_Deceleration(const NoEventData &data)
+{
+  (void)data;
+  STATE_LOG_INFO("StaticCentrifugeTest::ST_Deceleration");
+  this->startPoll();
+}
+
+void StaticCentrifugeTest::ST_WaitForDeceleration(const NoEventData &data)
+{
+  (void)data;
+  STATE_LOG_INFO("StaticCentrifugeTest::ST_WaitForDeceleration : Speed is %d", this->speed_);
+  if (this->speed_-- == 0)
+  {
+    this->internalEvent(ST_COMPLETED);
+  }
+}
+
+void StaticCentrifugeTest::EX_ExitWaitForDeceleration(void)
+{
+  STATE_LOG_INFO("StaticCentrifugeTest::EX_ExitWaitForDeceleration");
+  this->stopPoll();
+}
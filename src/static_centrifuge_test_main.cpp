@@ -0,0 +1,19 @@
+#include <static_centrifuge_test.hpp>
+#include <state_log.hpp>
+#include <cstdlib>
+
+int main(void)
+{
+  StateLog::start(stdout);
+
+  StaticCentrifugeTest test;
+  test.cancel();
+  test.start();
+  while (test.isPollActive())
+  {
+    test.poll();
+  }
+
+  StateLog::stop();
+  return EXIT_SUCCESS;
+}
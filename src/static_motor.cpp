@@ -0,0 +1,54 @@
+#include "static_motor.hpp"
+#include "state_log.hpp"
+#include "state_snapshot.hpp"
+
+StaticMotor::StaticMotor() : current_speed_(0)
+{
+}
+
+void StaticMotor::snapshotFields(SnapshotFields &fields)
+{
+  fields.field(this->current_speed_);
+}
+
+// set motor speed external event
+void StaticMotor::setSpeed(const MotorData &data)
+{
+  this->externalEvent<SetSpeed>(data);
+}
+
+// halt motor external event
+void StaticMotor::halt()
+{
+  this->externalEvent<Halt>();
+}
+
+// state machine sits here when motor is not running
+void StaticMotor::ST_Idle(const NoEventData &data)
+{
+  (void)data; // cast to avoid gcc unused warning
+  STATE_LOG_INFO("StaticMotor::ST_Idle");
+}
+
+// stop the motor
+void StaticMotor::ST_Stop(const NoEventData &data)
+{
+  (void)data; // cast to avoid gcc unused warning
+  STATE_LOG_INFO("StaticMotor::ST_Stop");
+  this->current_speed_ = 0;
+  this->internalEvent(ST_IDLE);
+}
+
+// start the motor going
+void StaticMotor::ST_Start(const MotorData &data)
+{
+  STATE_LOG_INFO("StaticMotor::ST_Start : Speed is %d", data.speed);
+  this->current_speed_ = data.speed;
+}
+
+// changes the motor speed once the motor is moving
+void StaticMotor::ST_ChangeSpeed(const MotorData &data)
+{
+  STATE_LOG_INFO("StaticMotor::ST_ChangeSpeed : Speed is %d", data.speed);
+  this->current_speed_ = data.speed;
+}
@@ -0,0 +1,249 @@
+#include "timer_wheel.hpp"
+
+TimerWheel::TimerWheel(uint64_t now, size_t capacity)
+    : nodes_(FIRST_TIMER), free_(NONE), count_(0), next_(now + 1)
+{
+  this->nodes_.reserve(FIRST_TIMER + capacity);
+  for (uint32_t sentinel = 0; sentinel < FIRST_TIMER; ++sentinel)
+  {
+    this->nodes_[sentinel].prev = sentinel;
+    this->nodes_[sentinel].next = sentinel;
+  }
+}
+
+void TimerWheel::advance(uint64_t now)
+{
+  const uint32_t mask = SLOTS - 1;
+  while (this->next_ <= now)
+  {
+    if (this->count_ == 0)
+    {
+      // Nothing to cascade or fire on the way
+      this->next_ = now + 1;
+      return;
+    }
+
+    // Each time a level wraps, bring the timers of the next slot of the
+    // level above down to where they now belong
+    size_t slot = this->next_ & mask;
+    if (slot == 0)
+    {
+      for (size_t level = 1; level < LEVELS; ++level)
+      {
+        size_t upper = (this->next_ >> (level * SLOT_BITS)) & mask;
+        this->cascade(level, upper);
+        if (upper != 0)
+        {
+          break;
+        }
+      }
+    }
+
+    // Take the timers due out of the wheel first, so that timers armed
+    // while they fire are placed relative to the next tick
+    uint32_t due = slotOf(0, slot);
+    if (this->nodes_[due].next != due)
+    {
+      Node &pending = this->nodes_[PENDING];
+      pending.next = this->nodes_[due].next;
+      pending.prev = this->nodes_[due].prev;
+      this->nodes_[pending.next].prev = PENDING;
+      this->nodes_[pending.prev].next = PENDING;
+      this->nodes_[due].next = due;
+      this->nodes_[due].prev = due;
+    }
+    ++this->next_;
+
+    while (this->nodes_[PENDING].next != PENDING)
+    {
+      uint32_t index = this->nodes_[PENDING].next;
+      Node &node = this->nodes_[index];
+      TimerFunc func = node.func;
+      StateMachine *sm = &node.owner->sm_;
+      StateIndex state = node.state;
+      this->release(index);
+
+      // May arm and cancel timers, growing nodes_
+      func(sm, state);
+    }
+  }
+}
+
+TimerId TimerWheel::arm(
+    StateTimers *owner,
+    uint64_t ticks,
+    TimerFunc func,
+    StateIndex state,
+    StateIndex bound_state)
+{
+  assert(ticks > 0 && ticks <= MAX_TICKS);
+
+  uint32_t index = this->free_;
+  if (index != NONE)
+  {
+    this->free_ = this->nodes_[index].next;
+  }
+  else
+  {
+    assert(this->nodes_.size() < UINT32_MAX);
+    index = static_cast<uint32_t>(this->nodes_.size());
+    this->nodes_.emplace_back();
+    this->nodes_[index].generation = 1;
+  }
+
+  Node &node = this->nodes_[index];
+  node.expires = this->now() + ticks;
+  node.state = state;
+  node.bound_state = bound_state;
+  node.func = func;
+  node.owner = owner;
+  this->link(index);
+
+  node.owner_prev = NONE;
+  node.owner_next = owner->head_;
+  if (owner->head_ != NONE)
+  {
+    this->nodes_[owner->head_].owner_prev = index;
+  }
+  owner->head_ = index;
+  ++owner->count_;
+  ++this->count_;
+
+  return (static_cast<TimerId>(node.generation) << 32) | index;
+}
+
+bool TimerWheel::cancel(TimerId id)
+{
+  uint32_t index = indexOf(id);
+  if (index < FIRST_TIMER || index >= this->nodes_.size() ||
+      this->nodes_[index].func == nullptr ||
+      this->nodes_[index].generation != generationOf(id))
+  {
+    return false;
+  }
+  this->release(index);
+  return true;
+}
+
+void TimerWheel::release(uint32_t index)
+{
+  Node &node = this->nodes_[index];
+  this->unlink(index);
+
+  StateTimers *owner = node.owner;
+  if (node.owner_prev != NONE)
+  {
+    this->nodes_[node.owner_prev].owner_next = node.owner_next;
+  }
+  else
+  {
+    owner->head_ = node.owner_next;
+  }
+  if (node.owner_next != NONE)
+  {
+    this->nodes_[node.owner_next].owner_prev = node.owner_prev;
+  }
+  --owner->count_;
+  --this->count_;
+
+  // A new generation invalidates the handles of this use of the node
+  node.func = nullptr;
+  node.owner = nullptr;
+  if (++node.generation == 0)
+  {
+    node.generation = 1;
+  }
+  node.next = this->free_;
+  this->free_ = index;
+}
+
+void TimerWheel::link(uint32_t index)
+{
+  const uint64_t mask = SLOTS - 1;
+  uint64_t expires = this->nodes_[index].expires;
+  uint64_t delta = expires - this->next_;
+
+  // The lowest level whose range covers the delay. A timer due on this
+  // tick, when cascaded, lands in the slot about to run.
+  size_t level = 0;
+  while (level + 1 < LEVELS && delta >= (uint64_t(1) << ((level + 1) * SLOT_BITS)))
+  {
+    ++level;
+  }
+  this->linkBefore(index, slotOf(level, (expires >> (level * SLOT_BITS)) & mask));
+}
+
+void TimerWheel::linkBefore(uint32_t index, uint32_t sentinel)
+{
+  Node &node = this->nodes_[index];
+  node.next = sentinel;
+  node.prev = this->nodes_[sentinel].prev;
+  this->nodes_[node.prev].next = index;
+  this->nodes_[sentinel].prev = index;
+}
+
+void TimerWheel::unlink(uint32_t index)
+{
+  Node &node = this->nodes_[index];
+  this->nodes_[node.prev].next = node.next;
+  this->nodes_[node.next].prev = node.prev;
+}
+
+void TimerWheel::cascade(size_t level, size_t slot)
+{
+  uint32_t sentinel = slotOf(level, slot);
+  uint32_t index = this->nodes_[sentinel].next;
+  this->nodes_[sentinel].next = sentinel;
+  this->nodes_[sentinel].prev = sentinel;
+  while (index != sentinel)
+  {
+    uint32_t next = this->nodes_[index].next;
+    this->link(index);
+    index = next;
+  }
+}
+
+bool StateTimers::cancel(TimerId id)
+{
+  uint32_t index = TimerWheel::indexOf(id);
+  if (index >= this->wheel_.nodes_.size() ||
+      this->wheel_.nodes_[index].owner != this)
+  {
+    return false;
+  }
+  return this->wheel_.cancel(id);
+}
+
+void StateTimers::cancelAll()
+{
+  while (this->head_ != TimerWheel::NONE)
+  {
+    this->wheel_.release(this->head_);
+  }
+}
+
+void StateTimers::fire(StateMachine *sm, StateIndex state)
+{
+  sm->externalEvent(state);
+}
+
+StateIndex StateTimers::activeState() const
+{
+  return this->sm_.engine_events_ != nullptr ? this->sm_.new_state_
+                                             : this->sm_.current_state_;
+}
+
+void StateTimers::exitState(StateIndex state)
+{
+  uint32_t index = this->head_;
+  while (index != TimerWheel::NONE)
+  {
+    const TimerWheel::Node &node = this->wheel_.nodes_[index];
+    uint32_t next = node.owner_next;
+    if (node.bound_state == state)
+    {
+      this->wheel_.release(index);
+    }
+    index = next;
+  }
+}